@@ -15,6 +15,16 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+# include <xmmintrin.h>
+# define ANORMS_SSE
+#endif
+
+#include "global.h"
+#include "thread.h"
 #include "anorms.h"
 
 /* compressed vertex normals used by mdl and md2 model formats */
@@ -184,7 +194,8 @@ const float anorms[162][3] =
 	{ -0.688191f, -0.587785f, -0.425325f }
 };
 
-int compress_normal(const float *normal)
+/* the original search, still used for normals the lookup table can't handle */
+static int compress_normal_brute(const float *normal)
 {
 	int i, besti;
 	float dot, bestdot;
@@ -204,3 +215,241 @@ int compress_normal(const float *normal)
 
 	return besti;
 }
+
+/* lookup table for compress_normal.
+ * directions are binned into the cells of a cube map. every cell lists, in
+ * ascending order, each anorm that could be the closest for some direction in
+ * it, with a margin that is far wider than float rounding. the exact same dot
+ * products are then taken against just those, so the result (ties included)
+ * is always the one the full search would give. with a 16x16 grid no cell has
+ * more than 4 candidates, so a cell is one SIMD dot product */
+
+#define ANORMS_GRID 16
+#define ANORMS_NUM_CELLS (6 * ANORMS_GRID * ANORMS_GRID)
+#define ANORMS_CELL_SIZE 4
+#define ANORMS_MARGIN 1e-4
+
+/* candidates are padded out to ANORMS_CELL_SIZE by repeating the last one */
+typedef struct anorms_cell_s
+{
+	float x[ANORMS_CELL_SIZE];
+	float y[ANORMS_CELL_SIZE];
+	float z[ANORMS_CELL_SIZE];
+	unsigned char index[ANORMS_CELL_SIZE];
+	int num_candidates;
+} anorms_cell_t;
+
+static anorms_cell_t anorms_cells[ANORMS_NUM_CELLS];
+static bool_t anorms_cells_valid = false;
+static volatile int anorms_cells_built = 0;
+
+static void anorms_cell_direction(int face, double u, double v, double *out)
+{
+	int axis = face >> 1;
+	double length;
+
+	out[axis] = (face & 1) ? -1.0 : 1.0;
+	out[(axis + 1) % 3] = u;
+	out[(axis + 2) % 3] = v;
+
+	length = sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+	out[0] /= length;
+	out[1] /= length;
+	out[2] /= length;
+}
+
+static double anorms_angle(const double *a, const double *b)
+{
+	double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+
+	return acos(bound(-1.0, dot, 1.0));
+}
+
+static void anorms_build_cells(void)
+{
+	double directions[162][3];
+	double angles[162];
+	int face, iu, iv, i, j;
+
+	for (i = 0; i < 162; i++)
+	{
+		double length = sqrt((double)anorms[i][0] * anorms[i][0] + (double)anorms[i][1] * anorms[i][1] + (double)anorms[i][2] * anorms[i][2]);
+
+		for (j = 0; j < 3; j++)
+			directions[i][j] = anorms[i][j] / length;
+	}
+
+	for (face = 0; face < 6; face++)
+	{
+		for (iu = 0; iu < ANORMS_GRID; iu++)
+		{
+			for (iv = 0; iv < ANORMS_GRID; iv++)
+			{
+				anorms_cell_t *cell = &anorms_cells[(face * ANORMS_GRID + iu) * ANORMS_GRID + iv];
+				double u0 = -1.0 + 2.0 * iu / ANORMS_GRID, u1 = -1.0 + 2.0 * (iu + 1) / ANORMS_GRID;
+				double v0 = -1.0 + 2.0 * iv / ANORMS_GRID, v1 = -1.0 + 2.0 * (iv + 1) / ANORMS_GRID;
+				double center[3], corner[3];
+				double radius, lowest;
+
+			/* cells are convex on the sphere, so the corners are the farthest points from the center.
+			 * pad the radius for normals that round into the neighbouring cell */
+				anorms_cell_direction(face, (u0 + u1) * 0.5, (v0 + v1) * 0.5, center);
+				radius = 0;
+				for (i = 0; i < 4; i++)
+				{
+					anorms_cell_direction(face, (i & 1) ? u1 : u0, (i & 2) ? v1 : v0, corner);
+					radius = max(radius, anorms_angle(center, corner));
+				}
+				radius += 1e-3;
+
+			/* the closest anorm is at least this close everywhere in the cell... */
+				lowest = -1.0;
+				for (i = 0; i < 162; i++)
+				{
+					angles[i] = anorms_angle(center, directions[i]);
+					lowest = max(lowest, cos(min(angles[i] + radius, M_PI)));
+				}
+
+			/* ...so only anorms that can get that close somewhere are candidates */
+				cell->num_candidates = 0;
+				for (i = 0; i < 162; i++)
+				{
+					if (cos(max(angles[i] - radius, 0.0)) < lowest - ANORMS_MARGIN)
+						continue;
+
+					if (cell->num_candidates == ANORMS_CELL_SIZE)
+						return; /* leaves the table unused */
+
+					cell->index[cell->num_candidates++] = i;
+				}
+
+				for (i = 0; i < ANORMS_CELL_SIZE; i++)
+				{
+					j = cell->index[min(i, cell->num_candidates - 1)];
+
+					cell->index[i] = j;
+					cell->x[i] = anorms[j][0];
+					cell->y[i] = anorms[j][1];
+					cell->z[i] = anorms[j][2];
+				}
+			}
+		}
+	}
+
+	anorms_cells_valid = true;
+}
+
+/* returns NULL for zero, non-finite or extremely short or long normals, where
+ * rounding in the dot products matters more than the direction does */
+static const anorms_cell_t *anorms_get_cell(const float *normal)
+{
+	float ax, ay, az, major;
+	int face, u, v;
+
+	if (!anorms_cells_valid)
+		return NULL;
+
+	ax = (float)fabs(normal[0]);
+	ay = (float)fabs(normal[1]);
+	az = (float)fabs(normal[2]);
+	major = max(ax, max(ay, az));
+
+/* also false for NaN */
+	if (!(major >= 1e-15f && ax + ay + az <= 1e15f))
+		return NULL;
+
+	if (ax >= ay && ax >= az)
+	{
+		face = normal[0] < 0 ? 1 : 0;
+		u = (int)((normal[1] / ax + 1.0f) * (ANORMS_GRID * 0.5f));
+		v = (int)((normal[2] / ax + 1.0f) * (ANORMS_GRID * 0.5f));
+	}
+	else if (ay >= az)
+	{
+		face = normal[1] < 0 ? 3 : 2;
+		u = (int)((normal[2] / ay + 1.0f) * (ANORMS_GRID * 0.5f));
+		v = (int)((normal[0] / ay + 1.0f) * (ANORMS_GRID * 0.5f));
+	}
+	else
+	{
+		face = normal[2] < 0 ? 5 : 4;
+		u = (int)((normal[0] / az + 1.0f) * (ANORMS_GRID * 0.5f));
+		v = (int)((normal[1] / az + 1.0f) * (ANORMS_GRID * 0.5f));
+	}
+
+	u = bound(0, u, ANORMS_GRID - 1);
+	v = bound(0, v, ANORMS_GRID - 1);
+
+	return &anorms_cells[(face * ANORMS_GRID + u) * ANORMS_GRID + v];
+}
+
+int compress_normal(const float *normal)
+{
+	const anorms_cell_t *cell;
+	int i, besti;
+	float dot, bestdot;
+
+	thread_once(&anorms_cells_built, anorms_build_cells);
+
+	cell = anorms_get_cell(normal);
+	if (!cell)
+		return compress_normal_brute(normal);
+
+	bestdot = normal[0] * cell->x[0] + normal[1] * cell->y[0] + normal[2] * cell->z[0];
+	besti = 0;
+
+	for (i = 1; i < cell->num_candidates; i++)
+	{
+		dot = normal[0] * cell->x[i] + normal[1] * cell->y[i] + normal[2] * cell->z[i];
+		if (dot > bestdot)
+		{
+			bestdot = dot;
+			besti = i;
+		}
+	}
+
+	return cell->index[besti];
+}
+
+/* the dot products are the same ones compress_normal does (as long as the
+ * compiler isn't contracting them into fused multiply-adds), done for all of
+ * a cell's candidates at once */
+void compress_normals(const float *normals, int num_normals, unsigned char *out_indices)
+{
+#ifdef ANORMS_SSE
+	int i, j, besti;
+	const float *n;
+	float dots[4];
+
+	thread_once(&anorms_cells_built, anorms_build_cells);
+
+	for (i = 0, n = normals; i < num_normals; i++, n += 3)
+	{
+		const anorms_cell_t *cell = anorms_get_cell(n);
+		__m128 d;
+
+		if (!cell)
+		{
+			out_indices[i] = (unsigned char)compress_normal_brute(n);
+			continue;
+		}
+
+		d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(n[0]), _mm_loadu_ps(cell->x)), _mm_mul_ps(_mm_set1_ps(n[1]), _mm_loadu_ps(cell->y)));
+		d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(n[2]), _mm_loadu_ps(cell->z)));
+		_mm_storeu_ps(dots, d);
+
+	/* padding repeats the last candidate, which never wins over the original */
+		besti = 0;
+		for (j = 1; j < ANORMS_CELL_SIZE; j++)
+			if (dots[j] > dots[besti])
+				besti = j;
+
+		out_indices[i] = cell->index[besti];
+	}
+#else
+	int i;
+
+	for (i = 0; i < num_normals; i++)
+		out_indices[i] = (unsigned char)compress_normal(normals + i * 3);
+#endif
+}
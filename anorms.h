@@ -17,6 +17,9 @@
 #ifndef ANORMS_H
 #define ANORMS_H
 
+/* index of the closest of the 162 anorms */
 int compress_normal(const float *normal);
+/* the same for an array of num_normals xyz normals, faster */
+void compress_normals(const float *normals, int num_normals, unsigned char *out_indices);
 
 #endif
@@ -0,0 +1,679 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* micro-benchmarks for the inner kernels of the converter, each run on its
+ * own at a few input sizes. reports the best time per element over several
+ * runs, a throughput figure, and (on linux, where perf events are allowed)
+ * instructions and cycles per element, which don't move with clock speed.
+ *
+ * usage: bench_kernels [-filter name] [-time seconds] [-threads n] [-json file] */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+#include "../anorms.h"
+#include "../global.h"
+#include "../model.h"
+#include "../model_md2.h"
+#include "../model_md3.h"
+#include "../palettes.h"
+#include "../thread.h"
+#include "fixtures.h"
+
+THREAD_LOCAL int texwidth = -1;
+THREAD_LOCAL int texheight = -1;
+THREAD_LOCAL const char *g_skinpath = NULL;
+THREAD_LOCAL const char *g_skin_base_name = NULL;
+
+/* inputs for one kernel at one size. each kernel uses the fields it needs */
+typedef struct kernel_input_s
+{
+	int size;
+	int num_elements;
+	size_t bytes_per_element; /* for the throughput figure */
+
+	float *normals;
+	mat4x4f_t *matrices;
+	image_rgba_t *image;
+	image_paletted_t *pimage;
+	void *filedata;
+	size_t filesize;
+	model_t *model;
+	dtriangle_t *triangles;
+	dstvert_t *texcoords;
+} kernel_input_t;
+
+typedef struct kernel_s
+{
+	const char *name;
+	const char *element; /* what num_elements counts */
+	int sizes[3];
+	bool_t (*setup)(kernel_input_t *input);
+	void (*run)(kernel_input_t *input);
+} kernel_t;
+
+/* results are summed into here so the compiler can't drop the work */
+static volatile unsigned int sink;
+
+static unsigned int rand_seed = 1;
+
+static float rand_float(void)
+{
+	rand_seed = rand_seed * 1103515245u + 12345u;
+	return (float)((rand_seed >> 8) & 0xffff) / 32768.0f - 1.0f;
+}
+
+/*
+==============================================================================
+
+KERNELS
+
+==============================================================================
+*/
+
+static bool_t setup_normals(kernel_input_t *input)
+{
+	int i;
+
+	input->num_elements = input->size;
+	input->bytes_per_element = sizeof(float[3]);
+	input->normals = (float*)qmalloc(sizeof(float[3]) * input->size);
+
+	for (i = 0; i < input->size; i++)
+	{
+		float *n = input->normals + i * 3;
+
+		do
+		{
+			n[0] = rand_float();
+			n[1] = rand_float();
+			n[2] = rand_float();
+		} while (DotProduct(n, n) < 0.0001f);
+		VectorNormalize(n);
+	}
+
+	return true;
+}
+
+static void run_compress_normal(kernel_input_t *input)
+{
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < input->num_elements; i++)
+		sum += compress_normal(input->normals + i * 3);
+	sink += sum;
+}
+
+static void run_compress_normals(kernel_input_t *input)
+{
+	unsigned char *indices = (unsigned char*)qmalloc(input->num_elements);
+
+	compress_normals(input->normals, input->num_elements, indices);
+	sink += indices[input->num_elements - 1];
+	qfree(indices);
+}
+
+static void run_md3_encodenormal(kernel_input_t *input)
+{
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < input->num_elements; i++)
+		sum += md3_encodenormal(input->normals + i * 3);
+	sink += sum;
+}
+
+static bool_t setup_image(kernel_input_t *input)
+{
+	input->num_elements = input->size * input->size;
+	input->bytes_per_element = 4;
+	input->image = fixture_create_image(input->size, input->size, 1);
+	return input->image != NULL;
+}
+
+/* resizes and pads are counted in output pixels */
+static bool_t setup_image_half(kernel_input_t *input)
+{
+	input->num_elements = input->size * input->size;
+	input->bytes_per_element = 4;
+	input->image = fixture_create_image(input->size / 2, input->size / 2, 1);
+	return input->image != NULL;
+}
+
+static bool_t setup_image_double(kernel_input_t *input)
+{
+	input->num_elements = input->size * input->size;
+	input->bytes_per_element = 4;
+	input->image = fixture_create_image(input->size * 2, input->size * 2, 1);
+	return input->image != NULL;
+}
+
+static bool_t setup_image_odd(kernel_input_t *input)
+{
+	input->num_elements = input->size * input->size;
+	input->bytes_per_element = 4;
+	input->image = fixture_create_image(input->size * 3 / 4 + 1, input->size * 3 / 4 + 1, 1);
+	return input->image != NULL;
+}
+
+static void run_image_palettize(kernel_input_t *input)
+{
+	image_paletted_t *pimage = image_palettize(mem_globalpool, &palette_quake, input->image, NULL);
+
+	sink += pimage->pixels[0];
+	image_paletted_free(&pimage);
+}
+
+static void run_image_resize(kernel_input_t *input)
+{
+	image_rgba_t *image = image_resize(mem_globalpool, input->image, input->size, input->size);
+
+	sink += image->pixels[0];
+	image_free(&image);
+}
+
+static void run_image_pad(kernel_input_t *input)
+{
+	image_rgba_t *image = image_pad(mem_globalpool, input->image, input->size, input->size);
+
+	sink += image->pixels[0];
+	image_free(&image);
+}
+
+static void run_tga_encode(kernel_input_t *input)
+{
+	xbuf_t *xbuf = xbuf_create_memory(65536, NULL);
+	void *data;
+	size_t size;
+
+	image_tga_save(input->image, xbuf, NULL);
+	xbuf_finish_memory(xbuf, &data, &size, NULL);
+	sink += (unsigned int)size;
+	qfree(data);
+}
+
+static bool_t setup_tga_decode(kernel_input_t *input)
+{
+	xbuf_t *xbuf;
+
+	if (!setup_image(input))
+		return false;
+	xbuf = xbuf_create_memory(65536, NULL);
+	image_tga_save(input->image, xbuf, NULL);
+	return xbuf_finish_memory(xbuf, &input->filedata, &input->filesize, NULL);
+}
+
+static void run_tga_decode(kernel_input_t *input)
+{
+	image_rgba_t *image = image_tga_load(mem_globalpool, input->filedata, input->filesize, NULL);
+
+	sink += image->pixels[0];
+	image_free(&image);
+}
+
+static bool_t setup_pcx(kernel_input_t *input)
+{
+	xbuf_t *xbuf;
+
+	if (!setup_image(input))
+		return false;
+	input->pimage = image_palettize(mem_globalpool, &palette_quake, input->image, NULL);
+	xbuf = xbuf_create_memory(65536, NULL);
+	image_pcx_save(input->pimage, xbuf, NULL);
+	return xbuf_finish_memory(xbuf, &input->filedata, &input->filesize, NULL);
+}
+
+static void run_pcx_encode(kernel_input_t *input)
+{
+	xbuf_t *xbuf = xbuf_create_memory(65536, NULL);
+	void *data;
+	size_t size;
+
+	image_pcx_save(input->pimage, xbuf, NULL);
+	xbuf_finish_memory(xbuf, &data, &size, NULL);
+	sink += (unsigned int)size;
+	qfree(data);
+}
+
+static void run_pcx_decode(kernel_input_t *input)
+{
+	image_paletted_t *pimage = image_pcx_load_paletted(mem_globalpool, input->filedata, input->filesize, NULL);
+
+	sink += pimage->pixels[0];
+	image_paletted_free(&pimage);
+}
+
+/* size is the grid size, counted in vertices over all frames */
+static bool_t setup_model(kernel_input_t *input)
+{
+	fixture_size_t size = { "kernel", 0, 20, 64 };
+
+	size.grid_size = input->size;
+	input->model = fixture_create_model(&size, "kernel_skin.tga");
+	input->num_elements = input->model->meshes[0].num_vertices * input->model->total_frames;
+	input->bytes_per_element = sizeof(float[3]);
+	return true;
+}
+
+static void run_recalculate_normals(kernel_input_t *input)
+{
+	model_recalculate_normals(input->model);
+	sink += (unsigned int)input->model->meshes[0].normal3f[0];
+}
+
+static bool_t setup_matrices(kernel_input_t *input)
+{
+	int i;
+
+	input->num_elements = input->size;
+	input->bytes_per_element = sizeof(mat4x4f_t);
+	input->matrices = (mat4x4f_t*)qmalloc(sizeof(mat4x4f_t) * (input->size + 1));
+
+	for (i = 0; i <= input->size; i++)
+	{
+		mat4x4f_create_rotate(&input->matrices[i], rand_float() * 180.0f, rand_float(), rand_float(), 1.0f);
+		mat4x4f_concat_translate(&input->matrices[i], rand_float() * 64.0f, rand_float() * 64.0f, rand_float() * 64.0f);
+	}
+
+	return true;
+}
+
+static void run_mat4x4f_concat(kernel_input_t *input)
+{
+	mat4x4f_t out;
+	float sum = 0;
+	int i;
+
+	for (i = 0; i < input->num_elements; i++)
+	{
+		mat4x4f_concat(&out, &input->matrices[i], &input->matrices[i + 1]);
+		sum += out.m[3][0];
+	}
+	sink += (unsigned int)sum;
+}
+
+static void run_mat4x4f_blend(kernel_input_t *input)
+{
+	mat4x4f_t out;
+	float sum = 0;
+	int i;
+
+	for (i = 0; i < input->num_elements; i++)
+	{
+		mat4x4f_blend(&out, &input->matrices[i], &input->matrices[i + 1], 0.25f);
+		sum += out.m[3][0];
+	}
+	sink += (unsigned int)sum;
+}
+
+/* size is the grid size, counted in triangles */
+static bool_t setup_glcmds(kernel_input_t *input)
+{
+	const fixture_size_t size = { "kernel", input->size, 1, 256 };
+	const mesh_t *mesh;
+	int i, j;
+
+	input->model = fixture_create_model(&size, "kernel_skin.tga");
+	mesh = &input->model->meshes[0];
+	if (mesh->num_vertices > 65536)
+		return false;
+
+	input->num_elements = mesh->num_triangles;
+	input->bytes_per_element = sizeof(dtriangle_t);
+	input->triangles = (dtriangle_t*)qmalloc(sizeof(dtriangle_t) * mesh->num_triangles);
+	input->texcoords = (dstvert_t*)qmalloc(sizeof(dstvert_t) * mesh->num_vertices);
+
+	for (i = 0; i < mesh->num_triangles; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			input->triangles[i].index_xyz[j] = (unsigned short)mesh->triangle3i[i*3+j];
+			input->triangles[i].index_st[j] = (unsigned short)mesh->triangle3i[i*3+j];
+		}
+	}
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		input->texcoords[i].s = (short)(mesh->texcoord2f[i*2+0] * 256);
+		input->texcoords[i].t = (short)(mesh->texcoord2f[i*2+1] * 256);
+	}
+
+	return true;
+}
+
+static void run_md2_build_glcmds(kernel_input_t *input)
+{
+	md2_glcmds_t glcmds;
+
+	md2_build_glcmds(&glcmds, input->triangles, input->num_elements, input->texcoords, 256, 256);
+	sink += glcmds.num_commands;
+	qfree(glcmds.commands);
+}
+
+static void free_input(kernel_input_t *input)
+{
+	qfree(input->normals);
+	qfree(input->matrices);
+	if (input->image)
+		image_free(&input->image);
+	if (input->pimage)
+		image_paletted_free(&input->pimage);
+	qfree(input->filedata);
+	if (input->model)
+		model_free(input->model);
+	qfree(input->triangles);
+	qfree(input->texcoords);
+}
+
+static const kernel_t kernels[] =
+{
+	{ "compress_normal",       "normal",   { 4096, 65536, 1048576 }, setup_normals,       run_compress_normal },
+	{ "compress_normals",      "normal",   { 4096, 65536, 1048576 }, setup_normals,       run_compress_normals },
+	{ "md3_encodenormal",      "normal",   { 4096, 65536, 1048576 }, setup_normals,       run_md3_encodenormal },
+	{ "image_palettize",       "pixel",    { 64, 256, 1024 },        setup_image,         run_image_palettize },
+	{ "image_resize_up",       "pixel",    { 64, 256, 1024 },        setup_image_half,    run_image_resize },
+	{ "image_resize_down",     "pixel",    { 64, 256, 1024 },        setup_image_double,  run_image_resize },
+	{ "image_pad",             "pixel",    { 64, 256, 1024 },        setup_image_odd,     run_image_pad },
+	{ "tga_rle_encode",        "pixel",    { 64, 256, 1024 },        setup_image,         run_tga_encode },
+	{ "tga_rle_decode",        "pixel",    { 64, 256, 1024 },        setup_tga_decode,    run_tga_decode },
+	{ "pcx_rle_encode",        "pixel",    { 64, 256, 1024 },        setup_pcx,           run_pcx_encode },
+	{ "pcx_rle_decode",        "pixel",    { 64, 256, 1024 },        setup_pcx,           run_pcx_decode },
+	{ "recalculate_normals",   "vertex",   { 16, 64, 128 },          setup_model,         run_recalculate_normals },
+	{ "mat4x4f_concat",        "matrix",   { 256, 4096, 65536 },     setup_matrices,      run_mat4x4f_concat },
+	{ "mat4x4f_blend",         "matrix",   { 256, 4096, 65536 },     setup_matrices,      run_mat4x4f_blend },
+	{ "md2_build_glcmds",      "triangle", { 16, 64, 160 },          setup_glcmds,        run_md2_build_glcmds }
+};
+
+/*
+==============================================================================
+
+COUNTERS
+
+==============================================================================
+*/
+
+/* instructions and cycles retired by this thread (and any threads it starts
+ * while they are open). -1 if perf events aren't available */
+static int counter_fds[2] = { -1, -1 };
+
+static void counters_open(void)
+{
+#ifdef __linux__
+	static const unsigned long long configs[2] = { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES };
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		counter_fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	if (counter_fds[0] < 0 || counter_fds[1] < 0)
+	{
+		for (i = 0; i < 2; i++)
+			if (counter_fds[i] >= 0)
+				close(counter_fds[i]);
+		counter_fds[0] = counter_fds[1] = -1;
+	}
+#endif
+}
+
+static void counters_close(void)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (counter_fds[i] >= 0)
+			close(counter_fds[i]);
+#endif
+	counter_fds[0] = counter_fds[1] = -1;
+}
+
+static void counters_start(void)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (counter_fds[i] >= 0)
+		{
+			ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+static bool_t counters_stop(double out_counts[2])
+{
+#ifdef __linux__
+	int i;
+
+	if (counter_fds[0] < 0)
+		return false;
+
+	for (i = 0; i < 2; i++)
+	{
+		unsigned long long count;
+
+		ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter_fds[i], &count, sizeof(count)) != sizeof(count))
+			return false;
+		out_counts[i] = (double)count;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+==============================================================================
+
+MAIN
+
+==============================================================================
+*/
+
+typedef struct kernel_result_s
+{
+	const kernel_t *kernel;
+	int size;
+	int num_elements;
+	size_t bytes_per_element;
+	double ns_per_element;
+	double instructions_per_element, cycles_per_element; /* negative if not counted */
+} kernel_result_t;
+
+/* calls the kernel until min_time has passed (at least 3 times), keeping the
+ * fastest call */
+static void measure(const kernel_t *kernel, kernel_input_t *input, double min_time, kernel_result_t *result)
+{
+	double start = get_time(), best = -1;
+	double counts[2], best_counts[2] = { -1, -1 };
+	int runs;
+
+	kernel->run(input); /* warm caches (and the palettizer's colormap) */
+
+	for (runs = 0; runs < 3 || get_time() - start < min_time; runs++)
+	{
+		double t;
+
+		counters_start();
+		t = get_time();
+		kernel->run(input);
+		t = get_time() - t;
+
+		if (best < 0 || t < best)
+		{
+			best = t;
+			if (!counters_stop(best_counts))
+				best_counts[0] = best_counts[1] = -1;
+		}
+		else
+			counters_stop(counts);
+	}
+
+	result->kernel = kernel;
+	result->size = input->size;
+	result->num_elements = input->num_elements;
+	result->bytes_per_element = input->bytes_per_element;
+	result->ns_per_element = best * 1e9 / input->num_elements;
+	result->instructions_per_element = best_counts[0] < 0 ? -1 : best_counts[0] / input->num_elements;
+	result->cycles_per_element = best_counts[1] < 0 ? -1 : best_counts[1] / input->num_elements;
+}
+
+static bool_t write_json(const char *filename, const kernel_result_t *results, int num_results, char **out_error)
+{
+	FILE *fp = fopen(filename, "wt");
+	int i;
+
+	if (!fp)
+		return (void)(out_error && (*out_error = msprintf("couldn't open %s for writing", filename))), false;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"benchmark\": \"bench_kernels\",\n");
+	fprintf(fp, "\t\"threads\": %d,\n", thread_num_workers());
+	fprintf(fp, "\t\"counters\": %s,\n", counter_fds[0] >= 0 ? "true" : "false");
+	fprintf(fp, "\t\"results\": [\n");
+	for (i = 0; i < num_results; i++)
+	{
+		const kernel_result_t *r = &results[i];
+
+		fprintf(fp, "\t\t{ \"kernel\": \"%s\", \"size\": %d, \"elements\": %d, \"element\": \"%s\", \"ns_per_element\": %.4f, \"melements_per_sec\": %.3f, \"mb_per_sec\": %.3f",
+			r->kernel->name, r->size, r->num_elements, r->kernel->element, r->ns_per_element, 1000.0 / r->ns_per_element, r->bytes_per_element * 1000.0 / r->ns_per_element);
+		if (r->instructions_per_element >= 0)
+			fprintf(fp, ", \"instructions_per_element\": %.2f, \"cycles_per_element\": %.2f", r->instructions_per_element, r->cycles_per_element);
+		fprintf(fp, " }%s\n", (i < num_results - 1) ? "," : "");
+	}
+	fprintf(fp, "\t]\n");
+	fprintf(fp, "}\n");
+
+	if (fclose(fp) != 0)
+		return (void)(out_error && (*out_error = msprintf("failed to write %s", filename))), false;
+	return true;
+}
+
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+int main(int argc, char **argv)
+{
+	const char *filter = NULL, *jsonfile = NULL;
+	kernel_result_t results[NUM_KERNELS * 3];
+	int num_results = 0, num_failed = 0;
+	double min_time = 0.2;
+	char *error;
+	int i, j;
+
+	g_num_threads = 1; /* per-element figures are for one core unless asked otherwise */
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-filter") && i + 1 < argc)
+			filter = argv[++i];
+		else if (!strcmp(argv[i], "-time") && i + 1 < argc)
+			min_time = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			g_num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-json") && i + 1 < argc)
+			jsonfile = argv[++i];
+		else
+		{
+			printf("usage: %s [-filter name] [-time seconds] [-threads n] [-json file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	mem_init();
+
+	counters_open();
+	if (counter_fds[0] < 0)
+		printf("hardware counters unavailable, reporting time only\n");
+
+	printf("%-20s %8s %9s %-9s %9s %11s %9s %11s %11s\n", "kernel", "size", "elements", "element", "ns/elem", "Melem/s", "MB/s", "instr/elem", "cycles/elem");
+
+	for (i = 0; i < NUM_KERNELS; i++)
+	{
+		const kernel_t *kernel = &kernels[i];
+
+		if (filter && !strstr(kernel->name, filter))
+			continue;
+
+		for (j = 0; j < 3; j++)
+		{
+			kernel_result_t *r = &results[num_results];
+			kernel_input_t input;
+
+			memset(&input, 0, sizeof(input));
+			input.size = kernel->sizes[j];
+			rand_seed = 1;
+
+			if (!kernel->setup(&input))
+			{
+				printf("%-20s %8d failed to set up\n", kernel->name, input.size);
+				free_input(&input);
+				num_failed++;
+				continue;
+			}
+
+			measure(kernel, &input, min_time, r);
+			free_input(&input);
+
+			printf("%-20s %8d %9d %-9s %9.3f %11.2f %9.1f", kernel->name, r->size, r->num_elements, kernel->element,
+				r->ns_per_element, 1000.0 / r->ns_per_element, r->bytes_per_element * 1000.0 / r->ns_per_element);
+			if (r->instructions_per_element >= 0)
+				printf(" %11.1f %11.1f\n", r->instructions_per_element, r->cycles_per_element);
+			else
+				printf(" %11s %11s\n", "-", "-");
+
+			num_results++;
+		}
+	}
+
+	counters_close();
+
+	if (jsonfile && !write_json(jsonfile, results, num_results, &error))
+	{
+		printf("%s\n", error);
+		qfree(error);
+		num_failed++;
+	}
+
+	mem_shutdown();
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* times the md2 exporter's vertex and texcoord welding against the old
+ * compare-against-everything version, on synthetic animated meshes, and checks
+ * that both produce the same result. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../global.h"
+#include "../model.h"
+#include "../model_md2.h"
+
+THREAD_LOCAL int texwidth = -1;
+THREAD_LOCAL int texheight = -1;
+THREAD_LOCAL const char *g_skinpath = NULL;
+THREAD_LOCAL const char *g_skin_base_name = NULL;
+
+#define SKIN_SIZE 256
+
+/* a size x size grid of quads as a triangle soup (every triangle has its own
+ * three vertices, as loaders produce for split texcoords), rippling over
+ * num_frames frames */
+static model_t *create_grid_model(int size, int num_frames)
+{
+	model_t *model = (model_t*)qmalloc(sizeof(model_t));
+	mesh_t *mesh;
+	int x, y, c, f, v;
+	static const int corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+
+	model_initialize(model);
+
+	model->num_frames = num_frames;
+	model->total_frames = num_frames;
+	model->frameinfo = (frameinfo_t*)qmalloc(sizeof(frameinfo_t) * num_frames);
+	for (f = 0; f < num_frames; f++)
+	{
+		model->frameinfo[f].num_frames = 1;
+		model->frameinfo[f].frametime = 0.1f;
+		model->frameinfo[f].frames = (singleframe_t*)qmalloc(sizeof(singleframe_t));
+		model->frameinfo[f].frames[0].name = msprintf("frame%d", f + 1);
+		model->frameinfo[f].frames[0].offset = f;
+	}
+
+	model->num_meshes = 1;
+	model->meshes = (mesh_t*)qmalloc(sizeof(mesh_t));
+	mesh = &model->meshes[0];
+	mesh_initialize(model, mesh);
+
+	mesh->name = copystring("grid");
+	mesh->num_triangles = size * size * 2;
+	mesh->num_vertices = mesh->num_triangles * 3;
+	mesh->vertex3f = (float*)qmalloc(sizeof(float[3]) * mesh->num_vertices * num_frames);
+	mesh->normal3f = (float*)qmalloc(sizeof(float[3]) * mesh->num_vertices * num_frames);
+	mesh->texcoord2f = (float*)qmalloc(sizeof(float[2]) * mesh->num_vertices);
+	mesh->triangle3i = (int*)qmalloc(sizeof(int[3]) * mesh->num_triangles);
+
+	v = 0;
+	for (y = 0; y < size; y++)
+	{
+		for (x = 0; x < size; x++)
+		{
+			for (c = 0; c < 6; c++, v++)
+			{
+				float gx = (float)(x + corners[c][0]);
+				float gy = (float)(y + corners[c][1]);
+
+				mesh->triangle3i[v] = v;
+				mesh->texcoord2f[v*2+0] = gx / size;
+				mesh->texcoord2f[v*2+1] = gy / size;
+
+				for (f = 0; f < num_frames; f++)
+				{
+					float *xyz = mesh->vertex3f + (f * mesh->num_vertices + v) * 3;
+					float *n = mesh->normal3f + (f * mesh->num_vertices + v) * 3;
+					float phase = (gx + gy) * 0.3f + f * 0.2f;
+
+					xyz[0] = gx * 4.0f;
+					xyz[1] = gy * 4.0f;
+					xyz[2] = (float)sin(phase) * 8.0f;
+					n[0] = -(float)cos(phase) * 0.6f;
+					n[1] = -(float)cos(phase) * 0.6f;
+					n[2] = 1.0f;
+					VectorNormalize(n);
+				}
+			}
+		}
+	}
+
+	return model;
+}
+
+/* the welding as it was, for reference */
+static void naive_weld_texcoords(md2_data_t *data, const mesh_t *mesh, int skinwidth, int skinheight)
+{
+	int i, j;
+
+	data->texcoords = (dstvert_t*)qmalloc(sizeof(dstvert_t) * mesh->num_vertices);
+	data->numtexcoords = 0;
+	data->texcoord_lookup = (int*)qmalloc(sizeof(int) * mesh->num_vertices);
+
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		dstvert_t md2texcoord;
+
+		md2texcoord.s = (int)(mesh->texcoord2f[i*2+0] * skinwidth);
+		md2texcoord.t = (int)(mesh->texcoord2f[i*2+1] * skinheight);
+
+		for (j = 0; j < data->numtexcoords; j++)
+			if (md2texcoord.s == data->texcoords[j].s && md2texcoord.t == data->texcoords[j].t)
+				break;
+		if (j == data->numtexcoords)
+			data->texcoords[data->numtexcoords++] = md2texcoord;
+		data->texcoord_lookup[i] = j;
+	}
+}
+
+static void naive_weld_vertices(md2_data_t *data, int num_vertices, int num_frames)
+{
+	int i, j, k;
+
+	data->vertices = (int*)qmalloc(sizeof(int) * num_vertices);
+	data->numvertices = 0;
+	data->vertex_lookup = (int*)qmalloc(sizeof(int) * num_vertices);
+
+	for (i = 0; i < num_vertices; i++)
+	{
+		const dtrivertx_t *v1 = data->original_vertices + i * num_frames;
+
+		for (j = 0; j < data->numvertices; j++)
+		{
+			const dtrivertx_t *v2 = data->original_vertices + data->vertices[j] * num_frames;
+
+			for (k = 0; k < num_frames; k++)
+				if (v1[k].v[0] != v2[k].v[0] || v1[k].v[1] != v2[k].v[1] || v1[k].v[2] != v2[k].v[2] || v1[k].lightnormalindex != v2[k].lightnormalindex)
+					break;
+			if (k == num_frames)
+				break;
+		}
+		if (j == data->numvertices)
+			data->vertices[data->numvertices++] = i;
+		data->vertex_lookup[i] = j;
+	}
+}
+
+static void free_weld(md2_data_t *data)
+{
+	qfree(data->texcoords);
+	qfree(data->texcoord_lookup);
+	qfree(data->vertices);
+	qfree(data->vertex_lookup);
+}
+
+static bool_t same_weld(const md2_data_t *a, const md2_data_t *b, int num_vertices)
+{
+	return a->numtexcoords == b->numtexcoords && a->numvertices == b->numvertices &&
+		!memcmp(a->texcoords, b->texcoords, sizeof(dstvert_t) * a->numtexcoords) &&
+		!memcmp(a->texcoord_lookup, b->texcoord_lookup, sizeof(int) * num_vertices) &&
+		!memcmp(a->vertices, b->vertices, sizeof(int) * a->numvertices) &&
+		!memcmp(a->vertex_lookup, b->vertex_lookup, sizeof(int) * num_vertices);
+}
+
+int main(void)
+{
+	static const int sizes[][2] = { { 16, 100 }, { 32, 100 }, { 64, 100 }, { 64, 400 } };
+	bool_t ok = true;
+	size_t i;
+
+	mem_init();
+
+	printf("%9s %7s %9s %10s %12s %11s %8s\n", "vertices", "frames", "welded", "texcoords", "naive (ms)", "hash (ms)", "speedup");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		model_t *model = create_grid_model(sizes[i][0], sizes[i][1]);
+		const mesh_t *mesh = &model->meshes[0];
+		md2_data_t *data, naive, hashed;
+		double start, naive_time, hashed_time;
+
+		data = md2_process_vertices(model, mesh, SKIN_SIZE, SKIN_SIZE);
+
+		naive = *data;
+		start = get_time();
+		naive_weld_texcoords(&naive, mesh, SKIN_SIZE, SKIN_SIZE);
+		naive_weld_vertices(&naive, mesh->num_vertices, model->num_frames);
+		naive_time = get_time() - start;
+
+		hashed = *data;
+		start = get_time();
+		md2_weld_texcoords(&hashed, mesh, SKIN_SIZE, SKIN_SIZE);
+		md2_weld_vertices(&hashed, mesh->num_vertices, model->num_frames);
+		hashed_time = get_time() - start;
+
+		printf("%9d %7d %9d %10d %12.2f %11.2f %7.1fx\n", mesh->num_vertices, model->num_frames, hashed.numvertices, hashed.numtexcoords, naive_time * 1000.0, hashed_time * 1000.0, naive_time / max(hashed_time, 1e-9));
+
+		if (!same_weld(&naive, &hashed, mesh->num_vertices))
+		{
+			printf("mismatch between naive and hashed welding\n");
+			ok = false;
+		}
+
+		free_weld(&naive);
+		free_weld(&hashed);
+		md2_free_data(data);
+		model_free(model);
+	}
+
+	mem_shutdown();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,404 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "../global.h"
+#include "../anorms.h"
+#include "../palettes.h"
+#include "fixtures.h"
+
+const fixture_size_t fixture_sizes[] =
+{
+	{ "small",   8,  10,  64 },
+	{ "medium", 24,  40, 128 },
+	{ "large",  64, 100, 256 }
+};
+
+const int fixture_num_sizes = sizeof(fixture_sizes) / sizeof(fixture_sizes[0]);
+
+const fixture_size_t *fixture_find_size(const char *name)
+{
+	int i;
+
+	for (i = 0; i < fixture_num_sizes; i++)
+		if (!strcmp(fixture_sizes[i].name, name))
+			return &fixture_sizes[i];
+
+	return NULL;
+}
+
+/* checkerboard over a gradient, with a little noise so the palettizer and the
+ * rle encoders have some work to do */
+image_rgba_t *fixture_create_image(int width, int height, unsigned int seed)
+{
+	image_rgba_t *image = image_alloc(mem_globalpool, width, height);
+	unsigned char *p;
+	int x, y;
+
+	if (!image)
+		return NULL;
+
+	for (y = 0, p = image->pixels; y < height; y++)
+	{
+		for (x = 0; x < width; x++, p += 4)
+		{
+			int checker = ((x >> 3) ^ (y >> 3)) & 1;
+
+			seed = seed * 1103515245u + 12345u;
+
+			p[0] = (unsigned char)(x * 255 / width);
+			p[1] = (unsigned char)(y * 255 / height);
+			p[2] = (unsigned char)(checker ? 192 : 64);
+			if (!(seed & 0x700000))
+				p[(seed >> 24) % 3] ^= 0x20;
+			p[3] = 255;
+		}
+	}
+
+	return image;
+}
+
+model_t *fixture_create_model(const fixture_size_t *size, const char *skinname)
+{
+	model_t *model = (model_t*)qmalloc(sizeof(model_t));
+	mesh_t *mesh;
+	const int n = size->grid_size;
+	const float spacing = 64.0f / n;
+	int x, y, f, v;
+	int *t;
+
+	model_initialize(model);
+
+	model->num_frames = size->num_frames;
+	model->total_frames = size->num_frames;
+	model->frameinfo = (frameinfo_t*)qmalloc(sizeof(frameinfo_t) * size->num_frames);
+	for (f = 0; f < size->num_frames; f++)
+	{
+		model->frameinfo[f].num_frames = 1;
+		model->frameinfo[f].frametime = 0.1f;
+		model->frameinfo[f].frames = (singleframe_t*)qmalloc(sizeof(singleframe_t));
+		model->frameinfo[f].frames[0].name = msprintf("frame%d", f + 1);
+		model->frameinfo[f].frames[0].offset = f;
+	}
+
+	model->num_skins = 1;
+	model->total_skins = 1;
+	model->skininfo = (skininfo_t*)qmalloc(sizeof(skininfo_t));
+	model->skininfo[0].frametime = 0.1f;
+	model->skininfo[0].num_skins = 1;
+	model->skininfo[0].skins = (singleskin_t*)qmalloc(sizeof(singleskin_t));
+	model->skininfo[0].skins[0].name = copystring(skinname);
+	model->skininfo[0].skins[0].offset = 0;
+
+	model->num_meshes = 1;
+	model->meshes = (mesh_t*)qmalloc(sizeof(mesh_t));
+	mesh = &model->meshes[0];
+	mesh_initialize(model, mesh);
+
+	mesh->name = copystring("sheet");
+	mesh->num_vertices = (n + 1) * (n + 1);
+	mesh->num_triangles = n * n * 2;
+	mesh->vertex3f = (float*)qmalloc(sizeof(float[3]) * mesh->num_vertices * size->num_frames);
+	mesh->normal3f = (float*)qmalloc(sizeof(float[3]) * mesh->num_vertices * size->num_frames);
+	mesh->texcoord2f = (float*)qmalloc(sizeof(float[2]) * mesh->num_vertices);
+	mesh->triangle3i = (int*)qmalloc(sizeof(int[3]) * mesh->num_triangles);
+
+	mesh->skins = (meshskin_t*)qmalloc(sizeof(meshskin_t));
+	mesh->skins[0].components[SKIN_DIFFUSE] = fixture_create_image(size->skin_size, size->skin_size, 1);
+	mesh->skins[0].components[SKIN_FULLBRIGHT] = NULL;
+
+	for (y = 0, v = 0; y <= n; y++)
+	{
+		for (x = 0; x <= n; x++, v++)
+		{
+			mesh->texcoord2f[v*2+0] = (x + 0.5f) / (n + 1);
+			mesh->texcoord2f[v*2+1] = (y + 0.5f) / (n + 1);
+
+			for (f = 0; f < size->num_frames; f++)
+			{
+				float *xyz = mesh->vertex3f + (f * mesh->num_vertices + v) * 3;
+				float *normal = mesh->normal3f + (f * mesh->num_vertices + v) * 3;
+				float phase = (x + y) * 0.5f + f * 0.3f;
+				float slope = (float)cos(phase) * 8.0f * 0.5f / spacing;
+
+				xyz[0] = (x - n * 0.5f) * spacing;
+				xyz[1] = (y - n * 0.5f) * spacing;
+				xyz[2] = (float)sin(phase) * 8.0f;
+				normal[0] = -slope;
+				normal[1] = -slope;
+				normal[2] = 1.0f;
+				VectorNormalize(normal);
+			}
+		}
+	}
+
+	for (y = 0, t = mesh->triangle3i; y < n; y++)
+	{
+		for (x = 0; x < n; x++, t += 6)
+		{
+			int a = y * (n + 1) + x, b = a + 1, c = a + n + 1, d = c + 1;
+
+			t[0] = a; t[1] = c; t[2] = b;
+			t[3] = b; t[4] = c; t[5] = d;
+		}
+	}
+
+	return model;
+}
+
+/* both formats are little endian and (mdo) unaligned, so write them field by field */
+
+static void put_int(xbuf_t *xbuf, int i)
+{
+	i = LittleLong(i);
+	xbuf_write_data(xbuf, 4, &i);
+}
+
+static void put_short(xbuf_t *xbuf, int i)
+{
+	short s = LittleShort((short)i);
+	xbuf_write_data(xbuf, 2, &s);
+}
+
+static void put_float(xbuf_t *xbuf, float f)
+{
+	f = LittleFloat(f);
+	xbuf_write_data(xbuf, 4, &f);
+}
+
+static void put_string(xbuf_t *xbuf, const char *string, size_t size)
+{
+	char buffer[256];
+
+	memset(buffer, 0, sizeof(buffer));
+	Q_strlcpy(buffer, string, min(size, sizeof(buffer)));
+	xbuf_write_data(xbuf, size, buffer);
+}
+
+static void frame_bounds(const model_t *model, int frame, float mins[3], float maxs[3])
+{
+	const mesh_t *mesh = &model->meshes[0];
+	const float *v = mesh->vertex3f + frame * mesh->num_vertices * 3;
+	int i, j;
+
+	for (i = 0; i < mesh->num_vertices; i++, v += 3)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			if (i == 0 || v[j] < mins[j])
+				mins[j] = v[j];
+			if (i == 0 || v[j] > maxs[j])
+				maxs[j] = v[j];
+		}
+	}
+}
+
+bool_t fixture_write_mdo(const char *filename, const model_t *model, char **out_error)
+{
+	const mesh_t *mesh = &model->meshes[0];
+	const image_rgba_t *skin = mesh->skins[0].components[SKIN_DIFFUSE];
+	image_paletted_t *pimage;
+	xbuf_t *xbuf, *pcx;
+	void *pcxdata;
+	size_t pcxsize;
+	float mins[3], maxs[3];
+	int i, j;
+
+/* the skin is stored as a pcx file */
+	pimage = image_palettize(mem_globalpool, &palette_quake, skin, NULL);
+	pcx = xbuf_create_memory(65536, out_error);
+	if (!pcx)
+		return false;
+	image_pcx_save(pimage, pcx, NULL);
+	image_paletted_free(&pimage);
+	if (!xbuf_finish_memory(pcx, &pcxdata, &pcxsize, out_error))
+		return false;
+
+	xbuf = xbuf_create_file(262144, filename, out_error);
+	if (!xbuf)
+	{
+		qfree(pcxdata);
+		return false;
+	}
+
+	xbuf_write_data(xbuf, 4, "MDO_");
+	put_int(xbuf, 1);
+	for (i = 0; i < 3; i++)
+		put_float(xbuf, model->offsets[i]);
+	put_int(xbuf, 1); /* bitmap_count */
+	put_int(xbuf, skin->width);
+	put_int(xbuf, skin->height);
+	put_int(xbuf, mesh->num_vertices); /* skin_vertex_count */
+	put_int(xbuf, mesh->num_triangles);
+	put_int(xbuf, mesh->num_vertices); /* frame_vertex_count */
+	put_int(xbuf, model->num_frames);
+	put_int(xbuf, model->synctype);
+	put_int(xbuf, model->flags);
+	put_int(xbuf, 1); /* global_palette */
+
+/* one single skin, and its name */
+	put_int(xbuf, 0);
+	put_int(xbuf, (int)pcxsize);
+	xbuf_write_data(xbuf, pcxsize, pcxdata);
+	qfree(pcxdata);
+
+	put_int(xbuf, 1);
+	xbuf_write_byte(xbuf, (unsigned char)strlen(model->skininfo[0].skins[0].name));
+	xbuf_write_data(xbuf, strlen(model->skininfo[0].skins[0].name), model->skininfo[0].skins[0].name);
+
+/* skin vertices, one per vertex */
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		put_int(xbuf, 0);
+		put_int(xbuf, (int)(mesh->texcoord2f[i*2+0] * (skin->width - 1) + 0.5f));
+		put_int(xbuf, (int)(mesh->texcoord2f[i*2+1] * (skin->height - 1) + 0.5f));
+	}
+
+	for (i = 0; i < mesh->num_triangles; i++)
+	{
+		put_int(xbuf, 1);
+		for (j = 0; j < 3; j++)
+			put_int(xbuf, mesh->triangle3i[i*3+j]);
+		for (j = 0; j < 3; j++)
+			put_int(xbuf, mesh->triangle3i[i*3+j]);
+	}
+
+/* single frames, bounds then vertices */
+	for (i = 0; i < model->num_frames; i++)
+	{
+		const float *v = mesh->vertex3f + i * mesh->num_vertices * 3;
+		const float *n = mesh->normal3f + i * mesh->num_vertices * 3;
+
+		put_int(xbuf, 0);
+
+		frame_bounds(model, i, mins, maxs);
+		for (j = 0; j < 3; j++)
+			put_float(xbuf, mins[j]);
+		xbuf_write_byte(xbuf, 0);
+		for (j = 0; j < 3; j++)
+			put_float(xbuf, maxs[j]);
+		xbuf_write_byte(xbuf, 0);
+		put_string(xbuf, model->frameinfo[i].frames[0].name, 16);
+
+		for (j = 0; j < mesh->num_vertices; j++, v += 3, n += 3)
+		{
+			put_float(xbuf, v[0]);
+			put_float(xbuf, v[1]);
+			put_float(xbuf, v[2]);
+			xbuf_write_byte(xbuf, (unsigned char)compress_normal(n));
+		}
+	}
+
+	return xbuf_finish_file(xbuf, out_error);
+}
+
+/* version 1 dkm, with byte vertices like md2 */
+bool_t fixture_write_dkm(const char *filename, const model_t *model, char **out_error)
+{
+	const mesh_t *mesh = &model->meshes[0];
+	const image_rgba_t *skin = mesh->skins[0].components[SKIN_DIFFUSE];
+	const int header_size = 4 * 20, skins_size = 64, surface_size = 32 + 4 * 5;
+	const int st_size = 4 * mesh->num_vertices, tris_size = 16 * mesh->num_triangles;
+	const int framesize = 40 + 4 * mesh->num_vertices;
+	int ofs_skins, ofs_st, ofs_tris, ofs_frames, ofs_surfaces, ofs_end;
+	float mins[3], maxs[3], scale[3];
+	xbuf_t *xbuf;
+	int i, j, k;
+
+	ofs_skins = header_size;
+	ofs_st = ofs_skins + skins_size;
+	ofs_tris = ofs_st + st_size;
+	ofs_frames = ofs_tris + tris_size;
+	ofs_surfaces = ofs_frames + framesize * model->num_frames;
+	ofs_end = ofs_surfaces + surface_size;
+
+	xbuf = xbuf_create_file(262144, filename, out_error);
+	if (!xbuf)
+		return false;
+
+	xbuf_write_data(xbuf, 4, "DKMD");
+	put_int(xbuf, 1);
+	for (i = 0; i < 3; i++)
+		put_float(xbuf, model->offsets[i]);
+	put_int(xbuf, framesize);
+	put_int(xbuf, 1); /* num_skins */
+	put_int(xbuf, mesh->num_vertices); /* num_xyz */
+	put_int(xbuf, mesh->num_vertices); /* num_st */
+	put_int(xbuf, mesh->num_triangles);
+	put_int(xbuf, 0); /* num_glcmds */
+	put_int(xbuf, model->num_frames);
+	put_int(xbuf, 1); /* num_surfaces */
+	put_int(xbuf, ofs_skins);
+	put_int(xbuf, ofs_st);
+	put_int(xbuf, ofs_tris);
+	put_int(xbuf, ofs_frames);
+	put_int(xbuf, ofs_end); /* ofs_glcmds */
+	put_int(xbuf, ofs_surfaces);
+	put_int(xbuf, ofs_end);
+
+	put_string(xbuf, model->skininfo[0].skins[0].name, 64);
+
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		put_short(xbuf, (int)(mesh->texcoord2f[i*2+0] * skin->width));
+		put_short(xbuf, (int)(mesh->texcoord2f[i*2+1] * skin->height));
+	}
+
+	for (i = 0; i < mesh->num_triangles; i++)
+	{
+		put_short(xbuf, 0); /* index_surface */
+		put_short(xbuf, 1); /* num_uvframes */
+		for (j = 0; j < 3; j++)
+			put_short(xbuf, mesh->triangle3i[i*3+j]);
+		for (j = 0; j < 3; j++)
+			put_short(xbuf, mesh->triangle3i[i*3+j]);
+	}
+
+	for (i = 0; i < model->num_frames; i++)
+	{
+		const float *v = mesh->vertex3f + i * mesh->num_vertices * 3;
+		const float *n = mesh->normal3f + i * mesh->num_vertices * 3;
+
+		frame_bounds(model, i, mins, maxs);
+		for (j = 0; j < 3; j++)
+		{
+			scale[j] = (maxs[j] - mins[j]) / 255.0f;
+			put_float(xbuf, scale[j]);
+		}
+		for (j = 0; j < 3; j++)
+			put_float(xbuf, mins[j]);
+		put_string(xbuf, model->frameinfo[i].frames[0].name, 16);
+
+		for (j = 0; j < mesh->num_vertices; j++, v += 3, n += 3)
+		{
+			for (k = 0; k < 3; k++)
+				xbuf_write_byte(xbuf, (unsigned char)(scale[k] ? bound(0, (int)((v[k] - mins[k]) / scale[k] + 0.5f), 255) : 0));
+			xbuf_write_byte(xbuf, (unsigned char)compress_normal(n));
+		}
+	}
+
+	put_string(xbuf, mesh->name, 32);
+	put_int(xbuf, 0); /* flags */
+	put_int(xbuf, 0); /* skinindex */
+	put_int(xbuf, skin->width);
+	put_int(xbuf, skin->height);
+	put_int(xbuf, 1); /* num_uvframes */
+
+	return xbuf_finish_file(xbuf, out_error);
+}
@@ -0,0 +1,48 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIXTURES_H
+#define FIXTURES_H
+
+#include "../global.h"
+#include "../model.h"
+
+/* procedurally generated models and images for the benchmarks, the same on
+ * every run and every machine so no game data is needed */
+
+typedef struct fixture_size_s
+{
+	const char *name;
+	int grid_size; /* quads along each side of the mesh */
+	int num_frames;
+	int skin_size;
+} fixture_size_t;
+
+extern const fixture_size_t fixture_sizes[];
+extern const int fixture_num_sizes;
+
+const fixture_size_t *fixture_find_size(const char *name);
+
+/* a rippling sheet with one opaque skin, named skinname */
+model_t *fixture_create_model(const fixture_size_t *size, const char *skinname);
+image_rgba_t *fixture_create_image(int width, int height, unsigned int seed);
+
+/* there are no savers for these formats, so the fixtures are written here */
+bool_t fixture_write_mdo(const char *filename, const model_t *model, char **out_error);
+bool_t fixture_write_dkm(const char *filename, const model_t *model, char **out_error);
+
+#endif
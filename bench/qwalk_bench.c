@@ -0,0 +1,338 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* end-to-end conversion benchmark. generates fixture models in every format
+ * the library can load, then times load, process and save for every
+ * input/output pair, and reports wall time, allocation counts, peak memory
+ * and output size. fixtures and outputs are written to the current directory.
+ *
+ * usage: qwalk_bench [-size small|medium|large] [-in ext] [-out ext]
+ *                    [-repeat n] [-threads n] [-json file] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../global.h"
+#include "../model.h"
+#include "../thread.h"
+#include "fixtures.h"
+
+THREAD_LOCAL int texwidth = -1;
+THREAD_LOCAL int texheight = -1;
+THREAD_LOCAL const char *g_skinpath = NULL;
+THREAD_LOCAL const char *g_skin_base_name = NULL;
+
+static const char *input_formats[] = { "mdl", "md2", "md3", "mdo", "dkm" };
+static const char *output_formats[] = { "mdl", "md2", "md3" };
+
+#define NUM_INPUTS (int)(sizeof(input_formats) / sizeof(input_formats[0]))
+#define NUM_OUTPUTS (int)(sizeof(output_formats) / sizeof(output_formats[0]))
+
+typedef struct bench_result_s
+{
+	const char *input, *output;
+	int num_vertices, num_triangles, num_frames;
+	double load_time, process_time, save_time;
+	size_t num_allocs, num_mallocs;
+	size_t peak_bytes;
+	long output_bytes;
+} bench_result_t;
+
+static long file_size(const char *filename)
+{
+	FILE *fp = fopen(filename, "rb");
+	long size;
+
+	if (!fp)
+		return -1;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+static bool_t write_fixtures(const fixture_size_t *size, char **out_error)
+{
+	char skinname[64], filename[64];
+	model_t *model;
+	bool_t ok;
+	int i;
+
+	sprintf(skinname, "%s_skin.tga", size->name);
+
+	model = fixture_create_model(size, skinname);
+
+	ok = image_save(skinname, model->meshes[0].skins[0].components[SKIN_DIFFUSE], out_error);
+
+	for (i = 0; ok && i < NUM_INPUTS; i++)
+	{
+		sprintf(filename, "%s.%s", size->name, input_formats[i]);
+
+		if (!strcmp(input_formats[i], "mdo"))
+			ok = fixture_write_mdo(filename, model, out_error);
+		else if (!strcmp(input_formats[i], "dkm"))
+			ok = fixture_write_dkm(filename, model, out_error);
+		else
+			ok = model_save(filename, model, out_error);
+	}
+
+	model_free(model);
+	return ok;
+}
+
+/* give skinless models (md3 loads without its shaders) the fixture skin, the
+ * same way modelconv's -texture option does */
+static bool_t attach_skin(model_t *model, const char *skinname, char **out_error)
+{
+	image_rgba_t *image;
+	int i;
+
+	image = image_load_from_file(mem_globalpool, skinname, out_error);
+	if (!image)
+		return false;
+
+	model_clear_skins(model);
+
+	model->total_skins = 1;
+	model->num_skins = 1;
+	model->skininfo = (skininfo_t*)qmalloc(sizeof(skininfo_t));
+	model->skininfo[0].frametime = 0.1f;
+	model->skininfo[0].num_skins = 1;
+	model->skininfo[0].skins = (singleskin_t*)qmalloc(sizeof(singleskin_t));
+	model->skininfo[0].skins[0].name = copystring(skinname);
+	model->skininfo[0].skins[0].offset = 0;
+
+	for (i = 0; i < model->num_meshes; i++)
+	{
+		model->meshes[i].skins = (meshskin_t*)qmalloc(sizeof(meshskin_t));
+		model->meshes[i].skins[0].components[SKIN_DIFFUSE] = image_clone(mem_globalpool, image);
+		model->meshes[i].skins[0].components[SKIN_FULLBRIGHT] = NULL;
+	}
+
+	image_free(&image);
+	return true;
+}
+
+static bool_t run_conversion(const fixture_size_t *size, const char *input, const char *output, bench_result_t *result, char **out_error)
+{
+	char infile[64], outfile[64], skinname[64];
+	mem_stats_t before, after;
+	model_t *model;
+	double start, loaded, processed, saved;
+	int i;
+
+	sprintf(infile, "%s.%s", size->name, input);
+	sprintf(outfile, "out_%s_%s.%s", size->name, input, output);
+	sprintf(skinname, "%s_skin.tga", size->name);
+
+	mem_reset_peak();
+	mem_get_stats(&before);
+
+	start = get_time();
+
+	model = model_load_from_file(infile, out_error);
+	if (!model)
+		return false;
+
+	loaded = get_time();
+
+	if (!model->num_skins && !attach_skin(model, skinname, out_error))
+	{
+		model_free(model);
+		return false;
+	}
+	model_recalculate_normals(model);
+
+	processed = get_time();
+
+	if (!model_save(outfile, model, out_error))
+	{
+		model_free(model);
+		return false;
+	}
+
+	saved = get_time();
+
+	mem_get_stats(&after);
+
+	result->input = input;
+	result->output = output;
+	result->num_vertices = 0;
+	result->num_triangles = 0;
+	for (i = 0; i < model->num_meshes; i++)
+	{
+		result->num_vertices += model->meshes[i].num_vertices;
+		result->num_triangles += model->meshes[i].num_triangles;
+	}
+	result->num_frames = model->total_frames;
+	result->load_time = loaded - start;
+	result->process_time = processed - loaded;
+	result->save_time = saved - processed;
+	result->num_allocs = after.num_allocs - before.num_allocs;
+	result->num_mallocs = after.num_mallocs - before.num_mallocs;
+	result->peak_bytes = after.peak_bytes - before.bytes_alloced;
+	result->output_bytes = file_size(outfile);
+
+	model_free(model);
+	return true;
+}
+
+static bool_t write_json(const char *filename, const fixture_size_t *size, int repeat, const bench_result_t *results, int num_results, char **out_error)
+{
+	FILE *fp = fopen(filename, "wt");
+	int i;
+
+	if (!fp)
+		return (void)(out_error && (*out_error = msprintf("couldn't open %s for writing", filename))), false;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"benchmark\": \"qwalk_bench\",\n");
+	fprintf(fp, "\t\"size\": \"%s\",\n", size->name);
+	fprintf(fp, "\t\"threads\": %d,\n", thread_num_workers());
+	fprintf(fp, "\t\"repeat\": %d,\n", repeat);
+	fprintf(fp, "\t\"results\": [\n");
+	for (i = 0; i < num_results; i++)
+	{
+		const bench_result_t *r = &results[i];
+
+		fprintf(fp, "\t\t{ \"input\": \"%s\", \"output\": \"%s\", \"vertices\": %d, \"triangles\": %d, \"frames\": %d, ",
+			r->input, r->output, r->num_vertices, r->num_triangles, r->num_frames);
+		fprintf(fp, "\"load_ms\": %.3f, \"process_ms\": %.3f, \"save_ms\": %.3f, \"total_ms\": %.3f, ",
+			r->load_time * 1000.0, r->process_time * 1000.0, r->save_time * 1000.0, (r->load_time + r->process_time + r->save_time) * 1000.0);
+		fprintf(fp, "\"allocations\": %lu, \"mallocs\": %lu, \"peak_bytes\": %lu, \"output_bytes\": %ld }%s\n",
+			(unsigned long)r->num_allocs, (unsigned long)r->num_mallocs, (unsigned long)r->peak_bytes, r->output_bytes, (i < num_results - 1) ? "," : "");
+	}
+	fprintf(fp, "\t]\n");
+	fprintf(fp, "}\n");
+
+	if (fclose(fp) != 0)
+		return (void)(out_error && (*out_error = msprintf("failed to write %s", filename))), false;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const fixture_size_t *size = fixture_find_size("small");
+	const char *only_input = NULL, *only_output = NULL, *jsonfile = NULL;
+	bench_result_t results[NUM_INPUTS * NUM_OUTPUTS];
+	int num_results = 0, num_failed = 0;
+	int repeat = 3;
+	char *error;
+	int i, j, k;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-size") && i + 1 < argc)
+		{
+			size = fixture_find_size(argv[++i]);
+			if (!size)
+			{
+				printf("unknown fixture size \"%s\"\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-in") && i + 1 < argc)
+			only_input = argv[++i];
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc)
+			only_output = argv[++i];
+		else if (!strcmp(argv[i], "-repeat") && i + 1 < argc)
+			repeat = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			g_num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-json") && i + 1 < argc)
+			jsonfile = argv[++i];
+		else
+		{
+			printf("usage: %s [-size small|medium|large] [-in ext] [-out ext] [-repeat n] [-threads n] [-json file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	repeat = max(repeat, 1);
+
+	mem_init();
+
+	g_force_yes = true; /* overwrite outputs from earlier runs */
+
+	if (!write_fixtures(size, &error))
+	{
+		printf("failed to write fixtures: %s\n", error);
+		qfree(error);
+		mem_shutdown();
+		return 1;
+	}
+
+	printf("%-6s %-6s %9s %9s %7s %10s %11s %10s %11s %8s %11s %12s\n",
+		"input", "output", "vertices", "triangles", "frames", "load (ms)", "process (ms)", "save (ms)", "total (ms)", "allocs", "peak (KiB)", "output (KiB)");
+
+	for (i = 0; i < NUM_INPUTS; i++)
+	{
+		if (only_input && strcmp(only_input, input_formats[i]))
+			continue;
+
+		for (j = 0; j < NUM_OUTPUTS; j++)
+		{
+			bench_result_t *best = &results[num_results];
+			bool_t ok = true;
+
+			if (only_output && strcmp(only_output, output_formats[j]))
+				continue;
+
+		/* keep the fastest run, the counters are the same each time */
+			for (k = 0; k < repeat; k++)
+			{
+				bench_result_t result;
+
+				if (!run_conversion(size, input_formats[i], output_formats[j], &result, &error))
+				{
+					printf("%-6s %-6s failed: %s\n", input_formats[i], output_formats[j], error ? error : "unknown error");
+					qfree(error);
+					ok = false;
+					break;
+				}
+
+				if (k == 0 || result.load_time + result.process_time + result.save_time < best->load_time + best->process_time + best->save_time)
+					*best = result;
+			}
+
+			if (!ok)
+			{
+				num_failed++;
+				continue;
+			}
+
+			printf("%-6s %-6s %9d %9d %7d %10.2f %11.2f %10.2f %11.2f %8lu %11lu %12ld\n",
+				best->input, best->output, best->num_vertices, best->num_triangles, best->num_frames,
+				best->load_time * 1000.0, best->process_time * 1000.0, best->save_time * 1000.0,
+				(best->load_time + best->process_time + best->save_time) * 1000.0,
+				(unsigned long)best->num_allocs, (unsigned long)(best->peak_bytes / 1024), best->output_bytes / 1024);
+
+			num_results++;
+		}
+	}
+
+	if (jsonfile && !write_json(jsonfile, size, repeat, results, num_results, &error))
+	{
+		printf("%s\n", error);
+		qfree(error);
+		num_failed++;
+	}
+
+	mem_shutdown();
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,462 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+# include <direct.h>
+# include <process.h>
+# include <sys/utime.h>
+#else
+# include <unistd.h>
+# include <utime.h>
+#endif
+
+#include "global.h"
+#include "cache.h"
+#include "thread.h"
+#include "util.h"
+
+/* an entry is a directory named after the key in hex, holding a manifest and
+ * the written files, named by their order in it. the manifest's modification
+ * time is when the entry was last used. its lines are
+ *   qwalk cache <CACHE_FORMAT>
+ *   read <hash in hex, or - if the file didn't exist> <filename>
+ *   write <size> <filename>
+ * entries are built under a temporary name and renamed into place whole */
+#define CACHE_FORMAT 1
+
+struct cache_s
+{
+	char directory[1024];
+	unsigned long long max_bytes;
+
+	thread_mutex_t *mutex;
+	int num_temps; /* temporary entry directories made so far */
+	cache_stats_t stats;
+};
+
+static int cache_mkdir(const char *path)
+{
+#ifdef WIN32
+	return _mkdir(path);
+#else
+	return mkdir(path, 0777);
+#endif
+}
+
+/* removes an entry directory, or what's left of one */
+static void cache_remove_entry(const char *path)
+{
+	char filename[1100];
+	int i;
+
+	for (i = 0; ; i++)
+	{
+		snprintf(filename, sizeof(filename), "%s/%d", path, i);
+		if (remove(filename) != 0)
+			break;
+	}
+
+	snprintf(filename, sizeof(filename), "%s/manifest", path);
+	remove(filename);
+#ifdef WIN32
+	_rmdir(path);
+#else
+	rmdir(path);
+#endif
+}
+
+static bool_t cache_writefile(const char *filename, const void *data, size_t size, char **out_error)
+{
+	FILE *fp;
+
+/* not openfile_write, the cache's own files are nobody else's business */
+	if (!(fp = fopen(filename, "wb")))
+		return (void)(out_error && (*out_error = msprintf("couldn't open %s: %s", filename, strerror(errno)))), false;
+
+	if (fwrite(data, 1, size, fp) < size)
+	{
+		if (out_error)
+			*out_error = msprintf("failed to write %s: %s", filename, strerror(errno));
+		fclose(fp);
+		return false;
+	}
+
+	if (fclose(fp) != 0)
+		return (void)(out_error && (*out_error = msprintf("failed to write %s: %s", filename, strerror(errno)))), false;
+	return true;
+}
+
+cache_t *cache_open(const char *directory, unsigned long long max_bytes, char **out_error)
+{
+	cache_t *cache;
+	struct stat st;
+
+	if (strlen(directory) >= sizeof(cache->directory) - 64)
+		return (void)(out_error && (*out_error = msprintf("cache directory name is too long"))), NULL;
+
+	if (stat(directory, &st) != 0)
+	{
+		if (cache_mkdir(directory) != 0 && errno != EEXIST)
+			return (void)(out_error && (*out_error = msprintf("couldn't create %s: %s", directory, strerror(errno)))), NULL;
+	}
+	else if ((st.st_mode & S_IFMT) != S_IFDIR)
+		return (void)(out_error && (*out_error = msprintf("%s is not a directory", directory))), NULL;
+
+	cache = (cache_t*)qmalloc(sizeof(cache_t));
+	memset(cache, 0, sizeof(cache_t));
+	Q_strlcpy(cache->directory, directory, sizeof(cache->directory));
+	cache->max_bytes = max_bytes;
+	cache->mutex = thread_mutex_create();
+	return cache;
+}
+
+void cache_close(cache_t *cache)
+{
+	thread_mutex_free(cache->mutex);
+	qfree(cache);
+}
+
+bool_t cache_hash_file(const char *filename, unsigned long long *hash)
+{
+	filemap_t filemap;
+
+	if (!mapfile(filename, &filemap, NULL))
+		return false;
+
+	*hash = hash_data64(filemap.data, filemap.size, *hash);
+	unmapfile(&filemap);
+	return true;
+}
+
+/* the hash field of a read line */
+static void cache_dependency_hash(const char *filename, char out_hex[17])
+{
+	unsigned long long hash = 0;
+
+	if (cache_hash_file(filename, &hash))
+		sprintf(out_hex, "%016llx", hash);
+	else
+		strcpy(out_hex, "-");
+}
+
+/* splits the next line off *s, in place. NULL at the end */
+static char *cache_next_line(char **s)
+{
+	char *line = *s;
+
+	if (!*line)
+		return NULL;
+
+	while (**s && **s != '\n')
+		(*s)++;
+	if (**s)
+		*(*s)++ = '\0';
+	return line;
+}
+
+static void cache_count(cache_t *cache, int *counter)
+{
+	thread_mutex_lock(cache->mutex);
+	(*counter)++;
+	thread_mutex_unlock(cache->mutex);
+}
+
+typedef struct cache_output_s
+{
+	const char *filename; /* in the manifest */
+	void *data;
+	size_t size;
+} cache_output_t;
+
+bool_t cache_fetch(cache_t *cache, unsigned long long key, char **out_error)
+{
+	char entryname[1100], filename[1200], hex[17], expectedhex[17];
+	char *manifest, *s, *line;
+	size_t manifestsize;
+	cache_output_t *outputs = NULL;
+	unsigned long size;
+	int num_outputs = 0, i, format, n;
+	bool_t hit = false;
+
+	if (out_error)
+		*out_error = NULL;
+
+	snprintf(entryname, sizeof(entryname), "%s/%016llx", cache->directory, key);
+	snprintf(filename, sizeof(filename), "%s/manifest", entryname);
+
+	if (!loadfile(filename, (void**)&manifest, &manifestsize, NULL))
+	{
+		cache_count(cache, &cache->stats.misses);
+		return false;
+	}
+
+/* count the outputs and check the dependencies haven't changed */
+	s = manifest;
+	line = cache_next_line(&s);
+	if (!line || sscanf(line, "qwalk cache %d", &format) != 1 || format != CACHE_FORMAT)
+		goto done;
+
+	while ((line = cache_next_line(&s)))
+	{
+		if (sscanf(line, "read %16s %n", expectedhex, &n) == 1)
+		{
+			cache_dependency_hash(line + n, hex);
+			if (strcmp(hex, expectedhex))
+				goto done;
+		}
+		else if (sscanf(line, "write %lu %n", &size, &n) == 1)
+			num_outputs++;
+		else
+			goto done;
+	}
+
+/* read all of the outputs before writing any, in case the entry is evicted
+ * by someone else meanwhile */
+	if (num_outputs)
+	{
+		outputs = (cache_output_t*)qmalloc(sizeof(cache_output_t) * num_outputs);
+		memset(outputs, 0, sizeof(cache_output_t) * num_outputs);
+	}
+
+	for (s = manifest, i = 0; i < num_outputs; s += strlen(s) + 1)
+	{
+		if (sscanf(s, "write %lu %n", &size, &n) != 1)
+			continue;
+
+		outputs[i].filename = s + n;
+		snprintf(filename, sizeof(filename), "%s/%d", entryname, i);
+		if (!loadfile(filename, &outputs[i].data, &outputs[i].size, NULL) || outputs[i].size != size)
+			goto done;
+		i++;
+	}
+
+	hit = true;
+
+	for (i = 0; i < num_outputs; i++)
+	{
+		char *error;
+
+		if (!writefile(outputs[i].filename, outputs[i].data, outputs[i].size, &error))
+		{
+			if (out_error)
+				*out_error = msprintf("failed to restore %s: %s", outputs[i].filename, error);
+			qfree(error);
+			break;
+		}
+	}
+
+/* freshen it for cache_trim */
+	snprintf(filename, sizeof(filename), "%s/manifest", entryname);
+	utime(filename, NULL);
+
+done:
+	for (i = 0; i < num_outputs && outputs; i++)
+		qfree(outputs[i].data);
+	qfree(outputs);
+	qfree(manifest);
+
+	cache_count(cache, hit ? &cache->stats.hits : &cache->stats.misses);
+	return hit && !(out_error && *out_error);
+}
+
+bool_t cache_store(cache_t *cache, unsigned long long key, const filelog_entry_t *entries, int num_entries, char **out_error)
+{
+	char entryname[1100], tempname[1100], filename[1200], hex[17];
+	char *error = NULL;
+	FILE *fp;
+	int num_outputs = 0, i, temp, pid;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		if (strchr(entries[i].filename, '\n'))
+			return (void)(out_error && (*out_error = msprintf("can't store file names with line breaks"))), false;
+		if (entries[i].written)
+			num_outputs++;
+	}
+
+	if (!num_outputs)
+		return true;
+
+	thread_mutex_lock(cache->mutex);
+	temp = cache->num_temps++;
+	thread_mutex_unlock(cache->mutex);
+
+#ifdef WIN32
+	pid = (int)_getpid();
+#else
+	pid = (int)getpid();
+#endif
+
+/* cache_open leaves room for these, but a truncated name would store the
+ * entry somewhere else */
+	snprintf(entryname, sizeof(entryname), "%s/%016llx", cache->directory, key);
+	if (snprintf(tempname, sizeof(tempname), "%s.%d.%d.tmp", entryname, pid, temp) >= (int)sizeof(tempname))
+		return (void)(out_error && (*out_error = msprintf("cache entry name is too long"))), false;
+
+	if (cache_mkdir(tempname) != 0)
+		return (void)(out_error && (*out_error = msprintf("couldn't create %s: %s", tempname, strerror(errno)))), false;
+
+	snprintf(filename, sizeof(filename), "%s/manifest", tempname);
+	if (!(fp = fopen(filename, "w")))
+	{
+		if (out_error)
+			*out_error = msprintf("couldn't open %s: %s", filename, strerror(errno));
+		cache_remove_entry(tempname);
+		return false;
+	}
+
+	fprintf(fp, "qwalk cache %d\n", CACHE_FORMAT);
+
+	for (i = 0; i < num_entries; i++)
+	{
+		if (!entries[i].written)
+		{
+			cache_dependency_hash(entries[i].filename, hex);
+			fprintf(fp, "read %s %s\n", hex, entries[i].filename);
+		}
+	}
+
+	for (i = 0, num_outputs = 0; i < num_entries && !error; i++)
+	{
+		void *data;
+		size_t size;
+
+		if (!entries[i].written)
+			continue;
+
+		if (!loadfile(entries[i].filename, &data, &size, &error))
+			break;
+
+		snprintf(filename, sizeof(filename), "%s/%d", tempname, num_outputs++);
+		if (cache_writefile(filename, data, size, &error))
+			fprintf(fp, "write %lu %s\n", (unsigned long)size, entries[i].filename);
+		qfree(data);
+	}
+
+	if (fclose(fp) != 0 && !error)
+		error = msprintf("failed to write manifest: %s", strerror(errno));
+
+	if (error)
+	{
+		if (out_error)
+			*out_error = error;
+		else
+			qfree(error);
+		cache_remove_entry(tempname);
+		return false;
+	}
+
+/* an entry already there missed in cache_fetch, so it's out of date. if the
+ * rename still fails, someone else stored it first */
+	if (rename(tempname, entryname) != 0)
+	{
+		cache_remove_entry(entryname);
+		if (rename(tempname, entryname) != 0)
+		{
+			cache_remove_entry(tempname);
+			return true;
+		}
+	}
+
+	cache_count(cache, &cache->stats.stores);
+	return true;
+}
+
+typedef struct cache_entry_s
+{
+	char name[17];
+	time_t lastused;
+	unsigned long long bytes;
+} cache_entry_t;
+
+static int cache_compare_entries(const void *a, const void *b)
+{
+	const cache_entry_t *ea = (const cache_entry_t*)a, *eb = (const cache_entry_t*)b;
+
+	if (ea->lastused != eb->lastused)
+		return ea->lastused < eb->lastused ? -1 : 1;
+	return strcmp(ea->name, eb->name);
+}
+
+void cache_trim(cache_t *cache)
+{
+	char filename[1200], entryname[1100];
+	char **files, *manifest, *s, *line;
+	cache_entry_t *entries;
+	size_t manifestsize;
+	unsigned long long total = 0;
+	unsigned long size;
+	struct stat st;
+	int num_files, num_entries = 0, i, n;
+
+	files = list_files(cache->directory, "/", &num_files);
+	entries = (cache_entry_t*)qmalloc(sizeof(cache_entry_t) * (num_files ? num_files : 1));
+
+	for (i = 0; i < num_files; i++)
+	{
+		cache_entry_t *entry = &entries[num_entries];
+
+	/* skip temporary entries, they're someone else's */
+		if (strlen(files[i]) != 16 || strspn(files[i], "0123456789abcdef") != 16)
+			continue;
+
+		snprintf(filename, sizeof(filename), "%s/%s/manifest", cache->directory, files[i]);
+		if (stat(filename, &st) != 0 || !loadfile(filename, (void**)&manifest, &manifestsize, NULL))
+			continue;
+
+		strcpy(entry->name, files[i]);
+		entry->lastused = st.st_mtime;
+		entry->bytes = manifestsize;
+		for (s = manifest; (line = cache_next_line(&s)); )
+			if (sscanf(line, "write %lu %n", &size, &n) == 1)
+				entry->bytes += size;
+		qfree(manifest);
+
+		total += entry->bytes;
+		num_entries++;
+	}
+
+	free_list_files(files, num_files);
+
+	qsort(entries, num_entries, sizeof(cache_entry_t), cache_compare_entries);
+
+	for (i = 0; i < num_entries && total > cache->max_bytes; i++)
+	{
+		snprintf(entryname, sizeof(entryname), "%s/%s", cache->directory, entries[i].name);
+		cache_remove_entry(entryname);
+		total -= entries[i].bytes;
+		cache->stats.evictions++;
+	}
+
+	qfree(entries);
+
+	cache->stats.bytes = total;
+}
+
+void cache_get_stats(cache_t *cache, cache_stats_t *out_stats)
+{
+	thread_mutex_lock(cache->mutex);
+	*out_stats = cache->stats;
+	thread_mutex_unlock(cache->mutex);
+}
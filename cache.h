@@ -0,0 +1,62 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/* on-disk store of the files conversions wrote, so an unchanged conversion can
+ * be skipped. entries are found by a key the caller chains together with
+ * hash_data64 and cache_hash_file from everything known to affect the outputs
+ * up front (input, options, tool version). files read during the conversion
+ * that weren't known up front (skins named inside a model) are stored with
+ * their hashes, and the entry is only a hit while they are unchanged.
+ * several threads, or processes, may use the same cache directory at once */
+typedef struct cache_s cache_t;
+
+typedef struct cache_stats_s
+{
+	int hits;
+	int misses;
+	int stores;
+	int evictions;
+	unsigned long long bytes; /* size of the whole cache, as of the last cache_trim */
+} cache_stats_t;
+
+/* the directory is created if it doesn't exist, but its parent must */
+cache_t *cache_open(const char *directory, unsigned long long max_bytes, char **out_error);
+void cache_close(cache_t *cache);
+
+/* chains the hash of the file's contents onto *hash. returns false, leaving
+ * *hash alone, if the file can't be read */
+bool_t cache_hash_file(const char *filename, unsigned long long *hash);
+
+/* writes the files stored under key back to where they were first written,
+ * asking before overwriting like the savers do. returns false on a miss, or
+ * on a hit that couldn't be restored, in which case *out_error is set */
+bool_t cache_fetch(cache_t *cache, unsigned long long key, char **out_error);
+
+/* stores the files a conversion wrote, from its filelog, under key. the files
+ * it read are kept as dependencies, so leave out the ones already in the key */
+bool_t cache_store(cache_t *cache, unsigned long long key, const filelog_entry_t *entries, int num_entries, char **out_error);
+
+/* evicts the least recently used entries until the cache fits in max_bytes.
+ * meant for the end of a run, it doesn't lock out other threads */
+void cache_trim(cache_t *cache);
+
+void cache_get_stats(cache_t *cache, cache_stats_t *out_stats);
+
+#endif
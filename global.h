@@ -58,22 +58,105 @@ typedef float vec3f_t[3];
 
 #define IS_POWER_OF_TWO(x) ((x) && !(((x)-1) & (x)))
 
+/* per-thread global variables */
+#ifdef _MSC_VER
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL __thread
+#endif
+
 typedef struct mem_pool_s mem_pool_t;
 extern mem_pool_t *mem_globalpool;
 mem_pool_t *mem_create_pool_(const char *file, int line);
 #define mem_create_pool() mem_create_pool_(__FILE__,__LINE__)
+mem_pool_t *mem_create_arena_(size_t chunk_size, const char *file, int line);
+#define mem_create_arena() mem_create_arena_(0,__FILE__,__LINE__)
 void mem_merge_pool(mem_pool_t *pool);
 void mem_free_pool_(mem_pool_t *pool, bool_t complain);
 #define mem_free_pool(pool) mem_free_pool_(pool,false)
 void *mem_alloc_(mem_pool_t *pool, size_t numbytes, const char *file, int line);
 #define mem_alloc(pool,numbytes) mem_alloc_(pool,numbytes,__FILE__,__LINE__)
 void mem_free(void *mem);
+/* memory can be shared, by reference counting, between copies of something
+ * (see model_clone). mem_free only frees it once the last reference goes, but
+ * freeing a pool still frees everything in it, so take a reference to the pool
+ * with mem_share_pool as well when sharing pool memory. mem_unshare returns
+ * mem if nothing else has it, otherwise a copy in the global pool (dropping
+ * the reference to mem), for changing it in place */
+void *mem_share(void *mem);
+void *mem_unshare(void *mem);
+mem_pool_t *mem_share_pool(mem_pool_t *pool);
 void mem_init(void);
 void mem_shutdown(void);
 void *qmalloc_(size_t numbytes, const char *file, int line);
 #define qmalloc(numbytes) qmalloc_(numbytes, __FILE__, __LINE__)
 void qfree(void *mem);
 
+extern bool_t g_mem_track_arenas; /* keep file/line leak tracking for arena allocations */
+
+typedef struct mem_stats_s
+{
+	size_t num_allocs; /* total mem_alloc calls */
+	size_t num_arena_allocs; /* of which were bump allocated from an arena */
+	size_t num_mallocs; /* calls to the system allocator, including arena chunks */
+	size_t bytes_alloced; /* currently allocated (arena memory counts until its pool is freed) */
+	size_t peak_bytes;
+	size_t arena_bytes_reserved; /* currently held in arena chunks */
+} mem_stats_t;
+
+void mem_get_stats(mem_stats_t *out_stats);
+void mem_reset_peak(void);
+
+/* per-thread breakdown of where a conversion spends its time and memory,
+ * including that of the thread_run workers it starts. stages nest, and time or allocations inside an inner stage (decoding a skin
+ * while parsing) are only counted for the inner one. outside of
+ * profile_begin/profile_end, profile_push and profile_pop do nothing */
+typedef enum profile_stage_e
+{
+	PROFILE_READ = 0,
+	PROFILE_PARSE,
+	PROFILE_SKINS,
+	PROFILE_RESIZE,
+	PROFILE_NORMALS,
+	PROFILE_FACETIZE,
+	PROFILE_PALETTIZE,
+	PROFILE_WRITE,
+	PROFILE_RENDER,
+
+	PROFILE_NUMSTAGES
+} profile_stage_t;
+
+extern const char *profile_stage_names[PROFILE_NUMSTAGES];
+
+typedef struct profile_s
+{
+	double time[PROFILE_NUMSTAGES];
+	size_t num_allocs[PROFILE_NUMSTAGES];
+	size_t peak_bytes[PROFILE_NUMSTAGES]; /* most this thread had allocated at once during the stage, over what it had when the stage began */
+
+	double total_time; /* between profile_begin and profile_end, including time outside any stage */
+	size_t total_allocs;
+	size_t total_peak_bytes;
+} profile_t;
+
+void profile_begin(profile_t *profile);
+void profile_end(void);
+void profile_push(profile_stage_t stage);
+void profile_pop(void);
+
+/* allocations made by thread_run's worker threads, which thread_run adds to
+ * the profile of the thread that started them (in its current stage) when
+ * they're done. their peaks are counted as if they all happened at once */
+typedef struct profile_worker_s
+{
+	size_t num_allocs;
+	long long bytes, peak;
+} profile_worker_t;
+
+void profile_worker_begin(profile_worker_t *worker);
+void profile_worker_end(void);
+void profile_add_workers(const profile_worker_t *workers, int num_workers);
+
 char *mem_copystring(mem_pool_t *pool, const char *string);
 #define copystring QWALK_copystring
 char *copystring(const char *string);
@@ -89,10 +172,40 @@ void Q_strlcpy(char *dest, const char *src, size_t size);
 extern bool_t g_force_yes;
 extern bool_t g_force_no;
 
+double get_time(void); /* monotonic clock, in seconds */
+
 bool_t makepath(char *path, char **out_error);
 bool_t loadfile(const char *filename, void **out_data, size_t *out_size, char **out_error);
 bool_t writefile(const char *filename, const void *data, size_t size, char **out_error);
 
+/* whole-file view, memory mapped where possible (falls back to loadfile).
+ * like loadfile, the data is NUL terminated and private to the caller, so it
+ * may be modified in place. release it with unmapfile, not qfree */
+typedef struct filemap_s
+{
+	void *data;
+	size_t size;
+	bool_t mapped;
+	size_t mapoffset; /* how far into its first page data starts, when mapped */
+} filemap_t;
+
+bool_t mapfile(const char *filename, filemap_t *out_map, char **out_error);
+void unmapfile(filemap_t *map);
+void mapfile_get_stats(size_t *out_bytes_mapped, size_t *out_bytes_read);
+
+/* between filelog_begin and filelog_end, the calling thread lists the files it
+ * opens through loadfile, mapfile and openfile_write, once each. release the
+ * list with filelog_free */
+typedef struct filelog_entry_s
+{
+	char *filename;
+	bool_t written; /* opened for writing, otherwise for reading (whether it existed or not) */
+} filelog_entry_t;
+
+void filelog_begin(void);
+filelog_entry_t *filelog_end(int *out_num_entries);
+void filelog_free(filelog_entry_t *entries, int num_entries);
+
 typedef void* dllhandle_t;
 typedef struct dllfunction_s { const char *name; void **funcvariable; } dllfunction_t;
 
@@ -119,8 +232,27 @@ bool_t xbuf_write_to_file(xbuf_t *xbuf, const char *filename, char **out_error);
 
 void xbuf_write_data(xbuf_t *xbuf, size_t length, const void *data);
 void xbuf_write_byte(xbuf_t *xbuf, unsigned char byte);
-void *xbuf_reserve_data(xbuf_t *xbuf, size_t length);
+void *xbuf_reserve_data(xbuf_t *xbuf, size_t length); /* memory buffers only */
+size_t xbuf_reserve(xbuf_t *xbuf, size_t length);
+void xbuf_patch_data(xbuf_t *xbuf, size_t offset, size_t length, const void *data);
 
 int xbuf_get_bytes_written(const xbuf_t *xbuf);
 
+/* hashing */
+
+unsigned int hash_data(const void *data, size_t length, unsigned int seed);
+unsigned long long hash_data64(const void *data, size_t length, unsigned long long seed);
+
+/* maps hash keys to lists of integer indices (e.g. into an array of unique
+ * elements), the caller compares the actual data. walk a key's indices with
+ * for (i = hashindex_first(h, key); i != -1; i = hashindex_next(h, i)) */
+typedef struct hashindex_s hashindex_t;
+
+hashindex_t *hashindex_create(int hash_size, int index_size);
+void hashindex_free(hashindex_t *hashindex);
+void hashindex_clear(hashindex_t *hashindex);
+void hashindex_add(hashindex_t *hashindex, unsigned int key, int index);
+int hashindex_first(const hashindex_t *hashindex, unsigned int key);
+int hashindex_next(const hashindex_t *hashindex, int index);
+
 #endif
@@ -18,8 +18,18 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define RESAMPLE_SSE2
+#endif
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define RESAMPLE_AVX2
+#endif
+
 #include "global.h"
 #include "image.h"
+#include "thread.h"
 
 typedef enum image_format_e
 {
@@ -86,22 +96,30 @@ image_rgba_t *image_load(mem_pool_t *pool, const char *filename, void *filedata,
 			if (image->pixels[i * 4 + 3] != 255)
 				image->num_transparent_pixels++;
 		}
+
+		image_intern(image);
 	}
 	return image;
 }
 
 image_rgba_t *image_load_from_file(mem_pool_t *pool, const char *filename, char **out_error)
 {
-	void *filedata;
-	size_t filesize;
+	filemap_t filemap;
 	image_rgba_t *image;
 
-	if (!loadfile(filename, &filedata, &filesize, out_error))
+	profile_push(PROFILE_SKINS);
+
+	if (!mapfile(filename, &filemap, out_error))
+	{
+		profile_pop();
 		return NULL;
+	}
+
+	image = image_load(pool, filename, filemap.data, filemap.size, out_error);
 
-	image = image_load(pool, filename, filedata, filesize, out_error);
+	unmapfile(&filemap);
 
-	qfree(filedata);
+	profile_pop();
 	return image;
 }
 
@@ -181,26 +199,156 @@ bool_t image_paletted_save(const char *filename, const image_paletted_t *image,
 	return xbuf_finish_file(xbuf, out_error);
 }
 
+/* pixel storage. images made by image_clone share their source's, and
+ * image_intern makes images with the same contents share one. interned
+ * storage stays in the hash table until the last image using it is freed */
+#define IMAGE_INTERN_HASH_SIZE 256
+
+typedef struct image_pixels_s
+{
+	int refcount;
+	int width, height;
+
+	bool_t interned;
+	unsigned long long hash;
+	struct image_pixels_s *next; /* in the intern hash chain */
+} image_pixels_t;
+
+static image_pixels_t *image_intern_hash[IMAGE_INTERN_HASH_SIZE];
+static thread_mutex_t *image_mutex = NULL;
+
+static void image_pixels_init(void)
+{
+	image_mutex = thread_mutex_create();
+}
+
+static void image_pixels_lock(void)
+{
+	static volatile int initialized = 0;
+
+	thread_once(&initialized, image_pixels_init);
+
+	thread_mutex_lock(image_mutex);
+}
+
+static void image_pixels_release(image_pixels_t *storage)
+{
+	image_pixels_t **link;
+
+	image_pixels_lock();
+
+	if (--storage->refcount > 0)
+	{
+		thread_mutex_unlock(image_mutex);
+		return;
+	}
+
+	if (storage->interned)
+	{
+		for (link = &image_intern_hash[storage->hash % IMAGE_INTERN_HASH_SIZE]; *link != storage; link = &(*link)->next);
+		*link = storage->next;
+	}
+
+	thread_mutex_unlock(image_mutex);
+
+	qfree(storage);
+}
+
 image_rgba_t *image_alloc(mem_pool_t *pool, int width, int height)
 {
 	image_rgba_t *image;
+	image_pixels_t *storage;
 	if (width < 1 || height < 1)
 		return NULL;
-	image = (image_rgba_t*)mem_alloc(pool, sizeof(image_rgba_t) + width * height * 4);
+	image = (image_rgba_t*)mem_alloc(pool, sizeof(image_rgba_t));
 	if (!image)
 		return NULL;
+	storage = (image_pixels_t*)qmalloc(sizeof(image_pixels_t) + width * height * 4);
+	if (!storage)
+	{
+		mem_free(image);
+		return NULL;
+	}
+	storage->refcount = 1;
+	storage->width = width;
+	storage->height = height;
+	storage->interned = false;
+	storage->hash = 0;
+	storage->next = NULL;
 	image->width = width;
 	image->height = height;
-	image->pixels = (unsigned char*)(image + 1);
+	image->pixels = (unsigned char*)(storage + 1);
+	image->num_nonempty_pixels = 0;
+	image->num_transparent_pixels = 0;
+	image->storage = storage;
 	return image;
 }
 
 void image_free(image_rgba_t **image)
 {
+	if (*image)
+		image_pixels_release((*image)->storage);
 	mem_free(*image);
 	*image = NULL;
 }
 
+void image_intern(image_rgba_t *image)
+{
+	image_pixels_t *storage = image->storage, *other;
+	size_t size = (size_t)image->width * image->height * 4;
+	unsigned long long hash;
+
+	if (storage->interned)
+		return;
+
+	hash = hash_data64(image->pixels, size, ((unsigned long long)image->width << 32) | (unsigned int)image->height);
+
+	image_pixels_lock();
+
+	for (other = image_intern_hash[hash % IMAGE_INTERN_HASH_SIZE]; other; other = other->next)
+		if (other->hash == hash && other->width == image->width && other->height == image->height && !memcmp(other + 1, image->pixels, size))
+			break;
+
+/* another image sharing the storage may have interned it in the meantime, in
+ * which case it finds itself */
+	if (other && other != storage)
+	{
+		other->refcount++;
+		image->storage = other;
+		image->pixels = (unsigned char*)(other + 1);
+	}
+	else
+	{
+		if (!storage->interned)
+		{
+			storage->interned = true;
+			storage->hash = hash;
+			storage->next = image_intern_hash[hash % IMAGE_INTERN_HASH_SIZE];
+			image_intern_hash[hash % IMAGE_INTERN_HASH_SIZE] = storage;
+		}
+		storage = NULL;
+	}
+
+	thread_mutex_unlock(image_mutex);
+
+/* let go of the old pixels */
+	if (storage)
+		image_pixels_release(storage);
+}
+
+bool_t image_same(const image_rgba_t *a, const image_rgba_t *b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->storage == b->storage)
+		return true;
+	if (a->width != b->width || a->height != b->height)
+		return false;
+	if (a->storage->interned && b->storage->interned)
+		return false;
+	return !memcmp(a->pixels, b->pixels, (size_t)a->width * a->height * 4);
+}
+
 image_paletted_t *image_paletted_alloc(mem_pool_t *pool, int width, int height)
 {
 	image_paletted_t *image;
@@ -248,30 +396,189 @@ image_rgba_t *image_clone(mem_pool_t *pool, const image_rgba_t *source)
 	if (!source)
 		return NULL;
 
-	image = image_alloc(pool, source->width, source->height);
+	image = (image_rgba_t*)mem_alloc(pool, sizeof(image_rgba_t));
 	if (!image)
 		return NULL;
 
-	memcpy(image->pixels, source->pixels, source->width * source->height * 4);
+	*image = *source;
+
+	image_pixels_lock();
+	image->storage->refcount++;
+	thread_mutex_unlock(image_mutex);
 
 	return image;
 }
 
-static unsigned char palettize_colour(const palette_t *palette, bool_t fullbright, const unsigned char rgb[3])
+static bool_t palette_is_fullbright(const palette_t *palette, int i)
 {
-	int i, dist;
-	int besti = -1, bestdist = 0;
+	return !!(palette->fullbright_flags[i >> 5] & (1U << (i & 31)));
+}
+
+static int palette_colour_distance(const palette_t *palette, int i, const unsigned char rgb[3])
+{
+	return 299 * abs(palette->rgb[i*3+0] - rgb[0]) + 587 * abs(palette->rgb[i*3+1] - rgb[1]) + 114 * abs(palette->rgb[i*3+2] - rgb[2]);
+}
+
+/* inverse colormap.
+ * the rgb cube is split into 32x32x32 cells, and each cell lists (in ascending
+ * order) the palette entries of one fullbright class that can be the closest
+ * to any colour in it. a colour is then matched exactly as the full search
+ * would, ties included, but against only a few entries. colormaps are built
+ * once per palette and class and kept for the rest of the run */
+
+#define COLORMAP_CELL_SHIFT 3
+#define COLORMAP_CELL_SIZE (1 << COLORMAP_CELL_SHIFT)
+#define COLORMAP_GRID (256 >> COLORMAP_CELL_SHIFT)
+#define COLORMAP_NUM_CELLS (COLORMAP_GRID * COLORMAP_GRID * COLORMAP_GRID)
+
+typedef struct colormap_s
+{
+	palette_t palette;
+	bool_t fullbright;
+
+	int cell_first[COLORMAP_NUM_CELLS + 1]; /* a cell's candidates are [cell_first[cell], cell_first[cell + 1]) */
+	unsigned char *candidates;
+
+	struct colormap_s *next;
+} colormap_t;
+
+static colormap_t *colormaps = NULL;
+static thread_mutex_t *colormap_mutex = NULL;
+
+static void colormap_free_all(void)
+{
+	colormap_t *colormap, *next;
+
+	for (colormap = colormaps; colormap; colormap = next)
+	{
+		next = colormap->next;
+		qfree(colormap->candidates);
+		qfree(colormap);
+	}
+	colormaps = NULL;
+}
 
+static void colormap_init(void)
+{
+	colormap_mutex = thread_mutex_create();
+	add_atexit_event(colormap_free_all);
+}
+
+static colormap_t *colormap_build(const palette_t *palette, bool_t fullbright)
+{
+	colormap_t *colormap = (colormap_t*)qmalloc(sizeof(colormap_t));
+	int entries[256], num_entries;
+	int mindist[256];
+	int num_candidates, max_candidates;
+	int cell, r, g, b, i, c, bestmax;
+
+	colormap->palette = *palette;
+	colormap->fullbright = fullbright;
+
+	num_entries = 0;
 	for (i = 0; i < 256; i++)
+		if (palette_is_fullbright(palette, i) == fullbright)
+			entries[num_entries++] = i;
+
+	max_candidates = COLORMAP_NUM_CELLS * 4;
+	colormap->candidates = (unsigned char*)qmalloc(max_candidates);
+	num_candidates = 0;
+
+	cell = 0;
+	for (r = 0; r < 256; r += COLORMAP_CELL_SIZE)
 	{
-		if (fullbright != !!(palette->fullbright_flags[i >> 5] & (1U << (i & 31))))
-			continue;
+		for (g = 0; g < 256; g += COLORMAP_CELL_SIZE)
+		{
+			for (b = 0; b < 256; b += COLORMAP_CELL_SIZE, cell++)
+			{
+				const int lo[3] = { r, g, b };
+				static const int weights[3] = { 299, 587, 114 };
+
+			/* the distance from each entry to the nearest and farthest colours in the cell.
+			 * the closest entry for any colour in the cell is within the smallest farthest distance */
+				bestmax = 0;
+				for (i = 0; i < num_entries; i++)
+				{
+					const unsigned char *rgb = palette->rgb + entries[i] * 3;
+					int nearest = 0, farthest = 0;
+
+					for (c = 0; c < 3; c++)
+					{
+						int hi = lo[c] + COLORMAP_CELL_SIZE - 1;
+
+						if (rgb[c] < lo[c])
+							nearest += weights[c] * (lo[c] - rgb[c]);
+						else if (rgb[c] > hi)
+							nearest += weights[c] * (rgb[c] - hi);
+						farthest += weights[c] * max(abs(rgb[c] - lo[c]), abs(rgb[c] - hi));
+					}
+
+					mindist[i] = nearest;
+					if (i == 0 || farthest < bestmax)
+						bestmax = farthest;
+				}
+
+				if (num_candidates + num_entries > max_candidates)
+				{
+					unsigned char *candidates = (unsigned char*)qmalloc(max_candidates * 2);
+					memcpy(candidates, colormap->candidates, num_candidates);
+					qfree(colormap->candidates);
+					colormap->candidates = candidates;
+					max_candidates *= 2;
+				}
+
+				colormap->cell_first[cell] = num_candidates;
+				for (i = 0; i < num_entries; i++)
+					if (mindist[i] <= bestmax)
+						colormap->candidates[num_candidates++] = entries[i];
+			}
+		}
+	}
+	colormap->cell_first[cell] = num_candidates;
 
-		dist = 299 * abs(palette->rgb[i*3+0] - rgb[0]) + 587 * abs(palette->rgb[i*3+1] - rgb[1]) + 114 * abs(palette->rgb[i*3+2] - rgb[2]);
+	return colormap;
+}
+
+static const colormap_t *colormap_get(const palette_t *palette, bool_t fullbright)
+{
+	static volatile int initialized = 0;
+	colormap_t *colormap;
+
+	thread_once(&initialized, colormap_init);
+
+	thread_mutex_lock(colormap_mutex);
+
+	for (colormap = colormaps; colormap; colormap = colormap->next)
+		if (colormap->fullbright == fullbright && !memcmp(&colormap->palette, palette, sizeof(palette_t)))
+			break;
+
+	if (!colormap)
+	{
+		colormap = colormap_build(palette, fullbright);
+		colormap->next = colormaps;
+		colormaps = colormap;
+	}
+
+	thread_mutex_unlock(colormap_mutex);
+
+	return colormap;
+}
+
+static unsigned char palettize_colour(const colormap_t *colormap, const unsigned char rgb[3])
+{
+	int cell = ((rgb[0] >> COLORMAP_CELL_SHIFT) * COLORMAP_GRID + (rgb[1] >> COLORMAP_CELL_SHIFT)) * COLORMAP_GRID + (rgb[2] >> COLORMAP_CELL_SHIFT);
+	const unsigned char *candidate = colormap->candidates + colormap->cell_first[cell];
+	const unsigned char *end = colormap->candidates + colormap->cell_first[cell + 1];
+	int dist;
+	int besti = -1, bestdist = 0;
+
+	for (; candidate < end; candidate++)
+	{
+		dist = palette_colour_distance(&colormap->palette, *candidate, rgb);
 
 		if (besti == -1 || dist < bestdist)
 		{
-			besti = i;
+			besti = *candidate;
 			bestdist = dist;
 		}
 	}
@@ -281,26 +588,33 @@ static unsigned char palettize_colour(const palette_t *palette, bool_t fullbrigh
 
 image_paletted_t *image_palettize(mem_pool_t *pool, const palette_t *palette, const image_rgba_t *source_diffuse, const image_rgba_t *source_fullbright)
 {
+	const image_rgba_t *source = source_diffuse ? source_diffuse : source_fullbright;
+	const colormap_t *diffuse_colormap, *fullbright_colormap;
 	bool_t palette_has_fullbrights;
 	image_paletted_t *pimage;
 	int i;
 
-	if (!source_diffuse && !source_fullbright)
+	if (!source)
 		return NULL;
 
-	pimage = (image_paletted_t*)mem_alloc(pool, sizeof(image_paletted_t) + source_diffuse->width * source_diffuse->height);
+	pimage = (image_paletted_t*)mem_alloc(pool, sizeof(image_paletted_t) + source->width * source->height);
 	if (!pimage)
 		return NULL;
-	pimage->width = source_diffuse->width;
-	pimage->height = source_diffuse->height;
+	pimage->width = source->width;
+	pimage->height = source->height;
 	pimage->pixels = (unsigned char*)(pimage + 1);
 	pimage->palette = *palette;
 
+	profile_push(PROFILE_PALETTIZE);
+
 	palette_has_fullbrights = false;
 	for (i = 0; i < 8; i++)
 		if (palette->fullbright_flags[i])
 			palette_has_fullbrights = true;
 
+	diffuse_colormap = colormap_get(palette, false);
+	fullbright_colormap = palette_has_fullbrights ? colormap_get(palette, true) : diffuse_colormap;
+
 	if (source_diffuse && source_fullbright)
 	{
 		const unsigned char *in_diffuse = source_diffuse->pixels;
@@ -309,9 +623,9 @@ image_paletted_t *image_palettize(mem_pool_t *pool, const palette_t *palette, co
 		for (i = 0; i < pimage->width * pimage->height; i++, in_diffuse += 4, in_fullbright += 4, out++)
 		{
 			if (in_fullbright[0] || in_fullbright[1] || in_fullbright[2])
-				*out = palettize_colour(palette, palette_has_fullbrights, in_fullbright);
+				*out = palettize_colour(fullbright_colormap, in_fullbright);
 			else
-				*out = palettize_colour(palette, false, in_diffuse);
+				*out = palettize_colour(diffuse_colormap, in_diffuse);
 		}
 	}
 	else if (source_diffuse)
@@ -319,178 +633,391 @@ image_paletted_t *image_palettize(mem_pool_t *pool, const palette_t *palette, co
 		const unsigned char *in_diffuse = source_diffuse->pixels;
 		unsigned char *out = pimage->pixels;
 		for (i = 0; i < pimage->width * pimage->height; i++, in_diffuse += 4, out++)
-			*out = palettize_colour(palette, false, in_diffuse);
+			*out = palettize_colour(diffuse_colormap, in_diffuse);
 	}
 	else if (source_fullbright)
 	{
 		const unsigned char *in_fullbright = source_fullbright->pixels;
 		unsigned char *out = pimage->pixels;
 		for (i = 0; i < pimage->width * pimage->height; i++, in_fullbright += 4, out++)
-			*out = palettize_colour(palette, palette_has_fullbrights, in_fullbright);
+			*out = palettize_colour(fullbright_colormap, in_fullbright);
 	}
 
+	profile_pop();
 	return pimage;
 }
 
-/* FIXME - rewrite the minification code... it's ugly, probably slow, and maybe also has some weighting issues */
-image_rgba_t *image_resize(mem_pool_t *pool, const image_rgba_t *source, int newwidth, int newheight)
+/* image resampling. each axis gets a table of fixed point weights for every
+ * output pixel, computed once and always adding up to exactly RESAMPLE_ONE.
+ * the horizontal pass keeps RESAMPLE_EXTRA_BITS of fraction in 16-bit
+ * intermediates, which the vertical pass rounds back to bytes. the output is
+ * done in tiles, each of which only resamples the source rows it needs, so the
+ * intermediates stay in cache and there is no intermediate image */
+#define RESAMPLE_BITS 14
+#define RESAMPLE_ONE (1 << RESAMPLE_BITS)
+#define RESAMPLE_EXTRA_BITS 7
+#define RESAMPLE_HSHIFT (RESAMPLE_BITS - RESAMPLE_EXTRA_BITS)
+#define RESAMPLE_VSHIFT (RESAMPLE_BITS + RESAMPLE_EXTRA_BITS)
+#define RESAMPLE_TILE_WIDTH 256
+#define RESAMPLE_TILE_HEIGHT 32
+#define RESAMPLE_MIN_THREADED_PIXELS (256 * 256) /* smaller images aren't worth starting threads for */
+
+typedef struct resample_axis_s
+{
+	int max_taps;
+	int *first; /* first source pixel of each output pixel */
+	int *num_taps;
+	short *weights; /* max_taps for each output pixel */
+} resample_axis_t;
+
+typedef struct resample_job_s
 {
-	image_rgba_t *intermediate;
+	const image_rgba_t *source;
 	image_rgba_t *image;
-	int x, y, i;
+	resample_axis_t horizontal, vertical;
+	int num_tiles_x;
+	unsigned char *failed; /* one per tile */
+} resample_job_t;
 
-	intermediate = image_alloc(pool, newwidth, source->height);
-	if (!intermediate)
-		return NULL;
+/* the source pixels that output pixel i draws from when minifying */
+static void resample_range(int insize, int outsize, int i, int *out_first, int *out_last)
+{
+	*out_first = max(((i - 1) * insize + outsize / 2) / outsize, 0);
+	*out_last = min(((i + 1) * insize + outsize / 2) / outsize, insize - 1);
+}
 
-	image = image_alloc(pool, newwidth, newheight);
-	if (!image)
-	{
-		image_free(&intermediate);
-		return NULL;
-	}
+static bool_t resample_axis_build(resample_axis_t *axis, int insize, int outsize)
+{
+	double *dists;
+	int i, j, n, first, last;
 
-/* horizontal resize */
-	if (newwidth > source->width)
+	axis->max_taps = 2;
+	if (outsize < insize)
 	{
-		for (x = 0; x < newwidth; x++)
+		for (i = 0; i < outsize; i++)
 		{
-			float fx = (float)x * (float)source->width / (float)newwidth;
-			int x1 = (int)fx;
-			int x2 = min(x1 + 1, source->width - 1);
-			float fx2 = fx - (float)x1;
-			float fx1 = 1.0f - fx2;
-			int ifx1 = (int)(fx1 * 256.0f);
-			int ifx2 = (int)(fx2 * 256.0f);
-			unsigned char *out = intermediate->pixels + x * 4;
-			const unsigned char *in1 = source->pixels + x1 * 4;
-			const unsigned char *in2 = source->pixels + x2 * 4;
-
-			for (y = 0; y < source->height; y++, out += newwidth * 4, in1 += source->width * 4, in2 += source->width * 4)
-				for (i = 0; i < 4; i++)
-					out[i] = (in1[i] * ifx1 + in2[i] * ifx2 + 127) >> 8;
+			resample_range(insize, outsize, i, &first, &last);
+			axis->max_taps = max(axis->max_taps, last - first + 1);
 		}
 	}
-	else if (newwidth < source->width)
+
+	axis->first = (int*)qmalloc(sizeof(int) * outsize * 2 + sizeof(double) * axis->max_taps + sizeof(short) * outsize * axis->max_taps);
+	if (!axis->first)
+		return false;
+	axis->num_taps = axis->first + outsize;
+	dists = (double*)(axis->num_taps + outsize);
+	axis->weights = (short*)(dists + axis->max_taps);
+
+	for (i = 0; i < outsize; i++)
 	{
-		for (y = 0; y < source->height; y++)
-		for (x = 0; x < newwidth; x++)
+		short *weights = axis->weights + i * axis->max_taps;
+
+		if (outsize == insize)
+		{
+			axis->first[i] = i;
+			axis->num_taps[i] = 1;
+			weights[0] = RESAMPLE_ONE;
+		}
+		else if (outsize > insize)
 		{
-			const unsigned char *in = source->pixels + y * source->width * 4;
-			float colour[4], count;
-			float fxx = (x * source->width) / (float)newwidth;
-			int x1 = ((x - 1) * source->width + newwidth / 2) / newwidth;
-			int x2 = ((x + 1) * source->width + newwidth / 2) / newwidth;
+		/* linear interpolation */
+			int x1 = i * insize / outsize;
+			int frac = (int)((double)(i * insize - x1 * outsize) * RESAMPLE_ONE / outsize + 0.5);
 
-			x1 = max(x1, 0);
-			x2 = min(x2, source->width - 1);
+			axis->first[i] = x1;
+			if (!frac || x1 + 1 >= insize)
+			{
+				axis->num_taps[i] = 1;
+				weights[0] = RESAMPLE_ONE;
+			}
+			else
+			{
+				axis->num_taps[i] = 2;
+				weights[0] = (short)(RESAMPLE_ONE - frac);
+				weights[1] = (short)frac;
+			}
+		}
+		else
+		{
+		/* tent over the source pixels between the neighbouring output pixels */
+			double centre = (double)i * insize / outsize;
+			double total = 0, sum = 0;
+			int rounded, prev = 0;
 
-			colour[0] = colour[1] = colour[2] = colour[3] = 0;
-			count = 0;
+			resample_range(insize, outsize, i, &first, &last);
+			n = last - first + 1;
 
-			for (i = x1; i <= x2; i++)
+			for (j = 0; j < n; j++)
 			{
-				float dist;
+				double dist;
 
-				if (i < fxx)
-					dist = (fxx - x1) - (fxx - i);
-				else if (i > fxx)
-					dist = (x2 - fxx) - (i - fxx);
+				if (first + j < centre)
+					dist = j;
+				else if (first + j > centre)
+					dist = last - (first + j);
 				else
-					dist = max(x2 - fxx, fxx - x1);
+					dist = max(last - centre, centre - first);
 
-				dist *= dist; /* square it to increase sharpness a little */
+				dists[j] = dist * dist; /* square it to increase sharpness a little */
+				total += dists[j];
+			}
 
-				colour[0] += dist * in[i*4+0];
-				colour[1] += dist * in[i*4+1];
-				colour[2] += dist * in[i*4+2];
-				colour[3] += dist * in[i*4+3];
-				count += dist;
+			if (total <= 0)
+			{
+			/* nothing to weigh, take the nearest pixel */
+				axis->first[i] = bound(0, (int)(centre + 0.5), insize - 1);
+				axis->num_taps[i] = 1;
+				weights[0] = RESAMPLE_ONE;
+				continue;
 			}
 
-			if (!count)
-				count = 1; /* i don't THINK this should happen... */
+		/* round the running sum rather than each weight, so the weights add up
+		 * to exactly RESAMPLE_ONE (the last sum is total, bit for bit) */
+			for (j = 0; j < n; j++)
+			{
+				sum += dists[j];
+				rounded = (int)(sum * RESAMPLE_ONE / total + 0.5);
+				weights[j] = (short)(rounded - prev);
+				prev = rounded;
+			}
 
-			for (i = 0; i < 4; i++)
-				intermediate->pixels[(y*newwidth+x)*4+i] = (unsigned char)(colour[i] / count);
+		/* drop the zero weights at the ends */
+			for (j = 0; !weights[j]; j++);
+			for (; !weights[n - 1]; n--);
+			memmove(weights, weights + j, sizeof(short) * (n - j));
+			axis->first[i] = first + j;
+			axis->num_taps[i] = n - j;
 		}
 	}
-	else
+
+	return true;
+}
+
+/* resample output pixels x0..x1-1 of a row into 16-bit rgba */
+static void resample_row_horizontal(const resample_axis_t *axis, const unsigned char *in, short *out, int x0, int x1)
+{
+	int x, j;
+
+	for (x = x0; x < x1; x++, out += 4)
 	{
-		memcpy(intermediate->pixels, source->pixels, source->width * source->height * 4);
+		const unsigned char *p = in + axis->first[x] * 4;
+		const short *w = axis->weights + x * axis->max_taps;
+		int n = axis->num_taps[x];
+#ifdef RESAMPLE_SSE2
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = _mm_set1_epi32(1 << (RESAMPLE_HSHIFT - 1));
+		__m128i px;
+		int pixel;
+
+	/* two pixels at a time, interleaved to r0 r1 g0 g1 b0 b1 a0 a1 for madd */
+		for (j = 0; j + 1 < n; j += 2, p += 8)
+		{
+			px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+			px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((unsigned short)w[j] | ((unsigned int)(unsigned short)w[j + 1] << 16))));
+		}
+		if (j < n)
+		{
+			memcpy(&pixel, p, 4);
+			px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((unsigned short)w[j])));
+		}
+
+		acc = _mm_srai_epi32(acc, RESAMPLE_HSHIFT);
+		_mm_storel_epi64((__m128i*)out, _mm_packs_epi32(acc, acc));
+#else
+		int acc[4] = { 0, 0, 0, 0 };
+		int c;
+
+		for (j = 0; j < n; j++, p += 4)
+			for (c = 0; c < 4; c++)
+				acc[c] += w[j] * p[c];
+
+		for (c = 0; c < 4; c++)
+			out[c] = (short)((acc[c] + (1 << (RESAMPLE_HSHIFT - 1))) >> RESAMPLE_HSHIFT);
+#endif
 	}
+}
 
-/* vertical resize */
-	if (newheight > source->height)
+/* resample output row y from the 16-bit rows the horizontal pass made, rows
+ * being the first one it uses */
+static void resample_row_vertical(const resample_axis_t *axis, int y, const short *rows, int row_stride, int num_values, unsigned char *out)
+{
+	const short *w = axis->weights + y * axis->max_taps;
+	const short *p;
+	int n = axis->num_taps[y];
+	int i = 0, j, acc;
+
+#if defined(RESAMPLE_AVX2)
+	for (; i + 16 <= num_values; i += 16)
 	{
-		for (y = 0; y < newheight; y++)
+		__m256i lo = _mm256_set1_epi32(1 << (RESAMPLE_VSHIFT - 1)), hi = lo;
+		__m256i a, b, wv, v;
+
+	/* in-lane unpacks, undone by the in-lane pack below */
+		for (j = 0, p = rows + i; j + 1 < n; j += 2, p += row_stride * 2)
 		{
-			float fy = (float)y * (float)source->height / (float)newheight;
-			int y1 = (int)fy;
-			int y2 = min(y1 + 1, source->height - 1);
-			float fy2 = fy - (float)y1;
-			float fy1 = 1.0f - fy2;
-			int ify1 = (int)(fy1 * 256.0f);
-			int ify2 = (int)(fy2 * 256.0f);
-			unsigned char *out = image->pixels + y * newwidth * 4;
-			const unsigned char *in1 = intermediate->pixels + y1 * newwidth * 4;
-			const unsigned char *in2 = intermediate->pixels + y2 * newwidth * 4;
-
-			for (x = 0; x < newwidth; x++, out += 4, in1 += 4, in2 += 4)
-				for (i = 0; i < 4; i++)
-					out[i] = (in1[i] * ify1 + in2[i] * ify2 + 127) >> 8;
+			a = _mm256_loadu_si256((const __m256i*)p);
+			b = _mm256_loadu_si256((const __m256i*)(p + row_stride));
+			wv = _mm256_set1_epi32((unsigned short)w[j] | ((unsigned int)(unsigned short)w[j + 1] << 16));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wv));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wv));
 		}
+		if (j < n)
+		{
+			a = _mm256_loadu_si256((const __m256i*)p);
+			wv = _mm256_set1_epi32((unsigned short)w[j]);
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, _mm256_setzero_si256()), wv));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, _mm256_setzero_si256()), wv));
+		}
+
+		v = _mm256_packs_epi32(_mm256_srai_epi32(lo, RESAMPLE_VSHIFT), _mm256_srai_epi32(hi, RESAMPLE_VSHIFT));
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+		_mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(v));
 	}
-	else if (newheight < source->height)
+#endif
+#if defined(RESAMPLE_SSE2)
+	for (; i + 8 <= num_values; i += 8)
 	{
-		for (y = 0; y < newheight; y++)
-		for (x = 0; x < newwidth; x++)
+		__m128i lo = _mm_set1_epi32(1 << (RESAMPLE_VSHIFT - 1)), hi = lo;
+		__m128i a, b, wv, v;
+
+		for (j = 0, p = rows + i; j + 1 < n; j += 2, p += row_stride * 2)
 		{
-			float colour[4], count;
-			float fyy = (y * source->height) / (float)newheight;
-			int y1 = ((y - 1) * source->height + newheight / 2) / newheight;
-			int y2 = ((y + 1) * source->height + newheight / 2) / newheight;
+			a = _mm_loadu_si128((const __m128i*)p);
+			b = _mm_loadu_si128((const __m128i*)(p + row_stride));
+			wv = _mm_set1_epi32((unsigned short)w[j] | ((unsigned int)(unsigned short)w[j + 1] << 16));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wv));
+		}
+		if (j < n)
+		{
+			a = _mm_loadu_si128((const __m128i*)p);
+			wv = _mm_set1_epi32((unsigned short)w[j]);
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, _mm_setzero_si128()), wv));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, _mm_setzero_si128()), wv));
+		}
 
-			y1 = max(y1, 0);
-			y2 = min(y2, source->height - 1);
+		v = _mm_packs_epi32(_mm_srai_epi32(lo, RESAMPLE_VSHIFT), _mm_srai_epi32(hi, RESAMPLE_VSHIFT));
+		_mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(v, v));
+	}
+#endif
+	for (; i < num_values; i++)
+	{
+		acc = 1 << (RESAMPLE_VSHIFT - 1);
+		for (j = 0, p = rows + i; j < n; j++, p += row_stride)
+			acc += w[j] * *p;
+		acc >>= RESAMPLE_VSHIFT;
+		out[i] = (unsigned char)bound(0, acc, 255);
+	}
+}
 
-			colour[0] = colour[1] = colour[2] = colour[3] = 0;
-			count = 0;
+static void resample_tile(void *data, int job)
+{
+	resample_job_t *rj = (resample_job_t*)data;
+	const image_rgba_t *source = rj->source;
+	image_rgba_t *image = rj->image;
+	const resample_axis_t *vertical = &rj->vertical;
+	int x0 = (job % rj->num_tiles_x) * RESAMPLE_TILE_WIDTH;
+	int x1 = min(x0 + RESAMPLE_TILE_WIDTH, image->width);
+	int y0 = (job / rj->num_tiles_x) * RESAMPLE_TILE_HEIGHT;
+	int y1 = min(y0 + RESAMPLE_TILE_HEIGHT, image->height);
+	int stride = (x1 - x0) * 4;
+	int sy0 = source->height, sy1 = 0;
+	int y;
+	short *rows;
+
+/* the source rows this tile uses */
+	for (y = y0; y < y1; y++)
+	{
+		sy0 = min(sy0, vertical->first[y]);
+		sy1 = max(sy1, vertical->first[y] + vertical->num_taps[y]);
+	}
 
-			for (i = y1; i <= y2; i++)
-			{
-				const unsigned char *in = intermediate->pixels + (i * newwidth + x) * 4;
-				float dist;
+	rows = (short*)qmalloc(sizeof(short) * stride * (sy1 - sy0));
+	if (!rows)
+	{
+		rj->failed[job] = 1;
+		return;
+	}
 
-				if (i < fyy)
-					dist = (fyy - y1) - (fyy - i);
-				else if (i > fyy)
-					dist = (y2 - fyy) - (i - fyy);
-				else
-					dist = max(y2 - fyy, fyy - y1);
+	for (y = sy0; y < sy1; y++)
+		resample_row_horizontal(&rj->horizontal, source->pixels + y * source->width * 4, rows + (y - sy0) * stride, x0, x1);
 
-				dist *= dist; /* square it to increase sharpness a little */
+	for (y = y0; y < y1; y++)
+		resample_row_vertical(vertical, y, rows + (vertical->first[y] - sy0) * stride, stride, stride, image->pixels + (y * image->width + x0) * 4);
 
-				colour[0] += dist * in[0];
-				colour[1] += dist * in[1];
-				colour[2] += dist * in[2];
-				colour[3] += dist * in[3];
-				count += dist;
-			}
+	qfree(rows);
+}
 
-			if (!count)
-				count = 1; /* i don't THINK this should happen... */
+static image_rgba_t *image_resample(mem_pool_t *pool, const image_rgba_t *source, int newwidth, int newheight)
+{
+	resample_job_t rj;
+	image_rgba_t *image;
+	int num_jobs, i;
 
-			for (i = 0; i < 4; i++)
-				image->pixels[(y*newwidth+x)*4+i] = (unsigned char)(colour[i] / count);
-		}
+	image = image_alloc(pool, newwidth, newheight);
+	if (!image)
+		return NULL;
+
+/* resampling doesn't empty an image or make it opaque */
+	image->num_nonempty_pixels = source->num_nonempty_pixels;
+	image->num_transparent_pixels = source->num_transparent_pixels;
+
+	rj.source = source;
+	rj.image = image;
+	rj.num_tiles_x = (newwidth + RESAMPLE_TILE_WIDTH - 1) / RESAMPLE_TILE_WIDTH;
+	num_jobs = rj.num_tiles_x * ((newheight + RESAMPLE_TILE_HEIGHT - 1) / RESAMPLE_TILE_HEIGHT);
+
+	rj.vertical.first = NULL;
+	rj.failed = NULL;
+	if (!resample_axis_build(&rj.horizontal, source->width, newwidth))
+	{
+		image_free(&image);
+		return NULL;
 	}
-	else
+	if (!resample_axis_build(&rj.vertical, source->height, newheight) || !(rj.failed = (unsigned char*)qmalloc(num_jobs)))
 	{
-		memcpy(image->pixels, intermediate->pixels, newwidth * newheight * 4);
+		qfree(rj.horizontal.first);
+		if (rj.vertical.first)
+			qfree(rj.vertical.first);
+		image_free(&image);
+		return NULL;
 	}
+	memset(rj.failed, 0, num_jobs);
+
+	if (newwidth * newheight < RESAMPLE_MIN_THREADED_PIXELS)
+	{
+		for (i = 0; i < num_jobs; i++)
+			resample_tile(&rj, i);
+	}
+	else
+		thread_run(num_jobs, resample_tile, &rj);
+
+	for (i = 0; i < num_jobs; i++)
+		if (rj.failed[i])
+			break;
+	if (i < num_jobs)
+		image_free(&image);
+
+	qfree(rj.failed);
+	qfree(rj.vertical.first);
+	qfree(rj.horizontal.first);
+
+	return image;
+}
+
+/* linear interpolation when magnifying, a sharpened tent filter when minifying */
+image_rgba_t *image_resize(mem_pool_t *pool, const image_rgba_t *source, int newwidth, int newheight)
+{
+	image_rgba_t *image;
+
+	if (newwidth == source->width && newheight == source->height)
+		return image_clone(pool, source);
 
-	image_free(&intermediate);
+	profile_push(PROFILE_RESIZE);
+	image = image_resample(pool, source, newwidth, newheight);
+	profile_pop();
 
 	return image;
 }
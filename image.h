@@ -24,13 +24,17 @@ typedef struct palette_s
 	unsigned int fullbright_flags[8];
 } palette_t;
 
-/* 32-bit image */
+/* 32-bit image. the pixels are reference counted and may be shared with other
+ * images (see image_clone and image_intern), so only write to the pixels of an
+ * image you allocated yourself and haven't shared yet */
 typedef struct image_rgba_s
 {
 	int width, height;
 	unsigned char *pixels;
 	int num_nonempty_pixels;
     int num_transparent_pixels;
+
+	struct image_pixels_s *storage; /* holds the pixels, freed with the last image using it */
 } image_rgba_t;
 
 /* 8-bit (256 colour) paletted image */
@@ -55,8 +59,17 @@ image_paletted_t *image_paletted_alloc(mem_pool_t *pool, int width, int height);
 void image_paletted_free(image_paletted_t **image);
 
 image_rgba_t *image_createfill(mem_pool_t *pool, int width, int height, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+/* shares the source's pixels instead of copying them */
 image_rgba_t *image_clone(mem_pool_t *pool, const image_rgba_t *source);
 
+/* switches the image over to the pixels of an interned image with the same
+ * contents if there is one, otherwise interns its own. either way they are
+ * shared from then on. image_load interns everything it loads */
+void image_intern(image_rgba_t *image);
+/* true if both images are NULL, or have the same size and pixels. only images
+ * that don't share pixels and aren't both interned need comparing */
+bool_t image_same(const image_rgba_t *a, const image_rgba_t *b);
+
 image_paletted_t *image_pcx_load_paletted(mem_pool_t *pool, void *filedata, size_t filesize, char **out_error);
 image_rgba_t *image_pcx_load(mem_pool_t *pool, void *filedata, size_t filesize, char **out_error);
 image_rgba_t *image_tga_load(mem_pool_t *pool, void *filedata, size_t filesize, char **out_error);
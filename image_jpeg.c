@@ -22,6 +22,7 @@
 
 #include "global.h"
 #include "image.h"
+#include "thread.h"
 
 /* jboolean is unsigned char instead of int on Win32 */
 #ifdef WIN32
@@ -428,7 +429,7 @@ static dllfunction_t jpegfuncs[] =
 static dllhandle_t jpegdll = 0;
 
 static unsigned char jpeg_eoi_marker[2] = { 0xFF, JPEG_EOI };
-static jmp_buf error_in_jpeg;
+static THREAD_LOCAL jmp_buf error_in_jpeg;
 /*static bool_t jpeg_toolarge;*/
 
 static void jpeg_closelibrary(void)
@@ -439,27 +440,33 @@ static void jpeg_closelibrary(void)
 	printf("Closed jpeg library.\n");
 }
 
-static bool_t jpeg_openlibrary(void)
+static void jpeg_loadlibrary(void)
 {
-	if (jpegdll)
-		return true;
-
 #if defined(WIN32)
 	if (!loadlibrary("libjpeg.dll", &jpegdll, jpegfuncs))
-		return false;
+		return;
 #elif defined(MACOSX)
 	if (!loadlibrary("libjpeg.62.dylib", &jpegdll, jpegfuncs))
-		return false;
+		return;
 #else
 	if (!loadlibrary("libjpeg.so.62", &jpegdll, jpegfuncs) &&
 	    !loadlibrary("libjpeg.so", &jpegdll, jpegfuncs))
-		return false;
+		return;
 #endif
 
 	add_atexit_event(jpeg_closelibrary);
 
 	printf("Opened jpeg library.\n");
-	return true;
+}
+
+/* the library is loaded once, the first time any thread needs it */
+static bool_t jpeg_openlibrary(void)
+{
+	static volatile int done = 0;
+
+	thread_once(&done, jpeg_loadlibrary);
+
+	return jpegdll != NULL;
 }
 
 /*
@@ -19,8 +19,39 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+# include <xmmintrin.h>
+# define NORMALS_SSE
+#endif
+
 #include "global.h"
 #include "model.h"
+#include "thread.h"
+
+extern const float anorms[162][3];
+
+/* below this many vertices (over all frames), normals are recalculated, and
+ * models facetized, on the calling thread */
+#define NORMALS_MIN_THREADED_VERTICES 65536
+
+/* decoded frames kept for each lazily loaded mesh, enough for lerping
+ * between two frames with a little to spare */
+#define MESH_FRAMECACHE_SIZE 4
+
+typedef struct mesh_framecache_s
+{
+	thread_mutex_t *mutex;
+	unsigned int clock;
+
+	struct
+	{
+		int offset; /* -1 if unused */
+		unsigned int lastused;
+		float *vertex3f, *normal3f;
+	} slots[MESH_FRAMECACHE_SIZE];
+} mesh_framecache_t;
+
+static void mesh_framecache_free(mesh_framecache_t *cache);
 
 typedef struct model_format_s
 {
@@ -53,6 +84,46 @@ static const model_format_t *get_model_format(const char *filename)
 	return NULL;
 }
 
+void meshvert_map_init(meshvert_map_t *map, mem_pool_t *pool, int max_meshverts)
+{
+	map->meshverts = (meshvert_t*)mem_alloc(pool, sizeof(meshvert_t) * max_meshverts);
+	map->num_meshverts = 0;
+	map->hashindex = hashindex_create(max_meshverts, max_meshverts);
+}
+
+void meshvert_map_free(meshvert_map_t *map)
+{
+	mem_free(map->meshverts);
+	hashindex_free(map->hashindex);
+}
+
+/* returns the index of the matching meshvert, adding it if it's new */
+int meshvert_map_add(meshvert_map_t *map, int vertex, int s, int t, int back)
+{
+	meshvert_t key;
+	unsigned int hash;
+	int i;
+
+	key.vertex = vertex;
+	key.s = s;
+	key.t = t;
+	key.back = back;
+	hash = hash_data(&key, sizeof(key), 0);
+
+	for (i = hashindex_first(map->hashindex, hash); i != -1; i = hashindex_next(map->hashindex, i))
+	{
+		const meshvert_t *mv = &map->meshverts[i];
+
+		if (mv->vertex == vertex && mv->s == s && mv->t == t && mv->back == back)
+			return i;
+	}
+
+	i = map->num_meshverts++;
+	map->meshverts[i] = key;
+	hashindex_add(map->hashindex, hash, i);
+	return i;
+}
+
 void mesh_initialize(model_t *model, mesh_t *mesh)
 {
 	memset(mesh, 0, sizeof(mesh_t));
@@ -69,6 +140,9 @@ void mesh_free(model_t *model, mesh_t *mesh)
 	qfree(mesh->normal3f);
 	qfree(mesh->texcoord2f);
 	qfree(mesh->triangle3i);
+	qfree(mesh->quantframes);
+	qfree(mesh->quantverts);
+	mesh_framecache_free(mesh->framecache);
 
 	for (i = 0; i < model->total_skins; i++)
 		for (j = 0; j < SKIN_NUMTYPES; j++)
@@ -110,8 +184,21 @@ void mesh_generaterenderdata(model_t *model, mesh_t *mesh)
 					mesh->renderdata.skins[i].components[j].texcoord2f[k*2+1] = mesh->texcoord2f[k*2+1] * fh;
 				}
 
-			/* pad the skin image */
-				mesh->renderdata.skins[i].components[j].image = image_pad(mem_globalpool, component, w, h);
+			/* pad the skin image. skins that are the same (as skingroups often
+			 * have) pad to the same image, so share it */
+				for (k = 0; k < i; k++)
+					if (image_same(mesh->skins[k].components[j], component))
+						break;
+				if (k < i)
+					mesh->renderdata.skins[i].components[j].image = image_clone(mem_globalpool, mesh->renderdata.skins[k].components[j].image);
+				else if (w == component->width && h == component->height)
+					mesh->renderdata.skins[i].components[j].image = image_clone(mem_globalpool, component);
+				else
+				{
+					mesh->renderdata.skins[i].components[j].image = image_pad(mem_globalpool, component, w, h);
+					if (mesh->renderdata.skins[i].components[j].image)
+						image_intern(mesh->renderdata.skins[i].components[j].image);
+				}
 			}
 			else
 			{
@@ -149,6 +236,210 @@ void mesh_freerenderdata(model_t *model, mesh_t *mesh)
 	mesh->renderdata.initialized = false;
 }
 
+const quantvert_t *mesh_frame_quantverts(const mesh_t *mesh, int offset, quantvert_t *scratch)
+{
+	const quantvert_t *filequantverts;
+	int i;
+
+	if (mesh->quantverts)
+		return mesh->quantverts + offset * mesh->num_vertices;
+
+	filequantverts = mesh->filequantverts[offset];
+	for (i = 0; i < mesh->num_vertices; i++)
+		scratch[i] = filequantverts[mesh->filevertexmap[i]];
+
+	return scratch;
+}
+
+/* either output can be NULL */
+static void mesh_decode_frame(const mesh_t *mesh, int offset, float *out_vertex3f, float *out_normal3f)
+{
+	const quantframe_t *frame = &mesh->quantframes[offset];
+	quantvert_t *scratch = mesh->quantverts ? NULL : (quantvert_t*)qmalloc(sizeof(quantvert_t) * max(mesh->num_vertices, 1));
+	const quantvert_t *qv = mesh_frame_quantverts(mesh, offset, scratch);
+	int i;
+
+	for (i = 0; i < mesh->num_vertices; i++, qv++)
+	{
+		if (out_vertex3f)
+		{
+			out_vertex3f[i*3+0] = frame->translate[0] + frame->scale[0] * qv->v[0];
+			out_vertex3f[i*3+1] = frame->translate[1] + frame->scale[1] * qv->v[1];
+			out_vertex3f[i*3+2] = frame->translate[2] + frame->scale[2] * qv->v[2];
+		}
+		if (out_normal3f)
+			VectorCopy(out_normal3f + i * 3, anorms[qv->normalindex]);
+	}
+
+	qfree(scratch);
+}
+
+static mesh_framecache_t *mesh_framecache_create(void)
+{
+	mesh_framecache_t *cache = (mesh_framecache_t*)qmalloc(sizeof(mesh_framecache_t));
+	int i;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->mutex = thread_mutex_create();
+	for (i = 0; i < MESH_FRAMECACHE_SIZE; i++)
+		cache->slots[i].offset = -1;
+
+	return cache;
+}
+
+static void mesh_framecache_free(mesh_framecache_t *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < MESH_FRAMECACHE_SIZE; i++)
+	{
+		qfree(cache->slots[i].vertex3f);
+		qfree(cache->slots[i].normal3f);
+	}
+	thread_mutex_free(cache->mutex);
+	qfree(cache);
+}
+
+/* copies a frame of a lazily loaded mesh out of the cache. if it isn't there
+ * it's decoded outside the lock, so threads going through different frames
+ * (the savers' frame jobs) don't wait on each other, then it replaces the
+ * least recently used slot */
+static const float *mesh_cached_frame(const mesh_t *mesh, int offset, bool_t normals, float *scratch)
+{
+	mesh_framecache_t *cache = mesh->framecache;
+	float *vertex3f, *normal3f, *swap;
+	int i, slot;
+
+	thread_mutex_lock(cache->mutex);
+
+	for (i = 0; i < MESH_FRAMECACHE_SIZE; i++)
+	{
+		if (cache->slots[i].offset == offset)
+		{
+			cache->slots[i].lastused = ++cache->clock;
+			memcpy(scratch, normals ? cache->slots[i].normal3f : cache->slots[i].vertex3f, sizeof(float[3]) * mesh->num_vertices);
+			thread_mutex_unlock(cache->mutex);
+			return scratch;
+		}
+	}
+
+	thread_mutex_unlock(cache->mutex);
+
+	vertex3f = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
+	normal3f = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
+	mesh_decode_frame(mesh, offset, vertex3f, normal3f);
+	memcpy(scratch, normals ? normal3f : vertex3f, sizeof(float[3]) * mesh->num_vertices);
+
+/* another thread may have put it in meanwhile. otherwise swap the decoded
+ * frame into the slot, and free what was there instead */
+	thread_mutex_lock(cache->mutex);
+
+	for (i = 0, slot = 0; i < MESH_FRAMECACHE_SIZE; i++)
+	{
+		if (cache->slots[i].offset == offset)
+			break;
+		if (cache->slots[i].lastused < cache->slots[slot].lastused)
+			slot = i;
+	}
+
+	if (i < MESH_FRAMECACHE_SIZE)
+	{
+		cache->slots[i].lastused = ++cache->clock;
+	}
+	else
+	{
+		swap = cache->slots[slot].vertex3f;
+		cache->slots[slot].vertex3f = vertex3f;
+		vertex3f = swap;
+		swap = cache->slots[slot].normal3f;
+		cache->slots[slot].normal3f = normal3f;
+		normal3f = swap;
+		cache->slots[slot].offset = offset;
+		cache->slots[slot].lastused = ++cache->clock;
+	}
+
+	thread_mutex_unlock(cache->mutex);
+
+	qfree(vertex3f);
+	qfree(normal3f);
+
+	return scratch;
+}
+
+const float *mesh_frame_vertex3f(const mesh_t *mesh, int offset, float *scratch)
+{
+	if (mesh->vertex3f)
+		return mesh->vertex3f + offset * mesh->num_vertices * 3;
+	if (mesh->framecache)
+		return mesh_cached_frame(mesh, offset, false, scratch);
+
+	mesh_decode_frame(mesh, offset, scratch, NULL);
+	return scratch;
+}
+
+const float *mesh_frame_normal3f(const mesh_t *mesh, int offset, float *scratch)
+{
+	if (mesh->normal3f)
+		return mesh->normal3f + offset * mesh->num_vertices * 3;
+	if (mesh->framecache)
+		return mesh_cached_frame(mesh, offset, true, scratch);
+
+	mesh_decode_frame(mesh, offset, NULL, scratch);
+	return scratch;
+}
+
+void mesh_decode_vertices(const model_t *model, mesh_t *mesh)
+{
+	float *vertex3f, *normal3f;
+	int f;
+
+	if (mesh->vertex3f)
+		return;
+
+	vertex3f = (float*)qmalloc(sizeof(float[3]) * model->total_frames * mesh->num_vertices);
+	normal3f = (float*)qmalloc(sizeof(float[3]) * model->total_frames * mesh->num_vertices);
+	for (f = 0; f < model->total_frames; f++)
+		mesh_decode_frame(mesh, f, vertex3f + f * mesh->num_vertices * 3, normal3f + f * mesh->num_vertices * 3);
+
+	mesh->vertex3f = vertex3f;
+	mesh->normal3f = normal3f;
+}
+
+/* copies the frames left in the file into quantverts */
+static void mesh_load_file_frames(const model_t *model, mesh_t *mesh)
+{
+	quantvert_t *quantverts;
+	int f;
+
+	if (!mesh->filequantverts)
+		return;
+
+	quantverts = (quantvert_t*)qmalloc(sizeof(quantvert_t) * model->total_frames * mesh->num_vertices);
+	for (f = 0; f < model->total_frames; f++)
+		mesh_frame_quantverts(mesh, f, quantverts + f * mesh->num_vertices);
+
+	mesh->quantverts = quantverts;
+	mesh->filequantverts = NULL;
+	mesh->filevertexmap = NULL;
+	mesh_framecache_free(mesh->framecache);
+	mesh->framecache = NULL;
+}
+
+void mesh_drop_quantized(mesh_t *mesh)
+{
+	qfree(mesh->quantframes);
+	qfree(mesh->quantverts);
+	mesh->quantframes = NULL;
+	mesh->quantverts = NULL;
+	mesh->filequantverts = NULL;
+	mesh->filevertexmap = NULL;
+	mesh_framecache_free(mesh->framecache);
+	mesh->framecache = NULL;
+}
+
 void model_initialize(model_t *model)
 {
 	memset(model, 0, sizeof(model_t));
@@ -191,9 +482,22 @@ void model_free(model_t *model)
 		mesh_free(model, mesh);
 	qfree(model->meshes);
 
+	if (model->pool)
+		mem_free_pool(model->pool);
+	if (model->filemap.data)
+		unmapfile(&model->filemap);
+
 	qfree(model);
 }
 
+void model_decode_vertices(model_t *model)
+{
+	int i;
+
+	for (i = 0; i < model->num_meshes; i++)
+		mesh_decode_vertices(model, &model->meshes[i]);
+}
+
 void model_clear_skins(model_t *model)
 {
 	int i, j, k;
@@ -222,7 +526,8 @@ void model_clear_skins(model_t *model)
 	model->skininfo = NULL;
 }
 
-bool_t model_load(const char *filename, void *filedata, size_t filesize, model_t *out_model, char **out_error)
+/* the loaders may leave frames in filedata */
+static bool_t model_load_lazily(const char *filename, void *filedata, size_t filesize, model_t *out_model, char **out_error)
 {
 	const model_format_t *format = get_model_format(filename);
 
@@ -231,28 +536,78 @@ bool_t model_load(const char *filename, void *filedata, size_t filesize, model_t
 	if (!format->load)
 		return (void)(out_error && (*out_error = msprintf("loading not implemented for %s format", format->name))), false;
 
-	return (*format->load)(filedata, filesize, out_model, out_error);
+	if (!(*format->load)(filedata, filesize, out_model, out_error))
+		return false;
+
+/* the loaders fill in the model field by field, and leave this to the caller */
+	memset(&out_model->filemap, 0, sizeof(out_model->filemap));
+	return true;
+}
+
+bool_t model_load(const char *filename, void *filedata, size_t filesize, model_t *out_model, char **out_error)
+{
+	int i;
+
+	if (!model_load_lazily(filename, filedata, filesize, out_model, out_error))
+		return false;
+
+/* filedata is the caller's, so nothing can be left in it */
+	for (i = 0; i < out_model->num_meshes; i++)
+		mesh_load_file_frames(out_model, &out_model->meshes[i]);
+
+	return true;
+}
+
+bool_t model_can_load(const char *filename)
+{
+	const model_format_t *format = get_model_format(filename);
+
+	return format && format->load;
 }
 
 model_t *model_load_from_file(const char *filename, char **out_error)
 {
-	void *filedata;
-	size_t filesize;
+	filemap_t filemap;
 	model_t *model;
+	bool_t ok, lazy = false;
+	int i;
 
-	if (!loadfile(filename, &filedata, &filesize, out_error))
+	profile_push(PROFILE_READ);
+	ok = mapfile(filename, &filemap, out_error);
+	profile_pop();
+	if (!ok)
 		return NULL;
 
 	model = (model_t*)qmalloc(sizeof(model_t));
 
-	if (!model_load(filename, filedata, filesize, model, out_error))
+	profile_push(PROFILE_PARSE);
+	ok = model_load_lazily(filename, filemap.data, filemap.size, model, out_error);
+	profile_pop();
+
+	if (!ok)
 	{
+		unmapfile(&filemap);
 		qfree(model);
-		qfree(filedata);
 		return NULL;
 	}
 
-	qfree(filedata);
+/* keep the file mapped while there are frames left in it. saving over the
+ * same file is safe, model_save only replaces it (by renaming its temporary
+ * file over it) after the frames have all been read */
+	for (i = 0; i < model->num_meshes; i++)
+	{
+		if (model->meshes[i].filequantverts)
+		{
+			model->meshes[i].framecache = mesh_framecache_create();
+			lazy = true;
+		}
+	}
+
+	if (lazy)
+		model->filemap = filemap;
+	else
+		unmapfile(&filemap);
+
 	return model;
 }
 
@@ -266,26 +621,33 @@ bool_t model_save(const char *filename, const model_t *model, char **out_error)
 	if (!format->save)
 		return (void)(out_error && (*out_error = msprintf("saving not implemented for %s format", format->name))), false;
 
-/* allocate write buffer, use a memory buffer because we need to be able to rewind at times (not supported with file buffers) */
-	xbuf = xbuf_create_memory(262144, out_error);
+	profile_push(PROFILE_WRITE);
+
+/* stream to the file (through a temporary file, so nothing is lost if the save
+ * fails), the savers patch their headers in with xbuf_patch_data */
+	xbuf = xbuf_create_file(262144, filename, out_error);
 	if (!xbuf)
+	{
+		profile_pop();
 		return false;
+	}
 
 /* write the model data into the buffer */
 	if (!(*format->save)(model, xbuf, out_error))
 	{
 		xbuf_free(xbuf, NULL);
+		profile_pop();
 		return false;
 	}
 
-/* save buffer contents to file */
-	if (!xbuf_write_to_file(xbuf, filename, out_error))
+/* flush the rest to the file */
+	if (!xbuf_finish_file(xbuf, out_error))
 	{
-		xbuf_free(xbuf, NULL);
+		profile_pop();
 		return false;
 	}
 
-	xbuf_free(xbuf, NULL);
+	profile_pop();
 	return true;
 }
 
@@ -305,10 +667,15 @@ void model_freerenderdata(model_t *model)
 		mesh_freerenderdata(model, &model->meshes[i]);
 }
 
-static model_t *model_clone_except_meshes(const model_t *model)
+/* out_offsets gets the offset in the old model of each of the new model's
+ * frames. cloning every frame keeps the offsets as they were, otherwise the
+ * frames are renumbered in order */
+static model_t *model_clone_except_meshes(const model_t *model, int first_frame, int num_frames, int **out_offsets)
 {
 	model_t *newmodel = (model_t*)qmalloc(sizeof(model_t));
-	int i, j;
+	const bool_t all_frames = (first_frame == 0 && num_frames == model->num_frames);
+	int *offsets;
+	int i, j, total_frames = 0;
 
 	model_initialize(newmodel);
 
@@ -327,18 +694,42 @@ static model_t *model_clone_except_meshes(const model_t *model)
 		}
 	}
 
-	newmodel->total_frames = model->total_frames;
-	newmodel->num_frames = model->num_frames;
-	newmodel->frameinfo = (frameinfo_t*)qmalloc(sizeof(frameinfo_t) * model->num_frames);
-	for (i = 0; i < model->num_frames; i++)
+	if (all_frames)
+	{
+		newmodel->total_frames = model->total_frames;
+	}
+	else
+	{
+		newmodel->total_frames = 0;
+		for (i = first_frame; i < first_frame + num_frames; i++)
+			newmodel->total_frames += model->frameinfo[i].num_frames;
+	}
+
+	offsets = (int*)qmalloc(sizeof(int) * max(newmodel->total_frames, 1));
+	for (i = 0; i < newmodel->total_frames; i++)
+		offsets[i] = i;
+
+	newmodel->num_frames = num_frames;
+	newmodel->frameinfo = (frameinfo_t*)qmalloc(sizeof(frameinfo_t) * num_frames);
+	for (i = 0; i < num_frames; i++)
 	{
-		newmodel->frameinfo[i].frametime = model->frameinfo[i].frametime;
-		newmodel->frameinfo[i].num_frames = model->frameinfo[i].num_frames;
-		newmodel->frameinfo[i].frames = (singleframe_t*)qmalloc(sizeof(singleframe_t) * model->frameinfo[i].num_frames);
-		for (j = 0; j < model->frameinfo[i].num_frames; j++)
+		const frameinfo_t *frameinfo = &model->frameinfo[first_frame + i];
+
+		newmodel->frameinfo[i].frametime = frameinfo->frametime;
+		newmodel->frameinfo[i].num_frames = frameinfo->num_frames;
+		newmodel->frameinfo[i].frames = (singleframe_t*)qmalloc(sizeof(singleframe_t) * frameinfo->num_frames);
+		for (j = 0; j < frameinfo->num_frames; j++)
 		{
-			newmodel->frameinfo[i].frames[j].name = copystring(model->frameinfo[i].frames[j].name);
-			newmodel->frameinfo[i].frames[j].offset = model->frameinfo[i].frames[j].offset;
+			newmodel->frameinfo[i].frames[j].name = copystring(frameinfo->frames[j].name);
+			if (all_frames)
+			{
+				newmodel->frameinfo[i].frames[j].offset = frameinfo->frames[j].offset;
+			}
+			else
+			{
+				offsets[total_frames] = frameinfo->frames[j].offset;
+				newmodel->frameinfo[i].frames[j].offset = total_frames++;
+			}
 		}
 	}
 
@@ -350,8 +741,9 @@ static model_t *model_clone_except_meshes(const model_t *model)
 	for (i = 0; i < model->num_tags; i++)
 	{
 		newmodel->tags[i].name = copystring(model->tags[i].name);
-		newmodel->tags[i].matrix = (mat4x4f_t*)qmalloc(sizeof(mat4x4f_t) * model->total_frames);
-		memcpy(newmodel->tags[i].matrix, model->tags[i].matrix, sizeof(mat4x4f_t) * model->total_frames);
+		newmodel->tags[i].matrix = (mat4x4f_t*)qmalloc(sizeof(mat4x4f_t) * newmodel->total_frames);
+		for (j = 0; j < newmodel->total_frames; j++)
+			newmodel->tags[i].matrix[j] = model->tags[i].matrix[offsets[j]];
 	}
 
 	newmodel->flags = model->flags;
@@ -359,40 +751,89 @@ static model_t *model_clone_except_meshes(const model_t *model)
 	for (i = 0; i < 3; i++)
 		newmodel->offsets[i] = model->offsets[i];
 
+	*out_offsets = offsets;
 	return newmodel;
 }
 
 model_t *model_clone(const model_t *model)
 {
-	model_t *newmodel = model_clone_except_meshes(model);
+	return model_clone_frames(model, 0, model->num_frames);
+}
+
+/* the mesh arrays and skins are shared with the original rather than copied
+ * (along with the pool they came from), and only copied by whatever changes
+ * them in place. vertices are copied when only some of the frames are wanted,
+ * and frames still in the file are read in */
+model_t *model_clone_frames(const model_t *model, int first_frame, int num_frames)
+{
+	int *offsets;
+	model_t *newmodel = model_clone_except_meshes(model, first_frame, num_frames, &offsets);
+	const bool_t all_frames = (first_frame == 0 && num_frames == model->num_frames);
 	int i, j, k;
 
+	if (model->pool)
+		newmodel->pool = mem_share_pool(model->pool);
+
 	newmodel->num_meshes = model->num_meshes;
 	newmodel->meshes = (mesh_t*)qmalloc(sizeof(mesh_t) * model->num_meshes);
 	for (i = 0; i < model->num_meshes; i++)
 	{
-		mesh_initialize(newmodel, &newmodel->meshes[i]);
+		const mesh_t *mesh = &model->meshes[i];
+		mesh_t *newmesh = &newmodel->meshes[i];
+		const int num_vertices = mesh->num_vertices;
 
-		newmodel->meshes[i].name = copystring(model->meshes[i].name);
+		mesh_initialize(newmodel, newmesh);
 
-		newmodel->meshes[i].num_vertices = model->meshes[i].num_vertices;
-		newmodel->meshes[i].num_triangles = model->meshes[i].num_triangles;
+		newmesh->name = copystring(mesh->name);
 
-		newmodel->meshes[i].vertex3f = (float*)qmalloc(sizeof(float[3]) * model->total_frames * model->meshes[i].num_vertices);
-		memcpy(newmodel->meshes[i].vertex3f, model->meshes[i].vertex3f, sizeof(float[3]) * model->total_frames * model->meshes[i].num_vertices);
-		newmodel->meshes[i].normal3f = (float*)qmalloc(sizeof(float[3]) * model->total_frames * model->meshes[i].num_vertices);
-		memcpy(newmodel->meshes[i].normal3f, model->meshes[i].normal3f, sizeof(float[3]) * model->total_frames * model->meshes[i].num_vertices);
-		newmodel->meshes[i].texcoord2f = (float*)qmalloc(sizeof(float[2]) * model->meshes[i].num_vertices);
-		memcpy(newmodel->meshes[i].texcoord2f, model->meshes[i].texcoord2f, sizeof(float[2]) * model->meshes[i].num_vertices);
-		newmodel->meshes[i].triangle3i = (int*)qmalloc(sizeof(int[3]) * model->meshes[i].num_triangles);
-		memcpy(newmodel->meshes[i].triangle3i, model->meshes[i].triangle3i, sizeof(int[3]) * model->meshes[i].num_triangles);
+		newmesh->num_vertices = num_vertices;
+		newmesh->num_triangles = mesh->num_triangles;
 
-		newmodel->meshes[i].skins = (meshskin_t*)qmalloc(sizeof(meshskin_t) * model->total_skins);
+		if (mesh->vertex3f && all_frames)
+		{
+			newmesh->vertex3f = (float*)mem_share(mesh->vertex3f);
+			newmesh->normal3f = (float*)mem_share(mesh->normal3f);
+		}
+		else if (mesh->vertex3f)
+		{
+			newmesh->vertex3f = (float*)qmalloc(sizeof(float[3]) * newmodel->total_frames * num_vertices);
+			newmesh->normal3f = (float*)qmalloc(sizeof(float[3]) * newmodel->total_frames * num_vertices);
+			for (j = 0; j < newmodel->total_frames; j++)
+			{
+				memcpy(newmesh->vertex3f + j * num_vertices * 3, mesh->vertex3f + offsets[j] * num_vertices * 3, sizeof(float[3]) * num_vertices);
+				memcpy(newmesh->normal3f + j * num_vertices * 3, mesh->normal3f + offsets[j] * num_vertices * 3, sizeof(float[3]) * num_vertices);
+			}
+		}
+		if (mesh->quantverts && all_frames)
+		{
+			newmesh->quantframes = (quantframe_t*)mem_share(mesh->quantframes);
+			newmesh->quantverts = (quantvert_t*)mem_share(mesh->quantverts);
+		}
+		else if (mesh->quantframes)
+		{
+		/* frames still in the file are only read for the frames being copied */
+			newmesh->quantframes = (quantframe_t*)qmalloc(sizeof(quantframe_t) * newmodel->total_frames);
+			newmesh->quantverts = (quantvert_t*)qmalloc(sizeof(quantvert_t) * newmodel->total_frames * num_vertices);
+			for (j = 0; j < newmodel->total_frames; j++)
+			{
+				quantvert_t *quantverts = newmesh->quantverts + j * num_vertices;
+				const quantvert_t *qv = mesh_frame_quantverts(mesh, offsets[j], quantverts);
+
+				if (qv != quantverts)
+					memcpy(quantverts, qv, sizeof(quantvert_t) * num_vertices);
+				newmesh->quantframes[j] = mesh->quantframes[offsets[j]];
+			}
+		}
+		newmesh->texcoord2f = (float*)mem_share(mesh->texcoord2f);
+		newmesh->triangle3i = (int*)mem_share(mesh->triangle3i);
+
+		newmesh->skins = (meshskin_t*)qmalloc(sizeof(meshskin_t) * model->total_skins);
 		for (j = 0; j < model->total_skins; j++)
 			for (k = 0; k < SKIN_NUMTYPES; k++)
-				newmodel->meshes[i].skins[j].components[k] = image_clone(mem_globalpool, model->meshes[i].skins[j].components[k]);
+				newmesh->skins[j].components[k] = image_clone(mem_globalpool, mesh->skins[j].components[k]);
 	}
 
+	qfree(offsets);
 	return newmodel;
 }
 
@@ -404,13 +845,18 @@ model_t *model_merge_meshes(const model_t *model)
 	mesh_t *newmesh;
 	int i, j, k;
 	int ofs_verts, ofs_tris;
+	int max_vertices = 1;
+	float *scratch_vertex3f, *scratch_normal3f;
+	int *offsets;
+	bool_t quantized;
 
 	if (model->num_meshes < 1)
 		return NULL;
 	if (model->num_meshes == 1)
 		return model_clone(model);
 
-	newmodel = model_clone_except_meshes(model);
+	newmodel = model_clone_except_meshes(model, 0, model->num_frames, &offsets);
+	qfree(offsets);
 
 	newmodel->num_meshes = 1;
 	newmodel->meshes = (mesh_t*)qmalloc(sizeof(mesh_t));
@@ -427,14 +873,34 @@ model_t *model_merge_meshes(const model_t *model)
 		newmesh->num_triangles += model->meshes[i].num_triangles;
 	}
 
-	newmesh->vertex3f = (float*)qmalloc(sizeof(float[3]) * newmesh->num_vertices * newmodel->total_frames);
-	newmesh->normal3f = (float*)qmalloc(sizeof(float[3]) * newmesh->num_vertices * newmodel->total_frames);
+/* meshes quantized with the same frames (as all of a dkm's are) stay quantized */
+	quantized = true;
+	for (i = 0; i < model->num_meshes; i++)
+		if (!model->meshes[i].quantframes || memcmp(model->meshes[i].quantframes, model->meshes[0].quantframes, sizeof(quantframe_t) * model->total_frames))
+			quantized = false;
+
+	if (quantized)
+	{
+		newmesh->quantframes = (quantframe_t*)qmalloc(sizeof(quantframe_t) * newmodel->total_frames);
+		memcpy(newmesh->quantframes, model->meshes[0].quantframes, sizeof(quantframe_t) * newmodel->total_frames);
+		newmesh->quantverts = (quantvert_t*)qmalloc(sizeof(quantvert_t) * newmesh->num_vertices * newmodel->total_frames);
+	}
+	else
+	{
+		newmesh->vertex3f = (float*)qmalloc(sizeof(float[3]) * newmesh->num_vertices * newmodel->total_frames);
+		newmesh->normal3f = (float*)qmalloc(sizeof(float[3]) * newmesh->num_vertices * newmodel->total_frames);
+	}
 	newmesh->texcoord2f = (float*)qmalloc(sizeof(float[2]) * newmesh->num_vertices);
 	newmesh->triangle3i = (int*)qmalloc(sizeof(int[3]) * newmesh->num_triangles);
 
 	ofs_verts = 0;
 	ofs_tris = 0;
 
+	for (i = 0; i < model->num_meshes; i++)
+		max_vertices = max(max_vertices, model->meshes[i].num_vertices);
+	scratch_vertex3f = (float*)qmalloc(sizeof(float[3]) * max_vertices);
+	scratch_normal3f = (float*)qmalloc(sizeof(float[3]) * max_vertices);
+
 	for (i = 0; i < model->num_meshes; i++)
 	{
 		const mesh_t *mesh = &model->meshes[i];
@@ -447,12 +913,21 @@ model_t *model_merge_meshes(const model_t *model)
 			newmesh->texcoord2f[(ofs_verts+j)*2+1] = mesh->texcoord2f[j*2+1];
 		}
 
-		iv = mesh->vertex3f;
-		in = mesh->normal3f;
-		for (j = 0; j < newmodel->total_frames; j++)
+		for (j = 0; j < newmodel->total_frames && quantized; j++)
+		{
+			quantvert_t *quantverts = newmesh->quantverts + j * newmesh->num_vertices + ofs_verts;
+			const quantvert_t *qv = mesh_frame_quantverts(mesh, j, quantverts);
+
+			if (qv != quantverts)
+				memcpy(quantverts, qv, sizeof(quantvert_t) * mesh->num_vertices);
+		}
+
+		for (j = 0; j < newmodel->total_frames && !quantized; j++)
 		{
 			v = newmesh->vertex3f + j * newmesh->num_vertices * 3 + ofs_verts * 3;
 			n = newmesh->normal3f + j * newmesh->num_vertices * 3 + ofs_verts * 3;
+			iv = mesh_frame_vertex3f(mesh, j, scratch_vertex3f);
+			in = mesh_frame_normal3f(mesh, j, scratch_normal3f);
 
 			for (k = 0; k < mesh->num_vertices; k++)
 			{
@@ -472,6 +947,9 @@ model_t *model_merge_meshes(const model_t *model)
 		ofs_tris += mesh->num_triangles;
 	}
 
+	qfree(scratch_normal3f);
+	qfree(scratch_vertex3f);
+
 /* FIXME - this just grabs the first mesh's skin */
 	newmesh->skins = (meshskin_t*)qmalloc(sizeof(meshskin_t) * newmodel->total_skins);
 
@@ -482,120 +960,264 @@ model_t *model_merge_meshes(const model_t *model)
 	return newmodel;
 }
 
-void model_recalculate_normals(model_t *model)
+/* vertex normals are the sum of the unnormalized face normals around them, so
+ * large faces count for more than small ones. each vertex gathers its faces
+ * through a list of the triangles using it, in triangle order, so the sums
+ * are added in the same order as scattering triangle by triangle would, and
+ * frames can be done in parallel */
+typedef struct normals_job_s
 {
-	int m, f, t, v;
-	mesh_t *mesh;
+	const mesh_t *mesh;
+	int frames_per_job;
+	int total_frames;
 
-	for (m = 0, mesh = model->meshes; m < model->num_meshes; m++, mesh++)
+	const int *vertex_first; /* [num_vertices + 1], into vertex_triangles */
+	const int *vertex_triangles; /* triangle for each corner, grouped by vertex */
+} normals_job_t;
+
+/* normalizes in place, as VectorNormalize does (zero length vectors are left
+ * alone), with the same rounding */
+static void normalize_vectors(float *v, int num_vectors)
+{
+	int i = 0;
+
+#ifdef NORMALS_SSE
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+	for (; i + 4 <= num_vectors; i += 4, v += 12)
 	{
-	/* clear all normals */
-		memset(mesh->normal3f, 0, sizeof(float[3]) * mesh->num_vertices * model->total_frames);
+	/* a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3 */
+		__m128 a = _mm_loadu_ps(v), b = _mm_loadu_ps(v + 4), c = _mm_loadu_ps(v + 8);
+		__m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2)); /* x2 y2 x3 y3 */
+		__m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1)); /* y0 z0 y1 z1 */
+		__m128 x = _mm_shuffle_ps(a, t0, _MM_SHUFFLE(2, 0, 3, 0));
+		__m128 y = _mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3, 1, 2, 0));
+		__m128 z = _mm_shuffle_ps(t1, c, _MM_SHUFFLE(3, 0, 3, 1));
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		__m128 nonzero = _mm_cmpneq_ps(length, zero);
+		__m128 scale = _mm_or_ps(_mm_and_ps(nonzero, _mm_div_ps(one, length)), _mm_andnot_ps(nonzero, one));
+
+		_mm_storeu_ps(v,     _mm_mul_ps(a, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1, 0, 0, 0))));
+		_mm_storeu_ps(v + 4, _mm_mul_ps(b, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2, 2, 1, 1))));
+		_mm_storeu_ps(v + 8, _mm_mul_ps(c, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3, 3, 3, 2))));
+	}
+#endif
+
+	for (; i < num_vectors; i++, v += 3)
+		VectorNormalize(v);
+}
 
-	/* add up all the unnormalized "normals" */
-		for (f = 0; f < model->total_frames; f++)
+static void recalculate_normals_job(void *data, int job)
+{
+	const normals_job_t *nj = (const normals_job_t*)data;
+	const mesh_t *mesh = nj->mesh;
+	const int first_frame = job * nj->frames_per_job;
+	const int last_frame = min(first_frame + nj->frames_per_job, nj->total_frames);
+	float *facenormals = (float*)qmalloc(sizeof(float[3]) * mesh->num_triangles);
+	int f, t, v, i;
+
+	for (f = first_frame; f < last_frame; f++)
+	{
+		const float *vertex3f = mesh->vertex3f + f * mesh->num_vertices * 3;
+		float *normal3f = mesh->normal3f + f * mesh->num_vertices * 3;
+		const int *tri;
+		float *normal;
+
+	/* find the face normals but don't normalize them yet */
+		for (t = 0, tri = mesh->triangle3i, normal = facenormals; t < mesh->num_triangles; t++, tri += 3, normal += 3)
+		{
+			const float *v0 = vertex3f + tri[0] * 3;
+			const float *v1 = vertex3f + tri[1] * 3;
+			const float *v2 = vertex3f + tri[2] * 3;
+			float q[3], w[3];
+
+			VectorSubtract(v1, v0, q);
+			VectorSubtract(v1, v2, w);
+			CrossProduct(q, w, normal);
+		}
+
+	/* add up the faces around each vertex, starting from zero like the memset did */
+		for (v = 0, normal = normal3f; v < mesh->num_vertices; v++, normal += 3)
 		{
-			const int firstvertex = f * mesh->num_vertices * 3;
-			const int *tri;
+			float sum[3] = { 0.0f, 0.0f, 0.0f };
 
-			for (tri = mesh->triangle3i, t = 0; t < mesh->num_triangles; tri += 3, t++)
+			for (i = nj->vertex_first[v]; i < nj->vertex_first[v + 1]; i++)
 			{
-				const float *v0 = mesh->vertex3f + firstvertex + tri[0] * 3;
-				const float *v1 = mesh->vertex3f + firstvertex + tri[1] * 3;
-				const float *v2 = mesh->vertex3f + firstvertex + tri[2] * 3;
-				float *n0 = mesh->normal3f + firstvertex + tri[0] * 3;
-				float *n1 = mesh->normal3f + firstvertex + tri[1] * 3;
-				float *n2 = mesh->normal3f + firstvertex + tri[2] * 3;
-				float q[3], v[3], normal[3];
-
-			/* find the face normal but don't normalize it yet, so large faces contribute more to the vertex normal than small faces */
-				VectorSubtract(v1, v0, q);
-				VectorSubtract(v1, v2, v);
-				CrossProduct(q, v, normal);
-
-			/* add normal to the three vertices of this face */
-				VectorAdd(n0, normal, n0);
-				VectorAdd(n1, normal, n1);
-				VectorAdd(n2, normal, n2);
+				const float *facenormal = facenormals + nj->vertex_triangles[i] * 3;
+
+				VectorAdd(sum, facenormal, sum);
 			}
 
-		/* now go back and normalize all the normals */
-			for (v = 0; v < mesh->num_vertices; v++)
-				VectorNormalize(mesh->normal3f + firstvertex + v * 3);
+			VectorCopy(normal, sum);
 		}
+
+		normalize_vectors(normal3f, mesh->num_vertices);
 	}
+
+	qfree(facenormals);
 }
 
-void model_facetize(model_t *model)
+void model_recalculate_normals(model_t *model)
 {
-	int i, j, k, f;
+	int m, t, v, i;
 	mesh_t *mesh;
 
-	for (i = 0, mesh = model->meshes; i < model->num_meshes; i++, mesh++)
+	for (m = 0, mesh = model->meshes; m < model->num_meshes; m++, mesh++)
 	{
-		float *vertex3f = (float*)qmalloc(model->total_frames * sizeof(float[3]) * mesh->num_triangles * 3);
-		float *normal3f = (float*)qmalloc(model->total_frames * sizeof(float[3]) * mesh->num_triangles * 3);
-		float *texcoord2f = (float*)qmalloc(sizeof(float[2]) * mesh->num_triangles * 3);
-		float *tc = texcoord2f;
+		normals_job_t nj;
+		int *vertex_first, *vertex_triangles;
+		int num_jobs;
+
+		if (!mesh->num_vertices || !model->total_frames)
+			continue;
+
+		mesh_decode_vertices(model, mesh);
+		mesh_drop_quantized(mesh);
+		mesh->normal3f = (float*)mem_unshare(mesh->normal3f);
+
+	/* list the triangles using each vertex (counting sort of the corners) */
+		vertex_first = (int*)qmalloc(sizeof(int) * (mesh->num_vertices + 1));
+		vertex_triangles = (int*)qmalloc(sizeof(int) * max(mesh->num_triangles * 3, 1));
+
+		memset(vertex_first, 0, sizeof(int) * (mesh->num_vertices + 1));
+		for (i = 0; i < mesh->num_triangles * 3; i++)
+			vertex_first[mesh->triangle3i[i] + 1]++;
+		for (v = 0; v < mesh->num_vertices; v++)
+			vertex_first[v + 1] += vertex_first[v];
+		for (t = 0; t < mesh->num_triangles; t++)
+			for (i = 0; i < 3; i++)
+				vertex_triangles[vertex_first[mesh->triangle3i[t * 3 + i]]++] = t;
+	/* each vertex_first[v] now holds where vertex v + 1 starts, shift them back */
+		memmove(vertex_first + 1, vertex_first, sizeof(int) * mesh->num_vertices);
+		vertex_first[0] = 0;
+
+	/* a few jobs per worker, so uneven progress evens out */
+		nj.mesh = mesh;
+		nj.total_frames = model->total_frames;
+		nj.vertex_first = vertex_first;
+		nj.vertex_triangles = vertex_triangles;
+		num_jobs = min(model->total_frames, thread_num_workers() * 4);
+		if ((size_t)mesh->num_vertices * model->total_frames < NORMALS_MIN_THREADED_VERTICES)
+			num_jobs = 1;
+		nj.frames_per_job = (model->total_frames + num_jobs - 1) / num_jobs;
+		num_jobs = (model->total_frames + nj.frames_per_job - 1) / nj.frames_per_job;
+
+		thread_run(num_jobs, recalculate_normals_job, &nj);
+
+		qfree(vertex_triangles);
+		qfree(vertex_first);
+	}
+}
 
-		for (j = 0; j < mesh->num_triangles; j++)
+/* facetizing gives each triangle its own three vertices, all with the face's
+ * normal. the output is written a frame at a time, so each frame's vertices
+ * are read while they're in cache and the output is written in order, and
+ * frames can be done in parallel */
+typedef struct facetize_job_s
+{
+	const mesh_t *mesh;
+	int frames_per_job;
+	int total_frames;
+
+	float *vertex3f; /* [total_frames * num_triangles * 3] */
+	float *normal3f;
+} facetize_job_t;
+
+static void facetize_job(void *data, int job)
+{
+	const facetize_job_t *fj = (const facetize_job_t*)data;
+	const mesh_t *mesh = fj->mesh;
+	const int first_frame = job * fj->frames_per_job;
+	const int last_frame = min(first_frame + fj->frames_per_job, fj->total_frames);
+	float *scratch = mesh->vertex3f ? NULL : (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
+	float *facenormals = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_triangles, 1));
+	int f, t;
+
+	for (f = first_frame; f < last_frame; f++)
+	{
+		const float *mvs = mesh_frame_vertex3f(mesh, f, scratch);
+		float *v = fj->vertex3f + (size_t)f * mesh->num_triangles * 9;
+		float *n = fj->normal3f + (size_t)f * mesh->num_triangles * 9;
+		const int *tri;
+		float *normal;
+
+	/* copy out the corners and find the face normals */
+		for (t = 0, tri = mesh->triangle3i, normal = facenormals; t < mesh->num_triangles; t++, tri += 3, v += 9, normal += 3)
 		{
-			for (f = 0; f < model->total_frames; f++)
-			{
-				const float *mvs = mesh->vertex3f + f * mesh->num_vertices * 3;
-				const float *mns = mesh->normal3f + f * mesh->num_vertices * 3;
-				float *a, *b, *c, q[3], v[3], normal[3];
+			float q[3], w[3];
 
-				for (k = 0; k < 3; k++)
-				{
-					int vertindex = mesh->triangle3i[j * 3 + k];
+			VectorCopy(v + 0, mvs + tri[0] * 3);
+			VectorCopy(v + 3, mvs + tri[1] * 3);
+			VectorCopy(v + 6, mvs + tri[2] * 3);
 
-					float *v = vertex3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + k) * 3;
-					float *n = normal3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + k) * 3;
+			VectorSubtract(v + 3, v + 0, q);
+			VectorSubtract(v + 3, v + 6, w);
+			CrossProduct(q, w, normal);
+		}
 
-					VectorCopy(v, mvs + vertindex * 3);
-					VectorCopy(n, mns + vertindex * 3);
-				}
+		normalize_vectors(facenormals, mesh->num_triangles);
 
-				c = vertex3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 0) * 3;
-				b = vertex3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 1) * 3;
-				a = vertex3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 2) * 3;
+		for (t = 0, normal = facenormals; t < mesh->num_triangles; t++, n += 9, normal += 3)
+		{
+			VectorCopy(n + 0, normal);
+			VectorCopy(n + 3, normal);
+			VectorCopy(n + 6, normal);
+		}
+	}
 
-				VectorSubtract(b, c, q);
-				VectorSubtract(b, a, v);
-				CrossProduct(q, v, normal);
-				VectorNormalize(normal);
+	qfree(facenormals);
+	qfree(scratch);
+}
 
-				c = normal3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 0) * 3;
-				b = normal3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 1) * 3;
-				a = normal3f + f * (mesh->num_triangles * 3) * 3 + (j * 3 + 2) * 3;
+void model_facetize(model_t *model)
+{
+	int i, j, k;
+	mesh_t *mesh;
 
-				VectorCopy(a, normal);
-				VectorCopy(b, normal);
-				VectorCopy(c, normal);
-			}
+	for (i = 0, mesh = model->meshes; i < model->num_meshes; i++, mesh++)
+	{
+		facetize_job_t fj;
+		float *texcoord2f = (float*)qmalloc(sizeof(float[2]) * mesh->num_triangles * 3);
+		int *triangle3i;
+		int num_jobs;
 
-			for (k = 0; k < 3; k++)
-			{
-				int vertindex = mesh->triangle3i[j * 3 + k];
+		fj.mesh = mesh;
+		fj.total_frames = model->total_frames;
+		fj.vertex3f = (float*)qmalloc(model->total_frames * sizeof(float[3]) * mesh->num_triangles * 3);
+		fj.normal3f = (float*)qmalloc(model->total_frames * sizeof(float[3]) * mesh->num_triangles * 3);
 
-				tc[0] = mesh->texcoord2f[vertindex*2+0];
-				tc[1] = mesh->texcoord2f[vertindex*2+1];
+	/* frames are read straight from the quantized vertices if there are no
+	 * floats, rather than decoding them all first */
+		if (model->total_frames)
+		{
+			num_jobs = min(model->total_frames, thread_num_workers() * 4);
+			if ((size_t)mesh->num_triangles * 3 * model->total_frames < NORMALS_MIN_THREADED_VERTICES)
+				num_jobs = 1;
+			fj.frames_per_job = (model->total_frames + num_jobs - 1) / num_jobs;
+			num_jobs = (model->total_frames + fj.frames_per_job - 1) / fj.frames_per_job;
+
+			thread_run(num_jobs, facetize_job, &fj);
+		}
 
-				tc += 2;
+		for (j = 0; j < mesh->num_triangles; j++)
+			for (k = 0; k < 3; k++)
+			{
+				texcoord2f[(j * 3 + k) * 2 + 0] = mesh->texcoord2f[mesh->triangle3i[j * 3 + k] * 2 + 0];
+				texcoord2f[(j * 3 + k) * 2 + 1] = mesh->texcoord2f[mesh->triangle3i[j * 3 + k] * 2 + 1];
 			}
 
-			mesh->triangle3i[j * 3 + 0] = j * 3 + 0;
-			mesh->triangle3i[j * 3 + 1] = j * 3 + 1;
-			mesh->triangle3i[j * 3 + 2] = j * 3 + 2;
-		}
+		triangle3i = (int*)mem_unshare(mesh->triangle3i);
+		for (j = 0; j < mesh->num_triangles * 3; j++)
+			triangle3i[j] = j;
 
+		mesh_drop_quantized(mesh);
 		qfree(mesh->vertex3f);
 		qfree(mesh->normal3f);
 		qfree(mesh->texcoord2f);
-		mesh->vertex3f = vertex3f;
-		mesh->normal3f = normal3f;
+		mesh->vertex3f = fj.vertex3f;
+		mesh->normal3f = fj.normal3f;
 		mesh->texcoord2f = texcoord2f;
+		mesh->triangle3i = triangle3i;
 		mesh->num_vertices = mesh->num_triangles * 3;
 	}
 }
@@ -71,6 +71,20 @@ typedef struct meshskin_s
 	image_rgba_t *components[SKIN_NUMTYPES];
 } meshskin_t;
 
+/* a vertex as the quantized formats (mdl, md2, dkm) store it. the position is
+ * the frame's translate + scale * v, the normal is anorms[normalindex] */
+typedef struct quantvert_s
+{
+	unsigned char v[3];
+	unsigned char normalindex;
+} quantvert_t;
+
+typedef struct quantframe_s
+{
+	float scale[3];
+	float translate[3];
+} quantframe_t;
+
 typedef struct mesh_s
 {
 	char *name;
@@ -78,12 +92,28 @@ typedef struct mesh_s
 	int num_vertices;
 	int num_triangles;
 
-	float *vertex3f;
+/* the arrays may be shared with clones of the model (see model_clone_frames),
+ * so use mem_unshare on one before changing it in place */
+	float *vertex3f; /* [model.total_frames * num_vertices], NULL if only quantverts are loaded */
 	float *normal3f;
 	float *texcoord2f;
 
 	int *triangle3i;
 
+/* models loaded from a quantized format keep the vertices as they were in the
+ * file, a sixth of the size of the floats, which are only decoded on demand.
+ * savers for those formats write them back untouched when they can.
+ * anything that changes vertex3f or normal3f must drop these */
+	quantframe_t *quantframes; /* [model.total_frames] */
+	quantvert_t *quantverts; /* [model.total_frames * num_vertices], NULL if still in the file */
+
+/* when loaded by model_load_from_file, the frames stay in the mapped file
+ * (model.filemap) until they are first used, and the last few decoded are
+ * kept in framecache. nothing may write to that file in place meanwhile */
+	const quantvert_t **filequantverts; /* [model.total_frames], each frame's vertices in the file */
+	const int *filevertexmap; /* [num_vertices], which of the file's vertices each mesh vertex is */
+	struct mesh_framecache_s *framecache;
+
 	meshskin_t *skins; /* [model.total_skins] */
 
 	struct
@@ -123,13 +153,48 @@ typedef struct model_s
 	int flags; /* quake only */
 	int synctype; /* quake only, possible values: 0 (sync), 1 (rand) */
 	float offsets[3]; /* quake only, unused but i'm including it for completeness */
+
+	mem_pool_t *pool; /* arena the loader allocated the model's data from (NULL if none) */
+	filemap_t filemap; /* file the meshes' filequantverts point into (data is NULL if none) */
 } model_t;
 
+/* used by the loaders to turn triangle corners (a vertex position index plus
+ * texcoord information) into mesh vertices. formats with a texcoord index
+ * instead of s/t store it in s */
+typedef struct meshvert_s
+{
+	int vertex;
+	int s, t, back;
+} meshvert_t;
+
+typedef struct meshvert_map_s
+{
+	meshvert_t *meshverts; /* [num_meshverts], in order of first use */
+	int num_meshverts;
+
+	hashindex_t *hashindex;
+} meshvert_map_t;
+
+void meshvert_map_init(meshvert_map_t *map, mem_pool_t *pool, int max_meshverts);
+void meshvert_map_free(meshvert_map_t *map);
+int meshvert_map_add(meshvert_map_t *map, int vertex, int s, int t, int back);
+
 void mesh_initialize(model_t *model, mesh_t *mesh);
 void mesh_free(model_t *model, mesh_t *mesh);
 void mesh_generaterenderdata(model_t *model, mesh_t *mesh);
 void mesh_freerenderdata(model_t *model, mesh_t *mesh);
 
+/* one frame's positions or normals. if the mesh only has quantized vertices
+ * they are decoded into scratch (num_vertices xyz), otherwise it points into
+ * the mesh */
+const float *mesh_frame_vertex3f(const mesh_t *mesh, int offset, float *scratch);
+const float *mesh_frame_normal3f(const mesh_t *mesh, int offset, float *scratch);
+/* the same for quantized meshes' quantverts (scratch is num_vertices long) */
+const quantvert_t *mesh_frame_quantverts(const mesh_t *mesh, int offset, quantvert_t *scratch);
+/* fills in vertex3f and normal3f of all frames from the quantverts if needed */
+void mesh_decode_vertices(const model_t *model, mesh_t *mesh);
+void mesh_drop_quantized(mesh_t *mesh);
+
 void model_initialize(model_t *model);
 void model_free(model_t *model);
 void model_generaterenderdata(model_t *model);
@@ -137,9 +202,13 @@ void model_freerenderdata(model_t *model);
 
 void model_clear_skins(model_t *model);
 
+void model_decode_vertices(model_t *model);
+
 /* note that the filedata pointer is not const, because it may be modified (most likely by byteswapping) */
 bool_t model_load(const char *filename, void *filedata, size_t filesize, model_t *out_model, char **out_error);
+/* unlike model_load, this leaves frames in the file until they're used */
 model_t *model_load_from_file(const char *filename, char **out_error);
+bool_t model_can_load(const char *filename); /* by file extension */
 
 bool_t model_save(const char *filename, const model_t *model, char **out_error);
 
@@ -154,6 +223,9 @@ bool_t model_md2_save(const model_t *model, xbuf_t *xbuf, char **out_error);
 bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error);
 
 model_t *model_clone(const model_t *model);
+/* copy of frameinfo[first_frame] to frameinfo[first_frame + num_frames - 1],
+ * which only decodes those frames of a lazily loaded model */
+model_t *model_clone_frames(const model_t *model, int first_frame, int num_frames);
 
 model_t *model_merge_meshes(const model_t *model);
 
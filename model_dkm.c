@@ -142,12 +142,6 @@ typedef struct dmdl_s
 } dmdl_t;
 
 bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char **out_error) {
-	typedef struct dkm_meshvert_s
-	{
-		unsigned short vertex;
-		unsigned short texcoord;
-	} dkm_meshvert_t;
-
 	int					i, j, k;
 	dmdl_t				*pinmodel;
 	dtriangle_t			*pintri;
@@ -159,10 +153,13 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
 	frameinfo_t         *frameinfo;
     char                skin_name[MAX_SKINNAME+1];
     char                original_skin_name[MAX_SKINNAME+1];
-	dkm_meshvert_t      *meshverts;
+	meshvert_map_t      meshvert_map;
+	const meshvert_t    *meshverts;
 	unsigned char * const f = (unsigned char*)filedata;
 	float iwidth, iheight;
 	float *v, *n;
+	const quantvert_t **filequantverts;
+	int *vertexmap;
     image_rgba_t **images;
 
 	pinmodel = (dmdl_t *)filedata;
@@ -174,7 +171,7 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
 		return (void)(out_error && (*out_error = msprintf("wrong version (%i should be %i)", version, ALIAS_VERSION))), false;
 	}
 
-	pool = mem_create_pool();
+	pool = mem_create_arena();
 
 	// byte swap the header fields and sanity check
 	for (i=0 ; i<sizeof(dmdl_t)/4 ; i++)
@@ -204,6 +201,7 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
         /* this is a warning. FIXME - return warnings too, don't print them here */
             printf("dkm: failed to load image \"%s\": %s\n", skin_name, error);
         }
+        image_free(&image); /* only the tga is used */
         replace_extension(skin_name, ".bmp", ".tga");
         replace_extension(skin_name, ".wal", ".tga");
         replace_extension(skin_name, ".pcx", ".tga");
@@ -290,8 +288,6 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
 
 	pinsurface = (dsurface_t *) (f + pinmodel->ofs_surfaces);
 
-    meshverts = (dkm_meshvert_t*)mem_alloc(pool, sizeof(dkm_meshvert_t) * pinmodel->num_tris * 3);
-
     for (i = 0; i < model.num_meshes; i++, pinsurface++)
     {
         int num_tris;
@@ -350,7 +346,7 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
         mesh->triangle3i = (int*)mem_alloc(pool, sizeof(int) * num_tris * 3);
 
         mesh->num_triangles = 0;
-        mesh->num_vertices = 0;
+        meshvert_map_init(&meshvert_map, pool, num_tris * 3);
         pintri = (dtriangle_t *) (f + pinmodel->ofs_tris);
         for (j = 0; j < pinmodel->num_tris; j++,
                                   pintri = (dtriangle_t *) ((unsigned char *) pintri + sizeof (dtriangle_t) + ((pintri->num_uvframes - 1) * sizeof (dstframe_t))))
@@ -362,30 +358,16 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
 
             for (k = 0; k < 3; k++)
             {
-                int vertnum;
                 unsigned short xyz = pintri->index_xyz[k];
                 unsigned short st = pintri->stframes[0].index_st[k];
 
-                for (vertnum = 0; vertnum < mesh->num_vertices; vertnum++)
-                {
-                /* see if this xyz+st combination exists in the buffer yet */
-                    dkm_meshvert_t *mv = &meshverts[vertnum];
-
-                    if (mv->vertex == xyz && mv->texcoord == st)
-                        break;
-                }
-                if (vertnum == mesh->num_vertices)
-                {
-                /* it isn't in the list yet, add it */
-                    meshverts[vertnum].vertex = xyz;
-                    meshverts[vertnum].texcoord = st;
-                    mesh->num_vertices++;
-                }
-
-                mesh->triangle3i[mesh->num_triangles * 3 + k] = vertnum; /* (clockwise winding) */
+            /* one vertex per xyz+st combination */
+                mesh->triangle3i[mesh->num_triangles * 3 + k] = meshvert_map_add(&meshvert_map, xyz, st, 0, 0); /* (clockwise winding) */
             }
             mesh->num_triangles++;
         }
+        mesh->num_vertices = meshvert_map.num_meshverts;
+        meshverts = meshvert_map.meshverts;
 
     /* read texcoords */
         mesh->texcoord2f = (float*)mem_alloc(pool, sizeof(float) * mesh->num_vertices * 2);
@@ -393,43 +375,39 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
         iheight = 1.0f / pinsurface->skinheight;
         for (j = 0; j < mesh->num_vertices; j++)
         {
-            const dstvert_t *dstvert = (const dstvert_t*)(f + pinmodel->ofs_st) + meshverts[j].texcoord;
+            const dstvert_t *dstvert = (const dstvert_t*)(f + pinmodel->ofs_st) + meshverts[j].s;
             mesh->texcoord2f[j*2+0] = (LittleFloat(dstvert->s) + 0.5f) * iwidth;
             mesh->texcoord2f[j*2+1] = (LittleFloat(dstvert->t) + 0.5f) * iheight;
         }
 
     /* read frames */
-        v = mesh->vertex3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
-        n = mesh->normal3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
 	    if (version == ALIAS_VERSION)
         {
+        /* the vertices stay in the file until they're needed, dtrivertx_t is laid out as quantvert_t */
+            mesh->quantframes = (quantframe_t*)mem_alloc(pool, model.num_frames * sizeof(quantframe_t));
+            filequantverts = (const quantvert_t**)mem_alloc(pool, model.num_frames * sizeof(quantvert_t*));
             for (j = 0; j < model.num_frames; j++)
             {
                 const daliasframe_t *frame = (const daliasframe_t*)(f + pinmodel->ofs_frames + j * pinmodel->framesize);
-                const dtrivertx_t *vtxbase = (const dtrivertx_t*)(frame->verts);
-                float scale[3], translate[3];
 
                 for (k = 0; k < 3; k++)
                 {
-                    scale[k] = LittleFloat(frame->scale[k]);
-                    translate[k] = LittleFloat(frame->translate[k]);
+                    mesh->quantframes[j].scale[k] = LittleFloat(frame->scale[k]);
+                    mesh->quantframes[j].translate[k] = LittleFloat(frame->translate[k]);
                 }
 
-                for (k = 0; k < mesh->num_vertices; k++, v += 3, n += 3)
-                {
-                    const dtrivertx_t *vtx = vtxbase + meshverts[k].vertex;
-                    v[0] = translate[0] + scale[0] * vtx->v[0];
-                    v[1] = translate[1] + scale[1] * vtx->v[1];
-                    v[2] = translate[2] + scale[2] * vtx->v[2];
-
-                    n[0] = anorms[vtx->lightnormalindex][0];
-                    n[1] = anorms[vtx->lightnormalindex][1];
-                    n[2] = anorms[vtx->lightnormalindex][2];
-                }
+                filequantverts[j] = (const quantvert_t*)(frame->verts);
             }
+            mesh->filequantverts = filequantverts;
+            mesh->filevertexmap = vertexmap = (int*)mem_alloc(pool, sizeof(int) * mesh->num_vertices);
+            for (k = 0; k < mesh->num_vertices; k++)
+                vertexmap[k] = meshverts[k].vertex;
         }
         else
         {
+        /* 11/10/11 bit positions don't fit in quantverts, so these are decoded now */
+            v = mesh->vertex3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
+            n = mesh->normal3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
             for (j = 0; j < model.num_frames; j++)
             {
                 const daliasframe2_t *frame = (const daliasframe2_t*)(f + pinmodel->ofs_frames + j * pinmodel->framesize);
@@ -457,9 +435,10 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
                 }
             }
         }
+
+        meshvert_map_free(&meshvert_map);
     }
 
-    mem_free(meshverts);
     for (i = 0; i < model.num_skins; i++) {
         image_rgba_t *image;
 
@@ -473,7 +452,7 @@ bool_t model_dkm_load(void *filedata, size_t filesize, model_t *out_model, char
     }
     mem_free(images);
 
-    mem_merge_pool(pool);
+    model.pool = pool; /* the model owns the arena, freed in model_free */
 
     *out_model = model;
     return true;
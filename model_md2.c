@@ -22,12 +22,17 @@
 #include "anorms.h"
 #include "global.h"
 #include "model.h"
+#include "model_md2.h"
 #include "palettes.h"
+#include "thread.h"
 
-extern int texwidth, texheight;
-extern const char *g_skinpath;
+/* below this many vertices (over all frames), frames are quantized on the
+ * calling thread */
+#define MD2_MIN_THREADED_VERTICES 65536
 
-extern const float anorms[162][3];
+extern THREAD_LOCAL int texwidth, texheight;
+extern THREAD_LOCAL const char *g_skinpath;
+extern THREAD_LOCAL const char *g_skin_base_name;
 
 typedef struct md2_header_s
 {
@@ -59,40 +64,8 @@ typedef struct md2_skin_s
 	char name[64];
 } md2_skin_t;
 
-typedef struct dstvert_s
-{
-	short s;
-	short t;
-} dstvert_t;
-
-typedef struct dtriangle_s
-{
-	unsigned short index_xyz[3];
-	unsigned short index_st[3];
-} dtriangle_t;
-
-typedef struct dtrivertx_s
-{
-	unsigned char v[3];
-	unsigned char lightnormalindex;
-} dtrivertx_t;
-
-typedef struct daliasframe_s
-{
-	float scale[3];
-	float translate[3];
-	char name[16];
-/*	dtrivertx_t verts[1];*/
-} daliasframe_t;
-
 bool_t model_md2_load(void *filedata, size_t filesize, model_t *out_model, char **out_error)
 {
-	typedef struct md2_meshvert_s
-	{
-		unsigned short vertex;
-		unsigned short texcoord;
-	} md2_meshvert_t;
-
 	unsigned char * const f = (unsigned char*)filedata;
 	mem_pool_t *pool;
 	md2_header_t *header;
@@ -101,9 +74,10 @@ bool_t model_md2_load(void *filedata, size_t filesize, model_t *out_model, char
 	mesh_t *mesh;
 	skininfo_t *skininfo;
 	frameinfo_t *frameinfo;
-	md2_meshvert_t *meshverts;
+	meshvert_map_t meshvert_map;
 	float iwidth, iheight;
-	float *v, *n;
+	const quantvert_t **filequantverts;
+	int *vertexmap;
 
 	header = (md2_header_t*)f;
 
@@ -113,7 +87,7 @@ bool_t model_md2_load(void *filedata, size_t filesize, model_t *out_model, char
 	if (LittleLong(header->version) != 8)
 		return (void)(out_error && (*out_error = msprintf("wrong format (version not 8)"))), false;
 
-	pool = mem_create_pool();
+	pool = mem_create_arena();
 
 /* byteswap file */
 	header->version       = LittleLong(header->version);
@@ -210,37 +184,21 @@ bool_t model_md2_load(void *filedata, size_t filesize, model_t *out_model, char
 	mesh->num_triangles = header->num_tris;
 	mesh->triangle3i = (int*)mem_alloc(pool, sizeof(int) * mesh->num_triangles * 3);
 
-	mesh->num_vertices = 0;
-	meshverts = (md2_meshvert_t*)mem_alloc(pool, sizeof(md2_meshvert_t) * mesh->num_triangles * 3);
+	meshvert_map_init(&meshvert_map, pool, mesh->num_triangles * 3);
 	for (i = 0; i < mesh->num_triangles; i++)
 	{
 		const dtriangle_t *dtriangle = (const dtriangle_t*)(f + header->offset_tris) + i;
 
 		for (j = 0; j < 3; j++)
 		{
-			int vertnum;
 			unsigned short xyz = LittleShort(dtriangle->index_xyz[j]);
 			unsigned short st = LittleShort(dtriangle->index_st[j]);
 
-			for (vertnum = 0; vertnum < mesh->num_vertices; vertnum++)
-			{
-			/* see if this xyz+st combination exists in the buffer yet */
-				md2_meshvert_t *mv = &meshverts[vertnum];
-
-				if (mv->vertex == xyz && mv->texcoord == st)
-					break;
-			}
-			if (vertnum == mesh->num_vertices)
-			{
-			/* it isn't in the list yet, add it */
-				meshverts[vertnum].vertex = xyz;
-				meshverts[vertnum].texcoord = st;
-				mesh->num_vertices++;
-			}
-
-			mesh->triangle3i[i * 3 + j] = vertnum; /* (clockwise winding) */
+		/* one vertex per xyz+st combination */
+			mesh->triangle3i[i * 3 + j] = meshvert_map_add(&meshvert_map, xyz, st, 0, 0); /* (clockwise winding) */
 		}
 	}
+	mesh->num_vertices = meshvert_map.num_meshverts;
 
 /* read texcoords */
 	mesh->texcoord2f = (float*)mem_alloc(pool, sizeof(float) * mesh->num_vertices * 2);
@@ -248,52 +206,49 @@ bool_t model_md2_load(void *filedata, size_t filesize, model_t *out_model, char
 	iheight = 1.0f / header->skinheight;
 	for (i = 0; i < mesh->num_vertices; i++)
 	{
-		const dstvert_t *dstvert = (const dstvert_t*)(f + header->offset_st) + meshverts[i].texcoord;
+		const dstvert_t *dstvert = (const dstvert_t*)(f + header->offset_st) + meshvert_map.meshverts[i].s;
 		mesh->texcoord2f[i*2+0] = (LittleFloat(dstvert->s) + 0.5f) * iwidth;
 		mesh->texcoord2f[i*2+1] = (LittleFloat(dstvert->t) + 0.5f) * iheight;
 	}
 
-/* read frames */
-	v = mesh->vertex3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
-	n = mesh->normal3f = (float*)mem_alloc(pool, model.num_frames * sizeof(float) * mesh->num_vertices * 3);
+/* read frames, leaving the vertices in the file until they're needed (dtrivertx_t is laid out as quantvert_t) */
+	mesh->quantframes = (quantframe_t*)mem_alloc(pool, model.num_frames * sizeof(quantframe_t));
+	filequantverts = (const quantvert_t**)mem_alloc(pool, model.num_frames * sizeof(quantvert_t*));
 	for (i = 0; i < model.num_frames; i++)
 	{
 		const daliasframe_t *frame = (const daliasframe_t*)(f + header->offset_frames + i * header->framesize);
-		const dtrivertx_t *vtxbase = (const dtrivertx_t*)(frame + 1);
-		float scale[3], translate[3];
 
 		for (j = 0; j < 3; j++)
 		{
-			scale[j] = LittleFloat(frame->scale[j]);
-			translate[j] = LittleFloat(frame->translate[j]);
+			mesh->quantframes[i].scale[j] = LittleFloat(frame->scale[j]);
+			mesh->quantframes[i].translate[j] = LittleFloat(frame->translate[j]);
 		}
 
-		for (j = 0; j < mesh->num_vertices; j++, v += 3, n += 3)
-		{
-			const dtrivertx_t *vtx = vtxbase + meshverts[j].vertex;
-			v[0] = translate[0] + scale[0] * vtx->v[0];
-			v[1] = translate[1] + scale[1] * vtx->v[1];
-			v[2] = translate[2] + scale[2] * vtx->v[2];
-
-			n[0] = anorms[vtx->lightnormalindex][0];
-			n[1] = anorms[vtx->lightnormalindex][1];
-			n[2] = anorms[vtx->lightnormalindex][2];
-		}
+		filequantverts[i] = (const quantvert_t*)(frame + 1);
 	}
+	mesh->filequantverts = filequantverts;
+	mesh->filevertexmap = vertexmap = (int*)mem_alloc(pool, sizeof(int) * mesh->num_vertices);
+	for (i = 0; i < mesh->num_vertices; i++)
+		vertexmap[i] = meshvert_map.meshverts[i].vertex;
 
-	mem_free(meshverts);
+	meshvert_map_free(&meshvert_map);
 
-	mem_merge_pool(pool);
+	model.pool = pool; /* the model owns the arena, freed in model_free */
 
 	*out_model = model;
 	return true;
 }
 
-static char *md2_create_skin_filename(const char *skinname)
+static char *md2_create_skin_filename(const model_t *model, int skinnum)
 {
+	const char *skinname = model->skininfo[skinnum].skins[0].name;
 	char temp[1024];
 	char *c;
 
+/* a custom name replaces the path too, like for md3 */
+	if (g_skin_base_name && g_skin_base_name[0])
+		return model->num_skins == 1 ? msprintf("%s.pcx", g_skin_base_name) : msprintf("%s%d.pcx", g_skin_base_name, skinnum);
+
 /* in case skinname is already a file path, strip path and extension (so "models/something/skin.pcx" becomes "skin") */
 	if ((c = strrchr(skinname, '/')))
 		strcpy(temp, c + 1);
@@ -309,33 +264,20 @@ static char *md2_create_skin_filename(const char *skinname)
 		return msprintf("%s.pcx", temp);
 }
 
-typedef struct md2_data_s
-{
-	dstvert_t *texcoords; /* [numtexcoords] */
-	int numtexcoords; /* <= mesh->num_vertices */
-	int *texcoord_lookup; /* [mesh->num_vertices] */
-
-	daliasframe_t *frames; /* [model->num_frames] */
-
-	dtrivertx_t *original_vertices; /* [mesh->num_vertices * model->num_frames] */
-
-	int *vertices; /* [numvertices] ; index into original_vertices */
-	int numvertices;
-	int *vertex_lookup; /* [mesh->num_vertices] index into vertices */
-} md2_data_t;
-
-static md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh, int skinwidth, int skinheight)
+/* the unique texcoords keep the order of their first use, so the output is the
+ * same as comparing against every texcoord seen so far */
+void md2_weld_texcoords(md2_data_t *data, const mesh_t *mesh, int skinwidth, int skinheight)
 {
-	md2_data_t *data;
-	int i, j, k;
-
-	data = (md2_data_t*)qmalloc(sizeof(md2_data_t));
+	hashindex_t *hashindex;
+	unsigned int key;
+	int i, j;
 
-/* convert texcoords to integer and combine duplicates */
 	data->texcoords = (dstvert_t*)qmalloc(sizeof(dstvert_t) * mesh->num_vertices);
 	data->numtexcoords = 0;
 	data->texcoord_lookup = (int*)qmalloc(sizeof(int) * mesh->num_vertices);
 
+	hashindex = hashindex_create(mesh->num_vertices, mesh->num_vertices);
+
 	for (i = 0; i < mesh->num_vertices; i++)
 	{
 		dstvert_t md2texcoord;
@@ -343,24 +285,109 @@ static md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh
 		md2texcoord.s = (int)(mesh->texcoord2f[i*2+0] * skinwidth);
 		md2texcoord.t = (int)(mesh->texcoord2f[i*2+1] * skinheight);
 
-		for (j = 0; j < data->numtexcoords; j++)
+		key = hash_data(&md2texcoord, sizeof(dstvert_t), 0);
+
+		for (j = hashindex_first(hashindex, key); j != -1; j = hashindex_next(hashindex, j))
 			if (md2texcoord.s == data->texcoords[j].s && md2texcoord.t == data->texcoords[j].t)
 				break;
-		if (j == data->numtexcoords)
-			data->texcoords[data->numtexcoords++] = md2texcoord;
+		if (j == -1)
+		{
+			j = data->numtexcoords++;
+			data->texcoords[j] = md2texcoord;
+			hashindex_add(hashindex, key, j);
+		}
 		data->texcoord_lookup[i] = j;
 	}
 
-/* compress vertices */
-	data->frames = (daliasframe_t*)qmalloc(sizeof(daliasframe_t) * model->num_frames);
-	data->original_vertices = (dtrivertx_t*)qmalloc(sizeof(dtrivertx_t) * mesh->num_vertices * model->num_frames);
+	hashindex_free(hashindex);
+}
 
-	for (i = 0; i < model->num_frames; i++)
+/* vertices are only combined if they match in every frame. the hash covers the
+ * vertex's whole run of compressed frames in original_vertices */
+void md2_weld_vertices(md2_data_t *data, int num_vertices, int num_frames)
+{
+	hashindex_t *hashindex;
+	unsigned int key;
+	int i, j;
+
+	data->vertices = (int*)qmalloc(sizeof(int) * num_vertices);
+	data->numvertices = 0;
+	data->vertex_lookup = (int*)qmalloc(sizeof(int) * num_vertices);
+
+	hashindex = hashindex_create(num_vertices, num_vertices);
+
+	for (i = 0; i < num_vertices; i++)
 	{
-		daliasframe_t *md2frame = &data->frames[i];
-		const float *v, *n;
+		const dtrivertx_t *v1 = data->original_vertices + i * num_frames;
+
+		key = hash_data(v1, sizeof(dtrivertx_t) * num_frames, 0);
+
+	/* see if a vertex at this position already exists */
+		for (j = hashindex_first(hashindex, key); j != -1; j = hashindex_next(hashindex, j))
+			if (!memcmp(v1, data->original_vertices + data->vertices[j] * num_frames, sizeof(dtrivertx_t) * num_frames))
+				break;
+		if (j == -1)
+		{
+		/* no match, add this one */
+			j = data->numvertices++;
+			data->vertices[j] = i;
+			hashindex_add(hashindex, key, j);
+		}
+		data->vertex_lookup[i] = j;
+	}
+
+	hashindex_free(hashindex);
+}
+
+typedef struct md2_quantize_job_s
+{
+	const model_t *model;
+	const mesh_t *mesh;
+	md2_data_t *data;
+	int frames_per_job;
+} md2_quantize_job_t;
+
+/* scale, translate and compressed vertices for a run of frames. each frame
+ * only writes its own slots, so the result doesn't depend on the order the
+ * jobs run in */
+static void md2_quantize_frames(void *data, int job)
+{
+	const md2_quantize_job_t *qj = (const md2_quantize_job_t*)data;
+	const model_t *model = qj->model;
+	const mesh_t *mesh = qj->mesh;
+	const int first_frame = job * qj->frames_per_job;
+	const int last_frame = min(first_frame + qj->frames_per_job, model->num_frames);
+	unsigned char *normalindices = (unsigned char*)qmalloc(mesh->num_vertices);
+	quantvert_t *scratch = (quantvert_t*)qmalloc(sizeof(quantvert_t) * max(mesh->num_vertices, 1));
+	int i, j, k;
+
+	for (i = first_frame; i < last_frame; i++)
+	{
+		daliasframe_t *md2frame = &qj->data->frames[i];
+		const float *v;
 		float mins[3], maxs[3], iscale[3];
 
+	/* already quantized, keep it as it was so it doesn't drift */
+		if (mesh->quantframes)
+		{
+			const int offset = model->frameinfo[i].frames[0].offset;
+			const quantvert_t *qv = mesh_frame_quantverts(mesh, offset, scratch);
+
+			VectorCopy(md2frame->scale, mesh->quantframes[offset].scale);
+			VectorCopy(md2frame->translate, mesh->quantframes[offset].translate);
+
+			for (j = 0; j < mesh->num_vertices; j++, qv++)
+			{
+				dtrivertx_t *md2vertex = &qj->data->original_vertices[j * model->num_frames + i];
+
+				md2vertex->v[0] = qv->v[0];
+				md2vertex->v[1] = qv->v[1];
+				md2vertex->v[2] = qv->v[2];
+				md2vertex->lightnormalindex = qv->normalindex;
+			}
+			continue;
+		}
+
 	/* calculate bounds of frame */
 		VectorClear(mins);
 		VectorClear(maxs);
@@ -384,10 +411,10 @@ static md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh
 
 	/* compress vertices */
 		v = mesh->vertex3f + model->frameinfo[i].frames[0].offset * mesh->num_vertices * 3;
-		n = mesh->normal3f + model->frameinfo[i].frames[0].offset * mesh->num_vertices * 3;
-		for (j = 0; j < mesh->num_vertices; j++, v += 3, n += 3)
+		compress_normals(mesh->normal3f + model->frameinfo[i].frames[0].offset * mesh->num_vertices * 3, mesh->num_vertices, normalindices);
+		for (j = 0; j < mesh->num_vertices; j++, v += 3)
 		{
-			dtrivertx_t *md2vertex = &data->original_vertices[j * model->num_frames + i];
+			dtrivertx_t *md2vertex = &qj->data->original_vertices[j * model->num_frames + i];
 
 			for (k = 0; k < 3; k++)
 			{
@@ -399,42 +426,51 @@ static md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh
 				md2vertex->v[k] = (unsigned char)pos;
 			}
 
-			md2vertex->lightnormalindex = compress_normal(n);
+			md2vertex->lightnormalindex = normalindices[j];
 		}
 	}
 
-/* combine duplicate vertices */
-	data->vertices = (int*)qmalloc(sizeof(int) * mesh->num_vertices);
-	data->numvertices = 0;
-	data->vertex_lookup = (int*)qmalloc(sizeof(int) * mesh->num_vertices);
+	qfree(scratch);
+	qfree(normalindices);
+}
 
-	for (i = 0; i < mesh->num_vertices; i++)
-	{
-		const dtrivertx_t *v1 = data->original_vertices + i * model->num_frames;
+md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh, int skinwidth, int skinheight)
+{
+	md2_data_t *data;
+	md2_quantize_job_t qj;
+	int num_jobs;
 
-	/* see if a vertex at this position already exists */
-		for (j = 0; j < data->numvertices; j++)
-		{
-			const dtrivertx_t *v2 = data->original_vertices + data->vertices[j] * model->num_frames;
+	data = (md2_data_t*)qmalloc(sizeof(md2_data_t));
 
-			for (k = 0; k < model->num_frames; k++)
-				if (v1[k].v[0] != v2[k].v[0] || v1[k].v[1] != v2[k].v[1] || v1[k].v[2] != v2[k].v[2] || v1[k].lightnormalindex != v2[k].lightnormalindex)
-					break;
-			if (k == model->num_frames)
-				break;
-		}
-		if (j == data->numvertices)
-		{
-		/* no match, add this one */
-			data->vertices[data->numvertices++] = i;
-		}
-		data->vertex_lookup[i] = j;
+/* convert texcoords to integer and combine duplicates */
+	md2_weld_texcoords(data, mesh, skinwidth, skinheight);
+
+/* compress vertices */
+	data->frames = (daliasframe_t*)qmalloc(sizeof(daliasframe_t) * model->num_frames);
+	data->original_vertices = (dtrivertx_t*)qmalloc(sizeof(dtrivertx_t) * mesh->num_vertices * model->num_frames);
+
+	if (model->num_frames)
+	{
+	/* a few jobs per worker, so uneven progress evens out */
+		qj.model = model;
+		qj.mesh = mesh;
+		qj.data = data;
+		num_jobs = min(model->num_frames, thread_num_workers() * 4);
+		if ((size_t)mesh->num_vertices * model->num_frames < MD2_MIN_THREADED_VERTICES)
+			num_jobs = 1;
+		qj.frames_per_job = (model->num_frames + num_jobs - 1) / num_jobs;
+		num_jobs = (model->num_frames + qj.frames_per_job - 1) / qj.frames_per_job;
+
+		thread_run(num_jobs, md2_quantize_frames, &qj);
 	}
 
+/* combine duplicate vertices */
+	md2_weld_vertices(data, mesh->num_vertices, model->num_frames);
+
 	return data;
 }
 
-static void md2_free_data(md2_data_t *data)
+void md2_free_data(md2_data_t *data)
 {
 	qfree(data->texcoords);
 	qfree(data->texcoord_lookup);
@@ -445,188 +481,235 @@ static void md2_free_data(md2_data_t *data)
 	qfree(data);
 }
 
-/* md2 glcmds generation, taken from quake2 source (models.c) */
+/* md2 glcmds generation, originally from the quake2 source (models.c). this
+ * makes the same strips and fans, but finds the next triangle through a table
+ * of edges instead of rescanning the triangles, and keeps its state in
+ * md2_stripper_t so that several models can be converted at once */
+
+typedef struct md2_stripper_s
+{
+	const dtriangle_t *triangles;
+	int num_tris;
 
-static int commands[16384];
-static int numcommands;
-static int *used;
+/* directed edges (index_xyz and index_st of both ends) get ids. each corner's
+ * edge runs from it to the next corner. edge_corners lists the corners of
+ * each edge in triangle order, from edge_first[id] to edge_first[id+1] */
+	int *reverse_edge; /* per corner, id of the edge going the other way (-1 if there is none) */
+	int *edge_first;
+	int *edge_corners;
+	int *edge_cursor; /* per edge, skips the corners of triangles before the current start triangle */
 
-static int strip_xyz[128];
-static int strip_st[128];
-static int strip_tris[128];
-static int stripcount;
+	unsigned char *used; /* 1 when in a strip or fan, 2 while trying one out */
 
-static dtriangle_t *triangles;
-static int num_tris;
+	int *strip_xyz, *strip_st, *strip_tris;
+	int stripcount;
+} md2_stripper_t;
 
-static int md2_strip_length(int starttri, int startv)
+static void md2_edge_key(const dtriangle_t *triangle, int from, int to, int key[4])
 {
-	int m1, m2;
-	int st1, st2;
-	int j;
-	dtriangle_t *last, *check;
-	int k;
-
-	used[starttri] = 2;
-
-	last = &triangles[starttri];
-
-	strip_xyz[0] = last->index_xyz[(startv  )%3];
-	strip_xyz[1] = last->index_xyz[(startv+1)%3];
-	strip_xyz[2] = last->index_xyz[(startv+2)%3];
-	strip_st[0] = last->index_st[(startv  )%3];
-	strip_st[1] = last->index_st[(startv+1)%3];
-	strip_st[2] = last->index_st[(startv+2)%3];
-
-	strip_tris[0] = starttri;
-	stripcount = 1;
-
-	m1 = last->index_xyz[(startv+2)%3];
-	st1 = last->index_st[(startv+2)%3];
-	m2 = last->index_xyz[(startv+1)%3];
-	st2 = last->index_st[(startv+1)%3];
-
-/* look for a matching triangle */
-nexttri:
-	for (j = starttri + 1, check = &triangles[starttri + 1]; j < num_tris; j++, check++)
+	key[0] = triangle->index_xyz[from];
+	key[1] = triangle->index_st[from];
+	key[2] = triangle->index_xyz[to];
+	key[3] = triangle->index_st[to];
+}
+
+static void md2_build_edges(md2_stripper_t *stripper)
+{
+	const int num_corners = stripper->num_tris * 3;
+	hashindex_t *hashindex;
+	int *edge_ids, *edge_keys;
+	int num_edges, i, j, key[4];
+	unsigned int hash;
+
+	edge_ids = (int*)qmalloc(sizeof(int) * num_corners);
+	edge_keys = (int*)qmalloc(sizeof(int[4]) * num_corners);
+
+/* give each distinct edge an id, edge_keys[id] being the first corner with it */
+	hashindex = hashindex_create(num_corners, num_corners);
+	num_edges = 0;
+
+	for (i = 0; i < num_corners; i++)
 	{
-		for (k = 0; k < 3; k++)
+		md2_edge_key(&stripper->triangles[i / 3], i % 3, (i + 1) % 3, key);
+		hash = hash_data(key, sizeof(key), 0);
+
+		for (j = hashindex_first(hashindex, hash); j != -1; j = hashindex_next(hashindex, j))
+			if (!memcmp(key, edge_keys + j * 4, sizeof(key)))
+				break;
+		if (j == -1)
 		{
-			if (check->index_xyz[k] != m1)
-				continue;
-			if (check->index_st[k] != st1)
-				continue;
-			if (check->index_xyz[(k+1)%3] != m2)
-				continue;
-			if (check->index_st[(k+1)%3] != st2)
-				continue;
-
-		/* this is the next part of the fan */
-
-		/* if we can't use this triangle, this tristrip is done */
-			if (used[j])
-				goto done;
-
-		/* the new edge */
-			if (stripcount & 1)
-			{
-				m2 = check->index_xyz[(k+2)%3];
-				st2 = check->index_st[(k+2)%3];
-			}
-			else
-			{
-				m1 = check->index_xyz[(k+2)%3];
-				st1 = check->index_st[(k+2)%3];
-			}
+			j = num_edges++;
+			memcpy(edge_keys + j * 4, key, sizeof(key));
+			hashindex_add(hashindex, hash, j);
+		}
+		edge_ids[i] = j;
+	}
 
-			strip_xyz[stripcount+2] = check->index_xyz[(k+2)%3];
-			strip_st[stripcount+2] = check->index_st[(k+2)%3];
-			strip_tris[stripcount] = j;
-			stripcount++;
+	for (i = 0; i < num_corners; i++)
+	{
+		md2_edge_key(&stripper->triangles[i / 3], (i + 1) % 3, i % 3, key);
+		hash = hash_data(key, sizeof(key), 0);
 
-			used[j] = 2;
-			goto nexttri;
-		}
+		for (j = hashindex_first(hashindex, hash); j != -1; j = hashindex_next(hashindex, j))
+			if (!memcmp(key, edge_keys + j * 4, sizeof(key)))
+				break;
+		stripper->reverse_edge[i] = j;
 	}
-done:
 
-/* clear the temp used flags */
-	for (j = starttri + 1; j < num_tris; j++)
-		if (used[j] == 2)
-			used[j] = 0;
+	hashindex_free(hashindex);
+
+/* bucket the corners by edge, keeping them in order */
+	stripper->edge_first = (int*)qmalloc(sizeof(int) * (num_edges + 1));
+	stripper->edge_corners = (int*)qmalloc(sizeof(int) * num_corners);
+	stripper->edge_cursor = (int*)qmalloc(sizeof(int) * num_edges);
+
+	memset(stripper->edge_first, 0, sizeof(int) * (num_edges + 1));
+	for (i = 0; i < num_corners; i++)
+		stripper->edge_first[edge_ids[i] + 1]++;
+	for (i = 0; i < num_edges; i++)
+		stripper->edge_first[i + 1] += stripper->edge_first[i];
 
-	return stripcount;
+	memcpy(stripper->edge_cursor, stripper->edge_first, sizeof(int) * num_edges);
+	for (i = 0; i < num_corners; i++)
+		stripper->edge_corners[stripper->edge_cursor[edge_ids[i]]++] = i;
+	memcpy(stripper->edge_cursor, stripper->edge_first, sizeof(int) * num_edges);
+
+	qfree(edge_keys);
+	qfree(edge_ids);
 }
 
-static int md2_fan_length(int starttri, int startv)
+/* the first corner after starttri's triangle that has the given edge, or -1.
+ * start triangles only ever increase, so the cursor never needs to go back */
+static int md2_find_edge(md2_stripper_t *stripper, int edge, int starttri)
 {
-	int m1, m2;
-	int st1, st2;
-	int j;
-	dtriangle_t *last, *check;
-	int k;
-
-	used[starttri] = 2;
+	int *cursor;
 
-	last = &triangles[starttri];
+	if (edge < 0)
+		return -1;
 
-	strip_xyz[0] = last->index_xyz[(startv  )%3];
-	strip_xyz[1] = last->index_xyz[(startv+1)%3];
-	strip_xyz[2] = last->index_xyz[(startv+2)%3];
-	strip_st[0] = last->index_st[(startv  )%3];
-	strip_st[1] = last->index_st[(startv+1)%3];
-	strip_st[2] = last->index_st[(startv+2)%3];
+	for (cursor = &stripper->edge_cursor[edge]; *cursor < stripper->edge_first[edge + 1]; (*cursor)++)
+		if (stripper->edge_corners[*cursor] / 3 > starttri)
+			return stripper->edge_corners[*cursor];
 
-	strip_tris[0] = starttri;
-	stripcount = 1;
+	return -1;
+}
 
-	m1 = last->index_xyz[(startv+0)%3];
-	st1 = last->index_st[(startv+0)%3];
-	m2 = last->index_xyz[(startv+2)%3];
-	st2 = last->index_st[(startv+2)%3];
+static void md2_begin_strip(md2_stripper_t *stripper, int starttri, int startv)
+{
+	const dtriangle_t *last = &stripper->triangles[starttri];
+	int i;
 
+	stripper->used[starttri] = 2;
 
-/* look for a matching triangle */
-nexttri:
-	for (j = starttri + 1, check = &triangles[starttri + 1]; j < num_tris; j++, check++)
+	for (i = 0; i < 3; i++)
 	{
-		for (k = 0; k < 3; k++)
-		{
-			if (check->index_xyz[k] != m1)
-				continue;
-			if (check->index_st[k] != st1)
-				continue;
-			if (check->index_xyz[(k+1)%3] != m2)
-				continue;
-			if (check->index_st[(k+1)%3] != st2)
-				continue;
-
-		/* this is the next part of the fan */
-
-		/* if we can't use this triangle, this tristrip is done */
-			if (used[j])
-				goto done;
-
-		/* the new edge */
-			m2 = check->index_xyz[(k+2)%3];
-			st2 = check->index_st[(k+2)%3];
-
-			strip_xyz[stripcount+2] = m2;
-			strip_st[stripcount+2] = st2;
-			strip_tris[stripcount] = j;
-			stripcount++;
-
-			used[j] = 2;
-			goto nexttri;
-		}
+		stripper->strip_xyz[i] = last->index_xyz[(startv+i)%3];
+		stripper->strip_st[i] = last->index_st[(startv+i)%3];
 	}
-done:
+
+	stripper->strip_tris[0] = starttri;
+	stripper->stripcount = 1;
+}
+
+/* add the triangle with the given corner to the strip, returns false if it's taken */
+static bool_t md2_add_to_strip(md2_stripper_t *stripper, int corner)
+{
+	const dtriangle_t *check = &stripper->triangles[corner / 3];
+	int k = corner % 3;
+
+	if (stripper->used[corner / 3])
+		return false;
+
+	stripper->strip_xyz[stripper->stripcount+2] = check->index_xyz[(k+2)%3];
+	stripper->strip_st[stripper->stripcount+2] = check->index_st[(k+2)%3];
+	stripper->strip_tris[stripper->stripcount] = corner / 3;
+	stripper->stripcount++;
+
+	stripper->used[corner / 3] = 2;
+	return true;
+}
 
 /* clear the temp used flags */
-	for (j = starttri + 1; j < num_tris; j++)
-		if (used[j] == 2)
-			used[j] = 0;
+static void md2_end_strip(md2_stripper_t *stripper)
+{
+	int i;
 
-	return stripcount;
+	for (i = 1; i < stripper->stripcount; i++)
+		stripper->used[stripper->strip_tris[i]] = 0;
 }
 
-static void md2_build_glcmds(const dstvert_t *texcoords, int skinwidth, int skinheight)
+static int md2_strip_length(md2_stripper_t *stripper, int starttri, int startv)
 {
+	int corner, edge;
+
+	md2_begin_strip(stripper, starttri, startv);
+
+/* the next triangle has to share the last edge, running the other way */
+	edge = stripper->reverse_edge[starttri * 3 + (startv+1)%3];
+
+	while ((corner = md2_find_edge(stripper, edge, starttri)) != -1 && md2_add_to_strip(stripper, corner))
+	{
+	/* the new edge alternates sides */
+		if (stripper->stripcount & 1)
+			edge = stripper->reverse_edge[corner - corner % 3 + (corner % 3 + 1) % 3];
+		else
+			edge = stripper->reverse_edge[corner - corner % 3 + (corner % 3 + 2) % 3];
+	}
+
+	md2_end_strip(stripper);
+
+	return stripper->stripcount;
+}
+
+static int md2_fan_length(md2_stripper_t *stripper, int starttri, int startv)
+{
+	int corner, edge;
+
+	md2_begin_strip(stripper, starttri, startv);
+
+/* every triangle shares the first vertex */
+	edge = stripper->reverse_edge[starttri * 3 + (startv+2)%3];
+
+	while ((corner = md2_find_edge(stripper, edge, starttri)) != -1 && md2_add_to_strip(stripper, corner))
+		edge = stripper->reverse_edge[corner - corner % 3 + (corner % 3 + 2) % 3];
+
+	md2_end_strip(stripper);
+
+	return stripper->stripcount;
+}
+
+void md2_build_glcmds(md2_glcmds_t *glcmds, const dtriangle_t *triangles, int num_tris, const dstvert_t *texcoords, int skinwidth, int skinheight)
+{
+	md2_stripper_t stripper;
 	int i, j;
 	int startv;
 	int len, bestlen, besttype = -1;
-	int best_xyz[1024];
-	int best_st[1024];
-	int best_tris[1024];
+	int *best_xyz, *best_st, *best_tris;
 	int type;
 
-	numcommands = 0;
-	used = (int*)qmalloc(sizeof(int) * num_tris);
-	memset(used, 0, sizeof(int) * num_tris);
+	memset(glcmds, 0, sizeof(*glcmds));
+
+/* a strip or fan of n triangles takes 3 * (n + 2) + 1 ints, at most 10 per triangle */
+	glcmds->commands = (int*)qmalloc(sizeof(int) * (num_tris * 10 + 1));
+
+	stripper.triangles = triangles;
+	stripper.num_tris = num_tris;
+	stripper.reverse_edge = (int*)qmalloc(sizeof(int) * num_tris * 3);
+	stripper.used = (unsigned char*)qmalloc(num_tris);
+	stripper.strip_xyz = (int*)qmalloc(sizeof(int) * (num_tris + 2) * 6);
+	stripper.strip_st = stripper.strip_xyz + (num_tris + 2);
+	stripper.strip_tris = stripper.strip_st + (num_tris + 2);
+	best_xyz = stripper.strip_tris + (num_tris + 2);
+	best_st = best_xyz + (num_tris + 2);
+	best_tris = best_st + (num_tris + 2);
+
+	memset(stripper.used, 0, num_tris);
+	md2_build_edges(&stripper);
+
 	for (i = 0; i < num_tris; i++)
 	{
 	/* pick an unused triangle and start the trifan */
-		if (used[i])
+		if (stripper.used[i])
 			continue;
 
 		bestlen = 0;
@@ -635,48 +718,72 @@ static void md2_build_glcmds(const dstvert_t *texcoords, int skinwidth, int skin
 			for (startv = 0; startv < 3; startv++)
 			{
 				if (type == 1)
-					len = md2_strip_length(i, startv);
+					len = md2_strip_length(&stripper, i, startv);
 				else
-					len = md2_fan_length(i, startv);
+					len = md2_fan_length(&stripper, i, startv);
 
 				if (len > bestlen)
 				{
 					besttype = type;
 					bestlen = len;
-					for (j = 0; j < bestlen + 2; j++)
-					{
-						best_st[j] = strip_st[j];
-						best_xyz[j] = strip_xyz[j];
-					}
-					for (j = 0; j < bestlen; j++)
-						best_tris[j] = strip_tris[j];
+					memcpy(best_st, stripper.strip_st, sizeof(int) * (bestlen + 2));
+					memcpy(best_xyz, stripper.strip_xyz, sizeof(int) * (bestlen + 2));
+					memcpy(best_tris, stripper.strip_tris, sizeof(int) * bestlen);
 				}
 			}
 		}
 
 	/* mark the tris on the best strip/fan as used */
 		for (j = 0; j < bestlen; j++)
-			used[best_tris[j]] = 1;
+			stripper.used[best_tris[j]] = 1;
 
 		if (besttype == 1)
-			commands[numcommands++] = (bestlen+2);
+		{
+			glcmds->commands[glcmds->num_commands++] = (bestlen+2);
+			glcmds->num_strips++;
+			glcmds->num_strip_tris += bestlen;
+		}
 		else
-			commands[numcommands++] = -(bestlen+2);
+		{
+			glcmds->commands[glcmds->num_commands++] = -(bestlen+2);
+			glcmds->num_fans++;
+			glcmds->num_fan_tris += bestlen;
+		}
+		glcmds->num_verts += bestlen + 2;
 
 		for (j = 0; j < bestlen + 2; j++)
 		{
 			union { float f; int i; } u;
 			u.f = (texcoords[best_st[j]].s + 0.5f) / skinwidth;
-			commands[numcommands++] = u.i;
+			glcmds->commands[glcmds->num_commands++] = u.i;
 			u.f = (texcoords[best_st[j]].t + 0.5f) / skinheight;
-			commands[numcommands++] = u.i;
-			commands[numcommands++] = best_xyz[j];
+			glcmds->commands[glcmds->num_commands++] = u.i;
+			glcmds->commands[glcmds->num_commands++] = best_xyz[j];
 		}
 	}
 
-	commands[numcommands++] = 0; /* end of list marker */
+	glcmds->commands[glcmds->num_commands++] = 0; /* end of list marker */
 
-	qfree(used);
+	qfree(stripper.strip_xyz);
+	qfree(stripper.used);
+	qfree(stripper.reverse_edge);
+	qfree(stripper.edge_first);
+	qfree(stripper.edge_corners);
+	qfree(stripper.edge_cursor);
+}
+
+/* frees an array of 8-bit skins, some of which may be the same */
+static void md2_free_skin_images(image_paletted_t **pimages, int num_skins)
+{
+	int i, j;
+
+	for (i = 0; i < num_skins; i++)
+	{
+		for (j = 0; j < i && pimages[j] != pimages[i]; j++);
+		if (j == i)
+			qfree(pimages[i]);
+	}
+	qfree(pimages);
 }
 
 bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
@@ -684,11 +791,14 @@ bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 	char *error;
 	int skinwidth, skinheight;
 	char **skinfilenames;
+	image_paletted_t **pimages;
 	const skininfo_t *skininfo;
 	model_t *model;
 	const mesh_t *mesh;
 	md2_data_t *md2data;
-	md2_header_t *header;
+	md2_header_t header;
+	size_t header_offset;
+	md2_glcmds_t glcmds;
 	dtriangle_t *dtriangles;
 	int i, j, k;
 
@@ -740,62 +850,75 @@ bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		return false;
 	}
 
-/* create 8-bit skins and save them to PCX files */
+/* create 8-bit skins and save them to PCX files. skins that are the same as
+ * an earlier one reuse its 8-bit image, and aren't written again if they
+ * have the same name too */
 	skinfilenames = (char**)qmalloc(sizeof(char*) * model->num_skins);
+	pimages = (image_paletted_t**)qmalloc(sizeof(image_paletted_t*) * model->num_skins);
 
 	for (i = 0, skininfo = model->skininfo; i < model->num_skins; i++, skininfo++)
 	{
-		image_paletted_t *pimage;
+		const meshskin_t *skin = &mesh->skins[skininfo->skins[0].offset]; /* skingroups not supported, just take the first skin from the group */
+		bool_t written = false;
 
-		int offset = skininfo->skins[0].offset; /* skingroups not supported, just take the first skin from the group */
+		skinfilenames[i] = md2_create_skin_filename(model, i);
 
-		skinfilenames[i] = md2_create_skin_filename(skininfo->skins[0].name);
+		for (j = 0; j < i; j++)
+			if (image_same(mesh->skins[model->skininfo[j].skins[0].offset].components[SKIN_DIFFUSE], skin->components[SKIN_DIFFUSE]) && image_same(mesh->skins[model->skininfo[j].skins[0].offset].components[SKIN_FULLBRIGHT], skin->components[SKIN_FULLBRIGHT]))
+				break;
 
-		pimage = image_palettize(mem_globalpool, &palette_quake2, mesh->skins[offset].components[SKIN_DIFFUSE], mesh->skins[offset].components[SKIN_FULLBRIGHT]);
+		if (j < i)
+		{
+			pimages[i] = pimages[j];
+			for (; j < i && !written; j++)
+				written = pimages[j] == pimages[i] && !strcmp(skinfilenames[j], skinfilenames[i]);
+		}
+		else
+			pimages[i] = image_palettize(mem_globalpool, &palette_quake2, skin->components[SKIN_DIFFUSE], skin->components[SKIN_FULLBRIGHT]);
 
 	/* FIXME - this shouldn't be a fatal error */
-		if (!image_paletted_save(skinfilenames[i], pimage, &error))
+		if (!written && !image_paletted_save(skinfilenames[i], pimages[i], &error))
 		{
 			if (out_error)
 				*out_error = msprintf("Failed to write %s: %s", skinfilenames[i], error);
 			qfree(error);
-			qfree(pimage);
-			for (j = 0; j < i; j++)
+			md2_free_skin_images(pimages, i + 1);
+			for (j = 0; j <= i; j++)
 				qfree(skinfilenames[j]);
 			qfree(skinfilenames);
 			model_free(model);
 			return false;
 		}
-
-		qfree(pimage);
 	}
 
+	md2_free_skin_images(pimages, model->num_skins);
+
 /* optimize vertices for md2 format */
 	md2data = md2_process_vertices(model, mesh, skinwidth, skinheight);
 
-/* write header */
-	header = (md2_header_t*)xbuf_reserve_data(xbuf, sizeof(md2_header_t));
-
-	memcpy(header->ident, "IDP2", 4);
-	header->version       = LittleLong(8);
-	header->skinwidth     = LittleLong(skinwidth);
-	header->skinheight    = LittleLong(skinheight);
-	header->framesize     = LittleLong(sizeof(daliasframe_t) + sizeof(dtrivertx_t) * md2data->numvertices);
-	header->num_skins     = LittleLong(model->num_skins);
-	header->num_vertices  = LittleLong(md2data->numvertices);
-	header->num_st        = LittleLong(md2data->numtexcoords);
-	header->num_tris      = LittleLong(mesh->num_triangles);
-	header->num_glcmds    = 0; /* filled in later */
-	header->num_frames    = LittleLong(model->num_frames);
-	header->offset_skins  = 0;
-	header->offset_st     = 0;
-	header->offset_tris   = 0;
-	header->offset_frames = 0;
-	header->offset_glcmds = 0;
-	header->offset_end    = 0;
+/* write header, the offsets are patched in at the end */
+	header_offset = xbuf_reserve(xbuf, sizeof(md2_header_t));
+
+	memcpy(header.ident, "IDP2", 4);
+	header.version       = LittleLong(8);
+	header.skinwidth     = LittleLong(skinwidth);
+	header.skinheight    = LittleLong(skinheight);
+	header.framesize     = LittleLong(sizeof(daliasframe_t) + sizeof(dtrivertx_t) * md2data->numvertices);
+	header.num_skins     = LittleLong(model->num_skins);
+	header.num_vertices  = LittleLong(md2data->numvertices);
+	header.num_st        = LittleLong(md2data->numtexcoords);
+	header.num_tris      = LittleLong(mesh->num_triangles);
+	header.num_glcmds    = 0; /* filled in later */
+	header.num_frames    = LittleLong(model->num_frames);
+	header.offset_skins  = 0;
+	header.offset_st     = 0;
+	header.offset_tris   = 0;
+	header.offset_frames = 0;
+	header.offset_glcmds = 0;
+	header.offset_end    = 0;
 
 /* write skins */
-	header->offset_skins = LittleLong(xbuf_get_bytes_written(xbuf));
+	header.offset_skins = LittleLong(xbuf_get_bytes_written(xbuf));
 
 	for (i = 0; i < model->num_skins; i++)
 	{
@@ -813,7 +936,7 @@ bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		md2data->texcoords[i].t = LittleShort(md2data->texcoords[i].t);
 	}
 
-	header->offset_st = LittleLong(xbuf_get_bytes_written(xbuf));
+	header.offset_st = LittleLong(xbuf_get_bytes_written(xbuf));
 
 	xbuf_write_data(xbuf, sizeof(dstvert_t) * md2data->numtexcoords, md2data->texcoords);
 
@@ -828,12 +951,12 @@ bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		}
 	}
 
-	header->offset_tris = LittleLong(xbuf_get_bytes_written(xbuf));
+	header.offset_tris = LittleLong(xbuf_get_bytes_written(xbuf));
 
 	xbuf_write_data(xbuf, sizeof(dtriangle_t) * mesh->num_triangles, dtriangles);
 
 /* write frames */
-	header->offset_frames = LittleLong(xbuf_get_bytes_written(xbuf));
+	header.offset_frames = LittleLong(xbuf_get_bytes_written(xbuf));
 
 	for (i = 0; i < model->num_frames; i++)
 	{
@@ -865,20 +988,25 @@ bool_t model_md2_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 	}
 
 /* write glcmds */
-	triangles = dtriangles;
-	num_tris = mesh->num_triangles;
+	md2_build_glcmds(&glcmds, dtriangles, mesh->num_triangles, md2data->texcoords, skinwidth, skinheight);
 
-	md2_build_glcmds(md2data->texcoords, skinwidth, skinheight);
+	header.num_glcmds = LittleLong(glcmds.num_commands);
+	header.offset_glcmds = LittleLong(xbuf_get_bytes_written(xbuf));
 
-	header->num_glcmds = LittleLong(numcommands);
-	header->offset_glcmds = LittleLong(xbuf_get_bytes_written(xbuf));
+	for (i = 0; i < glcmds.num_commands; i++)
+		glcmds.commands[i] = LittleLong(glcmds.commands[i]);
+	xbuf_write_data(xbuf, sizeof(int) * glcmds.num_commands, glcmds.commands);
 
-	for (i = 0; i < numcommands; i++)
-		commands[i] = LittleLong(commands[i]);
-	xbuf_write_data(xbuf, sizeof(int) * numcommands, commands);
+	printf("glcmds: %d strips (%d triangles), %d fans (%d triangles), %.2f vertices per triangle\n",
+		glcmds.num_strips, glcmds.num_strip_tris, glcmds.num_fans, glcmds.num_fan_tris,
+		mesh->num_triangles ? (double)glcmds.num_verts / mesh->num_triangles : 0.0);
+
+	qfree(glcmds.commands);
 
 /* write end */
-	header->offset_end = LittleLong(xbuf_get_bytes_written(xbuf));
+	header.offset_end = LittleLong(xbuf_get_bytes_written(xbuf));
+
+	xbuf_patch_data(xbuf, header_offset, sizeof(md2_header_t), &header);
 
 /* done */
 	qfree(dtriangles);
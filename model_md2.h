@@ -0,0 +1,86 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MODEL_MD2_H
+#define MODEL_MD2_H
+
+#include "model.h"
+
+/* internals of the md2 exporter, shared with the benchmarks */
+
+typedef struct dstvert_s
+{
+	short s;
+	short t;
+} dstvert_t;
+
+typedef struct dtriangle_s
+{
+	unsigned short index_xyz[3];
+	unsigned short index_st[3];
+} dtriangle_t;
+
+typedef struct dtrivertx_s
+{
+	unsigned char v[3];
+	unsigned char lightnormalindex;
+} dtrivertx_t;
+
+typedef struct daliasframe_s
+{
+	float scale[3];
+	float translate[3];
+	char name[16];
+/*	dtrivertx_t verts[1];*/
+} daliasframe_t;
+
+typedef struct md2_data_s
+{
+	dstvert_t *texcoords; /* [numtexcoords] */
+	int numtexcoords; /* <= mesh->num_vertices */
+	int *texcoord_lookup; /* [mesh->num_vertices] */
+
+	daliasframe_t *frames; /* [model->num_frames] */
+
+	dtrivertx_t *original_vertices; /* [mesh->num_vertices * model->num_frames] */
+
+	int *vertices; /* [numvertices] ; index into original_vertices */
+	int numvertices;
+	int *vertex_lookup; /* [mesh->num_vertices] index into vertices */
+} md2_data_t;
+
+/* quantizes the mesh's frames and welds its texcoords and vertices */
+md2_data_t *md2_process_vertices(const model_t *model, const mesh_t *mesh, int skinwidth, int skinheight);
+void md2_free_data(md2_data_t *data);
+
+void md2_weld_texcoords(md2_data_t *data, const mesh_t *mesh, int skinwidth, int skinheight);
+void md2_weld_vertices(md2_data_t *data, int num_vertices, int num_frames);
+
+typedef struct md2_glcmds_s
+{
+	int *commands;
+	int num_commands;
+
+	int num_strips, num_strip_tris;
+	int num_fans, num_fan_tris;
+	int num_verts; /* vertices submitted */
+} md2_glcmds_t;
+
+/* strips and fans for the triangles. free glcmds->commands with qfree */
+void md2_build_glcmds(md2_glcmds_t *glcmds, const dtriangle_t *triangles, int num_tris, const dstvert_t *texcoords, int skinwidth, int skinheight);
+
+#endif
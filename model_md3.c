@@ -21,9 +21,15 @@
 
 #include "global.h"
 #include "model.h"
+#include "model_md3.h"
+#include "thread.h"
 
-extern const char *g_skinpath;
-extern const char *g_skin_base_name;
+/* below this many vertices (over all meshes and frames), frames are encoded
+ * on the calling thread */
+#define MD3_MIN_THREADED_VERTICES 65536
+
+extern THREAD_LOCAL const char *g_skinpath;
+extern THREAD_LOCAL const char *g_skin_base_name;
 
 typedef struct md3_vertex_s
 {
@@ -111,7 +117,7 @@ bool_t model_md3_load(void *filedata, size_t filesize, model_t *out_model, char
 	if (LittleLong(header->version) != 15)
 		return (void)(out_error && (*out_error = msprintf("wrong format (version not 6)"))), false;
 
-	pool = mem_create_pool();
+	pool = mem_create_arena();
 
 /* byteswap header */
 	header->version        = LittleLong(header->version);
@@ -276,7 +282,7 @@ bool_t model_md3_load(void *filedata, size_t filesize, model_t *out_model, char
 		f += md3_mesh->lump_end;
 	}
 
-	mem_merge_pool(pool);
+	model.pool = pool; /* the model owns the arena, freed in model_free */
 
 	model.flags = header->flags;
 	model.synctype = 0;
@@ -288,7 +294,7 @@ bool_t model_md3_load(void *filedata, size_t filesize, model_t *out_model, char
 	return true;
 }
 
-static unsigned short md3_encodenormal(const float n[3])
+unsigned short md3_encodenormal(const float n[3])
 {
 	int blat, blng;
 
@@ -335,6 +341,89 @@ static char *md3_create_skin_filename(const char *skinname)
 		return msprintf("%s.tga", temp);
 }
 
+typedef struct md3_quantize_job_s
+{
+	const model_t *model;
+	int frames_per_job;
+	int max_vertices; /* of any mesh, for decoding quantized frames */
+
+	md3_frameinfo_t *frameinfos; /* [total_frames], without names */
+	md3_vertex_t **vertices; /* [num_meshes][total_frames * num_vertices] */
+} md3_quantize_job_t;
+
+/* bounds and encoded vertices of a run of frames (by offset), each into its
+ * own slot so that the file can be written in order afterwards */
+static void md3_quantize_frames(void *data, int job)
+{
+	const md3_quantize_job_t *qj = (const md3_quantize_job_t*)data;
+	const model_t *model = qj->model;
+	const int first_frame = job * qj->frames_per_job;
+	const int last_frame = min(first_frame + qj->frames_per_job, model->total_frames);
+	float *scratch_vertex3f = (float*)qmalloc(sizeof(float[3]) * qj->max_vertices);
+	float *scratch_normal3f = (float*)qmalloc(sizeof(float[3]) * qj->max_vertices);
+	const mesh_t *mesh;
+	int offset, j, k, m;
+
+	for (offset = first_frame; offset < last_frame; offset++)
+	{
+		md3_frameinfo_t *md3_frameinfo = &qj->frameinfos[offset];
+		float mins[3], maxs[3], dist[3];
+		bool_t first = true;
+
+		VectorClear(mins);
+		VectorClear(maxs);
+
+		for (j = 0, mesh = model->meshes; j < model->num_meshes; j++, mesh++)
+		{
+			const float *vertex3f = mesh_frame_vertex3f(mesh, offset, scratch_vertex3f);
+			const float *v = vertex3f;
+			const float *n = mesh_frame_normal3f(mesh, offset, scratch_normal3f);
+			md3_vertex_t *md3_vertex = qj->vertices[j] + mesh->num_vertices * offset;
+
+			for (k = 0; k < mesh->num_vertices; k++, v += 3)
+			{
+				for (m = 0; m < 3; m++)
+				{
+					mins[m] = first ? v[m] : min(mins[m], v[m]);
+					maxs[m] = first ? v[m] : max(maxs[m], v[m]);
+					first = false;
+				}
+			}
+
+			v = vertex3f;
+			for (k = 0; k < mesh->num_vertices; k++, v += 3, n += 3, md3_vertex++)
+			{
+				int x = (int)(v[0] * 64.0f);
+				int y = (int)(v[1] * 64.0f);
+				int z = (int)(v[2] * 64.0f);
+
+				md3_vertex->origin[0] = LittleShort(bound(-32768, x, 32767));
+				md3_vertex->origin[1] = LittleShort(bound(-32768, y, 32767));
+				md3_vertex->origin[2] = LittleShort(bound(-32768, z, 32767));
+				md3_vertex->normalpitchyaw = md3_encodenormal(n);
+			}
+		}
+
+		for (m = 0; m < 3; m++)
+			dist[m] = (fabs(mins[m]) > fabs(maxs[m])) ? mins[m] : maxs[m];
+
+		VectorCopy(md3_frameinfo->mins, mins);
+		VectorCopy(md3_frameinfo->maxs, maxs);
+		VectorClear(md3_frameinfo->origin);
+		md3_frameinfo->radius = (float)sqrt(DotProduct(dist, dist));
+	}
+
+	qfree(scratch_normal3f);
+	qfree(scratch_vertex3f);
+}
+
+static bool_t md3_skin_has_fullbright(const model_t *model, int skin)
+{
+	const image_rgba_t *fullbright = model->meshes[0].skins[skin].components[SKIN_FULLBRIGHT];
+
+	return fullbright && fullbright->num_nonempty_pixels > 0;
+}
+
 bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 {
 	md3_header_t header;
@@ -342,7 +431,9 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 	char **skinshaders;
 	const tag_t *tag;
 	const mesh_t *mesh;
-	int i, j, k, m, n;
+	md3_quantize_job_t qj;
+	int i, j, n;
+	int num_jobs;
 
 	memcpy(header.ident, "IDP3", 4);
 	header.version    = LittleLong(15);
@@ -370,9 +461,16 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 			snprintf(skin_image, sizeof(skin_image), "%s", skinshaders[i]);
 		}
 
+	/* skins that are the same as an earlier one of the same name are already written */
+		for (j = 0; j < i; j++)
+			if (!strcmp(skinshaders[j], skinshaders[i]) && image_same(model->meshes[0].skins[j].components[SKIN_DIFFUSE], model->meshes[0].skins[i].components[SKIN_DIFFUSE]) && image_same(model->meshes[0].skins[j].components[SKIN_FULLBRIGHT], model->meshes[0].skins[i].components[SKIN_FULLBRIGHT]) && md3_skin_has_fullbright(model, j) == md3_skin_has_fullbright(model, i))
+				break;
+		if (j < i)
+			continue;
+
 		image_save(skin_image, model->meshes[0].skins[i].components[SKIN_DIFFUSE], out_error);
 
-		if (model->meshes[0].skins[i].components[SKIN_FULLBRIGHT] && model->meshes[0].skins[i].components[SKIN_FULLBRIGHT]->num_nonempty_pixels > 0)
+		if (md3_skin_has_fullbright(model, i))
 		{
 			snprintf(skin_image, sizeof(skin_image), "%s_fb.tga", skinshaders[i]);
 			image_save(skin_image, model->meshes[0].skins[i].components[SKIN_FULLBRIGHT], out_error);
@@ -403,40 +501,41 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 /* write header */
 	xbuf_write_data(xbuf, sizeof(md3_header_t), &header);
 
-/* write frameinfo */
-	for (i = 0, frameinfo = model->frameinfo; i < model->num_frames; i++, frameinfo++)
-	for( n = 0; n < frameinfo->num_frames; n++ )
+/* bound and encode every frame, spread over the worker threads */
+	qj.model = model;
+	qj.max_vertices = 1;
+	qj.frameinfos = (md3_frameinfo_t*)qmalloc(sizeof(md3_frameinfo_t) * max(model->total_frames, 1));
+	qj.vertices = (md3_vertex_t**)qmalloc(sizeof(md3_vertex_t*) * max(model->num_meshes, 1));
+	for (j = 0, mesh = model->meshes; j < model->num_meshes; j++, mesh++)
 	{
-		const singleframe_t *singleframe = &frameinfo->frames[n];
-		md3_frameinfo_t md3_frameinfo;
-		float mins[3], maxs[3], dist[3];
-		bool_t first = true;
+		qj.vertices[j] = (md3_vertex_t*)qmalloc(sizeof(md3_vertex_t) * max(mesh->num_vertices * model->total_frames, 1));
+		qj.max_vertices = max(qj.max_vertices, mesh->num_vertices);
+	}
 
-		VectorClear(mins);
-		VectorClear(maxs);
+	if (model->total_frames)
+	{
+		int num_vertices = 0;
 
 		for (j = 0, mesh = model->meshes; j < model->num_meshes; j++, mesh++)
-		{
-			const float *v = mesh->vertex3f + mesh->num_vertices * singleframe->offset * 3;
+			num_vertices += mesh->num_vertices;
 
-			for (k = 0; k < mesh->num_vertices; k++, v += 3)
-			{
-				for (m = 0; m < 3; m++)
-				{
-					mins[m] = first ? v[m] : min(mins[m], v[m]);
-					maxs[m] = first ? v[m] : max(maxs[m], v[m]);
-					first = false;
-				}
-			}
-		}
+	/* a few jobs per worker, so uneven progress evens out */
+		num_jobs = min(model->total_frames, thread_num_workers() * 4);
+		if ((size_t)num_vertices * model->total_frames < MD3_MIN_THREADED_VERTICES)
+			num_jobs = 1;
+		qj.frames_per_job = (model->total_frames + num_jobs - 1) / num_jobs;
+		num_jobs = (model->total_frames + qj.frames_per_job - 1) / qj.frames_per_job;
 
-		for (m = 0; m < 3; m++)
-			dist[m] = (fabs(mins[m]) > fabs(maxs[m])) ? mins[m] : maxs[m];
+		thread_run(num_jobs, md3_quantize_frames, &qj);
+	}
+
+/* write frameinfo */
+	for (i = 0, frameinfo = model->frameinfo; i < model->num_frames; i++, frameinfo++)
+	for( n = 0; n < frameinfo->num_frames; n++ )
+	{
+		const singleframe_t *singleframe = &frameinfo->frames[n];
+		md3_frameinfo_t md3_frameinfo = qj.frameinfos[singleframe->offset];
 
-		VectorCopy(md3_frameinfo.mins, mins);
-		VectorCopy(md3_frameinfo.maxs, maxs);
-		VectorClear(md3_frameinfo.origin);
-		md3_frameinfo.radius = (float)sqrt(DotProduct(dist, dist));
 		Q_strlcpy(md3_frameinfo.name, singleframe->name, sizeof(md3_frameinfo.name));
 
 		xbuf_write_data(xbuf, sizeof(md3_frameinfo_t), &md3_frameinfo);
@@ -479,7 +578,7 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 		md3_mesh.flags = 0; /* unused */
 
 		md3_mesh.num_frames = LittleLong(model->total_frames);
-		md3_mesh.num_shaders = model->total_skins;
+		md3_mesh.num_shaders = LittleLong(model->num_skins);
 		md3_mesh.num_vertices = LittleLong(mesh->num_vertices);
 		md3_mesh.num_triangles = LittleLong(mesh->num_triangles);
 
@@ -514,10 +613,11 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 		}
 
 	/* write shaders */
-		for (j = 0; j < model->total_skins; j++)
+		for (j = 0; j < model->num_skins; j++)
 		{
 			md3_shader_t md3_shader;
-			strcpy(md3_shader.name, skinshaders[j]);
+			memset(&md3_shader, 0, sizeof(md3_shader));
+			Q_strlcpy(md3_shader.name, skinshaders[j], sizeof(md3_shader.name));
 			xbuf_write_data(xbuf, sizeof(md3_shader), &md3_shader);
 		}
 
@@ -535,28 +635,13 @@ bool_t model_md3_save(const model_t *model, xbuf_t *xbuf, char **out_error)
 	/* write framevertices */
 		for (j = 0, frameinfo = model->frameinfo; j < model->num_frames; j++, frameinfo++)
 		for( n = 0; n < frameinfo->num_frames; n++ )
-		{
-			const singleframe_t *singleframe = &frameinfo->frames[n];
-			const float *v = mesh->vertex3f + singleframe->offset * mesh->num_vertices * 3;
-			const float *n = mesh->normal3f + singleframe->offset * mesh->num_vertices * 3;
-
-			for (k = 0; k < mesh->num_vertices; k++, v += 3, n += 3)
-			{
-				md3_vertex_t md3_vertex;
-
-				int x = (int)(v[0] * 64.0f);
-				int y = (int)(v[1] * 64.0f);
-				int z = (int)(v[2] * 64.0f);
-
-				md3_vertex.origin[0] = LittleShort(bound(-32768, x, 32767));
-				md3_vertex.origin[1] = LittleShort(bound(-32768, y, 32767));
-				md3_vertex.origin[2] = LittleShort(bound(-32768, z, 32767));
-				md3_vertex.normalpitchyaw = md3_encodenormal(n);
-
-				xbuf_write_data(xbuf, sizeof(md3_vertex_t), &md3_vertex);
-			}
-		}
+			xbuf_write_data(xbuf, sizeof(md3_vertex_t) * mesh->num_vertices, qj.vertices[i] + frameinfo->frames[n].offset * mesh->num_vertices);
 	}
 
+	for (j = 0; j < model->num_meshes; j++)
+		qfree(qj.vertices[j]);
+	qfree(qj.vertices);
+	qfree(qj.frameinfos);
+
 	return true;
 }
@@ -0,0 +1,26 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MODEL_MD3_H
+#define MODEL_MD3_H
+
+/* internals of the md3 exporter, shared with the benchmarks */
+
+/* packs a unit normal into md3's latitude and longitude bytes */
+unsigned short md3_encodenormal(const float n[3]);
+
+#endif
@@ -19,12 +19,11 @@
 #include <stdio.h> /* FIXME - don't print to console in this file */
 #include <string.h>
 
+#include "anorms.h"
 #include "global.h"
 #include "model.h"
 #include "palettes.h"
-
-extern const float anorms[162][3];
-int compress_normal(const float *normal);
+#include "thread.h"
 
 /* mdl_stvert_t::onseam */
 #define ALIAS_ONSEAM 0x0020
@@ -36,6 +35,10 @@ int compress_normal(const float *normal);
 #define ST_SYNC 0
 #define ST_RAND 1
 
+/* below this many vertices (over all frames), frames are compressed on the
+ * calling thread */
+#define MDL_MIN_THREADED_VERTICES 65536
+
 typedef enum aliasframetype_e { ALIAS_SINGLE = 0, ALIAS_GROUP } aliasframetype_t;
 typedef enum aliasskintype_e { ALIAS_SKIN_SINGLE = 0, ALIAS_SKIN_GROUP } aliasskintype_t;
 
@@ -121,17 +124,11 @@ typedef struct daliasskininterval_s
 
 bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char **out_error)
 {
-	typedef struct mdl_meshvert_s
-	{
-		int vertex;
-		int s, t, back;
-	} mdl_meshvert_t;
-
 	unsigned char *f = (unsigned char*)filedata;
 	mem_pool_t *pool;
 	const unsigned char *tf;
 	mdl_header_t *header;
-	int i, j, k, offset;
+	int i, j, offset;
 	int total_skins, total_frames;
 	stvert_t *stverts;
 	dtriangle_t *dtriangles;
@@ -141,7 +138,9 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 	frameinfo_t *frameinfo;
 	model_t model;
 	mesh_t *mesh;
-	mdl_meshvert_t *meshverts;
+	meshvert_map_t meshvert_map;
+	const meshvert_t *meshverts;
+	int *vertexmap;
 	float iwidth, iheight;
 
 	header = (mdl_header_t*)f;
@@ -152,7 +151,7 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 	if (LittleLong(header->version) != 6)
 		return (void)(out_error && (*out_error = msprintf("wrong format (version not 6)"))), false;
 
-	pool = mem_create_pool();
+	pool = mem_create_arena();
 
 /* byteswap header */
 	header->version    = LittleLong(header->version);
@@ -386,15 +385,11 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 	mesh->num_triangles = header->numtris;
 	mesh->triangle3i = (int*)mem_alloc(pool, sizeof(int) * mesh->num_triangles * 3);
 
-	mesh->num_vertices = 0;
-	meshverts = (mdl_meshvert_t*)mem_alloc(pool, sizeof(mdl_meshvert_t) * mesh->num_triangles * 3);
+	meshvert_map_init(&meshvert_map, pool, mesh->num_triangles * 3);
 	for (i = 0; i < mesh->num_triangles; i++)
 	{
 		for (j = 0; j < 3; j++)
 		{
-			int vertnum;
-			mdl_meshvert_t *mv;
-
 			int xyz = dtriangles[i].vertindex[j];
 
 			int s = stverts[xyz].s;
@@ -402,21 +397,11 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 			int back = stverts[xyz].onseam && !dtriangles[i].facesfront;
 
 		/* add the vertex if it doesn't exist, otherwise use the old one */
-			for (vertnum = 0, mv = meshverts; vertnum < mesh->num_vertices; vertnum++, mv++)
-				if (mv->vertex == xyz && mv->s == s && mv->t == t && mv->back == back)
-					break;
-			if (vertnum == mesh->num_vertices)
-			{
-				mv = &meshverts[mesh->num_vertices++];
-				mv->vertex = xyz;
-				mv->s = s;
-				mv->t = t;
-				mv->back = back;
-			}
-
-			mesh->triangle3i[i * 3 + j] = vertnum; /* (clockwise winding) */
+			mesh->triangle3i[i * 3 + j] = meshvert_map_add(&meshvert_map, xyz, s, t, back); /* (clockwise winding) */
 		}
 	}
+	mesh->num_vertices = meshvert_map.num_meshverts;
+	meshverts = meshvert_map.meshverts;
 
 	mesh->texcoord2f = (float*)mem_alloc(pool, sizeof(float) * mesh->num_vertices * 2);
 	iwidth = 1.0f / header->skinwidth;
@@ -433,37 +418,36 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 		mesh->texcoord2f[i*2+1] = (t + 0.5f) * iheight;
 	}
 
-	mesh->vertex3f = (float*)mem_alloc(pool, model.total_frames * sizeof(float) * mesh->num_vertices * 3);
-	mesh->normal3f = (float*)mem_alloc(pool, model.total_frames * sizeof(float) * mesh->num_vertices * 3);
-	for (i = 0; i < model.num_frames; i++)
+/* the vertices are left in the file until they're needed, trivertx_t is laid out as quantvert_t */
+	mesh->quantframes = (quantframe_t*)mem_alloc(pool, model.total_frames * sizeof(quantframe_t));
+	for (i = 0; i < model.total_frames; i++)
 	{
-		for (j = 0; j < model.frameinfo[i].num_frames; j++)
-		{
-			int firstvertex = model.frameinfo[i].frames[j].offset * mesh->num_vertices * 3;
-			float *v = mesh->vertex3f + firstvertex;
-			float *n = mesh->normal3f + firstvertex;
-
-			for (k = 0; k < mesh->num_vertices; k++, v += 3, n += 3)
-			{
-				const trivertx_t *trivertx = &framevertstart[model.frameinfo[i].frames[j].offset][meshverts[k].vertex];
-
-				v[0] = header->origin[0] + header->scale[0] * trivertx->v[0];
-				v[1] = header->origin[1] + header->scale[1] * trivertx->v[1];
-				v[2] = header->origin[2] + header->scale[2] * trivertx->v[2];
-
-				n[0] = anorms[trivertx->lightnormalindex][0];
-				n[1] = anorms[trivertx->lightnormalindex][1];
-				n[2] = anorms[trivertx->lightnormalindex][2];
-			}
-		}
+		VectorCopy(mesh->quantframes[i].scale, header->scale);
+		VectorCopy(mesh->quantframes[i].translate, header->origin);
 	}
+	mesh->filequantverts = (const quantvert_t**)framevertstart;
+	mesh->filevertexmap = vertexmap = (int*)mem_alloc(pool, sizeof(int) * mesh->num_vertices);
+	for (i = 0; i < mesh->num_vertices; i++)
+		vertexmap[i] = meshverts[i].vertex;
+
+	meshvert_map_free(&meshvert_map);
 
-	mem_free(meshverts);
-	mem_free(framevertstart);
+	profile_push(PROFILE_SKINS);
 
 	mesh->skins = (meshskin_t*)mem_alloc(pool, sizeof(meshskin_t) * model.total_skins);
 	for (i = 0; i < model.total_skins; i++)
 	{
+	/* skingroups often repeat a skin, which only needs decoding once */
+		for (j = 0; j < i; j++)
+			if (!memcmp(skintexstart[j], skintexstart[i], header->skinwidth * header->skinheight))
+				break;
+		if (j < i)
+		{
+			mesh->skins[i].components[SKIN_DIFFUSE]    = image_clone(pool, mesh->skins[j].components[SKIN_DIFFUSE]);
+			mesh->skins[i].components[SKIN_FULLBRIGHT] = image_clone(pool, mesh->skins[j].components[SKIN_FULLBRIGHT]);
+			continue;
+		}
+
 		mesh->skins[i].components[SKIN_DIFFUSE]    = image_alloc(pool, header->skinwidth, header->skinheight);
 		mesh->skins[i].components[SKIN_FULLBRIGHT] = image_alloc(pool, header->skinwidth, header->skinheight);
 
@@ -505,25 +489,117 @@ bool_t model_mdl_load(void *filedata, size_t filesize, model_t *out_model, char
 				++mesh->skins[i].components[SKIN_DIFFUSE]->num_nonempty_pixels;
 			}
 		}
+
+		image_intern(mesh->skins[i].components[SKIN_DIFFUSE]);
+		image_intern(mesh->skins[i].components[SKIN_FULLBRIGHT]);
 	}
 
 	mem_free(skintexstart);
 
-	mem_merge_pool(pool);
+	profile_pop();
+
+	model.pool = pool; /* the model owns the arena, freed in model_free */
 
 	*out_model = model;
 	return true;
 }
 
+typedef struct mdl_quantize_job_s
+{
+	const mesh_t *mesh;
+	const float *origin, *iscale;
+	bool_t keep_quantized; /* the mesh's quantverts all use origin and scale already */
+	int frames_per_job;
+	int total_frames;
+
+	trivertx_t *vertices; /* [total_frames * num_vertices] */
+	daliasframe_t *frames; /* [total_frames], only the bounding boxes are filled in */
+} mdl_quantize_job_t;
+
+/* compresses the vertices of a run of frames (by offset) into their own slots,
+ * so the file can be written in order afterwards whichever thread did what */
+static void mdl_quantize_frames(void *data, int job)
+{
+	const mdl_quantize_job_t *qj = (const mdl_quantize_job_t*)data;
+	const mesh_t *mesh = qj->mesh;
+	const int first_frame = job * qj->frames_per_job;
+	const int last_frame = min(first_frame + qj->frames_per_job, qj->total_frames);
+	unsigned char *normalindices = (unsigned char*)qmalloc(mesh->num_vertices);
+	float *scratch_vertex3f = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
+	float *scratch_normal3f = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
+	quantvert_t *scratch_quantverts = (quantvert_t*)qmalloc(sizeof(quantvert_t) * max(mesh->num_vertices, 1));
+	int offset, k;
+
+	for (offset = first_frame; offset < last_frame; offset++)
+	{
+		daliasframe_t *simpleframe = &qj->frames[offset];
+		trivertx_t *trivertx = qj->vertices + offset * mesh->num_vertices;
+		const quantvert_t *qv = qj->keep_quantized ? mesh_frame_quantverts(mesh, offset, scratch_quantverts) : NULL;
+		const float *v = qv ? NULL : mesh_frame_vertex3f(mesh, offset, scratch_vertex3f);
+
+		memset(simpleframe, 0, sizeof(*simpleframe));
+
+		if (!qv)
+			compress_normals(mesh_frame_normal3f(mesh, offset, scratch_normal3f), mesh->num_vertices, normalindices);
+
+		for (k = 0; k < mesh->num_vertices; k++, trivertx++)
+		{
+			if (qv)
+			{
+				trivertx->v[0] = qv[k].v[0];
+				trivertx->v[1] = qv[k].v[1];
+				trivertx->v[2] = qv[k].v[2];
+				trivertx->lightnormalindex = qv[k].normalindex;
+			}
+			else
+			{
+				float pos[3];
+
+				pos[0] = (v[k*3+0] - qj->origin[0]) * qj->iscale[0];
+				pos[1] = (v[k*3+1] - qj->origin[1]) * qj->iscale[1];
+				pos[2] = (v[k*3+2] - qj->origin[2]) * qj->iscale[2];
+
+				trivertx->v[0] = (unsigned char)bound(0.0f, pos[0], 255.0f);
+				trivertx->v[1] = (unsigned char)bound(0.0f, pos[1], 255.0f);
+				trivertx->v[2] = (unsigned char)bound(0.0f, pos[2], 255.0f);
+				trivertx->lightnormalindex = normalindices[k];
+			}
+
+			if (k == 0 || trivertx->v[0] < simpleframe->bboxmin.v[0])
+				simpleframe->bboxmin.v[0] = trivertx->v[0];
+			if (k == 0 || trivertx->v[1] < simpleframe->bboxmin.v[1])
+				simpleframe->bboxmin.v[1] = trivertx->v[1];
+			if (k == 0 || trivertx->v[2] < simpleframe->bboxmin.v[2])
+				simpleframe->bboxmin.v[2] = trivertx->v[2];
+
+			if (k == 0 || trivertx->v[0] > simpleframe->bboxmax.v[0])
+				simpleframe->bboxmax.v[0] = trivertx->v[0];
+			if (k == 0 || trivertx->v[1] > simpleframe->bboxmax.v[1])
+				simpleframe->bboxmax.v[1] = trivertx->v[1];
+			if (k == 0 || trivertx->v[2] > simpleframe->bboxmax.v[2])
+				simpleframe->bboxmax.v[2] = trivertx->v[2];
+		}
+	}
+
+	qfree(scratch_quantverts);
+	qfree(scratch_normal3f);
+	qfree(scratch_vertex3f);
+	qfree(normalindices);
+}
+
 bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 {
 	model_t *model;
 	const mesh_t *mesh;
 	float mins[3], maxs[3], origin[3], scale[3], iscale[3], dist[3], totalsize;
+	float *scratch;
+	const float *vertex3f;
 	mdl_header_t header;
 	int i, j, k;
 	int skinwidth, skinheight;
 	image_paletted_t **skinimages;
+	mdl_quantize_job_t qj;
+	int num_jobs;
 
 	model = model_merge_meshes(orig_model);
 
@@ -571,6 +647,7 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 
 /* create 8-bit textures */
 	skinimages = (image_paletted_t**)qmalloc(sizeof(image_paletted_t*) * model->total_skins);
+	memset(skinimages, 0, sizeof(image_paletted_t*) * model->total_skins);
 
 	for (i = 0; i < model->num_skins; i++)
 	{
@@ -580,28 +657,55 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		{
 			int offset = skininfo->skins[j].offset;
 
-			skinimages[offset] = image_palettize(mem_globalpool, &palette_quake, mesh->skins[offset].components[SKIN_DIFFUSE], mesh->skins[offset].components[SKIN_FULLBRIGHT]);
+		/* skins that are the same as one already done (as in skingroups) share its 8-bit image */
+			for (k = 0; k < model->total_skins; k++)
+				if (skinimages[k] && image_same(mesh->skins[k].components[SKIN_DIFFUSE], mesh->skins[offset].components[SKIN_DIFFUSE]) && image_same(mesh->skins[k].components[SKIN_FULLBRIGHT], mesh->skins[offset].components[SKIN_FULLBRIGHT]))
+					break;
+
+			if (k < model->total_skins)
+				skinimages[offset] = skinimages[k];
+			else
+				skinimages[offset] = image_palettize(mem_globalpool, &palette_quake, mesh->skins[offset].components[SKIN_DIFFUSE], mesh->skins[offset].components[SKIN_FULLBRIGHT]);
 		}
 	}
 
 /* calculate bounds */
+	scratch = (float*)qmalloc(sizeof(float[3]) * max(mesh->num_vertices, 1));
 	VectorClear(mins);
 	VectorClear(maxs);
-	for (i = 0; i < model->total_frames * mesh->num_vertices; i++)
+	for (i = 0; i < model->total_frames; i++)
 	{
-		const float *xyz = mesh->vertex3f + i * 3;
+		const float *xyz = mesh_frame_vertex3f(mesh, i, scratch);
 
-		for (j = 0; j < 3; j++)
+		for (k = 0; k < mesh->num_vertices; k++, xyz += 3)
 		{
-			mins[j] = (i == 0) ? xyz[j] : min(mins[j], xyz[j]);
-			maxs[j] = (i == 0) ? xyz[j] : max(maxs[j], xyz[j]);
+			for (j = 0; j < 3; j++)
+			{
+				mins[j] = (i == 0 && k == 0) ? xyz[j] : min(mins[j], xyz[j]);
+				maxs[j] = (i == 0 && k == 0) ? xyz[j] : max(maxs[j], xyz[j]);
+			}
 		}
 	}
 
+/* if every frame was quantized the same way (as when it was loaded from an
+ * mdl) write them back as they were, rather than requantizing them */
+	qj.keep_quantized = mesh->quantframes && model->total_frames;
+	for (i = 1; i < model->total_frames && qj.keep_quantized; i++)
+		if (memcmp(&mesh->quantframes[i], &mesh->quantframes[0], sizeof(quantframe_t)))
+			qj.keep_quantized = false;
+
 	for (i = 0; i < 3; i++)
 	{
-		origin[i] = mins[i];
-		scale[i] = (maxs[i] - mins[i]) * (1.0f / 255.9f);
+		if (qj.keep_quantized)
+		{
+			origin[i] = mesh->quantframes[0].translate[i];
+			scale[i] = mesh->quantframes[0].scale[i];
+		}
+		else
+		{
+			origin[i] = mins[i];
+			scale[i] = (maxs[i] - mins[i]) * (1.0f / 255.9f);
+		}
 		iscale[i] = 1.0f / scale[i];
 
 		dist[i] = (fabs(mins[i]) > fabs(maxs[i])) ? mins[i] : maxs[i];
@@ -609,11 +713,12 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 
 /* calculate average polygon size (used by software engines for LOD) */
 	totalsize = 0.0f;
-	for (i = 0; i < mesh->num_triangles; i++)
+	vertex3f = model->total_frames ? mesh_frame_vertex3f(mesh, 0, scratch) : NULL;
+	for (i = 0; vertex3f && i < mesh->num_triangles; i++)
 	{
-		const float *v0 = mesh->vertex3f+mesh->triangle3i[i*3+0]*3;
-		const float *v1 = mesh->vertex3f+mesh->triangle3i[i*3+1]*3;
-		const float *v2 = mesh->vertex3f+mesh->triangle3i[i*3+2]*3;
+		const float *v0 = vertex3f+mesh->triangle3i[i*3+0]*3;
+		const float *v1 = vertex3f+mesh->triangle3i[i*3+1]*3;
+		const float *v2 = vertex3f+mesh->triangle3i[i*3+2]*3;
 		float vtemp1[3], vtemp2[3], normal[3];
 
 		VectorSubtract(v0, v1, vtemp1);
@@ -623,6 +728,8 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		totalsize += (float)sqrt(DotProduct(normal, normal)) * 0.5f;
 	}
 
+	qfree(scratch);
+
 /* write header */
 	memcpy(header.id, "IDPO", 4);
 	header.version    = LittleLong(6);
@@ -721,31 +828,58 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 		xbuf_write_data(xbuf, sizeof(dtriangle_t), &dtriangle);
 	}
 
+/* compress the vertices of every frame, spread over the worker threads */
+	qj.mesh = mesh;
+	qj.origin = origin;
+	qj.iscale = iscale;
+	qj.total_frames = model->total_frames;
+	qj.vertices = (trivertx_t*)qmalloc(sizeof(trivertx_t) * max(model->total_frames * mesh->num_vertices, 1));
+	qj.frames = (daliasframe_t*)qmalloc(sizeof(daliasframe_t) * max(model->total_frames, 1));
+
+	if (model->total_frames)
+	{
+	/* a few jobs per worker, so uneven progress evens out */
+		num_jobs = min(model->total_frames, thread_num_workers() * 4);
+		if ((size_t)mesh->num_vertices * model->total_frames < MDL_MIN_THREADED_VERTICES)
+			num_jobs = 1;
+		qj.frames_per_job = (model->total_frames + num_jobs - 1) / num_jobs;
+		num_jobs = (model->total_frames + qj.frames_per_job - 1) / qj.frames_per_job;
+
+		thread_run(num_jobs, mdl_quantize_frames, &qj);
+	}
+
 /* write frames */
 	for (i = 0; i < model->num_frames; i++)
 	{
 		const frameinfo_t *frameinfo = &model->frameinfo[i];
-		daliasgroup_t *aliasgroup = NULL;
 
 		if (frameinfo->num_frames > 1)
 		{
 		/* frame group */
 			daliasframetype_t frametype;
+			daliasgroup_t aliasgroup;
 
 			frametype.type = LittleLong(ALIAS_GROUP);
 			xbuf_write_data(xbuf, sizeof(daliasframetype_t), &frametype);
 
-			aliasgroup = (daliasgroup_t*)xbuf_reserve_data(xbuf, sizeof(daliasgroup_t));
+		/* the group's bounding box covers all of its frames' */
+			memset(&aliasgroup, 0, sizeof(aliasgroup));
+			aliasgroup.numframes = LittleLong(frameinfo->num_frames);
+
+			for (j = 0; j < frameinfo->num_frames && mesh->num_vertices; j++)
+			{
+				const daliasframe_t *simpleframe = &qj.frames[frameinfo->frames[j].offset];
+
+				for (k = 0; k < 3; k++)
+				{
+					if (j == 0 || simpleframe->bboxmin.v[k] < aliasgroup.bboxmin.v[k])
+						aliasgroup.bboxmin.v[k] = simpleframe->bboxmin.v[k];
+					if (j == 0 || simpleframe->bboxmax.v[k] > aliasgroup.bboxmax.v[k])
+						aliasgroup.bboxmax.v[k] = simpleframe->bboxmax.v[k];
+				}
+			}
 
-			aliasgroup->bboxmin.v[0] = 0; /* these will be set later */
-			aliasgroup->bboxmin.v[1] = 0;
-			aliasgroup->bboxmin.v[2] = 0;
-			aliasgroup->bboxmin.lightnormalindex = 0;
-			aliasgroup->bboxmax.v[0] = 0;
-			aliasgroup->bboxmax.v[1] = 0;
-			aliasgroup->bboxmax.v[2] = 0;
-			aliasgroup->bboxmax.lightnormalindex = 0;
-			aliasgroup->numframes = LittleLong(frameinfo->num_frames);
+			xbuf_write_data(xbuf, sizeof(daliasgroup_t), &aliasgroup);
 
 			for (j = 0; j < frameinfo->num_frames; j++)
 			{
@@ -764,78 +898,26 @@ bool_t model_mdl_save(const model_t *orig_model, xbuf_t *xbuf, char **out_error)
 
 		for (j = 0; j < frameinfo->num_frames; j++)
 		{
-			daliasframe_t *simpleframe;
 			int offset = frameinfo->frames[j].offset;
-			const float *v, *n;
-
-			simpleframe = (daliasframe_t*)xbuf_reserve_data(xbuf, sizeof(daliasframe_t));
-
-			simpleframe->bboxmin.v[0] = 0; /* these will be set in the following loop */
-			simpleframe->bboxmin.v[1] = 0;
-			simpleframe->bboxmin.v[2] = 0;
-			simpleframe->bboxmin.lightnormalindex = 0;
-			simpleframe->bboxmax.v[0] = 0;
-			simpleframe->bboxmax.v[1] = 0;
-			simpleframe->bboxmax.v[2] = 0;
-			simpleframe->bboxmax.lightnormalindex = 0;
-			Q_strlcpy(simpleframe->name, frameinfo->frames[j].name, sizeof(simpleframe->name));
+			daliasframe_t simpleframe = qj.frames[offset];
 
-			v = mesh->vertex3f + offset * mesh->num_vertices * 3;
-			n = mesh->normal3f + offset * mesh->num_vertices * 3;
+			Q_strlcpy(simpleframe.name, frameinfo->frames[j].name, sizeof(simpleframe.name));
 
-			for (k = 0; k < mesh->num_vertices; k++, v += 3, n += 3)
-			{
-				trivertx_t trivertx;
-				float pos[3];
-
-				pos[0] = (v[0] - origin[0]) * iscale[0];
-				pos[1] = (v[1] - origin[1]) * iscale[1];
-				pos[2] = (v[2] - origin[2]) * iscale[2];
-
-				trivertx.v[0] = (unsigned char)bound(0.0f, pos[0], 255.0f);
-				trivertx.v[1] = (unsigned char)bound(0.0f, pos[1], 255.0f);
-				trivertx.v[2] = (unsigned char)bound(0.0f, pos[2], 255.0f);
-				trivertx.lightnormalindex = compress_normal(n);
-
-				if (k == 0 || trivertx.v[0] < simpleframe->bboxmin.v[0])
-					simpleframe->bboxmin.v[0] = trivertx.v[0];
-				if (k == 0 || trivertx.v[1] < simpleframe->bboxmin.v[1])
-					simpleframe->bboxmin.v[1] = trivertx.v[1];
-				if (k == 0 || trivertx.v[2] < simpleframe->bboxmin.v[2])
-					simpleframe->bboxmin.v[2] = trivertx.v[2];
-
-				if (k == 0 || trivertx.v[0] > simpleframe->bboxmax.v[0])
-					simpleframe->bboxmax.v[0] = trivertx.v[0];
-				if (k == 0 || trivertx.v[1] > simpleframe->bboxmax.v[1])
-					simpleframe->bboxmax.v[1] = trivertx.v[1];
-				if (k == 0 || trivertx.v[2] > simpleframe->bboxmax.v[2])
-					simpleframe->bboxmax.v[2] = trivertx.v[2];
-
-				if (aliasgroup)
-				{
-					if ((j == 0 && k == 0) || trivertx.v[0] < aliasgroup->bboxmin.v[0])
-						aliasgroup->bboxmin.v[0] = trivertx.v[0];
-					if ((j == 0 && k == 0) || trivertx.v[1] < aliasgroup->bboxmin.v[1])
-						aliasgroup->bboxmin.v[1] = trivertx.v[1];
-					if ((j == 0 && k == 0) || trivertx.v[2] < aliasgroup->bboxmin.v[2])
-						aliasgroup->bboxmin.v[2] = trivertx.v[2];
-
-					if ((j == 0 && k == 0) || trivertx.v[0] > aliasgroup->bboxmax.v[0])
-						aliasgroup->bboxmax.v[0] = trivertx.v[0];
-					if ((j == 0 && k == 0) || trivertx.v[1] > aliasgroup->bboxmax.v[1])
-						aliasgroup->bboxmax.v[1] = trivertx.v[1];
-					if ((j == 0 && k == 0) || trivertx.v[2] > aliasgroup->bboxmax.v[2])
-						aliasgroup->bboxmax.v[2] = trivertx.v[2];
-				}
-
-				xbuf_write_data(xbuf, sizeof(trivertx_t), &trivertx);
-			}
+			xbuf_write_data(xbuf, sizeof(daliasframe_t), &simpleframe);
+			xbuf_write_data(xbuf, sizeof(trivertx_t) * mesh->num_vertices, qj.vertices + offset * mesh->num_vertices);
 		}
 	}
 
+	qfree(qj.frames);
+	qfree(qj.vertices);
+
 /* done */
 	for (i = 0; i < model->total_skins; i++)
-		qfree(skinimages[i]);
+	{
+		for (j = 0; j < i && skinimages[j] != skinimages[i]; j++);
+		if (j == i)
+			qfree(skinimages[i]);
+	}
 	qfree(skinimages);
 
 /* print some compatibility notes (FIXME - split out to a separate function so we can also analyze existing MDLs for compatibility issues) */
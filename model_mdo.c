@@ -49,13 +49,6 @@ typedef struct mdo_frame_s
 	char name[16];
 } mdo_frame_t;
 
-/* intermediate (not disk) struct */
-typedef struct meshvert_s
-{
-	int vertex;
-	int s, t, back;
-} meshvert_t;
-
 /* data in mdo files is unaligned so we have to load it carefully (we can't
  * just load integers or structs straight from the file) */
 
@@ -196,6 +189,8 @@ static bool_t mdo_load_skins(const mdo_header_t *header, model_t *model, mem_poo
 	model->total_skins = mdo_count_skins(header, f);
 
 	mesh->skins = (meshskin_t*)mem_alloc(pool, sizeof(meshskin_t) * model->total_skins);
+	if (mesh->skins)
+		memset(mesh->skins, 0, sizeof(meshskin_t) * model->total_skins);
 
 	offset = 0;
 
@@ -323,6 +318,9 @@ static bool_t mdo_load_skins(const mdo_header_t *header, model_t *model, mem_poo
 				}
 			}
 
+			image_intern(mesh->skins[offset].components[SKIN_DIFFUSE]);
+			image_intern(mesh->skins[offset].components[SKIN_FULLBRIGHT]);
+
 			image_paletted_free(&image);
 		}
 	}
@@ -501,7 +499,8 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 	int i, j;
 	mdo_stvert_t *mdostverts;
 	mdo_triangle_t *mdotriangles;
-	meshvert_t *meshverts;
+	meshvert_map_t meshvert_map;
+	const meshvert_t *meshverts;
 	float iwidth, iheight;
 
 	if (out_error)
@@ -534,7 +533,7 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 
 /* allocate memory pool so we don't have to clean things up by hand if we have
  * to return an error somewhere in the middle of this function... */
-	pool = mem_create_pool();
+	pool = mem_create_arena();
 
 /* create mesh */
 	model.num_meshes = 1;
@@ -549,11 +548,18 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 	mesh->name = mem_copystring(pool, "mdomesh");
 
 /* load skins */
+	profile_push(PROFILE_SKINS);
 	if (!mdo_load_skins(&header, &model, pool, &f, out_error))
 	{
+	/* the pool doesn't own the skins' pixels */
+		for (i = 0; i < model.total_skins; i++)
+			for (j = 0; j < SKIN_NUMTYPES; j++)
+				image_free(&mesh->skins[i].components[j]);
+		profile_pop();
 		mem_free_pool(pool);
 		return false;
 	}
+	profile_pop();
 
 /* load skin vertices */
 	mdostverts = (mdo_stvert_t*)mem_alloc(pool, sizeof(mdo_stvert_t) * header.skin_vertex_count);
@@ -571,15 +577,11 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 	mesh->num_triangles = header.triangle_count;
 	mesh->triangle3i = (int*)mem_alloc(pool, sizeof(int) * mesh->num_triangles * 3);
 
-	mesh->num_vertices = 0;
-	meshverts = (meshvert_t*)mem_alloc(pool, sizeof(meshvert_t) * mesh->num_triangles * 3);
+	meshvert_map_init(&meshvert_map, pool, mesh->num_triangles * 3);
 	for (i = 0; i < mesh->num_triangles; i++)
 	{
 		for (j = 0; j < 3; j++)
 		{
-			int vertnum;
-			meshvert_t *mv;
-
 			int xyz = mdotriangles[i].vertindex[j];
 			int st = mdotriangles[i].skinvertindex[j];
 
@@ -588,21 +590,11 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 			int back = mdostverts[st].onseam && !mdotriangles[i].facesfront;
 
 		/* add the vertex if it doesn't exist, otherwise use the old one */
-			for (vertnum = 0, mv = meshverts; vertnum < mesh->num_vertices; vertnum++, mv++)
-				if (mv->vertex == xyz && mv->s == s && mv->t == t && mv->back == back)
-					break;
-			if (vertnum == mesh->num_vertices)
-			{
-				mv = &meshverts[mesh->num_vertices++];
-				mv->vertex = xyz;
-				mv->s = s;
-				mv->t = t;
-				mv->back = back;
-			}
-
-			mesh->triangle3i[i * 3 + j] = vertnum; /* (clockwise winding) */
+			mesh->triangle3i[i * 3 + j] = meshvert_map_add(&meshvert_map, xyz, s, t, back); /* (clockwise winding) */
 		}
 	}
+	mesh->num_vertices = meshvert_map.num_meshverts;
+	meshverts = meshvert_map.meshverts;
 
 	mem_free(mdostverts);
 	mem_free(mdotriangles);
@@ -629,9 +621,9 @@ bool_t model_mdo_load(void *filedata, size_t filesize, model_t *out_model, char
 	mdo_load_frames(&header, &model, meshverts, pool, &f);
 
 /* done */
-	mem_free(meshverts);
+	meshvert_map_free(&meshvert_map);
 
-	mem_merge_pool(pool);
+	model.pool = pool; /* the model owns the arena, freed in model_free */
 
 	model.flags = header.flags;
 	model.synctype = header.synctype;
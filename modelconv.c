@@ -18,33 +18,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "global.h"
+#include "cache.h"
 #include "model.h"
+#include "pack.h"
+#include "render.h"
 #include "shaders.h"
+#include "thread.h"
+#include "util.h"
 
-int texwidth = -1;
-int texheight = -1;
+/* read by the savers. per thread, since batches convert several models at once */
+THREAD_LOCAL int texwidth = -1;
+THREAD_LOCAL int texheight = -1;
 
-const char *g_skinpath = NULL;
-const char * g_skin_base_name = NULL;
+THREAD_LOCAL const char *g_skinpath = NULL;
+THREAD_LOCAL const char * g_skin_base_name = NULL;
 
-static model_t *model = NULL;
+/* everything needed to convert one model. anything that can change the
+ * output also goes into convert_cache_key */
+typedef struct convert_options_s
+{
+	char infilename[1024];
+	char outfilename[1024];
+	char texfilename[1024];
+	char skinpath[1024];
+	char skin_base_name[1024];
+	bool_t notex;
+	int texwidth;
+	int texheight;
+	int flags;
+	bool_t flags_specified;
+	int synctype;
+	bool_t synctype_specified;
+	float offsets[3];
+	bool_t offsets_specified;
+	bool_t renormal;
+	bool_t facet;
+	bool_t rename_frames;
+	bool_t frames_specified;
+	int firstframe, lastframe;
+	char renderfilename[1024];
+	int renderwidth;
+	int renderheight;
+	float renderangles[2]; /* yaw, pitch */
+	int renderframe;
+	int turntable; /* number of views around the model */
+} convert_options_t;
 
-static bool_t replacetexture(const char *filename)
+typedef struct convert_job_s
+{
+	convert_options_t options;
+	int result; /* exit code of the conversion */
+	char *error; /* NULL if the conversion succeeded */
+	double time;
+	profile_t profile; /* with -profile */
+} convert_job_t;
+
+static bool_t profiling = false;
+
+static cache_t *cache = NULL; /* with -cache */
+static unsigned long long cache_tool_hash; /* a rebuilt modelconv may convert differently */
+
+static bool_t replacetexture(model_t *model, const char *filename, char **out_error)
 {
-	char *error;
 	image_rgba_t *image;
 	int i;
 	mesh_t *mesh;
 
-	image = image_load_from_file(mem_globalpool, filename, &error);
+	image = image_load_from_file(mem_globalpool, filename, out_error);
 	if (!image)
-	{
-		fprintf(stderr, "Failed to load %s: %s.\n", filename, error);
-		qfree(error);
 		return false;
-	}
 
 /* clear old skins */
 	model_clear_skins(model);
@@ -182,25 +227,834 @@ void dump_txt(const char *filename, const model_t *model)
 }
 #endif
 
+
+static void init_convert_options(convert_options_t *options)
+{
+	memset(options, 0, sizeof(convert_options_t));
+	options->texwidth = -1;
+	options->texheight = -1;
+	options->renderwidth = 256;
+	options->renderheight = 256;
+	options->renderangles[0] = 30.0f;
+	options->renderangles[1] = 20.0f;
+	options->turntable = 1;
+}
+
+/* parses the option at argv[*i], moving *i past its arguments. returns 1 if it
+ * was a conversion option, 0 if it wasn't one, and -1 (after printing the
+ * problem, prefixed with context) if it was malformed */
+static int parse_conversion_option(const char *context, int argc, char **argv, int *i, convert_options_t *options)
+{
+	const char *option = argv[*i];
+	char *error;
+
+#define GET_ARGUMENT() \
+	if (++*i == argc) \
+	{ \
+		printf("%s: missing argument for option '%s'\n", context, option); \
+		return -1; \
+	}
+
+	if (!strcmp(option, "-notex"))
+	{
+		options->notex = true;
+	}
+	else if (!strcmp(option, "-tex"))
+	{
+		GET_ARGUMENT()
+		Q_strlcpy(options->texfilename, argv[*i], sizeof(options->texfilename));
+	}
+	else if (!strcmp(option, "-outtex"))
+	{
+		GET_ARGUMENT()
+		Q_strlcpy(options->skin_base_name, argv[*i], sizeof(options->skin_base_name));
+	}
+	else if (!strcmp(option, "-texwidth"))
+	{
+		GET_ARGUMENT()
+		options->texwidth = (int)atoi(argv[*i]);
+
+		if (options->texwidth < 1 || options->texwidth > 4096)
+		{
+			printf("%s: invalid value for option '-texwidth'\n", context);
+			return -1;
+		}
+	}
+	else if (!strcmp(option, "-texheight"))
+	{
+		GET_ARGUMENT()
+		options->texheight = (int)atoi(argv[*i]);
+
+		if (options->texheight < 1 || options->texheight > 4096)
+		{
+			printf("%s: invalid value for option '-texheight'\n", context);
+			return -1;
+		}
+	}
+	else if (!strcmp(option, "-skinpath"))
+	{
+		GET_ARGUMENT()
+		Q_strlcpy(options->skinpath, argv[*i], sizeof(options->skinpath));
+
+	/* parse the path, create missing directories, and normalize the path syntax to something like "folder/folder/folder" */
+		if (!makepath(options->skinpath, &error))
+		{
+			printf("failed to make skin path: %s\n", error);
+			qfree(error);
+			return -1;
+		}
+	}
+	else if (!strcmp(option, "-flags"))
+	{
+		GET_ARGUMENT()
+		options->flags = (int)atoi(argv[*i]);
+		options->flags_specified = true;
+	}
+	else if (!strcmp(option, "-synctype"))
+	{
+		GET_ARGUMENT()
+		if (!strcmp(argv[*i], "sync"))
+			options->synctype = 0;
+		else if (!strcmp(argv[*i], "rand"))
+			options->synctype = 1;
+		else
+		{
+			printf("%s: invalid value for option '-synctype' (accepted values: 'sync' (default), 'rand')\n", context);
+			return -1;
+		}
+
+		options->synctype_specified = true;
+	}
+	else if (!strcmp(option, "-offsets_x") || !strcmp(option, "-offsets_y") || !strcmp(option, "-offsets_z"))
+	{
+		GET_ARGUMENT()
+		options->offsets[option[9] - 'x'] = (float)atof(argv[*i]);
+		options->offsets_specified = true;
+	}
+	else if (!strcmp(option, "-renormal"))
+	{
+		options->renormal = true;
+	}
+	else if (!strcmp(option, "-facet"))
+	{
+		options->facet = true;
+	}
+	else if (!strcmp(option, "-rename_frames"))
+	{
+		options->rename_frames = true;
+	}
+	else if (!strcmp(option, "-render"))
+	{
+		GET_ARGUMENT()
+		Q_strlcpy(options->renderfilename, argv[*i], sizeof(options->renderfilename));
+	}
+	else if (!strcmp(option, "-rendersize"))
+	{
+		GET_ARGUMENT()
+		options->renderwidth = (int)atoi(argv[*i]);
+		GET_ARGUMENT()
+		options->renderheight = (int)atoi(argv[*i]);
+
+		if (options->renderwidth < 1 || options->renderwidth > 4096 || options->renderheight < 1 || options->renderheight > 4096)
+		{
+			printf("%s: invalid value for option '-rendersize'\n", context);
+			return -1;
+		}
+	}
+	else if (!strcmp(option, "-renderangles"))
+	{
+		GET_ARGUMENT()
+		options->renderangles[0] = (float)atof(argv[*i]);
+		GET_ARGUMENT()
+		options->renderangles[1] = (float)atof(argv[*i]);
+	}
+	else if (!strcmp(option, "-renderframe"))
+	{
+		GET_ARGUMENT()
+		options->renderframe = (int)atoi(argv[*i]);
+
+		if (options->renderframe < 0)
+		{
+			printf("%s: invalid value for option '-renderframe'\n", context);
+			return -1;
+		}
+	}
+	else if (!strcmp(option, "-frames"))
+	{
+		GET_ARGUMENT()
+		switch (sscanf(argv[*i], "%d-%d", &options->firstframe, &options->lastframe))
+		{
+		case 1:
+			options->lastframe = options->firstframe;
+			break;
+		case 2:
+			break;
+		default:
+			options->firstframe = -1;
+			break;
+		}
+
+		if (options->firstframe < 0 || options->lastframe < options->firstframe)
+		{
+			printf("%s: invalid value for option '-frames'\n", context);
+			return -1;
+		}
+		options->frames_specified = true;
+	}
+	else if (!strcmp(option, "-turntable"))
+	{
+		GET_ARGUMENT()
+		options->turntable = (int)atoi(argv[*i]);
+
+		if (options->turntable < 1 || options->turntable > 256)
+		{
+			printf("%s: invalid value for option '-turntable'\n", context);
+			return -1;
+		}
+	}
+	else
+	{
+		return 0;
+	}
+
+#undef GET_ARGUMENT
+
+	return 1;
+}
+
+/* draws the model's views side by side, in as square a grid as they fit */
+static bool_t render_views(const model_t *model, const convert_options_t *options, char **out_error)
+{
+	image_rgba_t *image;
+	render_view_t view;
+	float centre[3], radius;
+	int columns, rows, i;
+	bool_t ok;
+
+	for (columns = 1; columns * columns < options->turntable; columns++);
+	rows = (options->turntable + columns - 1) / columns;
+
+	image = image_createfill(mem_globalpool, columns * options->renderwidth, rows * options->renderheight, 0, 0, 0, 0);
+	if (!image)
+		return (void)(out_error && (*out_error = msprintf("couldn't allocate %dx%d image", columns * options->renderwidth, rows * options->renderheight))), false;
+
+/* every view frames the same sphere, and finding it goes through all the frames */
+	render_model_bounds(model, centre, &radius);
+
+	for (i = 0; i < options->turntable; i++)
+	{
+		render_view_init(&view, image);
+		view.x = (i % columns) * options->renderwidth;
+		view.y = (i / columns) * options->renderheight;
+		view.width = options->renderwidth;
+		view.height = options->renderheight;
+		view.yaw = options->renderangles[0] + 360.0f * i / options->turntable;
+		view.pitch = options->renderangles[1];
+		view.frame = options->renderframe;
+		view.bounds_known = true;
+		VectorCopy(view.centre, centre);
+		view.radius = radius;
+
+		render_model(image, model, &view);
+	}
+
+	ok = image_save(options->renderfilename, image, out_error);
+	image_free(&image);
+	return ok;
+}
+
+/* loads, modifies and saves a single model. progress is printed as it goes,
+ * failures are also returned in out_error. the return value is the exit code */
+static int convert(const convert_options_t *options, char **out_error)
+{
+	model_t *model;
+	char *error;
+	int i, j, k;
+
+	*out_error = NULL;
+
+	texwidth = options->texwidth;
+	texheight = options->texheight;
+	g_skinpath = options->skinpath[0] ? options->skinpath : NULL;
+	g_skin_base_name = options->skin_base_name[0] ? options->skin_base_name : NULL;
+
+	model = model_load_from_file(options->infilename, &error);
+	if (!model)
+	{
+		printf("Failed to load model: %s.\n", error);
+		*out_error = msprintf("failed to load model: %s", error);
+		qfree(error);
+		return 0;
+	}
+
+	printf("Loaded %s.\n", options->infilename);
+
+	if (options->frames_specified)
+	{
+		model_t *oldmodel = model;
+
+		if (options->lastframe >= model->num_frames)
+		{
+			printf("Can't extract frames %d-%d, the model has %d.\n", options->firstframe, options->lastframe, model->num_frames);
+			*out_error = msprintf("can't extract frames %d-%d, the model has %d", options->firstframe, options->lastframe, model->num_frames);
+			model_free(model);
+			return 1;
+		}
+
+	/* frames that weren't decoded yet never will be */
+		profile_push(PROFILE_PARSE);
+		model = model_clone_frames(oldmodel, options->firstframe, options->lastframe - options->firstframe + 1);
+		profile_pop();
+		model_free(oldmodel);
+	}
+
+	if (options->flags_specified)
+		model->flags = options->flags;
+	if (options->synctype_specified)
+		model->synctype = options->synctype;
+	if (options->offsets_specified)
+	{
+		model->offsets[0] = options->offsets[0];
+		model->offsets[1] = options->offsets[1];
+		model->offsets[2] = options->offsets[2];
+	}
+
+	if (options->notex)
+	{
+		model_clear_skins(model);
+	}
+
+	if (options->texfilename[0])
+	{
+		if (!replacetexture(model, options->texfilename, &error))
+		{
+			fprintf(stderr, "Failed to load %s: %s.\n", options->texfilename, error);
+			*out_error = msprintf("failed to load %s: %s", options->texfilename, error);
+			qfree(error);
+			model_free(model);
+			return 1;
+		}
+	}
+
+	if (texwidth > 0 || texheight > 0)
+	{
+		mesh_t *mesh;
+
+		for (i = 0, mesh = model->meshes; i < model->num_meshes; i++, mesh++)
+		{
+			for (j = 0; j < model->total_skins; j++)
+			{
+				for (k = 0; k < SKIN_NUMTYPES; k++)
+				{
+					if (mesh->skins[j].components[k])
+					{
+						image_rgba_t *oldimage = mesh->skins[j].components[k];
+						mesh->skins[j].components[k] = image_resize(mem_globalpool, oldimage, (texwidth > 0) ? texwidth : oldimage->width, (texheight > 0) ? texheight : oldimage->height);
+						image_free(&oldimage);
+						if (mesh->skins[j].components[k])
+							image_intern(mesh->skins[j].components[k]);
+					}
+				}
+			}
+		}
+	}
+
+	if (options->renormal)
+	{
+		profile_push(PROFILE_NORMALS);
+		model_recalculate_normals(model);
+		profile_pop();
+	}
+
+	if (options->facet)
+	{
+		profile_push(PROFILE_FACETIZE);
+		model_facetize(model);
+		profile_pop();
+	}
+
+	if (options->rename_frames)
+		model_rename_frames(model);
+
+	if (options->renderfilename[0])
+	{
+		bool_t ok;
+
+		if (options->renderframe >= model->num_frames)
+		{
+			printf("Can't render frame %d, the model has %d.\n", options->renderframe, model->num_frames);
+			*out_error = msprintf("can't render frame %d, the model has %d", options->renderframe, model->num_frames);
+			model_free(model);
+			return 1;
+		}
+
+		profile_push(PROFILE_RENDER);
+		ok = render_views(model, options, &error);
+		profile_pop();
+
+		if (!ok)
+		{
+			printf("Failed to render %s: %s.\n", options->renderfilename, error);
+			*out_error = msprintf("failed to render %s: %s", options->renderfilename, error);
+			qfree(error);
+			model_free(model);
+			return 1;
+		}
+
+		printf("Rendered %s.\n", options->renderfilename);
+	}
+
+	if (!options->outfilename[0])
+	{
+		if (!options->renderfilename[0])
+		{
+		/* TODO - print brief analysis of input file (further analysis done on option) */
+			printf("No output file specified.\n");
+		}
+	}
+	else
+	{
+		if (!model_save(options->outfilename, model, &error))
+		{
+			printf("Failed to save model: %s.\n", error);
+			*out_error = msprintf("failed to save model: %s", error);
+			qfree(error);
+		}
+	}
+
+	model_free(model);
+	return 0;
+}
+
+/* everything that can change what a conversion writes: the options, the
+ * bytes of the input and -tex files, and modelconv itself. other files the
+ * conversion reads are checked by the cache. false if the input or -tex file
+ * can't be read */
+static bool_t convert_cache_key(const convert_options_t *options, unsigned long long *out_key)
+{
+	unsigned long long key = cache_tool_hash;
+	const char *extension = strrchr(options->infilename, '.');
+	bool_t ok;
+
+#define HASH_STRING(s) key = hash_data64((s), strlen(s) + 1, key)
+#define HASH_VALUE(v) key = hash_data64(&(v), sizeof(v), key)
+
+/* the extension picks the loader, the rest of the name doesn't matter */
+	HASH_STRING(extension ? extension : "");
+	HASH_STRING(options->outfilename);
+	HASH_STRING(options->texfilename);
+	HASH_STRING(options->skinpath);
+	HASH_STRING(options->skin_base_name);
+	HASH_VALUE(options->notex);
+	HASH_VALUE(options->texwidth);
+	HASH_VALUE(options->texheight);
+	HASH_VALUE(options->flags);
+	HASH_VALUE(options->flags_specified);
+	HASH_VALUE(options->synctype);
+	HASH_VALUE(options->synctype_specified);
+	HASH_VALUE(options->offsets);
+	HASH_VALUE(options->offsets_specified);
+	HASH_VALUE(options->renormal);
+	HASH_VALUE(options->facet);
+	HASH_VALUE(options->rename_frames);
+	HASH_VALUE(options->frames_specified);
+	HASH_VALUE(options->firstframe);
+	HASH_VALUE(options->lastframe);
+	HASH_STRING(options->renderfilename);
+	HASH_VALUE(options->renderwidth);
+	HASH_VALUE(options->renderheight);
+	HASH_VALUE(options->renderangles);
+	HASH_VALUE(options->renderframe);
+	HASH_VALUE(options->turntable);
+
+#undef HASH_STRING
+#undef HASH_VALUE
+
+	profile_push(PROFILE_READ);
+	ok = cache_hash_file(options->infilename, &key) && (!options->texfilename[0] || cache_hash_file(options->texfilename, &key));
+	profile_pop();
+
+	*out_key = key;
+	return ok;
+}
+
+/* convert, unless the cache has the outputs of the same conversion already */
+static int convert_cached(const convert_options_t *options, char **out_error)
+{
+	unsigned long long key;
+	filelog_entry_t *entries;
+	char *error;
+	int ret, num_entries, i, j;
+
+/* let convert report the missing file */
+	if (!convert_cache_key(options, &key))
+		return convert(options, out_error);
+
+	if (cache_fetch(cache, key, &error))
+	{
+		printf("Restored the conversion of %s from the cache.\n", options->infilename);
+		*out_error = NULL;
+		return 0;
+	}
+
+	if (error)
+	{
+		printf("Failed to save model: %s.\n", error);
+		*out_error = msprintf("failed to save model: %s", error);
+		qfree(error);
+		return 0;
+	}
+
+	filelog_begin();
+	ret = convert(options, out_error);
+	entries = filelog_end(&num_entries);
+
+	if (!*out_error)
+	{
+	/* the input and -tex files are in the key already */
+		for (i = 0, j = 0; i < num_entries; i++)
+		{
+			if (!entries[i].written && (!strcmp(entries[i].filename, options->infilename) || !strcmp(entries[i].filename, options->texfilename)))
+				qfree(entries[i].filename);
+			else
+				entries[j++] = entries[i];
+		}
+		num_entries = j;
+
+		if (!cache_store(cache, key, entries, num_entries, &error))
+		{
+			printf("Failed to add %s to the cache: %s.\n", options->infilename, error);
+			qfree(error);
+		}
+	}
+
+	filelog_free(entries, num_entries);
+	return ret;
+}
+
+static void convert_job(void *data, int job)
+{
+	convert_job_t *jobs = (convert_job_t*)data;
+	double start = get_time();
+
+	if (profiling)
+		profile_begin(&jobs[job].profile);
+
+	if (cache)
+		jobs[job].result = convert_cached(&jobs[job].options, &jobs[job].error);
+	else
+		jobs[job].result = convert(&jobs[job].options, &jobs[job].error);
+	jobs[job].time = get_time() - start;
+
+	if (profiling)
+		profile_end();
+}
+
+static convert_job_t *add_job(convert_job_t **jobs, int *num_jobs, const convert_options_t *options)
+{
+	if (!(*num_jobs & (*num_jobs - 1)))
+	{
+		convert_job_t *newjobs = (convert_job_t*)qmalloc(sizeof(convert_job_t) * (*num_jobs ? *num_jobs * 2 : 16));
+		if (*num_jobs)
+			memcpy(newjobs, *jobs, sizeof(convert_job_t) * *num_jobs);
+		qfree(*jobs);
+		*jobs = newjobs;
+	}
+
+	memset(&(*jobs)[*num_jobs], 0, sizeof(convert_job_t));
+	(*jobs)[*num_jobs].options = *options;
+	return &(*jobs)[(*num_jobs)++];
+}
+
+static int compare_filenames(const void *a, const void *b)
+{
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/* one job per loadable model in the directory, saved to outdir with the new
+ * extension (if there is one). renders go beside them, named after the model
+ * with the extension of the -render file name. models that would get the same
+ * name (model.mdl and model.md2) keep their extension in it (model_mdl.md3).
+ * the jobs run at the same time, so each one's skins are named after its
+ * output too (model_skin0.pcx), in the skin path or else outdir. -outtex is a
+ * prefix for those names instead */
+static bool_t add_directory_jobs(const char *dirname, const char *outdir, const char *format, const convert_options_t *defaults, convert_job_t **jobs, int *num_jobs)
+{
+	convert_options_t options;
+	char basename[1024], otherbasename[1024];
+	const char *renderextension = strrchr(defaults->renderfilename, '.');
+	char **files, *c;
+	int num_files, first_job = *num_jobs, i, j, ret;
+
+	files = list_files(dirname, "", &num_files);
+	if (files)
+		qsort(files, num_files, sizeof(char*), compare_filenames);
+
+	for (i = 0; i < num_files; i++)
+	{
+		if (!model_can_load(files[i]))
+			continue;
+
+		strip_extension(files[i], basename);
+		for (j = 0; j < num_files; j++)
+		{
+			if (j != i && model_can_load(files[j]))
+			{
+				strip_extension(files[j], otherbasename);
+				if (!strcmp(basename, otherbasename))
+					break;
+			}
+		}
+		if (j < num_files)
+		{
+			Q_strlcpy(basename, files[i], sizeof(basename));
+			for (c = basename; *c; c++)
+				if (*c == '.')
+					*c = '_';
+		}
+
+	/* a truncated name would read or overwrite the wrong file */
+		options = *defaults;
+		if (defaults->skin_base_name[0])
+			ret = snprintf(options.skin_base_name, sizeof(options.skin_base_name), "%s%s_skin", defaults->skin_base_name, basename);
+		else
+			ret = snprintf(options.skin_base_name, sizeof(options.skin_base_name), "%s/%s_skin", defaults->skinpath[0] ? defaults->skinpath : outdir, basename);
+		if (snprintf(options.infilename, sizeof(options.infilename), "%s/%s", dirname, files[i]) >= (int)sizeof(options.infilename) ||
+			(format[0] && snprintf(options.outfilename, sizeof(options.outfilename), "%s/%s.%s", outdir, basename, format) >= (int)sizeof(options.outfilename)) ||
+			(defaults->renderfilename[0] && snprintf(options.renderfilename, sizeof(options.renderfilename), "%s/%s%s", outdir, basename, renderextension ? renderextension : ".tga") >= (int)sizeof(options.renderfilename)) ||
+			ret >= (int)sizeof(options.skin_base_name))
+		{
+			printf("Skipping %s/%s: file name too long.\n", dirname, files[i]);
+			continue;
+		}
+
+	/* two jobs writing the same file at once would clobber each other */
+		for (j = first_job; j < *num_jobs; j++)
+			if ((options.outfilename[0] && !strcmp(options.outfilename, (*jobs)[j].options.outfilename)) || (options.renderfilename[0] && !strcmp(options.renderfilename, (*jobs)[j].options.renderfilename)) || !strcmp(options.skin_base_name, (*jobs)[j].options.skin_base_name))
+				break;
+		if (j < *num_jobs)
+		{
+			printf("Skipping %s/%s: its output has the same name as %s's.\n", dirname, files[i], (*jobs)[j].options.infilename);
+			continue;
+		}
+
+		add_job(jobs, num_jobs, &options);
+	}
+
+	free_list_files(files, num_files);
+	return true;
+}
+
+/* manifest lines look like "infile outfile [options]", with arguments separated
+ * by whitespace or quoted, and # starting a comment. the options are added to
+ * the ones given on the command line */
+static bool_t add_manifest_jobs(const char *filename, const convert_options_t *defaults, convert_job_t **jobs, int *num_jobs)
+{
+	convert_options_t options;
+	char context[1100];
+	char *argv[64];
+	char *data, *s, *error;
+	int argc, line, i, ret;
+	size_t size;
+
+	if (!loadfile(filename, (void**)&data, &size, &error))
+	{
+		printf("Failed to load %s: %s.\n", filename, error);
+		qfree(error);
+		return false;
+	}
+
+	for (s = data, line = 1; *s; line++)
+	{
+	/* split the line into arguments, in place */
+		argc = 0;
+		for (;;)
+		{
+			while (*s == ' ' || *s == '\t' || *s == '\r')
+				s++;
+			if (!*s || *s == '\n' || *s == '#')
+				break;
+
+			if (argc == sizeof(argv) / sizeof(argv[0]))
+			{
+				printf("%s:%d: too many arguments\n", filename, line);
+				qfree(data);
+				return false;
+			}
+
+			if (*s == '"')
+			{
+				argv[argc++] = ++s;
+				while (*s && *s != '"' && *s != '\n')
+					s++;
+				if (*s == '"')
+					*s++ = '\0';
+			}
+			else
+			{
+				argv[argc++] = s;
+				while (*s && *s != ' ' && *s != '\t' && *s != '\r' && *s != '\n')
+					s++;
+			}
+
+			if (*s && *s != '\n')
+				*s++ = '\0';
+		}
+
+	/* skip the rest of the line */
+		while (*s && *s != '\n')
+			s++;
+		if (*s == '\n')
+			*s++ = '\0';
+
+		if (!argc)
+			continue;
+
+		sprintf(context, "%s:%d", filename, line);
+
+		if (argc < 2 || argv[0][0] == '-' || argv[1][0] == '-')
+		{
+			printf("%s: expected input and output file names\n", context);
+			qfree(data);
+			return false;
+		}
+
+		options = *defaults;
+		Q_strlcpy(options.infilename, argv[0], sizeof(options.infilename));
+		Q_strlcpy(options.outfilename, argv[1], sizeof(options.outfilename));
+
+		for (i = 2; i < argc; i++)
+		{
+			ret = parse_conversion_option(context, argc, argv, &i, &options);
+			if (!ret)
+				printf("%s: unrecognized option '%s'\n", context, argv[i]);
+			if (ret <= 0)
+			{
+				qfree(data);
+				return false;
+			}
+		}
+
+		add_job(jobs, num_jobs, &options);
+	}
+
+	qfree(data);
+	return true;
+}
+
+static void write_report(const char *filename, const convert_job_t *jobs, int num_jobs)
+{
+	FILE *fp;
+	int i;
+
+	if (!(fp = fopen(filename, "w")))
+	{
+		printf("Failed to write report to %s.\n", filename);
+		return;
+	}
+
+	for (i = 0; i < num_jobs; i++)
+		fprintf(fp, "%s\t%.3f\t%s\t%s\t%s\n", jobs[i].error ? "failed" : "ok", jobs[i].time, jobs[i].options.infilename, jobs[i].options.outfilename, jobs[i].error ? jobs[i].error : "");
+
+	fclose(fp);
+}
+
+/* stage totals over all jobs. peaks are the largest of any one job, since jobs
+ * running at once are counted on their own threads */
+static void print_profile(const convert_job_t *jobs, int num_jobs)
+{
+	profile_t total;
+	double stage_time = 0;
+	int i, j;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < num_jobs; i++)
+	{
+		const profile_t *profile = &jobs[i].profile;
+
+		for (j = 0; j < PROFILE_NUMSTAGES; j++)
+		{
+			total.time[j] += profile->time[j];
+			total.num_allocs[j] += profile->num_allocs[j];
+			total.peak_bytes[j] = max(total.peak_bytes[j], profile->peak_bytes[j]);
+		}
+		total.total_time += profile->total_time;
+		total.total_allocs += profile->total_allocs;
+		total.total_peak_bytes = max(total.total_peak_bytes, profile->total_peak_bytes);
+	}
+
+	printf("\n%-10s %10s %7s %10s %12s\n", "stage", "time (ms)", "%", "allocs", "peak (KiB)");
+	for (j = 0; j < PROFILE_NUMSTAGES; j++)
+	{
+		stage_time += total.time[j];
+		printf("%-10s %10.2f %6.1f%% %10lu %12.1f\n", profile_stage_names[j], total.time[j] * 1000.0, total.total_time > 0 ? total.time[j] * 100.0 / total.total_time : 0.0,
+			(unsigned long)total.num_allocs[j], total.peak_bytes[j] / 1024.0);
+	}
+	printf("%-10s %10.2f %6.1f%%\n", "other", (total.total_time - stage_time) * 1000.0, total.total_time > 0 ? (total.total_time - stage_time) * 100.0 / total.total_time : 0.0);
+	printf("%-10s %10.2f %6.1f%% %10lu %12.1f\n", "total", total.total_time * 1000.0, 100.0, (unsigned long)total.total_allocs, total.total_peak_bytes / 1024.0);
+}
+
+static void fprint_json_string(FILE *fp, const char *s)
+{
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+}
+
+static void write_profile_json(const char *filename, const convert_job_t *jobs, int num_jobs)
+{
+	FILE *fp;
+	int i, j;
+
+	if (!(fp = fopen(filename, "w")))
+	{
+		printf("Failed to write profile to %s.\n", filename);
+		return;
+	}
+
+	fprintf(fp, "{\n\t\"threads\": %d,\n\t\"jobs\": [\n", thread_num_workers());
+	for (i = 0; i < num_jobs; i++)
+	{
+		const profile_t *profile = &jobs[i].profile;
+
+		fprintf(fp, "\t\t{\n\t\t\t\"input\": \"");
+		fprint_json_string(fp, jobs[i].options.infilename);
+		fprintf(fp, "\",\n\t\t\t\"output\": \"");
+		fprint_json_string(fp, jobs[i].options.outfilename);
+		fprintf(fp, "\",\n\t\t\t\"ok\": %s,\n", jobs[i].error ? "false" : "true");
+		fprintf(fp, "\t\t\t\"total\": { \"ms\": %.3f, \"allocs\": %lu, \"peak_bytes\": %lu },\n", profile->total_time * 1000.0, (unsigned long)profile->total_allocs, (unsigned long)profile->total_peak_bytes);
+		fprintf(fp, "\t\t\t\"stages\": {\n");
+		for (j = 0; j < PROFILE_NUMSTAGES; j++)
+			fprintf(fp, "\t\t\t\t\"%s\": { \"ms\": %.3f, \"allocs\": %lu, \"peak_bytes\": %lu }%s\n", profile_stage_names[j], profile->time[j] * 1000.0,
+				(unsigned long)profile->num_allocs[j], (unsigned long)profile->peak_bytes[j], (j < PROFILE_NUMSTAGES - 1) ? "," : "");
+		fprintf(fp, "\t\t\t}\n\t\t}%s\n", (i < num_jobs - 1) ? "," : "");
+	}
+	fprintf(fp, "\t]\n}\n");
+
+	fclose(fp);
+}
+
 int main(int argc, char **argv)
 {
 	char *error;
-	char infilename[1024] = {0};
-	char outfilename[1024] = {0};
-	char texfilename[1024] = {0};
-	char skinpath[1024] = {0};
+	convert_options_t options;
 	char shaderbasepath[1024] = {0};
-	bool_t notex = false;
-	int flags = 0;
-	bool_t flags_specified = false;
-	int synctype = 0;
-	bool_t synctype_specified = false;
-	float offsets_x = 0.0f, offsets_y = 0.0f, offsets_z = 0.0f;
-	bool_t offsets_specified = false;
-	bool_t renormal = false;
-	bool_t facet = false;
-	bool_t rename_frames = false;
-	int i, j, k;
+	char batchname[1024] = {0};
+	char batchformat[64] = {0};
+	char reportfilename[1024] = {0};
+	char profilefilename[1024] = {0};
+	char cachedirectory[1024] = {0};
+	int cachesize = 256; /* megabytes */
+	convert_job_t *jobs = NULL;
+	int num_jobs = 0, num_failed;
+	double start;
+	int i, ret;
 
 	mem_init();
 
@@ -211,16 +1065,22 @@ int main(int argc, char **argv)
 	{
 		printf(
 "modelconv [options] -i infilename outfilename\n"
+"modelconv [options] -batch directory|manifest [outdirectory]\n"
 "Output format is specified by the file extension of outfilename.\n"
 "Options:\n"
 "  -i filename        specify the model to load (required).\n"
 "  -s path            specify the shader directory path (required if you want to output shaders)\n"
+"  -pak filename      read files that aren't on disk (models, skins, shaders)\n"
+"                     from a PAK or PK3 file, as if it was extracted into the\n"
+"                     current directory. Can be given more than once, later\n"
+"                     archives take precedence.\n"
 "  -notex             remove all existing skins from model after importing.\n"
 "  -tex filename      replace the model's texture with the given texture. This\n"
 "                     is required for any texture to be loaded onto MD2 or MD3\n"
 "                     models (the program doesn't automatically load external\n"
 "                     skins). Supported formats are PCX, TGA, and JPEG.\n"
-"  -outtex filename   set custom path for output skin for MD3 save (without extension).\n"
+"  -outtex filename   set custom path for output skin for MD2 and MD3 save\n"
+"                     (without extension).\n"
 "  -texwidth #        see below\n"
 "  -texheight #       resample the model's texture to the given dimensions.\n"
 "  -skinpath x        specify the path that skins will be exported to when\n"
@@ -237,21 +1097,68 @@ int main(int argc, char **argv)
 "                     format and is not used by Quake. It's only supported here\n"
 "                     for reasons of completeness.\n"
 "  -renormal          recalculate vertex normals.\n"
+"  -frames a-b        keep only frames a to b (counting from 0, a framegroup\n"
+"                     counts as one frame), or just frame a if there's no -b.\n"
 "  -rename_frames     rename all frames to \"frame1\", \"frame2\", etc.\n"
+"  -render filename   render a picture of the model (after the options above) to\n"
+"                     a TGA file, lit from the camera on a transparent\n"
+"                     background. In directory batches, each model's picture\n"
+"                     is saved in the output directory, named after the model.\n"
+"  -rendersize w h    size of the picture, or of each view (default: 256 256).\n"
+"  -renderangles y p  camera yaw and pitch in degrees (default: 30 20). Yaw 0\n"
+"                     looks at the front of the model.\n"
+"  -renderframe #     frame to render (default: 0).\n"
+"  -turntable #       render # views around the model, turning the yaw by an\n"
+"                     equal step each time, laid out in a grid.\n"
 "  -force             force \"yes\" response to all confirmation requests\n"
 "                     regarding overwriting existing files or creating\n"
 "                     nonexistent paths.\n"
 "  -noforce           force \"no\" (default) response to all confirmation requests\n"
 "                     regarding overwriting existing files or creating\n"
 "                     nonexistent paths.\n"
+"Batch options:\n"
+"  -batch x           convert many models at once. x is either a directory, in\n"
+"                     which case every model in it is converted to the format\n"
+"                     given with -format and saved to outdirectory (default: the\n"
+"                     same directory), or a manifest file with one conversion\n"
+"                     per line: \"infilename outfilename [options]\". Options\n"
+"                     given on the command line apply to every conversion.\n"
+"                     In directory batches, skins are named after the output\n"
+"                     (model_skin0.pcx) and saved in outdirectory, or the\n"
+"                     -skinpath. -outtex is a prefix for the names instead.\n"
+"  -format ext        output file extension for directory batches (e.g. md3).\n"
+"  -j #               number of conversions to run at once (default: one per\n"
+"                     CPU).\n"
+"  -report filename   write a tab separated line per conversion with its status,\n"
+"                     time in seconds, input, output and error.\n"
+"Profiling options:\n"
+"  -profile           print the time, allocation count and peak memory of each\n"
+"                     stage (read, parse, skins, resize, normals, facetize,\n"
+"                     palettize, write, render) after converting.\n"
+"  -profilejson file  also write the profile of every conversion as JSON.\n"
+"Cache options:\n"
+"  -cache directory   keep the files each conversion writes in the directory,\n"
+"                     and restore them instead of converting again while the\n"
+"                     input, skins, options and modelconv are unchanged. Not\n"
+"                     used with -s, since shaders are added to shared files.\n"
+"  -cachesize #       when done, remove the least recently used conversions\n"
+"                     until the cache fits in # megabytes (default: 256).\n"
 		);
 		return 0;
 	}
 
+	init_convert_options(&options);
+
 	for (i = 1; i < argc; i++)
 	{
 		if (argv[i][0] == '-')
 		{
+			ret = parse_conversion_option(argv[0], argc, argv, &i, &options);
+			if (ret < 0)
+				return 0;
+			if (ret > 0)
+				continue;
+
 			if (!strcmp(argv[i], "-i"))
 			{
 				if (++i == argc)
@@ -260,7 +1167,7 @@ int main(int argc, char **argv)
 					return 0;
 				}
 
-				Q_strlcpy(infilename, argv[i], sizeof(infilename));
+				Q_strlcpy(options.infilename, argv[i], sizeof(options.infilename));
 			}
 			else if (!strcmp(argv[i], "-s"))
 			{
@@ -272,157 +1179,107 @@ int main(int argc, char **argv)
 
 				Q_strlcpy(shaderbasepath, argv[i], sizeof(shaderbasepath));
 			}
-			else if (!strcmp(argv[i], "-notex"))
-			{
-				notex = true;
-			}
-			else if (!strcmp(argv[i], "-tex"))
+			else if (!strcmp(argv[i], "-pak"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-tex'\n", argv[0]);
+					printf("%s: missing argument for option '-pak'\n", argv[0]);
 					return 0;
 				}
 
-				Q_strlcpy(texfilename, argv[i], sizeof(texfilename));
-			}
-			else if (!strcmp(argv[i], "-outtex"))
-			{
-				if (++i == argc)
+				if (!pack_mount(argv[i], &error))
 				{
-					printf("%s: missing argument for option '-outtex'\n", argv[0]);
-					return 0;
+					printf("Failed to mount %s: %s.\n", argv[i], error);
+					qfree(error);
+					return 1;
 				}
-
-				g_skin_base_name = argv[i];
 			}
-			else if (!strcmp(argv[i], "-texwidth"))
+			else if (!strcmp(argv[i], "-batch"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-texwidth'\n", argv[0]);
+					printf("%s: missing argument for option '-batch'\n", argv[0]);
 					return 0;
 				}
 
-				texwidth = (int)atoi(argv[i]);
-
-				if (texwidth < 1 || texwidth > 4096)
-				{
-					printf("%s: invalid value for option '-texwidth'\n", argv[0]);
-					return 0;
-				}
+				Q_strlcpy(batchname, argv[i], sizeof(batchname));
 			}
-			else if (!strcmp(argv[i], "-texheight"))
+			else if (!strcmp(argv[i], "-format"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-texheight'\n", argv[0]);
+					printf("%s: missing argument for option '-format'\n", argv[0]);
 					return 0;
 				}
 
-				texheight = (int)atoi(argv[i]);
-
-				if (texheight < 1 || texheight > 4096)
-				{
-					printf("%s: invalid value for option '-texheight'\n", argv[0]);
-					return 0;
-				}
+				Q_strlcpy(batchformat, argv[i][0] == '.' ? argv[i] + 1 : argv[i], sizeof(batchformat));
 			}
-			else if (!strcmp(argv[i], "-skinpath"))
+			else if (!strcmp(argv[i], "-j"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for options '-skinpath'\n", argv[0]);
+					printf("%s: missing argument for option '-j'\n", argv[0]);
 					return 0;
 				}
 
-				Q_strlcpy(skinpath, argv[i], sizeof(skinpath));
+				g_num_threads = (int)atoi(argv[i]);
 
-			/* parse the path, create missing directories, and normalize the path syntax to something like "folder/folder/folder" */
-				if (!makepath(skinpath, &error))
+				if (g_num_threads < 1)
 				{
-					printf("failed to make skin path: %s\n", error);
-					qfree(error);
+					printf("%s: invalid value for option '-j'\n", argv[0]);
 					return 0;
 				}
-
-				g_skinpath = skinpath;
 			}
-			else if (!strcmp(argv[i], "-flags"))
+			else if (!strcmp(argv[i], "-report"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-flags'\n", argv[0]);
+					printf("%s: missing argument for option '-report'\n", argv[0]);
 					return 0;
 				}
 
-				flags = (int)atoi(argv[i]);
-				flags_specified = true;
+				Q_strlcpy(reportfilename, argv[i], sizeof(reportfilename));
+			}
+			else if (!strcmp(argv[i], "-profile"))
+			{
+				profiling = true;
 			}
-			else if (!strcmp(argv[i], "-synctype"))
+			else if (!strcmp(argv[i], "-profilejson"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-synctype'\n", argv[0]);
+					printf("%s: missing argument for option '-profilejson'\n", argv[0]);
 					return 0;
 				}
 
-				if (!strcmp(argv[i], "sync"))
-					synctype = 0;
-				else if (!strcmp(argv[i], "rand"))
-					synctype = 1;
-				else
-				{
-					printf("%s: invalid value for option '-synctype' (accepted values: 'sync' (default), 'rand')\n", argv[0]);
-					return 0;
-				}
-
-				synctype_specified = true;
+				Q_strlcpy(profilefilename, argv[i], sizeof(profilefilename));
+				profiling = true;
 			}
-			else if (!strcmp(argv[i], "-offsets_x"))
+			else if (!strcmp(argv[i], "-cache"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-offsets_x'\n", argv[0]);
+					printf("%s: missing argument for option '-cache'\n", argv[0]);
 					return 0;
 				}
 
-				offsets_x = (float)atof(argv[i]);
-				offsets_specified = true;
+				Q_strlcpy(cachedirectory, argv[i], sizeof(cachedirectory));
 			}
-			else if (!strcmp(argv[i], "-offsets_y"))
+			else if (!strcmp(argv[i], "-cachesize"))
 			{
 				if (++i == argc)
 				{
-					printf("%s: missing argument for option '-offsets_y'\n", argv[0]);
+					printf("%s: missing argument for option '-cachesize'\n", argv[0]);
 					return 0;
 				}
 
-				offsets_y = (float)atof(argv[i]);
-				offsets_specified = true;
-			}
-			else if (!strcmp(argv[i], "-offsets_z"))
-			{
-				if (++i == argc)
+				cachesize = (int)atoi(argv[i]);
+
+				if (cachesize < 0)
 				{
-					printf("%s: missing argument for option '-offsets_z'\n", argv[0]);
+					printf("%s: invalid value for option '-cachesize'\n", argv[0]);
 					return 0;
 				}
-
-				offsets_z = (float)atof(argv[i]);
-				offsets_specified = true;
-			}
-			else if (!strcmp(argv[i], "-renormal"))
-			{
-				renormal = true;
-			}
-			else if (!strcmp(argv[i], "-facet"))
-			{
-				facet = true;
-			}
-			else if (!strcmp(argv[i], "-rename_frames"))
-			{
-				rename_frames = true;
 			}
 			else if (!strcmp(argv[i], "-force"))
 			{
@@ -440,14 +1297,58 @@ int main(int argc, char **argv)
 		}
 		else
 		{
-			Q_strlcpy(outfilename, argv[i], sizeof(outfilename));
+			Q_strlcpy(options.outfilename, argv[i], sizeof(options.outfilename));
 		}
 	}
 
-	if (!infilename[0])
+	if (batchname[0])
 	{
-		printf("No input file specified.\n");
-		return 0;
+		struct stat st;
+
+		if (stat(batchname, &st) != 0)
+		{
+			printf("Couldn't open %s.\n", batchname);
+			return 1;
+		}
+
+		if ((st.st_mode & S_IFMT) == S_IFDIR)
+		{
+			char outdir[1024];
+
+			if (!batchformat[0] && !options.renderfilename[0])
+			{
+				printf("%s: option '-format' or '-render' is required to convert a directory\n", argv[0]);
+				return 1;
+			}
+
+		/* the positional argument names the output directory */
+			Q_strlcpy(outdir, options.outfilename[0] ? options.outfilename : batchname, sizeof(outdir));
+			if (!makepath(outdir, &error))
+			{
+				printf("failed to make output path: %s\n", error);
+				qfree(error);
+				return 1;
+			}
+
+			options.outfilename[0] = '\0';
+			if (!add_directory_jobs(batchname, outdir, batchformat, &options, &jobs, &num_jobs))
+				return 1;
+		}
+		else
+		{
+			if (!add_manifest_jobs(batchname, &options, &jobs, &num_jobs))
+				return 1;
+		}
+	}
+	else
+	{
+		if (!options.infilename[0])
+		{
+			printf("No input file specified.\n");
+			return 0;
+		}
+
+		add_job(&jobs, &num_jobs, &options);
 	}
 
 	if (shaderbasepath[0])
@@ -460,90 +1361,66 @@ int main(int argc, char **argv)
 		 }
 	}
 
-	model = model_load_from_file(infilename, &error);
-	if (!model)
-	{
-		printf("Failed to load model: %s.\n", error);
-		qfree(error);
-		return 0;
-	}
-
-	printf("Loaded %s.\n", infilename);
-
-	if (flags_specified)
-		model->flags = flags;
-	if (synctype_specified)
-		model->synctype = synctype;
-	if (offsets_specified)
-	{
-		model->offsets[0] = offsets_x;
-		model->offsets[1] = offsets_y;
-		model->offsets[2] = offsets_z;
-	}
-
-	if (notex)
-	{
-		model_clear_skins(model);
-	}
-
-	if (texfilename[0])
+	if (cachedirectory[0] && !shaderbasepath[0])
 	{
-		if (!replacetexture(texfilename))
+		cache = cache_open(cachedirectory, (unsigned long long)cachesize * 1024 * 1024, &error);
+		if (!cache)
 		{
-			model_free(model);
+			printf("Failed to open cache: %s.\n", error);
+			qfree(error);
 			return 1;
 		}
+
+		cache_tool_hash = hash_data64("modelconv", 9, 0);
+		if (!cache_hash_file("/proc/self/exe", &cache_tool_hash))
+			cache_hash_file(argv[0], &cache_tool_hash);
 	}
 
-	if (texwidth > 0 || texheight > 0)
-	{
-		mesh_t *mesh;
+	start = get_time();
 
-		for (i = 0, mesh = model->meshes; i < model->num_meshes; i++, mesh++)
-		{
-			for (j = 0; j < model->total_skins; j++)
-			{
-				for (k = 0; k < SKIN_NUMTYPES; k++)
-				{
-					if (mesh->skins[j].components[k])
-					{
-						image_rgba_t *oldimage = mesh->skins[j].components[k];
-						mesh->skins[j].components[k] = image_resize(mem_globalpool, oldimage, (texwidth > 0) ? texwidth : oldimage->width, (texheight > 0) ? texheight : oldimage->height);
-						image_free(&oldimage);
-					}
-				}
-			}
-		}
+	thread_run(num_jobs, convert_job, jobs);
+
+	if (shaderbasepath[0])
+	{
+		write_shaders();
 	}
 
-	if (renormal)
-		model_recalculate_normals(model);
+	if (reportfilename[0])
+		write_report(reportfilename, jobs, num_jobs);
 
-	if (facet)
-		model_facetize(model);
+	if (profiling)
+		print_profile(jobs, num_jobs);
+	if (profilefilename[0])
+		write_profile_json(profilefilename, jobs, num_jobs);
 
-	if (rename_frames)
-		model_rename_frames(model);
-
-	if (!outfilename[0])
+	ret = 0;
+	num_failed = 0;
+	for (i = 0; i < num_jobs; i++)
 	{
-	/* TODO - print brief analysis of input file (further analysis done on option) */
-		printf("No output file specified.\n");
+		if (jobs[i].error)
+			num_failed++;
+		ret = max(ret, jobs[i].result);
+		qfree(jobs[i].error);
 	}
-	else
+
+	if (batchname[0])
 	{
-		if (!model_save(outfilename, model, &error))
-		{
-			printf("Failed to save model: %s.\n", error);
-			qfree(error);
-		}
+		printf("Converted %d of %d models in %.2f seconds.\n", num_jobs - num_failed, num_jobs, get_time() - start);
+
+		if (num_failed)
+			ret = 1;
 	}
 
-	if (shaderbasepath[0])
+	if (cache)
 	{
-		write_shaders();
+		cache_stats_t stats;
+
+		cache_trim(cache);
+		cache_get_stats(cache, &stats);
+		printf("Cache: %d hits, %d misses, %d stored, %d evicted, %.1f MiB in use.\n", stats.hits, stats.misses, stats.stores, stats.evictions, stats.bytes / (1024.0 * 1024.0));
+		cache_close(cache);
 	}
 
-	model_free(model);
-	return 0;
+	qfree(jobs);
+	return ret;
 }
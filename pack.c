@@ -0,0 +1,591 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+#include "global.h"
+#include "pack.h"
+#include "thread.h"
+
+/*
+=================================================================
+
+  Minimal set of definitions from zlib, which is only loaded
+  once a compressed file is read
+
+=================================================================
+*/
+
+#define Z_OK 0
+#define Z_STREAM_END 1
+#define Z_FINISH 4
+#define MAX_WBITS 15
+
+typedef struct z_stream_s
+{
+	const unsigned char *next_in;
+	unsigned int avail_in;
+	unsigned long total_in;
+
+	unsigned char *next_out;
+	unsigned int avail_out;
+	unsigned long total_out;
+
+	const char *msg;
+	void *state;
+
+	void *zalloc; /* NULL for the default allocator */
+	void *zfree;
+	void *opaque;
+
+	int data_type;
+	unsigned long adler;
+	unsigned long reserved;
+} z_stream;
+
+static int (*qz_inflateInit2_) (z_stream *strm, int windowBits, const char *version, int stream_size);
+static int (*qz_inflate) (z_stream *strm, int flush);
+static int (*qz_inflateEnd) (z_stream *strm);
+
+static dllfunction_t zlibfuncs[] =
+{
+	{ "inflateInit2_", (void**)&qz_inflateInit2_ },
+	{ "inflate",       (void**)&qz_inflate },
+	{ "inflateEnd",    (void**)&qz_inflateEnd },
+	{ NULL, NULL }
+};
+
+static dllhandle_t zlibdll = 0;
+
+static void zlib_closelibrary(void)
+{
+	unloadlibrary(&zlibdll);
+	zlibdll = NULL;
+}
+
+static void zlib_loadlibrary(void)
+{
+#if defined(WIN32)
+	if (!loadlibrary("zlib1.dll", &zlibdll, zlibfuncs))
+		return;
+#elif defined(MACOSX)
+	if (!loadlibrary("libz.dylib", &zlibdll, zlibfuncs))
+		return;
+#else
+	if (!loadlibrary("libz.so.1", &zlibdll, zlibfuncs) &&
+	    !loadlibrary("libz.so", &zlibdll, zlibfuncs))
+		return;
+#endif
+
+	add_atexit_event(zlib_closelibrary);
+}
+
+/* the library is loaded once, the first time any thread needs it */
+static bool_t zlib_openlibrary(void)
+{
+	static volatile int done = 0;
+
+	thread_once(&done, zlib_loadlibrary);
+
+	return zlibdll != NULL;
+}
+
+/*
+=================================================================
+
+  Archives
+
+=================================================================
+*/
+
+#define PACK_MAX_PATH 256
+
+/* in a zip, offset is the entry's local header, since the extra field there
+ * (and so where the data starts) can differ from the central directory's */
+typedef struct pack_entry_s
+{
+	char *name;
+	int archive;
+	size_t offset;
+	size_t size;
+	size_t compressed_size;
+	bool_t deflated;
+} pack_entry_t;
+
+typedef struct pack_archive_s
+{
+	char *filename;
+	bool_t zip;
+	filemap_t filemap;
+#ifndef WIN32
+	int fd; /* for mapping stored files on their own */
+#endif
+} pack_archive_t;
+
+static pack_archive_t *pack_archives = NULL;
+static int pack_num_archives = 0;
+
+/* the entries of every archive in the order they were mounted, looked up by
+ * name through pack_index, which holds only the one that takes precedence */
+static pack_entry_t *pack_entries = NULL;
+static int pack_num_entries = 0;
+static int pack_max_entries = 0;
+static hashindex_t *pack_index = NULL;
+
+static unsigned int pack_read16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int pack_read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* the name as it would be stored: forward slashes and no leading "./" */
+static bool_t pack_normalize(const char *filename, char *out_name)
+{
+	size_t i;
+
+	while (filename[0] == '.' && (filename[1] == '/' || filename[1] == '\\'))
+		filename += 2;
+
+	for (i = 0; filename[i]; i++)
+	{
+		if (i == PACK_MAX_PATH - 1)
+			return false;
+		out_name[i] = (filename[i] == '\\') ? '/' : filename[i];
+	}
+	out_name[i] = '\0';
+	return true;
+}
+
+static void pack_add_entry(const char *name, int archive, size_t offset, size_t size, size_t compressed_size, bool_t deflated)
+{
+	pack_entry_t *entry;
+
+	if (pack_num_entries == pack_max_entries)
+	{
+		pack_entry_t *newentries;
+
+		pack_max_entries = pack_max_entries ? pack_max_entries * 2 : 256;
+		newentries = (pack_entry_t*)qmalloc(sizeof(pack_entry_t) * pack_max_entries);
+		if (pack_num_entries)
+			memcpy(newentries, pack_entries, sizeof(pack_entry_t) * pack_num_entries);
+		qfree(pack_entries);
+		pack_entries = newentries;
+	}
+
+	entry = &pack_entries[pack_num_entries++];
+	entry->name = copystring(name);
+	entry->archive = archive;
+	entry->offset = offset;
+	entry->size = size;
+	entry->compressed_size = compressed_size;
+	entry->deflated = deflated;
+}
+
+static int pack_find_index(const char *name)
+{
+	unsigned int key = hash_data(name, strlen(name), 0);
+	int i;
+
+	for (i = hashindex_first(pack_index, key); i != -1; i = hashindex_next(pack_index, i))
+		if (!strcmp(pack_entries[i].name, name))
+			return i;
+	return -1;
+}
+
+static const pack_entry_t *pack_find(const char *filename)
+{
+	char name[PACK_MAX_PATH];
+	int i;
+
+	if (!pack_index || !pack_normalize(filename, name))
+		return NULL;
+
+	i = pack_find_index(name);
+	return (i >= 0) ? &pack_entries[i] : NULL;
+}
+
+/* newest entries first, so they hide older ones with the same name */
+static void pack_build_index(void)
+{
+	int i;
+
+	hashindex_free(pack_index);
+	pack_index = hashindex_create(pack_num_entries, pack_num_entries);
+
+	for (i = pack_num_entries - 1; i >= 0; i--)
+		if (pack_find_index(pack_entries[i].name) < 0)
+			hashindex_add(pack_index, hash_data(pack_entries[i].name, strlen(pack_entries[i].name), 0), i);
+}
+
+static bool_t pack_read_pak(int archive, const unsigned char *data, size_t size, char **out_error)
+{
+	char name[PACK_MAX_PATH];
+	int dirofs, dirlen, filepos, filelen, i;
+
+	if (size < 12)
+		return (void)(out_error && (*out_error = msprintf("file is too small"))), false;
+
+	memcpy(&dirofs, data + 4, 4);
+	memcpy(&dirlen, data + 8, 4);
+	dirofs = LittleLong(dirofs);
+	dirlen = LittleLong(dirlen);
+
+	if (dirofs < 0 || dirlen < 0 || dirlen % 64 || (size_t)dirofs + (size_t)dirlen > size)
+		return (void)(out_error && (*out_error = msprintf("directory is out of bounds"))), false;
+
+	for (i = 0; i < dirlen / 64; i++)
+	{
+		const unsigned char *dfile = data + dirofs + i * 64;
+
+		memcpy(name, dfile, 56);
+		name[56] = '\0';
+		memcpy(&filepos, dfile + 56, 4);
+		memcpy(&filelen, dfile + 60, 4);
+		filepos = LittleLong(filepos);
+		filelen = LittleLong(filelen);
+
+		if (filepos < 0 || filelen < 0 || (size_t)filepos + (size_t)filelen > size)
+			return (void)(out_error && (*out_error = msprintf("%s is out of bounds", name))), false;
+
+		pack_add_entry(name, archive, filepos, filelen, filelen, false);
+	}
+
+	return true;
+}
+
+static bool_t pack_read_zip(int archive, const unsigned char *data, size_t size, char **out_error)
+{
+	char name[PACK_MAX_PATH];
+	const unsigned char *end = data + size, *p, *q;
+	unsigned int num_files, dirofs, dirsize, i;
+
+/* the end of central directory record is followed by a comment of up to 64k */
+	if (size < 22)
+		return (void)(out_error && (*out_error = msprintf("not a PAK or zip file"))), false;
+	for (p = end - 22; p > data && p > end - 22 - 65535 && pack_read32(p) != 0x06054b50; p--);
+	if (pack_read32(p) != 0x06054b50)
+		return (void)(out_error && (*out_error = msprintf("not a PAK or zip file"))), false;
+
+	num_files = pack_read16(p + 10);
+	dirsize = pack_read32(p + 12);
+	dirofs = pack_read32(p + 16);
+
+	if (num_files == 0xffff || dirofs == 0xffffffff)
+		return (void)(out_error && (*out_error = msprintf("zip64 archives are not supported"))), false;
+	if ((size_t)dirofs + dirsize > size)
+		return (void)(out_error && (*out_error = msprintf("central directory is out of bounds"))), false;
+
+	for (i = 0, q = data + dirofs; i < num_files; i++)
+	{
+		unsigned int flags, method, namelen;
+
+		if (q + 46 > end || pack_read32(q) != 0x02014b50)
+			return (void)(out_error && (*out_error = msprintf("corrupt central directory"))), false;
+
+		flags = pack_read16(q + 8);
+		method = pack_read16(q + 10);
+		namelen = pack_read16(q + 28);
+
+		if (q + 46 + namelen > end)
+			return (void)(out_error && (*out_error = msprintf("corrupt central directory"))), false;
+
+	/* skip directories, encrypted files, and anything neither stored nor deflated */
+		if (namelen && namelen < PACK_MAX_PATH && q[46 + namelen - 1] != '/' && !(flags & 1) && (method == 0 || method == 8))
+		{
+		/* stored files are read and mapped by their size, only the compressed size is checked against the archive */
+			if (method == 0 && pack_read32(q + 24) != pack_read32(q + 20))
+				return (void)(out_error && (*out_error = msprintf("corrupt central directory"))), false;
+
+			memcpy(name, q + 46, namelen);
+			name[namelen] = '\0';
+			pack_add_entry(name, archive, pack_read32(q + 42), pack_read32(q + 24), pack_read32(q + 20), method == 8);
+		}
+
+		q += 46 + namelen + pack_read16(q + 30) + pack_read16(q + 32);
+	}
+
+	return true;
+}
+
+bool_t pack_mount(const char *filename, char **out_error)
+{
+	pack_archive_t *archive;
+	filemap_t filemap;
+	bool_t ok;
+	char *error;
+	int first_entry = pack_num_entries, i;
+
+	if (!mapfile(filename, &filemap, out_error))
+		return false;
+
+	if (!pack_num_archives)
+		add_atexit_event(pack_unmount_all);
+
+	if (!(pack_num_archives & (pack_num_archives - 1)))
+	{
+		pack_archive_t *newarchives = (pack_archive_t*)qmalloc(sizeof(pack_archive_t) * (pack_num_archives ? pack_num_archives * 2 : 1));
+		if (pack_num_archives)
+			memcpy(newarchives, pack_archives, sizeof(pack_archive_t) * pack_num_archives);
+		qfree(pack_archives);
+		pack_archives = newarchives;
+	}
+
+	if (filemap.size >= 4 && !memcmp(filemap.data, "PACK", 4))
+		ok = pack_read_pak(pack_num_archives, (const unsigned char*)filemap.data, filemap.size, &error);
+	else
+		ok = pack_read_zip(pack_num_archives, (const unsigned char*)filemap.data, filemap.size, &error);
+
+	if (!ok)
+	{
+		for (i = first_entry; i < pack_num_entries; i++)
+			qfree(pack_entries[i].name);
+		pack_num_entries = first_entry;
+		unmapfile(&filemap);
+
+		if (out_error)
+			*out_error = error;
+		else
+			qfree(error);
+		return false;
+	}
+
+	archive = &pack_archives[pack_num_archives];
+	archive->filename = copystring(filename);
+	archive->zip = memcmp(filemap.data, "PACK", 4) != 0;
+	archive->filemap = filemap;
+#ifndef WIN32
+	archive->fd = open(filename, O_RDONLY);
+#endif
+	pack_num_archives++;
+
+	pack_build_index();
+	return true;
+}
+
+void pack_unmount_all(void)
+{
+	int i;
+
+	for (i = 0; i < pack_num_entries; i++)
+		qfree(pack_entries[i].name);
+	qfree(pack_entries);
+	pack_entries = NULL;
+	pack_num_entries = 0;
+	pack_max_entries = 0;
+
+	hashindex_free(pack_index);
+	pack_index = NULL;
+
+	for (i = 0; i < pack_num_archives; i++)
+	{
+		qfree(pack_archives[i].filename);
+		unmapfile(&pack_archives[i].filemap);
+#ifndef WIN32
+		if (pack_archives[i].fd >= 0)
+			close(pack_archives[i].fd);
+#endif
+	}
+	qfree(pack_archives);
+	pack_archives = NULL;
+	pack_num_archives = 0;
+}
+
+/* where the entry's (possibly compressed) data starts in its archive */
+static bool_t pack_data_offset(const pack_entry_t *entry, size_t *out_offset, char **out_error)
+{
+	const pack_archive_t *archive = &pack_archives[entry->archive];
+	const unsigned char *header = (const unsigned char*)archive->filemap.data + entry->offset;
+	size_t offset = entry->offset;
+
+	if (archive->zip)
+	{
+		if (entry->offset + 30 > archive->filemap.size || pack_read32(header) != 0x04034b50)
+			return (void)(out_error && (*out_error = msprintf("%s: corrupt local header for %s", archive->filename, entry->name))), false;
+
+		offset += 30 + pack_read16(header + 26) + pack_read16(header + 28);
+	}
+
+	if (offset + entry->compressed_size > archive->filemap.size)
+		return (void)(out_error && (*out_error = msprintf("%s: %s is out of bounds", archive->filename, entry->name))), false;
+
+	*out_offset = offset;
+	return true;
+}
+
+/* into a new buffer, NUL terminated like loadfile's */
+static void *pack_read(const pack_entry_t *entry, size_t offset, char **out_error)
+{
+	const pack_archive_t *archive = &pack_archives[entry->archive];
+	const unsigned char *in = (const unsigned char*)archive->filemap.data + offset;
+	unsigned char *out;
+	z_stream stream;
+	int ret;
+
+	out = (unsigned char*)qmalloc(entry->size + 1);
+	out[entry->size] = 0;
+
+	if (!entry->deflated)
+	{
+		memcpy(out, in, entry->size);
+		return out;
+	}
+
+	if (!zlib_openlibrary())
+	{
+		qfree(out);
+		return (void)(out_error && (*out_error = msprintf("%s is compressed, and zlib couldn't be loaded", entry->name))), NULL;
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	if (qz_inflateInit2_(&stream, -MAX_WBITS, "1.2.3", (int)sizeof(stream)) != Z_OK)
+	{
+		qfree(out);
+		return (void)(out_error && (*out_error = msprintf("couldn't start inflating %s", entry->name))), NULL;
+	}
+
+	stream.next_in = in;
+	stream.avail_in = (unsigned int)entry->compressed_size;
+	stream.next_out = out;
+	stream.avail_out = (unsigned int)entry->size;
+
+	ret = qz_inflate(&stream, Z_FINISH);
+	qz_inflateEnd(&stream);
+
+	if (ret != Z_STREAM_END || stream.total_out != entry->size)
+	{
+		qfree(out);
+		return (void)(out_error && (*out_error = msprintf("%s: corrupt compressed data in %s", archive->filename, entry->name))), NULL;
+	}
+
+	return out;
+}
+
+bool_t pack_loadfile(const char *filename, void **out_data, size_t *out_size, bool_t *out_found, char **out_error)
+{
+	const pack_entry_t *entry = pack_find(filename);
+	size_t offset;
+	void *data;
+
+	*out_found = (entry != NULL);
+	if (!entry)
+		return false;
+
+	if (!pack_data_offset(entry, &offset, out_error) || !(data = pack_read(entry, offset, out_error)))
+		return false;
+
+	*out_data = data;
+	if (out_size)
+		*out_size = entry->size;
+	return true;
+}
+
+bool_t pack_mapfile(const char *filename, filemap_t *out_map, bool_t *out_found, char **out_error)
+{
+	const pack_entry_t *entry = pack_find(filename);
+	size_t offset;
+	void *data;
+
+	*out_found = (entry != NULL);
+	if (!entry)
+		return false;
+
+	if (!pack_data_offset(entry, &offset, out_error))
+		return false;
+
+#ifndef WIN32
+/* a private mapping of just the file's pages, which (like mapfile's) can be
+ * written to. the NUL terminator goes over the next byte of the archive,
+ * copying only that page, so the file can't be the last thing in it */
+	if (!entry->deflated && pack_archives[entry->archive].fd >= 0 && offset + entry->size < pack_archives[entry->archive].filemap.size)
+	{
+		long pagesize = sysconf(_SC_PAGESIZE);
+		size_t mapoffset = (pagesize > 0) ? offset % (size_t)pagesize : 0;
+
+		data = mmap(NULL, mapoffset + entry->size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, pack_archives[entry->archive].fd, (off_t)(offset - mapoffset));
+		if (data != MAP_FAILED)
+		{
+			unsigned char *p = (unsigned char*)data + mapoffset;
+
+			if (p[entry->size])
+				p[entry->size] = 0;
+
+			out_map->data = p;
+			out_map->size = entry->size;
+			out_map->mapped = true;
+			out_map->mapoffset = mapoffset;
+			return true;
+		}
+	}
+#endif
+
+	if (!(data = pack_read(entry, offset, out_error)))
+		return false;
+
+	out_map->data = data;
+	out_map->size = entry->size;
+	out_map->mapped = false;
+	out_map->mapoffset = 0;
+	return true;
+}
+
+void pack_list_files(const char *directory, const char *extension, void (*function)(const char *name, void *data), void *data)
+{
+	char dir[PACK_MAX_PATH];
+	size_t dirlen, extlen = strlen(extension), namelen;
+	int i;
+
+	if (!pack_index || !pack_normalize(directory, dir))
+		return;
+
+	dirlen = strlen(dir);
+	while (dirlen && dir[dirlen - 1] == '/')
+		dir[--dirlen] = '\0';
+	if (!strcmp(dir, "."))
+		dir[dirlen = 0] = '\0';
+
+	for (i = 0; i < pack_num_entries; i++)
+	{
+		const char *name = pack_entries[i].name;
+
+		if (dirlen && (strncmp(name, dir, dirlen) || name[dirlen] != '/'))
+			continue;
+		name += dirlen ? dirlen + 1 : 0;
+		namelen = strlen(name);
+
+		if (strchr(name, '/') || namelen < extlen || strcasecmp(name + namelen - extlen, extension))
+			continue;
+
+	/* hidden by a newer archive? */
+		if (pack_find_index(pack_entries[i].name) != i)
+			continue;
+
+		function(name, data);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACK_H
+#define PACK_H
+
+/* PAK (Quake) and PK3 (zip) archives. once mounted, files that aren't on disk
+ * are looked up in them by loadfile, mapfile and list_files, as if the
+ * archives were extracted into the current directory. archives mounted later
+ * take precedence. mount them before starting any threads */
+bool_t pack_mount(const char *filename, char **out_error);
+void pack_unmount_all(void);
+
+/* for loadfile and mapfile. *out_found is false (and nothing else is done)
+ * if no mounted archive has the file. pack_mapfile maps stored files straight
+ * from the archive where it can, and inflates compressed ones */
+bool_t pack_loadfile(const char *filename, void **out_data, size_t *out_size, bool_t *out_found, char **out_error);
+bool_t pack_mapfile(const char *filename, filemap_t *out_map, bool_t *out_found, char **out_error);
+
+/* for list_files. calls function(name, data) for each archived file directly
+ * in the directory with the extension (compared like list_files does), or
+ * every file there if the extension is empty */
+void pack_list_files(const char *directory, const char *extension, void (*function)(const char *name, void *data), void *data);
+
+#endif
@@ -0,0 +1,693 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "global.h"
+#include "model.h"
+#include "render.h"
+#include "thread.h"
+
+#define RENDER_TILE_SIZE 32
+#define RENDER_MIN_THREADED_PIXELS (128 * 128) /* smaller views aren't worth starting threads for */
+
+void render_calc_anim(const model_t *model, int frame, float time, bool_t nolerp, render_anim_t *out_anim)
+{
+	if (!model->num_frames)
+	{
+		out_anim->num_frames = 0;
+		return;
+	}
+
+	if (frame >= 0 && frame < model->num_frames)
+	{
+	/* view an individual frame or framegroup */
+		const frameinfo_t *frameinfo = &model->frameinfo[frame];
+
+		if (frameinfo->num_frames > 1)
+		{
+		/* framegroup */
+			if (nolerp)
+			{
+				int frame = (int)(time / frameinfo->frametime) % frameinfo->num_frames;
+
+				out_anim->num_frames = 1;
+				out_anim->frames[0].offset = frameinfo->frames[frame].offset;
+				out_anim->frames[0].frac = 1.0f;
+			}
+			else
+			{
+				float frame;
+				int frame0, frame1;
+
+				frame = time / frameinfo->frametime;
+				frame -= (float)floor(frame / frameinfo->num_frames) * frameinfo->num_frames;
+
+				frame0 = (int)floor(frame) % frameinfo->num_frames;
+				frame1 = (frame0 + 1) % frameinfo->num_frames;
+
+				out_anim->num_frames = 2;
+				out_anim->frames[0].offset = frameinfo->frames[frame0].offset;
+				out_anim->frames[0].frac = 1.0f - (frame - (float)frame0);
+				out_anim->frames[1].offset = frameinfo->frames[frame1].offset;
+				out_anim->frames[1].frac = frame - (float)frame0;
+			}
+		}
+		else
+		{
+		/* single frame */
+			out_anim->num_frames = 1;
+			out_anim->frames[0].offset = frameinfo->frames[0].offset;
+			out_anim->frames[0].frac = 1.0f;
+		}
+	}
+	else
+	{
+	/* loop through all animation frames */
+		if (nolerp)
+		{
+			int frame = (int)(time / 0.1f) % model->num_frames;
+
+			out_anim->num_frames = 1;
+			out_anim->frames[0].offset = model->frameinfo[frame].frames[0].offset;
+			out_anim->frames[0].frac = 1.0f;
+		}
+		else
+		{
+			float frame;
+			int frame0, frame1;
+
+			frame = time / 0.1f;
+			frame -= (float)floor(frame / model->num_frames) * model->num_frames;
+
+			frame0 = (int)floor(frame) % model->num_frames;
+			frame1 = (frame0 + 1) % model->num_frames;
+
+			out_anim->num_frames = 2;
+			out_anim->frames[0].offset = model->frameinfo[frame0].frames[0].offset;
+			out_anim->frames[0].frac = 1.0f - (frame - (float)frame0);
+			out_anim->frames[1].offset = model->frameinfo[frame1].frames[0].offset;
+			out_anim->frames[1].frac = frame - (float)frame0;
+		}
+	}
+}
+
+void render_animate_mesh(const mesh_t *mesh, const render_anim_t *anim, float *out_vertex3f, float *out_normal3f)
+{
+	if (anim->num_frames == 1)
+	{
+		int offset = anim->frames[0].offset;
+		const float *v = mesh_frame_vertex3f(mesh, offset, out_vertex3f);
+		const float *n = mesh_frame_normal3f(mesh, offset, out_normal3f);
+
+		if (v != out_vertex3f)
+			memcpy(out_vertex3f, v, mesh->num_vertices * sizeof(float[3]));
+		if (n != out_normal3f)
+			memcpy(out_normal3f, n, mesh->num_vertices * sizeof(float[3]));
+	}
+	if (anim->num_frames == 2)
+	{
+		int offset0 = anim->frames[0].offset;
+		int offset1 = anim->frames[1].offset;
+		float frac0 = anim->frames[0].frac;
+		float frac1 = anim->frames[1].frac;
+	/* a quantized first frame is decoded straight into the output, which is
+	 * fine as each vertex is only read before it is written */
+		float *scratch = mesh->vertex3f ? NULL : (float*)qmalloc(sizeof(float[6]) * mesh->num_vertices);
+		const float *vertex3f0 = mesh_frame_vertex3f(mesh, offset0, out_vertex3f);
+		const float *normal3f0 = mesh_frame_normal3f(mesh, offset0, out_normal3f);
+		const float *vertex3f1 = mesh_frame_vertex3f(mesh, offset1, scratch);
+		const float *normal3f1 = mesh_frame_normal3f(mesh, offset1, scratch ? scratch + mesh->num_vertices * 3 : NULL);
+		int i;
+
+		for (i = 0; i < mesh->num_vertices; i++)
+		{
+			const float *v0 = vertex3f0 + i * 3;
+			const float *n0 = normal3f0 + i * 3;
+			const float *v1 = vertex3f1 + i * 3;
+			const float *n1 = normal3f1 + i * 3;
+
+			out_vertex3f[i*3+0] = v0[0] * frac0 + v1[0] * frac1;
+			out_vertex3f[i*3+1] = v0[1] * frac0 + v1[1] * frac1;
+			out_vertex3f[i*3+2] = v0[2] * frac0 + v1[2] * frac1;
+
+			out_normal3f[i*3+0] = n0[0] * frac0 + n1[0] * frac1;
+			out_normal3f[i*3+1] = n0[1] * frac0 + n1[1] * frac1;
+			out_normal3f[i*3+2] = n0[2] * frac0 + n1[2] * frac1;
+
+			/* TODO - renormalize? */
+		}
+
+		qfree(scratch);
+	}
+}
+
+void render_light_mesh(int num_vertices, const float *vertex3f, const float *normal3f, const float lightpos[3], unsigned char *out_colour4ub)
+{
+	float lightnormal[3], dot;
+	const float *v, *n;
+	int i;
+	unsigned char *c;
+
+	for (i = 0, v = vertex3f, n = normal3f, c = out_colour4ub; i < num_vertices; i++, v += 3, n += 3, c += 4)
+	{
+		VectorSubtract(lightpos, v, lightnormal);
+		VectorNormalize(lightnormal);
+
+		dot = DotProduct(n, lightnormal);
+
+		if (dot < 0)
+			dot = 0;
+
+		c[0] = c[1] = c[2] = (unsigned char)(dot * 255);
+		c[3] = 255;
+	}
+}
+
+/* software rasterizer. triangles are transformed and set up for the whole
+ * view, then sorted into tiles which are drawn in parallel. each tile draws
+ * its triangles in the order they were submitted and evaluates the edges at
+ * every pixel from scratch, so the image doesn't depend on the thread count */
+
+typedef struct render_eyevertex_s
+{
+	float e[3]; /* right, up, forward */
+	float s, t, light;
+} render_eyevertex_t;
+
+typedef struct render_vertex_s
+{
+	float x, y; /* pixel coordinates within the viewport */
+	float iw; /* 1 / forward distance, which (unlike the distance) is linear in screen space */
+	float s, t, light; /* all multiplied by iw */
+} render_vertex_t;
+
+typedef struct render_triangle_s
+{
+	render_vertex_t v[3];
+	float area; /* twice the area in pixels */
+	int mins[2], maxs[2]; /* pixels it might cover, inclusive */
+
+	const image_rgba_t *diffuse, *fullbright;
+} render_triangle_t;
+
+typedef struct render_state_s
+{
+	image_rgba_t *image;
+	const render_view_t *view;
+
+	float origin[3], right[3], up[3], forward[3]; /* camera */
+	float znear;
+	float scale; /* pixels per unit at a forward distance of 1 */
+
+	int clipmins[2], clipmaxs[2]; /* part of the viewport inside the image, inclusive */
+
+	render_triangle_t *triangles;
+	int num_triangles, max_triangles;
+
+	float *depth; /* [view->width * view->height], iw of what was drawn at each pixel */
+
+	int tiles_wide, tiles_high;
+	int *tile_first; /* [num_tiles + 1], into tile_triangles */
+	int *tile_triangles;
+} render_state_t;
+
+void render_view_init(render_view_t *view, const image_rgba_t *image)
+{
+	memset(view, 0, sizeof(*view));
+	view->width = image->width;
+	view->height = image->height;
+	view->fov = 45.0f;
+	view->frame = 0;
+	view->skin = 0;
+}
+
+static void render_add_triangle(render_state_t *rs, const render_eyevertex_t *e0, const render_eyevertex_t *e1, const render_eyevertex_t *e2, const image_rgba_t *diffuse, const image_rgba_t *fullbright)
+{
+	const render_eyevertex_t *in[3];
+	render_triangle_t *tri;
+	render_vertex_t v[3];
+	float area;
+	int i, j;
+
+	in[0] = e0;
+	in[1] = e1;
+	in[2] = e2;
+
+	for (i = 0; i < 3; i++)
+	{
+		float iw = 1.0f / in[i]->e[2];
+
+		v[i].x = rs->view->width * 0.5f + in[i]->e[0] * iw * rs->scale;
+		v[i].y = rs->view->height * 0.5f - in[i]->e[1] * iw * rs->scale;
+		v[i].iw = iw;
+		v[i].s = in[i]->s * iw;
+		v[i].t = in[i]->t * iw;
+		v[i].light = in[i]->light * iw;
+	}
+
+/* models are wound clockwise as seen from the front with y pointing up (as
+ * the viewer culls them), which is counterclockwise here since y points down,
+ * making the area and the edge functions inside positive */
+	area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+	if (!(area > 0.0f))
+		return;
+
+	if (rs->num_triangles == rs->max_triangles)
+	{
+		render_triangle_t *newtriangles;
+
+		rs->max_triangles = rs->max_triangles ? rs->max_triangles * 2 : 1024;
+		newtriangles = (render_triangle_t*)qmalloc(sizeof(render_triangle_t) * rs->max_triangles);
+		if (rs->num_triangles)
+			memcpy(newtriangles, rs->triangles, sizeof(render_triangle_t) * rs->num_triangles);
+		qfree(rs->triangles);
+		rs->triangles = newtriangles;
+	}
+
+	tri = &rs->triangles[rs->num_triangles];
+
+	for (j = 0; j < 2; j++)
+	{
+		float vmin = min(min(v[0].x, v[1].x), v[2].x);
+		float vmax = max(max(v[0].x, v[1].x), v[2].x);
+
+		if (j == 1)
+		{
+			vmin = min(min(v[0].y, v[1].y), v[2].y);
+			vmax = max(max(v[0].y, v[1].y), v[2].y);
+		}
+
+	/* pixel centres are at +0.5 */
+		tri->mins[j] = max((int)floor(vmin - 0.5f), rs->clipmins[j]);
+		tri->maxs[j] = min((int)ceil(vmax - 0.5f), rs->clipmaxs[j]);
+	}
+
+	if (tri->mins[0] > tri->maxs[0] || tri->mins[1] > tri->maxs[1])
+		return;
+
+	tri->v[0] = v[0];
+	tri->v[1] = v[1];
+	tri->v[2] = v[2];
+	tri->area = area;
+	tri->diffuse = diffuse;
+	tri->fullbright = fullbright;
+
+	rs->num_triangles++;
+}
+
+static void render_lerp_eyevertex(const render_eyevertex_t *a, const render_eyevertex_t *b, float frac, render_eyevertex_t *out)
+{
+	out->e[0] = a->e[0] + (b->e[0] - a->e[0]) * frac;
+	out->e[1] = a->e[1] + (b->e[1] - a->e[1]) * frac;
+	out->e[2] = a->e[2] + (b->e[2] - a->e[2]) * frac;
+	out->s = a->s + (b->s - a->s) * frac;
+	out->t = a->t + (b->t - a->t) * frac;
+	out->light = a->light + (b->light - a->light) * frac;
+}
+
+/* clips the triangle to the near plane, which can leave a quad */
+static void render_clip_triangle(render_state_t *rs, const render_eyevertex_t *e0, const render_eyevertex_t *e1, const render_eyevertex_t *e2, const image_rgba_t *diffuse, const image_rgba_t *fullbright)
+{
+	const render_eyevertex_t *in[3];
+	render_eyevertex_t out[4];
+	int num_out = 0, i;
+
+	in[0] = e0;
+	in[1] = e1;
+	in[2] = e2;
+
+	if (e0->e[2] >= rs->znear && e1->e[2] >= rs->znear && e2->e[2] >= rs->znear)
+	{
+		render_add_triangle(rs, e0, e1, e2, diffuse, fullbright);
+		return;
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		const render_eyevertex_t *a = in[i];
+		const render_eyevertex_t *b = in[(i + 1) % 3];
+
+		if (a->e[2] >= rs->znear)
+			out[num_out++] = *a;
+		if ((a->e[2] >= rs->znear) != (b->e[2] >= rs->znear))
+			render_lerp_eyevertex(a, b, (rs->znear - a->e[2]) / (b->e[2] - a->e[2]), &out[num_out++]);
+	}
+
+	for (i = 2; i < num_out; i++)
+		render_add_triangle(rs, &out[0], &out[i - 1], &out[i], diffuse, fullbright);
+}
+
+static void render_add_mesh(render_state_t *rs, const model_t *model, const mesh_t *mesh, const render_anim_t *anim, float *vertex3f, float *normal3f, unsigned char *colour4ub, render_eyevertex_t *eyevertices)
+{
+	const render_view_t *view = rs->view;
+	const image_rgba_t *diffuse = NULL, *fullbright = NULL;
+	const int *tri;
+	int i;
+
+	if (view->skin >= 0 && view->skin < model->num_skins)
+	{
+		const skininfo_t *skininfo = &model->skininfo[view->skin];
+		int sframe = (int)(view->time / skininfo->frametime) % skininfo->num_skins;
+		int skinoffset = skininfo->skins[sframe].offset;
+
+		diffuse = mesh->skins[skinoffset].components[SKIN_DIFFUSE];
+		fullbright = mesh->skins[skinoffset].components[SKIN_FULLBRIGHT];
+	}
+
+	render_animate_mesh(mesh, anim, vertex3f, normal3f);
+	render_light_mesh(mesh->num_vertices, vertex3f, normal3f, rs->origin, colour4ub);
+
+	for (i = 0; i < mesh->num_vertices; i++)
+	{
+		float d[3];
+
+		VectorSubtract(vertex3f + i * 3, rs->origin, d);
+		eyevertices[i].e[0] = DotProduct(d, rs->right);
+		eyevertices[i].e[1] = DotProduct(d, rs->up);
+		eyevertices[i].e[2] = DotProduct(d, rs->forward);
+		eyevertices[i].s = mesh->texcoord2f[i*2+0];
+		eyevertices[i].t = mesh->texcoord2f[i*2+1];
+		eyevertices[i].light = colour4ub[i*4+0] * (1.0f / 255.0f);
+	}
+
+	for (i = 0, tri = mesh->triangle3i; i < mesh->num_triangles; i++, tri += 3)
+		render_clip_triangle(rs, &eyevertices[tri[0]], &eyevertices[tri[1]], &eyevertices[tri[2]], diffuse, fullbright);
+}
+
+static const unsigned char *render_sample(const image_rgba_t *image, float s, float t)
+{
+	int x = (int)floor(s * image->width) % image->width;
+	int y = (int)floor(t * image->height) % image->height;
+
+	if (x < 0)
+		x += image->width;
+	if (y < 0)
+		y += image->height;
+
+	return image->pixels + (y * image->width + x) * 4;
+}
+
+/* whether pixels exactly on the edge from a to b belong to this triangle. the
+ * neighbour sharing the edge has it the other way around, so they don't both
+ * draw it */
+static bool_t render_edge_owns_ties(const render_vertex_t *a, const render_vertex_t *b)
+{
+	return (b->y > a->y) || (b->y == a->y && b->x < a->x);
+}
+
+static void render_tile(void *data, int job)
+{
+	render_state_t *rs = (render_state_t*)data;
+	const render_view_t *view = rs->view;
+	image_rgba_t *image = rs->image;
+	int tx0 = (job % rs->tiles_wide) * RENDER_TILE_SIZE;
+	int ty0 = (job / rs->tiles_wide) * RENDER_TILE_SIZE;
+	int tx1 = min(tx0 + RENDER_TILE_SIZE, view->width) - 1;
+	int ty1 = min(ty0 + RENDER_TILE_SIZE, view->height) - 1;
+	int i, j, x, y;
+
+	for (i = rs->tile_first[job]; i < rs->tile_first[job + 1]; i++)
+	{
+		const render_triangle_t *tri = &rs->triangles[rs->tile_triangles[i]];
+		const render_vertex_t *v = tri->v;
+		bool_t ties[3];
+		float iarea = 1.0f / tri->area;
+		int x0 = max(tri->mins[0], tx0), x1 = min(tri->maxs[0], tx1);
+		int y0 = max(tri->mins[1], ty0), y1 = min(tri->maxs[1], ty1);
+
+		for (j = 0; j < 3; j++)
+			ties[j] = render_edge_owns_ties(&v[(j + 1) % 3], &v[(j + 2) % 3]);
+
+		for (y = y0; y <= y1; y++)
+		{
+			float py = y + 0.5f;
+			unsigned char *out = image->pixels + ((view->y + y) * image->width + view->x + x0) * 4;
+			float *depth = rs->depth + y * view->width + x0;
+
+			for (x = x0; x <= x1; x++, out += 4, depth++)
+			{
+				float px = x + 0.5f;
+				float w[3], iw, s, t, light;
+				int colour[3];
+
+			/* w[j] is the edge opposite vertex j, and its barycentric weight */
+				for (j = 0; j < 3; j++)
+				{
+					const render_vertex_t *a = &v[(j + 1) % 3];
+					const render_vertex_t *b = &v[(j + 2) % 3];
+
+					w[j] = (b->x - a->x) * (py - a->y) - (b->y - a->y) * (px - a->x);
+					if (w[j] < 0.0f || (w[j] == 0.0f && !ties[j]))
+						break;
+				}
+				if (j < 3)
+					continue;
+
+				w[0] *= iarea;
+				w[1] *= iarea;
+				w[2] *= iarea;
+
+				iw = w[0] * v[0].iw + w[1] * v[1].iw + w[2] * v[2].iw;
+				if (!(iw > *depth))
+					continue;
+				*depth = iw;
+
+				s = (w[0] * v[0].s + w[1] * v[1].s + w[2] * v[2].s) / iw;
+				t = (w[0] * v[0].t + w[1] * v[1].t + w[2] * v[2].t) / iw;
+				light = (w[0] * v[0].light + w[1] * v[1].light + w[2] * v[2].light) / iw;
+
+			/* diffuse modulated by the lighting, then the fullbright added on top */
+				if (tri->diffuse)
+				{
+					const unsigned char *texel = render_sample(tri->diffuse, s, t);
+
+					colour[0] = (int)(texel[0] * light);
+					colour[1] = (int)(texel[1] * light);
+					colour[2] = (int)(texel[2] * light);
+				}
+				else
+					colour[0] = colour[1] = colour[2] = (int)(255.0f * light);
+
+				if (tri->fullbright)
+				{
+					const unsigned char *texel = render_sample(tri->fullbright, s, t);
+
+					colour[0] += texel[0];
+					colour[1] += texel[1];
+					colour[2] += texel[2];
+				}
+
+				out[0] = (unsigned char)bound(0, colour[0], 255);
+				out[1] = (unsigned char)bound(0, colour[1], 255);
+				out[2] = (unsigned char)bound(0, colour[2], 255);
+				out[3] = 255;
+			}
+		}
+	}
+}
+
+void render_model_bounds(const model_t *model, float centre[3], float *out_radius)
+{
+	float mins[3], maxs[3], radius = 0.0f;
+	float *scratch;
+	bool_t first = true;
+	int i, j, k, f, max_vertices = 1;
+
+	VectorClear(mins);
+	VectorClear(maxs);
+
+	for (i = 0; i < model->num_meshes; i++)
+		max_vertices = max(max_vertices, model->meshes[i].num_vertices);
+	scratch = (float*)qmalloc(sizeof(float[3]) * max_vertices);
+
+	for (i = 0; i < model->num_meshes; i++)
+	{
+		const mesh_t *mesh = &model->meshes[i];
+
+		for (f = 0; f < model->total_frames; f++)
+		{
+			const float *v = mesh_frame_vertex3f(mesh, f, scratch);
+
+			for (j = 0; j < mesh->num_vertices; j++, v += 3)
+			{
+				for (k = 0; k < 3; k++)
+				{
+					mins[k] = first ? v[k] : min(mins[k], v[k]);
+					maxs[k] = first ? v[k] : max(maxs[k], v[k]);
+				}
+				first = false;
+			}
+		}
+	}
+
+	for (k = 0; k < 3; k++)
+		centre[k] = (mins[k] + maxs[k]) * 0.5f;
+
+	for (i = 0; i < model->num_meshes; i++)
+	{
+		const mesh_t *mesh = &model->meshes[i];
+
+		for (f = 0; f < model->total_frames; f++)
+		{
+			const float *v = mesh_frame_vertex3f(mesh, f, scratch);
+
+			for (j = 0; j < mesh->num_vertices; j++, v += 3)
+			{
+				float d[3];
+
+				VectorSubtract(v, centre, d);
+				radius = max(radius, DotProduct(d, d));
+			}
+		}
+	}
+
+	qfree(scratch);
+
+	*out_radius = (float)sqrt(radius);
+}
+
+void render_model(image_rgba_t *image, const model_t *model, const render_view_t *view)
+{
+	render_state_t rs;
+	render_anim_t anim;
+	float centre[3], radius, distance, yaw, pitch, halffov;
+	float *vertex3f, *normal3f;
+	unsigned char *colour4ub;
+	render_eyevertex_t *eyevertices;
+	int max_vertices, num_tiles, i, t, x, y;
+
+	if (view->width <= 0 || view->height <= 0)
+		return;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.image = image;
+	rs.view = view;
+	rs.clipmins[0] = max(0, -view->x);
+	rs.clipmins[1] = max(0, -view->y);
+	rs.clipmaxs[0] = min(view->width, image->width - view->x) - 1;
+	rs.clipmaxs[1] = min(view->height, image->height - view->y) - 1;
+	if (rs.clipmins[0] > rs.clipmaxs[0] || rs.clipmins[1] > rs.clipmaxs[1])
+		return;
+
+/* set up the camera */
+	if (view->bounds_known)
+	{
+		VectorCopy(centre, view->centre);
+		radius = view->radius;
+	}
+	else
+		render_model_bounds(model, centre, &radius);
+	radius = max(radius, 1.0f);
+
+	halffov = (float)(bound(1.0f, view->fov, 170.0f) * M_PI / 360.0);
+	rs.scale = view->height * 0.5f / (float)tan(halffov);
+
+	distance = view->distance;
+	if (distance <= 0.0f)
+	{
+	/* fit the bounding sphere in the narrower direction */
+		if (view->width < view->height)
+			halffov = (float)atan(tan(halffov) * view->width / view->height);
+		distance = radius / (float)sin(halffov);
+	}
+	rs.znear = distance * 0.001f;
+
+	yaw = (float)(view->yaw * M_PI / 180.0);
+	pitch = (float)(bound(-89.0f, view->pitch, 89.0f) * M_PI / 180.0);
+
+	rs.forward[0] = -(float)(cos(pitch) * cos(yaw));
+	rs.forward[1] = -(float)(cos(pitch) * sin(yaw));
+	rs.forward[2] = -(float)sin(pitch);
+	VectorScale(rs.forward, -distance, rs.origin);
+	VectorAdd(rs.origin, centre, rs.origin);
+	rs.right[0] = -rs.forward[1];
+	rs.right[1] = rs.forward[0];
+	rs.right[2] = 0.0f;
+	VectorNormalize(rs.right);
+	CrossProduct(rs.right, rs.forward, rs.up);
+
+/* transform, light and set up the triangles */
+	render_calc_anim(model, view->frame, view->time, view->nolerp, &anim);
+
+	max_vertices = 0;
+	for (i = 0; i < model->num_meshes; i++)
+		max_vertices = max(max_vertices, model->meshes[i].num_vertices);
+
+	vertex3f = (float*)qmalloc(sizeof(float[3]) * max(max_vertices, 1));
+	normal3f = (float*)qmalloc(sizeof(float[3]) * max(max_vertices, 1));
+	colour4ub = (unsigned char*)qmalloc(sizeof(unsigned char[4]) * max(max_vertices, 1));
+	eyevertices = (render_eyevertex_t*)qmalloc(sizeof(render_eyevertex_t) * max(max_vertices, 1));
+
+	if (anim.num_frames)
+		for (i = 0; i < model->num_meshes; i++)
+			render_add_mesh(&rs, model, &model->meshes[i], &anim, vertex3f, normal3f, colour4ub, eyevertices);
+
+	qfree(eyevertices);
+	qfree(colour4ub);
+	qfree(normal3f);
+	qfree(vertex3f);
+
+/* sort the triangles into tiles, keeping them in order (counting sort) */
+	rs.tiles_wide = (view->width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	rs.tiles_high = (view->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	num_tiles = rs.tiles_wide * rs.tiles_high;
+
+	rs.tile_first = (int*)qmalloc(sizeof(int) * (num_tiles + 1));
+	memset(rs.tile_first, 0, sizeof(int) * (num_tiles + 1));
+	for (i = 0; i < rs.num_triangles; i++)
+	{
+		const render_triangle_t *tri = &rs.triangles[i];
+
+		for (y = tri->mins[1] / RENDER_TILE_SIZE; y <= tri->maxs[1] / RENDER_TILE_SIZE; y++)
+			for (x = tri->mins[0] / RENDER_TILE_SIZE; x <= tri->maxs[0] / RENDER_TILE_SIZE; x++)
+				rs.tile_first[y * rs.tiles_wide + x + 1]++;
+	}
+	for (t = 0; t < num_tiles; t++)
+		rs.tile_first[t + 1] += rs.tile_first[t];
+
+	rs.tile_triangles = (int*)qmalloc(sizeof(int) * max(rs.tile_first[num_tiles], 1));
+	for (i = 0; i < rs.num_triangles; i++)
+	{
+		const render_triangle_t *tri = &rs.triangles[i];
+
+		for (y = tri->mins[1] / RENDER_TILE_SIZE; y <= tri->maxs[1] / RENDER_TILE_SIZE; y++)
+			for (x = tri->mins[0] / RENDER_TILE_SIZE; x <= tri->maxs[0] / RENDER_TILE_SIZE; x++)
+				rs.tile_triangles[rs.tile_first[y * rs.tiles_wide + x]++] = i;
+	}
+/* each tile_first[t] now holds where tile t + 1 starts, shift them back */
+	memmove(rs.tile_first + 1, rs.tile_first, sizeof(int) * num_tiles);
+	rs.tile_first[0] = 0;
+
+/* draw */
+	rs.depth = (float*)qmalloc(sizeof(float) * view->width * view->height);
+	memset(rs.depth, 0, sizeof(float) * view->width * view->height);
+
+	if (view->width * view->height < RENDER_MIN_THREADED_PIXELS)
+	{
+		for (t = 0; t < num_tiles; t++)
+			render_tile(&rs, t);
+	}
+	else
+		thread_run(num_tiles, render_tile, &rs);
+
+	qfree(rs.depth);
+	qfree(rs.tile_triangles);
+	qfree(rs.tile_first);
+	qfree(rs.triangles);
+}
@@ -0,0 +1,72 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "model.h"
+
+/* which actual frames to show, and how much of each (two when lerping) */
+typedef struct render_anim_s
+{
+	int num_frames;
+
+	struct
+	{
+		int offset;
+		float frac;
+	} frames[2];
+} render_anim_t;
+
+/* frame is a frameinfo index (framegroups play through their frames), or -1
+ * to play through all of the model's frames at 10 per second */
+void render_calc_anim(const model_t *model, int frame, float time, bool_t nolerp, render_anim_t *out_anim);
+void render_animate_mesh(const mesh_t *mesh, const render_anim_t *anim, float *out_vertex3f, float *out_normal3f);
+/* greyscale diffuse lighting from a point light, lightpos is in model space */
+void render_light_mesh(int num_vertices, const float *vertex3f, const float *normal3f, const float lightpos[3], unsigned char *out_colour4ub);
+
+/* software rendering, for thumbnails and such without a window */
+typedef struct render_view_s
+{
+	int x, y, width, height; /* viewport within the image */
+
+	float yaw, pitch; /* in degrees. the camera orbits the middle of the model, yaw 0 looks at its front */
+	float distance; /* from the middle of the model, or 0 to fit the whole model in view */
+	float fov; /* vertical, in degrees */
+
+	int frame; /* as for render_calc_anim */
+	float time;
+	bool_t nolerp;
+	int skin; /* skininfo index, or -1 for no texture */
+
+	bool_t bounds_known; /* centre and radius are set, from render_model_bounds */
+	float centre[3], radius;
+} render_view_t;
+
+/* defaults to a front view filling the whole image */
+void render_view_init(render_view_t *view, const image_rgba_t *image);
+
+/* bounding sphere of every frame, so the camera doesn't move as the model
+ * animates. it goes through all the frames, so when drawing several views of
+ * a model, work it out once and put it in each view */
+void render_model_bounds(const model_t *model, float out_centre[3], float *out_radius);
+
+/* draws the model over what is already in the viewport, lit from the camera.
+ * pixels the model covers become opaque, the rest are left alone */
+void render_model(image_rgba_t *image, const model_t *model, const render_view_t *view);
+
+#endif
@@ -31,54 +31,83 @@ Suite 120, Rockville, Maryland 20850 USA.
 
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "global.h"
 #include "shaders.h"
 #include "image.h"
 #include "util.h"
+#include "thread.h"
 
 /*
 ===========================================================================
 
 PARSING
 
+Tokens are views into the text being parsed, which is left untouched, and
+all of the state is in the parser, so any number of files can be parsed at
+once (on different threads)
+
 ===========================================================================
 */
 
-#define MAX_TOKEN_CHARS 1024
-static	char	com_token[MAX_TOKEN_CHARS];
-static	char	com_parsename[MAX_TOKEN_CHARS];
-static	int		com_lines;
-static	int		com_tokenline;
+typedef struct parser_s
+{
+	const char	*data;			// NULL once the text runs out
+	int			lines;
+	int			tokenline;
+} parser_t;
 
-static void COM_BeginParseSession(const char *name)
+typedef struct token_s
 {
-	com_lines = 1;
-	com_tokenline = 0;
-	snprintf(com_parsename, sizeof(com_parsename), "%s", name);
+	const char	*start;
+	int			length;			// 0 if there are no more tokens
+} token_t;
+
+static void COM_BeginParseSession(parser_t *parser, const char *data)
+{
+	parser->data = data;
+	parser->lines = 1;
+	parser->tokenline = 0;
 }
 
-static int COM_GetCurrentParseLine(void)
+static int COM_GetCurrentParseLine(const parser_t *parser)
 {
-	if (com_tokenline)
+	if (parser->tokenline)
 	{
-		return com_tokenline;
+		return parser->tokenline;
 	}
 
-	return com_lines;
+	return parser->lines;
 }
 
-static char *SkipWhitespace(char *data, int *linesSkipped)
+static bool_t COM_TokenIs(const token_t *token, const char *string)
+{
+	return (int)strlen(string) == token->length && !strncmp(token->start, string, token->length);
+}
+
+// for messages and names, which are never longer than a path
+static char *COM_TokenString(const token_t *token, char *buffer, size_t size)
+{
+	size_t length = ((size_t)token->length < size - 1) ? (size_t)token->length : size - 1;
+
+	memcpy(buffer, token->start, length);
+	buffer[length] = 0;
+	return buffer;
+}
+
+static const char *SkipWhitespace(const char *data, int *linesSkipped)
 {
 	int c;
 
 	while ((c = *data) <= ' ')
-    {
+	{
 		if (!c)
-        {
+		{
 			return NULL;
 		}
 		if (c == '\n')
-        {
+		{
 			*linesSkipped += 1;
 		}
 		data++;
@@ -87,22 +116,21 @@ static char *SkipWhitespace(char *data, int *linesSkipped)
 	return data;
 }
 
-static char *COM_ParseExt2(char **data_p, bool_t allowLineBreaks, char delimiter)
+static void COM_ParseExt2(parser_t *parser, bool_t allowLineBreaks, char delimiter, token_t *token)
 {
-	int c = 0, len;
+	int c = 0;
 	int linesSkipped = 0;
-	char *data;
+	const char *data;
 
-	data = *data_p;
-	len = 0;
-	com_token[0] = 0;
-	com_tokenline = 0;
+	data = parser->data;
+	token->start = "";
+	token->length = 0;
+	parser->tokenline = 0;
 
 	// make sure incoming data is valid
 	if (!data)
 	{
-		*data_p = NULL;
-		return com_token;
+		return;
 	}
 
 	while (1)
@@ -111,17 +139,17 @@ static char *COM_ParseExt2(char **data_p, bool_t allowLineBreaks, char delimiter
 		data = SkipWhitespace(data, &linesSkipped);
 		if (!data)
 		{
-			*data_p = NULL;
-			return com_token;
+			parser->data = NULL;
+			return;
 		}
 		if (data && linesSkipped && !allowLineBreaks)
 		{
 			// ZTM: Don't move the pointer so that calling SkipRestOfLine afterwards works as expected
-			//*data_p = data;
-			return com_token;
+			//parser->data = data;
+			return;
 		}
 
-		com_lines += linesSkipped;
+		parser->lines += linesSkipped;
 
 		c = *data;
 
@@ -130,7 +158,7 @@ static char *COM_ParseExt2(char **data_p, bool_t allowLineBreaks, char delimiter
 		{
 			data += 2;
 			while (*data && *data != '\n')
-            {
+			{
 				data++;
 			}
 		}
@@ -142,7 +170,7 @@ static char *COM_ParseExt2(char **data_p, bool_t allowLineBreaks, char delimiter
 			{
 				if (*data == '\n')
 				{
-					com_lines++;
+					parser->lines++;
 				}
 				data++;
 			}
@@ -158,75 +186,61 @@ static char *COM_ParseExt2(char **data_p, bool_t allowLineBreaks, char delimiter
 	}
 
 	// token starts on this line
-	com_tokenline = com_lines;
+	parser->tokenline = parser->lines;
 
 	// handle quoted strings
 	if (c == '\"')
 	{
-		data++;
+		token->start = ++data;
 		while (1)
 		{
 			c = *data++;
 			if (c=='\"' || !c)
 			{
-				com_token[len] = 0;
-				*data_p = (char *)data;
-				return com_token;
+				token->length = (int)(data - 1 - token->start);
+				parser->data = c ? data : data - 1; // don't run past the end
+				return;
 			}
 			if (c == '\n')
 			{
-				com_lines++;
-			}
-			if (len < MAX_TOKEN_CHARS - 1)
-			{
-				com_token[len] = c;
-				len++;
+				parser->lines++;
 			}
 		}
 	}
 
 	// parse a regular word
+	token->start = data;
 	do
 	{
-		if (len < MAX_TOKEN_CHARS - 1)
-		{
-			com_token[len] = c;
-			len++;
-		}
 		data++;
 		c = *data;
 	} while (c>32 && c != delimiter);
 
-	com_token[len] = 0;
-
-	*data_p = (char *)data;
-	return com_token;
+	token->length = (int)(data - token->start);
+	parser->data = data;
 }
 
-static char *COM_ParseExt(char **data_p, bool_t allowLineBreaks)
+static void COM_ParseExt(parser_t *parser, bool_t allowLineBreaks, token_t *token)
 {
-	return COM_ParseExt2(data_p, allowLineBreaks, 0);
+	COM_ParseExt2(parser, allowLineBreaks, 0, token);
 }
 
-static bool_t SkipBracedSection(char **program, int depth)
+static bool_t SkipBracedSection(parser_t *parser, int depth)
 {
-	char			*token;
+	token_t			token;
 
 	do
-    {
-		token = COM_ParseExt(program, true);
-		if (token[1] == 0)
-        {
-			if (token[0] == '{')
-            {
-				depth++;
-			}
-			else if (token[0] == '}')
-            {
-				depth--;
-			}
+	{
+		COM_ParseExt(parser, true, &token);
+		if (COM_TokenIs(&token, "{"))
+		{
+			depth++;
 		}
-	} while (depth && *program);
+		else if (COM_TokenIs(&token, "}"))
+		{
+			depth--;
+		}
+	} while (depth && parser->data);
 
 	return (depth == 0);
 }
@@ -240,384 +254,816 @@ SHADER GENERATION
 */
 
 static int initialized = 0;
+static thread_mutex_t *shader_mutex = NULL; /* define_shader can be called from conversion threads */
 
 #define MAX_QPATH 64
 
 static char shader_base_path[1024];
 
-#define MAX_SHADERS 8192
+// where init_shaders remembers which shaders each file defines, so files that
+// haven't changed since don't have to be parsed again
+#define SHADER_INDEX_NAME	".shaderindex"
+#define SHADER_INDEX_ID		"QWSHIDX"
+#define SHADER_INDEX_VERSION	1
 
-typedef struct shader_source_s shader_source_t;
-typedef struct shader_s shader_t;
+typedef struct shader_entry_s
+{
+	char			name[MAX_QPATH];
+	int				offset;			// of the name in the file
+} shader_entry_t;
 
 typedef struct shader_source_s
 {
-    char            filename[MAX_QPATH];
-    bool_t          sourced;
-    shader_t        *shaders, *new_shaders;
-    shader_source_t *next;
+	char			filename[MAX_QPATH];
+	bool_t			sourced;
+	bool_t			scanned;		// by ScanAndLoadShaderFiles, so it's only parsed once
+	long long		mtime, size;	// as of the last parse, mtime is -1 if it can't be trusted
+	int				shaders, new_shaders;	// first of each in the file, -1 if none
+
+	shader_entry_t	*entries;		// every shader defined in the file, for the index
+	int				num_entries, max_entries;
 } shader_source_t;
 
 typedef struct shader_s
 {
-    char             name[MAX_QPATH];
-    bool_t           sourced;
+	char			name[MAX_QPATH];
+	bool_t			sourced;
 
-    char             diffuse_map[MAX_QPATH];
-    int              alpha_tested;
-    char             fullbright_map[MAX_QPATH];
+	char			diffuse_map[MAX_QPATH];
+	int				alpha_tested;
+	char			fullbright_map[MAX_QPATH];
 
-    shader_source_t  *file;
-    shader_t         *next, *next_in_file;
+	int				file;			// shader source, -1 if none
+	int				next_in_file;
 } shader_t;
 
-#define	MAX_SHADER_FILES	4096
-#define FILE_HASH_SIZE		1024
+// the index file is the header followed by the arrays, in native byte order
+// (byteorder and the record sizes tell if it was written by another machine)
+typedef struct shader_index_header_s
+{
+	char			id[8];
+	int				version;
+	int				byteorder;
+	int				file_record_size, entry_record_size;
+	int				num_files, num_entries;
+} shader_index_header_t;
+
+typedef struct shader_index_file_s
+{
+	char			filename[MAX_QPATH];
+	long long		mtime, size;
+	int				first_entry, num_entries;
+} shader_index_file_t;
+
+// open addressing over indices into an array, looked up by case insensitive
+// name. it doubles whenever it gets three quarters full
+typedef struct name_table_s
+{
+	unsigned int	*hashes;
+	int				*indices;		// -1 for an empty slot
+	int				size;			// a power of two
+	int				count;
+} name_table_t;
 
-static  shader_source_t     *source_hash_table[FILE_HASH_SIZE];
-static shader_source_t      shader_sources[MAX_SHADER_FILES];
-static int                  num_shader_sources;
+static shader_source_t		*shader_sources;
+static int					num_shader_sources, max_shader_sources;
+static name_table_t			source_table;
 
-static shader_t	        	*hash_table[FILE_HASH_SIZE];
-static shader_t             shaders[MAX_SHADERS];
-static int                  num_shaders;
+static shader_t				*shaders;
+static int					num_shaders, max_shaders;
+static name_table_t			shader_table;
 
-/*
-================
-return a hash value for the filename
-================
-*/
-static long generateHashValue( const char *fname, const int size ) {
+static unsigned int name_hash(const char *name)
+{
+	char	lower[MAX_QPATH];
 	int		i;
-	long	hash;
-	char	letter;
-
-	hash = 0;
-	i = 0;
-	while (fname[i] != '\0') {
-		letter = tolower(fname[i]);
-		if (letter =='.') break;				// don't include extension
-		if (letter =='\\') letter = '/';		// damn path names
-		if (letter == '/') letter = '/';		// damn path names
-		hash+=(long)(letter)*(i+119);
-		i++;
-	}
-	hash = (hash ^ (hash >> 10) ^ (hash >> 20));
-	hash &= (size-1);
-	return hash;
+
+	for (i = 0; name[i] && i < MAX_QPATH - 1; i++)
+	{
+		lower[i] = (name[i] == '\\') ? '/' : tolower((unsigned char)name[i]);
+	}
+
+	return hash_data(lower, i, 0);
+}
+
+static void name_table_free(name_table_t *table)
+{
+	qfree(table->hashes);
+	qfree(table->indices);
+	memset(table, 0, sizeof(*table));
+}
+
+static void name_table_insert(name_table_t *table, unsigned int hash, int index)
+{
+	int	slot;
+
+	if ((table->count + 1) * 4 > table->size * 3)
+	{
+		name_table_t	old = *table;
+		int				i;
+
+		table->size = old.size ? old.size * 2 : 256;
+		table->hashes = (unsigned int*)qmalloc(sizeof(unsigned int) * table->size);
+		table->indices = (int*)qmalloc(sizeof(int) * table->size);
+		memset(table->indices, -1, sizeof(int) * table->size);
+		table->count = 0;
+
+		for (i = 0; i < old.size; i++)
+		{
+			if (old.indices[i] >= 0)
+			{
+				name_table_insert(table, old.hashes[i], old.indices[i]);
+			}
+		}
+
+		name_table_free(&old);
+	}
+
+	for (slot = hash & (table->size - 1); table->indices[slot] >= 0; slot = (slot + 1) & (table->size - 1));
+
+	table->hashes[slot] = hash;
+	table->indices[slot] = index;
+	table->count++;
+}
+
+// names sit at the start of each record, records are stride bytes apart
+static int name_table_find(const name_table_t *table, unsigned int hash, const char *name, const void *records, size_t stride)
+{
+	int	slot;
+
+	if (!table->size)
+	{
+		return -1;
+	}
+
+	for (slot = hash & (table->size - 1); table->indices[slot] >= 0; slot = (slot + 1) & (table->size - 1))
+	{
+		if (table->hashes[slot] == hash && !strcasecmp((const char*)records + table->indices[slot] * stride, name))
+		{
+			return table->indices[slot];
+		}
+	}
+
+	return -1;
 }
 
-static shader_source_t *FindShaderSourceByName(const char *name)
+static int FindShaderSourceByName(const char *name)
 {
-	int			    hash;
+	unsigned int	hash;
+	int				i;
 	shader_source_t	*source;
 
-    if (!name || !name[0])
-        return NULL;
+	if (!name || !name[0])
+	{
+		return -1;
+	}
 
-	hash = generateHashValue(name, FILE_HASH_SIZE);
+	hash = name_hash(name);
 
 	//
 	// see if the shader source is already loaded
 	//
-	for (source=source_hash_table[hash]; source; source=source->next) {
-		if (strcasecmp(source->filename, name) == 0) {
-			// match found
-			return source;
-		}
+	i = name_table_find(&source_table, hash, name, shader_sources, sizeof(shader_source_t));
+	if (i >= 0)
+	{
+		return i;
 	}
 
-    if (num_shader_sources == MAX_SHADER_FILES)
-    {
-        return NULL;
-    }
-	source = &shader_sources[num_shader_sources++];
-    Q_strlcpy(source->filename, name, sizeof(source->filename));
-    source->shaders = NULL;
-    source->new_shaders = NULL;
-	hash = generateHashValue(source->filename, FILE_HASH_SIZE);
-	source->next = source_hash_table[hash];
-	source_hash_table[hash] = source;
+	if (num_shader_sources == max_shader_sources)
+	{
+		shader_source_t *newsources;
+
+		max_shader_sources = max_shader_sources ? max_shader_sources * 2 : 64;
+		newsources = (shader_source_t*)qmalloc(sizeof(shader_source_t) * max_shader_sources);
+		if (num_shader_sources)
+			memcpy(newsources, shader_sources, sizeof(shader_source_t) * num_shader_sources);
+		qfree(shader_sources);
+		shader_sources = newsources;
+	}
+
+	source = &shader_sources[num_shader_sources];
+	memset(source, 0, sizeof(*source));
+	Q_strlcpy(source->filename, name, sizeof(source->filename));
+	source->mtime = -1;
+	source->size = -1;
+	source->shaders = -1;
+	source->new_shaders = -1;
+	name_table_insert(&source_table, hash, num_shader_sources);
+
+	return num_shader_sources++;
 }
 
-static shader_t *FindShaderByName(const char *name)
+static int FindShaderByName(const char *name)
 {
-	char		strippedName[MAX_QPATH];
-	int			hash;
-	shader_t	*sh;
+	char			strippedName[MAX_QPATH];
+	unsigned int	hash;
+	int				i;
+	shader_t		*sh;
 
 	if ((name==NULL) || (name[0] == 0))
-    {
-		return NULL;
+	{
+		return -1;
 	}
 
 	strip_extension(name, strippedName);
 
-	hash = generateHashValue(strippedName, FILE_HASH_SIZE);
+	hash = name_hash(strippedName);
 
 	//
 	// see if the shader is already loaded
 	//
-	for (sh=hash_table[hash]; sh; sh=sh->next) {
-		// NOTE: if there was no shader or image available with the name strippedName
-		// then a default shader is created with lightmapIndex == LIGHTMAP_NONE, so we
-		// have to check all default shaders otherwise for every call to R_FindShader
-		// with that same strippedName a new default shader is created.
-		if (strcasecmp(sh->name, strippedName) == 0) {
-			// match found
-			return sh;
+	i = name_table_find(&shader_table, hash, strippedName, shaders, sizeof(shader_t));
+	if (i >= 0)
+	{
+		return i;
+	}
+
+	if (num_shaders == max_shaders)
+	{
+		shader_t *newshaders;
+
+		max_shaders = max_shaders ? max_shaders * 2 : 256;
+		newshaders = (shader_t*)qmalloc(sizeof(shader_t) * max_shaders);
+		if (num_shaders)
+			memcpy(newshaders, shaders, sizeof(shader_t) * num_shaders);
+		qfree(shaders);
+		shaders = newshaders;
+	}
+
+	sh = &shaders[num_shaders];
+	memset(sh, 0, sizeof(*sh));
+	Q_strlcpy(sh->name, strippedName, sizeof(sh->name));
+	sh->file = -1;
+	sh->next_in_file = -1;
+	name_table_insert(&shader_table, hash, num_shaders);
+
+	return num_shaders++;
+}
+
+static void AddShaderEntry(shader_source_t *source, const char *name, int offset)
+{
+	if (source->num_entries == source->max_entries)
+	{
+		shader_entry_t *newentries;
+
+		source->max_entries = source->max_entries ? source->max_entries * 2 : 16;
+		newentries = (shader_entry_t*)qmalloc(sizeof(shader_entry_t) * source->max_entries);
+		if (source->num_entries)
+			memcpy(newentries, source->entries, sizeof(shader_entry_t) * source->num_entries);
+		qfree(source->entries);
+		source->entries = newentries;
+	}
+
+	Q_strlcpy(source->entries[source->num_entries].name, name, sizeof(source->entries[0].name));
+	source->entries[source->num_entries].offset = offset;
+	source->num_entries++;
+}
+
+// the first file to define a shader is the one it's sourced from
+static void AddSourcedShaders(int source_index)
+{
+	shader_source_t	*source = &shader_sources[source_index];
+	shader_t		*shader;
+	int				i, sh;
+
+	source->sourced = true;
+
+	for (i = 0; i < source->num_entries; i++)
+	{
+		sh = FindShaderByName(source->entries[i].name);
+		if (sh < 0)
+		{
+			continue;
+		}
+		shader = &shaders[sh];
+
+		if (shader->file >= 0)
+		{
+			// it's a duplicate sourced shader...
+			continue;
+		}
+
+		shader->sourced = true;
+		shader->file = source_index;
+		shader->next_in_file = source->shaders;
+		source->shaders = sh;
+	}
+}
+
+// one per file that has to be parsed, which can happen on any thread. the
+// results are only added to the shader table afterwards, in file order
+typedef struct shader_parse_job_s
+{
+	char			*filename;
+	int				source;
+	char			*warning;		// to print once all are done, NULL if none
+	char			*error;			// NULL if the file could be read
+} shader_parse_job_t;
+
+// finds the shaders defined in the file
+static void ParseShaderFile(void *data, int job_index)
+{
+	shader_parse_job_t	*job = (shader_parse_job_t*)data + job_index;
+	shader_source_t		*source = &shader_sources[job->source];
+	filemap_t			filemap;
+	parser_t			parser;
+	token_t				token;
+	char				shaderName[MAX_QPATH], found[MAX_QPATH];
+	int					shaderLine, shaderOffset;
+
+	if (!mapfile(job->filename, &filemap, &job->error))
+	{
+		return;
+	}
+
+	COM_BeginParseSession(&parser, (const char*)filemap.data);
+	while (1)
+	{
+		COM_ParseExt(&parser, true, &token);
+
+		if (!token.length)
+			break;
+
+		COM_TokenString(&token, shaderName, sizeof(shaderName));
+		shaderLine = COM_GetCurrentParseLine(&parser);
+		shaderOffset = (int)(token.start - (const char*)filemap.data);
+
+		COM_ParseExt(&parser, true, &token);
+		if (!COM_TokenIs(&token, "{"))
+		{
+			if (token.length)
+			{
+				job->warning = msprintf("WARNING: Ignoring shader file %s. Shader \"%s\" on line %d missing opening brace (found \"%s\" on line %d).\n",
+							job->filename, shaderName, shaderLine, COM_TokenString(&token, found, sizeof(found)), COM_GetCurrentParseLine(&parser));
+			}
+			else
+			{
+				job->warning = msprintf("WARNING: Ignoring shader file %s. Shader \"%s\" on line %d missing opening brace.\n",
+							job->filename, shaderName, shaderLine);
+			}
+			break;
+		}
+
+		if (!SkipBracedSection(&parser, 1))
+		{
+			job->warning = msprintf("WARNING: Ignoring shader file %s. Shader \"%s\" on line %d missing closing brace.\n",
+						job->filename, shaderName, shaderLine);
+			break;
+		}
+
+		AddShaderEntry(source, shaderName, shaderOffset);
+	}
+
+	unmapfile(&filemap);
+}
+
+static void StatShaderFile(const char *filename, shader_source_t *source)
+{
+	struct stat st;
+
+	if (stat(filename, &st) == 0)
+	{
+		source->mtime = (long long)st.st_mtime;
+		source->size = (long long)st.st_size;
+	}
+	else
+	{
+		// in an archive, or gone
+		source->mtime = -1;
+		source->size = -1;
+	}
+}
+
+/*
+====================
+LoadShaderIndex
+
+Maps the index written by the last run, if there is one that this
+machine can read, and looks its files up by name
+=====================
+*/
+static const shader_index_header_t *LoadShaderIndex(filemap_t *filemap, name_table_t *table)
+{
+	char						*filename;
+	const shader_index_header_t	*header;
+	const shader_index_file_t	*files;
+	int							i;
+	bool_t						ok;
+
+	memset(table, 0, sizeof(*table));
+
+	filename = msprintf("%s/%s", shader_base_path, SHADER_INDEX_NAME);
+	ok = mapfile(filename, filemap, NULL);
+	qfree(filename);
+	if (!ok)
+	{
+		return NULL;
+	}
+
+	header = (const shader_index_header_t*)filemap->data;
+	if (filemap->size < sizeof(*header) ||
+		memcmp(header->id, SHADER_INDEX_ID, sizeof(header->id)) ||
+		header->version != SHADER_INDEX_VERSION ||
+		header->byteorder != 0x01020304 ||
+		header->file_record_size != (int)sizeof(shader_index_file_t) ||
+		header->entry_record_size != (int)sizeof(shader_entry_t) ||
+		header->num_files < 0 || header->num_entries < 0 ||
+		filemap->size != sizeof(*header) + header->num_files * sizeof(shader_index_file_t) + header->num_entries * sizeof(shader_entry_t))
+	{
+		unmapfile(filemap);
+		return NULL;
+	}
+
+	files = (const shader_index_file_t*)(header + 1);
+	for (i = 0; i < header->num_files; i++)
+	{
+		if (files[i].first_entry < 0 || files[i].num_entries < 0 || files[i].first_entry + files[i].num_entries > header->num_entries)
+		{
+			name_table_free(table);
+			unmapfile(filemap);
+			return NULL;
 		}
+
+		name_table_insert(table, name_hash(files[i].filename), i);
 	}
 
-    if (num_shaders == MAX_SHADERS)
-    {
-        return NULL;
-    }
-	sh = &shaders[num_shaders++];
-    Q_strlcpy(sh->name, strippedName, sizeof(sh->name));
-	hash = generateHashValue(sh->name, FILE_HASH_SIZE);
-	sh->next = hash_table[hash];
-	hash_table[hash] = sh;
-	sh->next_in_file = NULL;
-    sh->file = NULL;
+	return header;
+}
 
-	return sh;
+/*
+====================
+WriteShaderIndex
+
+Saves the shaders of every file that was parsed or found unchanged.
+Files changed within the last second might change again without their
+mtime moving, so they're saved as untrusted and parsed next time
+=====================
+*/
+static void WriteShaderIndex(void)
+{
+	char					*filename, *tempname;
+	shader_index_header_t	header;
+	shader_index_file_t		file;
+	long long				now = (long long)time(NULL);
+	FILE					*fp;
+	int						i, first_entry;
+	bool_t					ok;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, SHADER_INDEX_ID, sizeof(header.id));
+	header.version = SHADER_INDEX_VERSION;
+	header.byteorder = 0x01020304;
+	header.file_record_size = (int)sizeof(shader_index_file_t);
+	header.entry_record_size = (int)sizeof(shader_entry_t);
+
+	for (i = 0; i < num_shader_sources; i++)
+	{
+		if (shader_sources[i].sourced && shader_sources[i].mtime >= 0)
+		{
+			header.num_files++;
+			header.num_entries += shader_sources[i].num_entries;
+		}
+	}
+
+	// written aside and renamed over the old one, in case another run reads it meanwhile
+	filename = msprintf("%s/%s", shader_base_path, SHADER_INDEX_NAME);
+	tempname = msprintf("%s.tmp", filename);
+	if (!(fp = fopen(tempname, "wb")))
+	{
+		qfree(filename);
+		qfree(tempname);
+		return;
+	}
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+	for (i = 0, first_entry = 0; i < num_shader_sources && ok; i++)
+	{
+		const shader_source_t *source = &shader_sources[i];
+
+		if (!source->sourced || source->mtime < 0)
+		{
+			continue;
+		}
+
+		memset(&file, 0, sizeof(file));
+		Q_strlcpy(file.filename, source->filename, sizeof(file.filename));
+		file.mtime = (source->mtime >= now - 1) ? -1 : source->mtime;
+		file.size = source->size;
+		file.first_entry = first_entry;
+		file.num_entries = source->num_entries;
+		first_entry += source->num_entries;
+
+		ok = fwrite(&file, sizeof(file), 1, fp) == 1;
+	}
+
+	for (i = 0; i < num_shader_sources && ok; i++)
+	{
+		const shader_source_t *source = &shader_sources[i];
+
+		if (source->sourced && source->mtime >= 0 && source->num_entries)
+		{
+			ok = fwrite(source->entries, sizeof(shader_entry_t), source->num_entries, fp) == (size_t)source->num_entries;
+		}
+	}
+
+	if (fclose(fp) != 0 || !ok)
+	{
+		remove(tempname);
+	}
+	else
+	{
+		remove(filename); // rename doesn't replace files on windows
+		rename(tempname, filename);
+	}
+
+	qfree(filename);
+	qfree(tempname);
 }
 
 /*
 ====================
 ScanAndLoadShaderFiles
 
-Finds and loads all .shader files, combining them into
-a single large text block that can be scanned for shader names
+Finds all .shader files, and the shaders defined in each. Files that
+the index has with the same size and mtime aren't read at all, the
+rest are parsed at the same time
 =====================
 */
 static bool_t ScanAndLoadShaderFiles(char **out_error)
 {
-    char shader_dir[1024];
-	char **shaderFiles;
-	char *buffer;
-	char *p;
-	int numShaderFiles;
-	int i;
-	char *oldp, *token, *hashMem;
-	int hash;
-    size_t size;
-    char shaderName[MAX_QPATH];
-    int shaderLine;
-    shader_t *shader;
-    shader_source_t *shader_source;
+	char						**shaderFiles;
+	int							numShaderFiles;
+	int							i, j;
+	int							*sources;
+	filemap_t					indexmap;
+	const shader_index_header_t	*index;
+	const shader_index_file_t	*index_files = NULL;
+	const shader_entry_t		*index_entries = NULL;
+	name_table_t				index_table;
+	shader_parse_job_t			*jobs;
+	int							num_jobs = 0;
+	bool_t						ok = true;
 
 	// scan for shader files
-    snprintf(shader_dir, sizeof(shader_dir), "%s", shader_base_path);
-	shaderFiles = list_files(shader_dir, ".shader", &numShaderFiles);
+	shaderFiles = list_files(shader_base_path, ".shader", &numShaderFiles);
 
 	if (!shaderFiles || !numShaderFiles)
 	{
-        return (void)(out_error && (*out_error = msprintf("no shader files found"))), false;
+		return (void)(out_error && (*out_error = msprintf("no shader files found"))), false;
 	}
 
-	if (numShaderFiles > MAX_SHADER_FILES)
-    {
-		numShaderFiles = MAX_SHADER_FILES;
-	}
-    
-	// load and parse shader files
-	for ( i = 0; i < numShaderFiles; i++ )
+	index = LoadShaderIndex(&indexmap, &index_table);
+	if (index)
 	{
-		char *filename = msprintf("%s/%s", shader_dir, shaderFiles[i]);
+		index_files = (const shader_index_file_t*)(index + 1);
+		index_entries = (const shader_entry_t*)(index_files + index->num_files);
+	}
 
-        shader_source = FindShaderSourceByName(shaderFiles[i]);
-        if (!shader_source)
-        {
-            break;
-        }
-        shader_source->sourced = true;
+	sources = (int*)qmalloc(sizeof(int) * numShaderFiles);
+	jobs = (shader_parse_job_t*)qmalloc(sizeof(shader_parse_job_t) * numShaderFiles);
 
-        if (!loadfile(filename, (void **)&buffer, &size, out_error))
-        {
-            break;
-        }
+	// take the shaders of unchanged files from the index, and queue up the rest
+	for (i = 0; i < numShaderFiles; i++)
+	{
+		char			*filename = msprintf("%s/%s", shader_base_path, shaderFiles[i]);
+		shader_source_t	*source;
+		const shader_index_file_t *indexed;
 
-		p = buffer;
-		COM_BeginParseSession(filename);
-		while (1)
+		sources[i] = FindShaderSourceByName(shaderFiles[i]);
+		source = &shader_sources[sources[i]];
+
+		// names differing only in case are the same file
+		if (source->scanned)
 		{
-			token = COM_ParseExt(&p, true);
-			
-			if(!*token)
-				break;
+			qfree(filename);
+			continue;
+		}
+		source->scanned = true;
+		StatShaderFile(filename, source);
 
-			Q_strlcpy(shaderName, token, sizeof(shaderName));
-			shaderLine = COM_GetCurrentParseLine();
+		j = name_table_find(&index_table, name_hash(shaderFiles[i]), shaderFiles[i], index_files, sizeof(shader_index_file_t));
+		indexed = (j >= 0) ? &index_files[j] : NULL;
 
-			token = COM_ParseExt(&p, true);
-			if(token[0] != '{' || token[1] != '\0')
+		if (indexed && source->mtime >= 0 && indexed->mtime == source->mtime && indexed->size == source->size)
+		{
+			for (j = 0; j < indexed->num_entries; j++)
 			{
-				printf("WARNING: Ignoring shader file %s. Shader \"%s\" on line %d missing opening brace",
-							filename, shaderName, shaderLine);
-				if (token[0])
-				{
-					printf(" (found \"%s\" on line %d)", token, COM_GetCurrentParseLine());
-				}
-				printf(".\n");
-				break;
+				AddShaderEntry(source, index_entries[indexed->first_entry + j].name, index_entries[indexed->first_entry + j].offset);
 			}
+			qfree(filename);
+		}
+		else
+		{
+			memset(&jobs[num_jobs], 0, sizeof(jobs[num_jobs]));
+			jobs[num_jobs].filename = filename;
+			jobs[num_jobs].source = sources[i];
+			num_jobs++;
+		}
+	}
 
-			if(!SkipBracedSection(&p, 1))
-			{
-				printf("WARNING: Ignoring shader file %s. Shader \"%s\" on line %d missing closing brace.\n",
-							filename, shaderName, shaderLine);
-				break;
-			}
+	// the sources don't move from here on, so each job can fill in its own
+	thread_run(num_jobs, ParseShaderFile, jobs);
 
-            shader = FindShaderByName(shaderName);
-            if (shader == NULL)
-            {
-				printf("not enough space\n");
-                break; // not enough space
-            }
-
-            if (shader->file != NULL)
-            {
-                // it's a duplicate sourced shader...
-                //printf("Shader \"%s\" on line %d of file %s previously defined in file %s.\n",
-                //    shaderName, shaderLine, shader->file->filename);
-            }
-            else
-            {
-                shader->sourced = true;
-                shader->file = shader_source;
-                shader->next_in_file = shader_source->shaders;
-                shader_source->shaders = shader;
-            }
+	for (i = 0; i < num_jobs; i++)
+	{
+		if (jobs[i].warning)
+		{
+			printf("%s", jobs[i].warning);
 		}
-
-		if (buffer)
+		if (jobs[i].error && ok)
 		{
-			qfree(buffer);
-			buffer = NULL;
+			if (out_error)
+				*out_error = msprintf("%s: %s", jobs[i].filename, jobs[i].error);
+			ok = false;
 		}
+
+		qfree(jobs[i].warning);
+		qfree(jobs[i].error);
+		qfree(jobs[i].filename);
+	}
+
+	// in the order the files were found, which decides where duplicates come from
+	for (i = 0; i < numShaderFiles && ok; i++)
+	{
+		AddSourcedShaders(sources[i]);
+	}
+
+	// save the index if anything was parsed, or files went away
+	if (ok && (!index || num_jobs || index->num_files != numShaderFiles))
+	{
+		WriteShaderIndex();
+	}
+
+	name_table_free(&index_table);
+	if (index)
+	{
+		unmapfile(&indexmap);
 	}
 
 	// free up memory
+	qfree(jobs);
+	qfree(sources);
 	free_list_files(shaderFiles, numShaderFiles);
+
+	return ok;
 }
 
 // ==========================================
 
-bool_t init_shaders(const char *basepath, char **out_error)
+static void free_shaders(void)
 {
-    bool_t success;
+	int i;
 
-    if (initialized || !basepath || !*basepath)
-        return true;
+	for (i = 0; i < num_shader_sources; i++)
+	{
+		qfree(shader_sources[i].entries);
+	}
+	qfree(shader_sources);
+	shader_sources = NULL;
+	num_shader_sources = max_shader_sources = 0;
+	name_table_free(&source_table);
+
+	qfree(shaders);
+	shaders = NULL;
+	num_shaders = max_shaders = 0;
+	name_table_free(&shader_table);
+}
+
+bool_t init_shaders(const char *basepath, char **out_error)
+{
+	bool_t success;
 
-    Q_strlcpy(shader_base_path,  basepath, sizeof(shader_base_path));
+	if (initialized || !basepath || !*basepath)
+		return true;
 
-	memset(hash_table, 0, sizeof(hash_table));
-    memset(source_hash_table, 0, sizeof(source_hash_table));
+	Q_strlcpy(shader_base_path,  basepath, sizeof(shader_base_path));
 
 	success = ScanAndLoadShaderFiles(out_error);
 
-    initialized = 1;
+	shader_mutex = thread_mutex_create();
+	initialized = 1;
+	add_atexit_event(free_shaders);
 
-    return success;
+	return success;
 }
 
 void define_shader(const char *shader_source_name, const char *name, const char *diffuse_image, const char *fullbright_image, bool_t alpha_tested)
 {
-    shader_t        *sh;
-    shader_source_t *shader_source;
-    int             i;
-
-    if (!initialized)
-        return;
-
-    if (!alpha_tested && !(fullbright_image && fullbright_image[0]))
-        return; // not interesting enough
-
-    sh = FindShaderByName(name);
-    if (sh == NULL)
-    {
-        // can't doo much
-        return;
-    }
-    if (sh->sourced)
-    {
-        return;
-    }
-    Q_strlcpy(sh->diffuse_map, diffuse_image, sizeof(sh->diffuse_map));
-    sh->alpha_tested = alpha_tested;
-    if (fullbright_image && fullbright_image[0])
-    {
-        Q_strlcpy(sh->fullbright_map, fullbright_image, sizeof(sh->fullbright_map));
-    }
-    else
-    {
-        sh->fullbright_map[0] = 0;
-    }
-
-    shader_source = FindShaderSourceByName(shader_source_name);
-
-    sh->sourced = false;
-    sh->file = shader_source;
-    sh->next_in_file = shader_source->new_shaders;
-    shader_source->new_shaders = sh;
+	shader_t		*sh;
+	shader_source_t	*shader_source;
+	int				i, source_index;
+
+	if (!initialized)
+		return;
+
+	if (!alpha_tested && !(fullbright_image && fullbright_image[0]))
+		return; // not interesting enough
+
+	thread_mutex_lock(shader_mutex);
+
+	i = FindShaderByName(name);
+	if (i < 0 || shaders[i].sourced || shaders[i].file >= 0)
+	{
+		// can't doo much
+		thread_mutex_unlock(shader_mutex);
+		return;
+	}
+	sh = &shaders[i];
+	Q_strlcpy(sh->diffuse_map, diffuse_image, sizeof(sh->diffuse_map));
+	sh->alpha_tested = alpha_tested;
+	if (fullbright_image && fullbright_image[0])
+	{
+		Q_strlcpy(sh->fullbright_map, fullbright_image, sizeof(sh->fullbright_map));
+	}
+	else
+	{
+		sh->fullbright_map[0] = 0;
+	}
+
+	source_index = FindShaderSourceByName(shader_source_name);
+	shader_source = &shader_sources[source_index];
+
+	sh->sourced = false;
+	sh->file = source_index;
+	sh->next_in_file = shader_source->new_shaders;
+	shader_source->new_shaders = i;
+
+	thread_mutex_unlock(shader_mutex);
 }
 
 static void fprint_shader(FILE *fp, shader_t *shader)
 {
-    fprintf(fp, "\n%s\n", shader->name);
-    fprintf(fp, "{\n");
-    fprintf(fp, "\tsurfaceparm alphashadow\n");
-    fprintf(fp, "\tsurfaceparm trans\n");
-    fprintf(fp, "\t{\n");
-    fprintf(fp, "\t\tmap %s\n", shader->diffuse_map);
-    fprintf(fp, "\t\trgbGen identity\n");
-    fprintf(fp, "\t\tdepthWrite\n");
-    fprintf(fp, "\t\talphaFunc GE128\n");
-    fprintf(fp, "\t}\n");
-    fprintf(fp, "}\n");
+	fprintf(fp, "\n%s\n", shader->name);
+	fprintf(fp, "{\n");
+	fprintf(fp, "\tsurfaceparm alphashadow\n");
+	fprintf(fp, "\tsurfaceparm trans\n");
+	fprintf(fp, "\t{\n");
+	fprintf(fp, "\t\tmap %s\n", shader->diffuse_map);
+	fprintf(fp, "\t\trgbGen identity\n");
+	fprintf(fp, "\t\tdepthWrite\n");
+	fprintf(fp, "\t\talphaFunc GE128\n");
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "}\n");
 }
 
 void write_shaders(void)
 {
-    int             i;
-    shader_source_t *source;
-    shader_t        *shader;
-    FILE            *fp;
-    char            shader_file_name[1024];
-
-    if (!initialized)
-        return;
-
-    // go over all files that have shaders that need writing
-    // append each shader to its file
-    for (i = 0; i < num_shader_sources; i++)
-    {
-        source = &shader_sources[i];
-        shader = source->new_shaders;
-
-        if (!shader)
-        {
-            continue;
-        }
-
-        snprintf(shader_file_name, sizeof(shader_file_name), "%s/%s", shader_base_path, source->filename);
-
-        if (!(fp = fopen(shader_file_name, "ab")))
-        {
-            // unable to open the file for writing
-            continue;
-        }
-
-        while (shader)
-        {
-            fprint_shader(fp, shader);
-            shader = shader->next;
-        }
-
-        fclose(fp);
-    }
+	int				i, sh;
+	shader_source_t	*source;
+	FILE			*fp;
+	char			*shader_file_name;
+	bool_t			appended = false, indexable;
+
+	if (!initialized)
+		return;
+
+	// go over all files that have shaders that need writing
+	// append each shader to its file
+	for (i = 0; i < num_shader_sources; i++)
+	{
+		source = &shader_sources[i];
+		sh = source->new_shaders;
+
+		if (sh < 0)
+		{
+			continue;
+		}
+
+		shader_file_name = msprintf("%s/%s", shader_base_path, source->filename);
+
+		if (!(fp = fopen(shader_file_name, "ab")))
+		{
+			// unable to open the file for writing
+			qfree(shader_file_name);
+			continue;
+		}
+
+		// the index learns about the new shaders along with the new mtime, so
+		// the file isn't parsed again next time. that is, unless it came from
+		// an archive, then the file on disk only has the new ones
+		indexable = !source->sourced || source->mtime >= 0;
+		fseek(fp, 0, SEEK_END);
+		while (sh >= 0)
+		{
+			AddShaderEntry(source, shaders[sh].name, (int)ftell(fp) + 1);
+			fprint_shader(fp, &shaders[sh]);
+			sh = shaders[sh].next_in_file;
+		}
+
+		fclose(fp);
+
+		if (indexable)
+		{
+			StatShaderFile(shader_file_name, source);
+		}
+		qfree(shader_file_name);
+		source->sourced = true;
+		appended = true;
+	}
+
+	if (appended)
+	{
+		WriteShaderIndex();
+	}
 }
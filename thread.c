@@ -0,0 +1,300 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#include "global.h"
+#include "thread.h"
+
+int g_num_threads = 0;
+
+/* set while the thread is running jobs for thread_run */
+static THREAD_LOCAL int in_worker = 0;
+
+struct thread_mutex_s
+{
+#ifdef WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+/* mutexes are allocated with plain malloc, since the memory manager itself uses one */
+thread_mutex_t *thread_mutex_create(void)
+{
+	thread_mutex_t *mutex = (thread_mutex_t*)malloc(sizeof(thread_mutex_t));
+
+	if (!mutex)
+		return NULL;
+
+#ifdef WIN32
+	InitializeCriticalSection(&mutex->cs);
+#else
+	if (pthread_mutex_init(&mutex->mutex, NULL) != 0)
+	{
+		free(mutex);
+		return NULL;
+	}
+#endif
+
+	return mutex;
+}
+
+void thread_mutex_free(thread_mutex_t *mutex)
+{
+	if (!mutex)
+		return;
+
+#ifdef WIN32
+	DeleteCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_destroy(&mutex->mutex);
+#endif
+	free(mutex);
+}
+
+void thread_mutex_lock(thread_mutex_t *mutex)
+{
+	if (!mutex)
+		return;
+
+#ifdef WIN32
+	EnterCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void thread_mutex_unlock(thread_mutex_t *mutex)
+{
+	if (!mutex)
+		return;
+
+#ifdef WIN32
+	LeaveCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+#ifdef WIN32
+static SRWLOCK once_lock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t once_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void thread_once(volatile int *done, void (*function)(void))
+{
+/* cheap check once it's done, so it can be called from inner loops */
+#if defined(__GNUC__)
+	if (__atomic_load_n(done, __ATOMIC_ACQUIRE))
+		return;
+#elif defined(WIN32)
+	if (*done)
+	{
+		MemoryBarrier();
+		return;
+	}
+#endif
+
+#ifdef WIN32
+	AcquireSRWLockExclusive(&once_lock);
+#else
+	pthread_mutex_lock(&once_lock);
+#endif
+
+	if (!*done)
+	{
+		(*function)();
+#if defined(__GNUC__)
+		__atomic_store_n(done, 1, __ATOMIC_RELEASE);
+#elif defined(WIN32)
+		MemoryBarrier();
+		*done = 1;
+#else
+		*done = 1;
+#endif
+	}
+
+#ifdef WIN32
+	ReleaseSRWLockExclusive(&once_lock);
+#else
+	pthread_mutex_unlock(&once_lock);
+#endif
+}
+
+int thread_num_cpus(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return max((int)info.dwNumberOfProcessors, 1);
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+int thread_num_workers(void)
+{
+	return g_num_threads > 0 ? g_num_threads : thread_num_cpus();
+}
+
+typedef struct thread_work_s
+{
+	void (*function)(void *data, int job);
+	void *data;
+
+	int num_jobs;
+	int next_job;
+	thread_mutex_t *mutex;
+} thread_work_t;
+
+/* what each started thread is given */
+typedef struct thread_worker_s
+{
+	thread_work_t *work;
+	profile_worker_t *profile;
+} thread_worker_t;
+
+static void thread_do_work(thread_work_t *work)
+{
+	int job;
+
+	in_worker = 1;
+
+	for (;;)
+	{
+		thread_mutex_lock(work->mutex);
+		job = work->next_job++;
+		thread_mutex_unlock(work->mutex);
+
+		if (job >= work->num_jobs)
+			break;
+
+		(*work->function)(work->data, job);
+	}
+
+	in_worker = 0;
+}
+
+static void thread_worker_main(thread_worker_t *worker)
+{
+	profile_worker_begin(worker->profile);
+	thread_do_work(worker->work);
+	profile_worker_end();
+}
+
+#ifdef WIN32
+static DWORD WINAPI thread_main(LPVOID param)
+{
+	thread_worker_main((thread_worker_t*)param);
+	return 0;
+}
+#else
+static void *thread_main(void *param)
+{
+	thread_worker_main((thread_worker_t*)param);
+	return NULL;
+}
+#endif
+
+void thread_run(int num_jobs, void (*function)(void *data, int job), void *data)
+{
+	thread_work_t work;
+	thread_worker_t *workers;
+	profile_worker_t *profiles;
+	int num_threads, num_started, i;
+#ifdef WIN32
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+
+	num_threads = min(thread_num_workers(), num_jobs);
+
+	work.mutex = NULL;
+	if (num_threads > 1 && !in_worker)
+		work.mutex = thread_mutex_create();
+
+	if (!work.mutex)
+	{
+	/* run everything on this thread */
+		for (i = 0; i < num_jobs; i++)
+			(*function)(data, i);
+		return;
+	}
+
+	work.function = function;
+	work.data = data;
+	work.num_jobs = num_jobs;
+	work.next_job = 0;
+
+#ifdef WIN32
+	threads = (HANDLE*)malloc(sizeof(HANDLE) * num_threads);
+#else
+	threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+#endif
+	workers = (thread_worker_t*)malloc(sizeof(thread_worker_t) * num_threads);
+	profiles = (profile_worker_t*)malloc(sizeof(profile_worker_t) * num_threads);
+
+/* if a thread fails to start, the ones that did (and this one) pick up the slack */
+	num_started = 0;
+	for (i = 1; threads && workers && profiles && i < num_threads; i++)
+	{
+		workers[num_started].work = &work;
+		workers[num_started].profile = &profiles[num_started];
+#ifdef WIN32
+		threads[num_started] = CreateThread(NULL, 0, thread_main, &workers[num_started], 0, NULL);
+		if (!threads[num_started])
+			break;
+#else
+		if (pthread_create(&threads[num_started], NULL, thread_main, &workers[num_started]) != 0)
+			break;
+#endif
+		num_started++;
+	}
+
+	thread_do_work(&work);
+
+	for (i = 0; i < num_started; i++)
+	{
+#ifdef WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+	profile_add_workers(profiles, num_started);
+
+	free(profiles);
+	free(workers);
+	free(threads);
+	thread_mutex_free(work.mutex);
+}
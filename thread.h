@@ -0,0 +1,43 @@
+/*
+    QShed <http://www.icculus.org/qshed>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+typedef struct thread_mutex_s thread_mutex_t;
+
+/* locking or unlocking a NULL mutex does nothing */
+thread_mutex_t *thread_mutex_create(void);
+void thread_mutex_free(thread_mutex_t *mutex);
+void thread_mutex_lock(thread_mutex_t *mutex);
+void thread_mutex_unlock(thread_mutex_t *mutex);
+
+/* call function once per process, even if several threads get here at the same time.
+ * done must be a zero-initialized static */
+void thread_once(volatile int *done, void (*function)(void));
+
+extern int g_num_threads; /* number of worker threads, 0 means one per CPU */
+
+int thread_num_cpus(void);
+int thread_num_workers(void);
+
+/* call function(data, job) for each job in 0..num_jobs-1, spread over the
+ * worker threads, and return once they are all done. the calling thread takes
+ * part. calls made from inside a job run serially on that thread */
+void thread_run(int num_jobs, void (*function)(void *data, int job), void *data);
+
+#endif
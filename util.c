@@ -24,20 +24,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #ifdef WIN32
 # include <windows.h>
 # include <direct.h>
+# include <fcntl.h>
+# include <io.h>
+# include <process.h>
 #else
 # include <unistd.h>
 # include <fcntl.h>
 # include <dlfcn.h>
+# include <sys/mman.h>
 # include <errno.h>
 #endif
 
 #include "global.h"
+#include "pack.h"
 #include "util.h"
+#include "thread.h"
 
 bool_t g_force_yes = false; /* automatically choose "yes" for all confirms? */
 bool_t g_force_no = true; /* automatically choose "no" for all confirms? */
@@ -92,6 +99,22 @@ void Q_strlcpy(char *dest, const char *src, size_t size)
 	}
 }
 
+double get_time(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+#endif
+}
+
 bool_t yesno(void)
 {
 	char buffer[16];
@@ -159,11 +182,11 @@ bool_t makepath(char *path, char **out_error)
 					if (!yesno())
 						FAIL(copystring("user aborted operation"))
 
-				/* create the directory */
+				/* create the directory (another thread may have just done so) */
 #ifdef WIN32
-					if (_mkdir(newpath) != 0)
+					if (_mkdir(newpath) != 0 && errno != EEXIST)
 #else
-					if (mkdir(newpath, 0777) != 0)
+					if (mkdir(newpath, 0777) != 0 && errno != EEXIST)
 #endif
 						FAIL(msprintf("%s: %s", newpath, strerror(errno)))
 				}
@@ -196,7 +219,69 @@ bool_t makepath(char *path, char **out_error)
 	return true;
 }
 
-FILE *openfile_write(const char *filename, char **out_error)
+typedef struct filelog_s
+{
+	bool_t active;
+	filelog_entry_t *entries;
+	int num_entries;
+	int max_entries;
+} filelog_t;
+
+static THREAD_LOCAL filelog_t filelog;
+
+static void filelog_add(const char *filename, bool_t written)
+{
+	int i;
+
+	if (!filelog.active)
+		return;
+
+	for (i = 0; i < filelog.num_entries; i++)
+		if (filelog.entries[i].written == written && !strcmp(filelog.entries[i].filename, filename))
+			return;
+
+	if (filelog.num_entries == filelog.max_entries)
+	{
+		filelog_entry_t *newentries;
+
+		filelog.max_entries = filelog.max_entries ? filelog.max_entries * 2 : 16;
+		newentries = (filelog_entry_t*)qmalloc(sizeof(filelog_entry_t) * filelog.max_entries);
+		if (filelog.num_entries)
+			memcpy(newentries, filelog.entries, sizeof(filelog_entry_t) * filelog.num_entries);
+		qfree(filelog.entries);
+		filelog.entries = newentries;
+	}
+
+	filelog.entries[filelog.num_entries].filename = copystring(filename);
+	filelog.entries[filelog.num_entries].written = written;
+	filelog.num_entries++;
+}
+
+void filelog_begin(void)
+{
+	memset(&filelog, 0, sizeof(filelog));
+	filelog.active = true;
+}
+
+filelog_entry_t *filelog_end(int *out_num_entries)
+{
+	filelog_entry_t *entries = filelog.entries;
+
+	*out_num_entries = filelog.num_entries;
+	memset(&filelog, 0, sizeof(filelog));
+	return entries;
+}
+
+void filelog_free(filelog_entry_t *entries, int num_entries)
+{
+	int i;
+
+	for (i = 0; i < num_entries; i++)
+		qfree(entries[i].filename);
+	qfree(entries);
+}
+
+static bool_t confirm_overwrite(const char *filename, char **out_error)
 {
 	bool_t file_exists;
 	FILE *fp;
@@ -212,13 +297,24 @@ FILE *openfile_write(const char *filename, char **out_error)
 	{
 		printf("File %s already exists. Overwrite? [y/N] ", filename);
 		if (!yesno())
-			return (void)(out_error && (*out_error = msprintf("user aborted operation"))), NULL;
+			return (void)(out_error && (*out_error = msprintf("user aborted operation"))), false;
 	}
 
+	return true;
+}
+
+FILE *openfile_write(const char *filename, char **out_error)
+{
+	FILE *fp;
+
+	if (!confirm_overwrite(filename, out_error))
+		return NULL;
+
 	fp = fopen(filename, "wb");
 	if (!fp)
 		return (void)(out_error && (*out_error = msprintf("couldn't open file: %s", strerror(errno)))), NULL;
 
+	filelog_add(filename, true);
 	return fp;
 }
 
@@ -228,10 +324,20 @@ bool_t loadfile(const char *filename, void **out_data, size_t *out_size, char **
 	long ftellret;
 	unsigned char *filemem;
 	size_t filesize, readsize;
+	bool_t found;
+
+	filelog_add(filename, false);
 
 	fp = fopen(filename, "rb");
 	if (!fp)
 	{
+		int error = errno;
+
+	/* not on disk, maybe in a mounted archive */
+		if (pack_loadfile(filename, out_data, out_size, &found, out_error) || found)
+			return found;
+
+		errno = error;
 		if (out_error)
 			*out_error = msprintf("Couldn't open file: %s", strerror(errno));
 		return false;
@@ -278,6 +384,117 @@ bool_t loadfile(const char *filename, void **out_data, size_t *out_size, char **
 	return true;
 }
 
+/* file mapping. the mapping is private and writable, so loaders can byteswap
+ * in place without the changes reaching the file on disk */
+
+/* guards the memory manager's pool lists and statistics, and the file stats */
+static thread_mutex_t *mem_mutex = NULL;
+
+static size_t bytes_mapped = 0; /* bytes brought in by mmap, without a copy */
+static size_t bytes_read = 0; /* bytes brought in by the loadfile fallback */
+
+bool_t mapfile(const char *filename, filemap_t *out_map, char **out_error)
+{
+#ifndef WIN32
+	int fd;
+	struct stat st;
+	long pagesize;
+	void *data;
+	bool_t found;
+
+	filelog_add(filename, false);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		int error = errno;
+
+		if (pack_mapfile(filename, out_map, &found, out_error) || found)
+		{
+			if (found)
+			{
+				thread_mutex_lock(mem_mutex);
+				if (out_map->mapped)
+					bytes_mapped += out_map->size;
+				else
+					bytes_read += out_map->size;
+				thread_mutex_unlock(mem_mutex);
+			}
+			return found;
+		}
+
+		errno = error;
+		if (out_error)
+			*out_error = msprintf("Couldn't open file: %s", strerror(errno));
+		return false;
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+
+/* the tail of the last page is zero filled, which gives us the same NUL
+ * terminator loadfile provides. if the file ends exactly on a page boundary
+ * (or is empty, or isn't a regular file) there is no room for it, so read it
+ * the old way instead */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && pagesize > 0 && (st.st_size % pagesize) != 0)
+	{
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			close(fd);
+
+			out_map->data = data;
+			out_map->size = (size_t)st.st_size;
+			out_map->mapped = true;
+			out_map->mapoffset = 0;
+
+			thread_mutex_lock(mem_mutex);
+			bytes_mapped += out_map->size;
+			thread_mutex_unlock(mem_mutex);
+			return true;
+		}
+	}
+
+	close(fd);
+#endif
+
+	if (!loadfile(filename, &out_map->data, &out_map->size, out_error))
+		return false;
+	out_map->mapped = false;
+	out_map->mapoffset = 0;
+
+	thread_mutex_lock(mem_mutex);
+	bytes_read += out_map->size;
+	thread_mutex_unlock(mem_mutex);
+	return true;
+}
+
+void unmapfile(filemap_t *map)
+{
+	if (!map->data)
+		return;
+
+#ifndef WIN32
+	if (map->mapped)
+		munmap((unsigned char*)map->data - map->mapoffset, map->mapoffset + map->size + 1);
+	else
+#endif
+		qfree(map->data);
+
+	map->data = NULL;
+	map->size = 0;
+	map->mapped = false;
+}
+
+void mapfile_get_stats(size_t *out_bytes_mapped, size_t *out_bytes_read)
+{
+	thread_mutex_lock(mem_mutex);
+	if (out_bytes_mapped)
+		*out_bytes_mapped = bytes_mapped;
+	if (out_bytes_read)
+		*out_bytes_read = bytes_read;
+	thread_mutex_unlock(mem_mutex);
+}
+
 bool_t writefile(const char *filename, const void *data, size_t size, char **out_error)
 {
 	FILE *fp;
@@ -306,16 +523,43 @@ typedef struct mem_alloc_s
 	size_t numbytes;
 	const char *file;
 	int line;
+	int flags;
+	int refcount; /* see mem_share */
 
 	struct mem_alloc_s *prev;
 	struct mem_alloc_s *next;
 } mem_alloc_t;
 
+#define MEM_ALLOC_ARENA  1 /* carved out of an arena chunk, released with the pool */
+#define MEM_ALLOC_LINKED 2 /* linked into the pool's alloc list */
+
+/* arena chunk. the header is padded so the memory after it stays aligned */
+typedef union mem_chunk_u
+{
+	struct
+	{
+		union mem_chunk_u *next;
+		size_t size;
+		size_t used;
+	} c;
+	double align[4];
+} mem_chunk_t;
+
+#define MEM_ARENA_ALIGN 16
+#define MEM_ARENA_DEFAULT_CHUNK_SIZE 65536
+
 struct mem_pool_s
 {
 	const char *file;
 	int line;
 
+	int refcount; /* see mem_share_pool */
+	bool_t arena;
+	bool_t track; /* link arena allocations into the alloc list too, for leak reports */
+	size_t chunk_size;
+	mem_chunk_t *chunk_head;
+	size_t arena_bytes; /* bytes handed out from the chunks */
+
 	mem_alloc_t *alloc_head;
 	mem_alloc_t *alloc_tail;
 
@@ -328,10 +572,75 @@ static mem_pool_t *mem_pool_tail;
 
 mem_pool_t *mem_globalpool;
 
+#ifdef _DEBUG
+bool_t g_mem_track_arenas = true;
+#else
+bool_t g_mem_track_arenas = false;
+#endif
+
 static size_t bytes_alloced = 0;
 static size_t peak_bytes = 0;
+static size_t num_allocs = 0;
+static size_t num_arena_allocs = 0;
+static size_t num_mallocs = 0;
+static size_t arena_bytes_reserved = 0;
+
+#define PROFILE_MAX_DEPTH 16
+
+/* the profile being recorded on this thread. allocations are counted here,
+ * without the mutex, as they are made. memory is counted as it is allocated
+ * and freed by this thread, so bytes can go negative when it frees memory that
+ * was allocated before profile_begin */
+typedef struct profile_state_s
+{
+	profile_t *profile;
+	profile_worker_t *worker; /* set instead of profile on thread_run's workers */
+	double start_time;
+	long long bytes, peak, start_bytes;
 
-mem_pool_t *mem_create_pool_(const char *file, int line)
+	int depth;
+	struct
+	{
+		profile_stage_t stage;
+		double resume_time; /* when the stage last started running, after it began or an inner stage ended */
+		long long start_bytes;
+		long long outer_peak; /* peak of the enclosing stage when this one began */
+	} stack[PROFILE_MAX_DEPTH];
+} profile_state_t;
+
+static THREAD_LOCAL profile_state_t profile_state;
+
+static void profile_count_alloc(size_t numbytes)
+{
+	profile_state_t *ps = &profile_state;
+
+	if (ps->worker)
+	{
+		ps->worker->num_allocs++;
+		ps->worker->bytes += numbytes;
+		ps->worker->peak = max(ps->worker->peak, ps->worker->bytes);
+		return;
+	}
+
+	if (!ps->profile)
+		return;
+
+	if (ps->depth)
+		ps->profile->num_allocs[ps->stack[ps->depth - 1].stage]++;
+	ps->profile->total_allocs++;
+	ps->bytes += numbytes;
+	ps->peak = max(ps->peak, ps->bytes);
+}
+
+static void profile_count_free(size_t numbytes)
+{
+	if (profile_state.worker)
+		profile_state.worker->bytes -= numbytes;
+	else if (profile_state.profile)
+		profile_state.bytes -= numbytes;
+}
+
+static mem_pool_t *mem_new_pool(const char *file, int line)
 {
 	mem_pool_t *pool;
 
@@ -342,9 +651,17 @@ mem_pool_t *mem_create_pool_(const char *file, int line)
 	pool->file = file;
 	pool->line = line;
 
+	pool->refcount = 1;
+	pool->arena = false;
+	pool->track = true;
+	pool->chunk_size = 0;
+	pool->chunk_head = NULL;
+	pool->arena_bytes = 0;
+
 	pool->alloc_head = NULL;
 	pool->alloc_tail = NULL;
 
+	thread_mutex_lock(mem_mutex);
 	pool->prev = mem_pool_tail;
 	if (pool->prev)
 		pool->prev->next = pool;
@@ -352,15 +669,64 @@ mem_pool_t *mem_create_pool_(const char *file, int line)
 	if (!mem_pool_head)
 		mem_pool_head = pool;
 	mem_pool_tail = pool;
+	thread_mutex_unlock(mem_mutex);
+
+	return pool;
+}
+
+mem_pool_t *mem_create_pool_(const char *file, int line)
+{
+	return mem_new_pool(file, line);
+}
+
+/* an arena pool bump-allocates small allocations out of large chunks. they
+ * can't be freed individually (mem_free on them does nothing), but the whole
+ * pool is released in one go by mem_free_pool. big allocations still go
+ * through malloc and can be freed as usual */
+mem_pool_t *mem_create_arena_(size_t chunk_size, const char *file, int line)
+{
+	mem_pool_t *pool;
+
+	pool = mem_new_pool(file, line);
+	if (!pool)
+		return NULL;
+
+	pool->arena = true;
+	pool->track = g_mem_track_arenas;
+	pool->chunk_size = chunk_size ? chunk_size : MEM_ARENA_DEFAULT_CHUNK_SIZE;
 
 	return pool;
 }
 
+static void mem_link_alloc(mem_pool_t *pool, mem_alloc_t *alloc)
+{
+	alloc->flags |= MEM_ALLOC_LINKED;
+	alloc->prev = pool->alloc_tail;
+	alloc->next = NULL;
+	if (!pool->alloc_head)
+		pool->alloc_head = alloc;
+	else
+		pool->alloc_tail->next = alloc;
+	pool->alloc_tail = alloc;
+}
+
+static void mem_unlink_alloc(mem_alloc_t *alloc)
+{
+	if (alloc->prev) alloc->prev->next = alloc->next;
+	if (alloc->next) alloc->next->prev = alloc->prev;
+	if (alloc->pool->alloc_head == alloc) alloc->pool->alloc_head = alloc->next;
+	if (alloc->pool->alloc_tail == alloc) alloc->pool->alloc_tail = alloc->prev;
+	alloc->flags &= ~MEM_ALLOC_LINKED;
+}
+
 /* transfer the pool's allocs to the global pool then free the now-empty pool.
  * this is pretty lame... */
 void mem_merge_pool(mem_pool_t *pool)
 {
 	mem_alloc_t *alloc;
+	mem_chunk_t *chunk;
+
+	thread_mutex_lock(mem_mutex);
 
 	for (alloc = pool->alloc_head; alloc; alloc = alloc->next)
 		alloc->pool = mem_globalpool;
@@ -381,12 +747,27 @@ void mem_merge_pool(mem_pool_t *pool)
 	pool->alloc_head = NULL;
 	pool->alloc_tail = NULL;
 
+/* arena chunks stay alive until the global pool goes away */
+	while ((chunk = pool->chunk_head))
+	{
+		pool->chunk_head = chunk->c.next;
+		chunk->c.next = mem_globalpool->chunk_head;
+		mem_globalpool->chunk_head = chunk;
+	}
+	mem_globalpool->arena_bytes += pool->arena_bytes;
+	pool->arena_bytes = 0;
+
+	thread_mutex_unlock(mem_mutex);
+
 	mem_free_pool(pool);
 }
 
-void mem_free_pool_(mem_pool_t *pool, bool_t complain)
+static void mem_destroy_pool(mem_pool_t *pool, bool_t complain)
 {
 	mem_alloc_t *alloc, *nextalloc;
+	mem_chunk_t *chunk, *nextchunk;
+
+	thread_mutex_lock(mem_mutex);
 
 	for (alloc = pool->alloc_head; alloc; alloc = nextalloc)
 	{
@@ -394,17 +775,108 @@ void mem_free_pool_(mem_pool_t *pool, bool_t complain)
 
 		if (complain)
 			printf("%s (ln %d) (%d bytes)\n", alloc->file, alloc->line, (int)alloc->numbytes);
-		free(alloc);
+		if (!(alloc->flags & MEM_ALLOC_ARENA))
+		{
+			bytes_alloced -= alloc->numbytes;
+			profile_count_free(alloc->numbytes);
+			free(alloc);
+		}
 	}
 
+	for (chunk = pool->chunk_head; chunk; chunk = nextchunk)
+	{
+		nextchunk = chunk->c.next;
+		arena_bytes_reserved -= chunk->c.size;
+		free(chunk);
+	}
+	bytes_alloced -= pool->arena_bytes;
+	profile_count_free(pool->arena_bytes);
+
 	if (pool->prev) pool->prev->next = pool->next;
 	if (pool->next) pool->next->prev = pool->prev;
 	if (mem_pool_head == pool) mem_pool_head = pool->next;
 	if (mem_pool_tail == pool) mem_pool_tail = pool->prev;
 
+	thread_mutex_unlock(mem_mutex);
+
 	free(pool);
 }
 
+/* the pool's memory is only given back when its last reference goes */
+void mem_free_pool_(mem_pool_t *pool, bool_t complain)
+{
+	int refcount;
+
+	thread_mutex_lock(mem_mutex);
+	refcount = --pool->refcount;
+	thread_mutex_unlock(mem_mutex);
+
+	if (!refcount)
+		mem_destroy_pool(pool, complain);
+}
+
+mem_pool_t *mem_share_pool(mem_pool_t *pool)
+{
+	thread_mutex_lock(mem_mutex);
+	pool->refcount++;
+	thread_mutex_unlock(mem_mutex);
+
+	return pool;
+}
+
+static void *mem_arena_alloc(mem_pool_t *pool, size_t numbytes, const char *file, int line)
+{
+	mem_chunk_t *chunk;
+	mem_alloc_t *alloc;
+	size_t size;
+
+	size = sizeof(mem_alloc_t) + ((numbytes + MEM_ARENA_ALIGN - 1) & ~(size_t)(MEM_ARENA_ALIGN - 1));
+
+	thread_mutex_lock(mem_mutex);
+
+	chunk = pool->chunk_head;
+	if (!chunk || chunk->c.used + size > chunk->c.size)
+	{
+		chunk = (mem_chunk_t*)malloc(sizeof(mem_chunk_t) + pool->chunk_size);
+		if (!chunk)
+		{
+			thread_mutex_unlock(mem_mutex);
+			return NULL;
+		}
+
+		num_mallocs++;
+		arena_bytes_reserved += pool->chunk_size;
+
+		chunk->c.size = pool->chunk_size;
+		chunk->c.used = 0;
+		chunk->c.next = pool->chunk_head;
+		pool->chunk_head = chunk;
+	}
+
+	alloc = (mem_alloc_t*)((unsigned char*)(chunk + 1) + chunk->c.used);
+	chunk->c.used += size;
+
+	num_allocs++;
+	num_arena_allocs++;
+	bytes_alloced += numbytes;
+	peak_bytes = max(peak_bytes, bytes_alloced);
+	pool->arena_bytes += numbytes;
+	profile_count_alloc(numbytes);
+
+	alloc->pool = pool;
+	alloc->numbytes = numbytes;
+	alloc->file = file;
+	alloc->line = line;
+	alloc->flags = MEM_ALLOC_ARENA;
+	alloc->refcount = 1;
+	if (pool->track)
+		mem_link_alloc(pool, alloc);
+
+	thread_mutex_unlock(mem_mutex);
+
+	return alloc + 1;
+}
+
 void *mem_alloc_(mem_pool_t *pool, size_t numbytes, const char *file, int line)
 {
 	mem_alloc_t *alloc;
@@ -413,26 +885,31 @@ void *mem_alloc_(mem_pool_t *pool, size_t numbytes, const char *file, int line)
 	if (!numbytes)
 		return NULL;
 
+	if (pool->arena && numbytes <= pool->chunk_size / 4)
+		return mem_arena_alloc(pool, numbytes, file, line);
+
 	mem = malloc(sizeof(mem_alloc_t) + numbytes);
 
 	if (!mem)
 		return NULL;
 
-	bytes_alloced += numbytes;
-	peak_bytes = max(peak_bytes, bytes_alloced);
-
 	alloc = (mem_alloc_t*)mem;
 	alloc->pool = pool;
 	alloc->numbytes = numbytes;
 	alloc->file = file;
 	alloc->line = line;
-	alloc->prev = pool->alloc_tail;
-	alloc->next = NULL;
-	if (!pool->alloc_head)
-		pool->alloc_head = alloc;
-	else
-		pool->alloc_tail->next = alloc;
-	pool->alloc_tail = alloc;
+	alloc->flags = 0;
+	alloc->refcount = 1;
+
+	thread_mutex_lock(mem_mutex);
+	num_allocs++;
+	num_mallocs++;
+	bytes_alloced += numbytes;
+	peak_bytes = max(peak_bytes, bytes_alloced);
+	mem_link_alloc(pool, alloc);
+	thread_mutex_unlock(mem_mutex);
+
+	profile_count_alloc(numbytes);
 
 	return alloc + 1;
 }
@@ -446,16 +923,201 @@ void mem_free(void *mem)
 
 	alloc = (mem_alloc_t*)mem - 1;
 
+	thread_mutex_lock(mem_mutex);
+
+	if (--alloc->refcount > 0)
+	{
+		thread_mutex_unlock(mem_mutex);
+		return;
+	}
+
+/* arena memory is only given back when the pool is freed */
+	if (alloc->flags & MEM_ALLOC_ARENA)
+	{
+		if (alloc->flags & MEM_ALLOC_LINKED)
+			mem_unlink_alloc(alloc);
+		thread_mutex_unlock(mem_mutex);
+		return;
+	}
+
 	bytes_alloced -= alloc->numbytes;
 
-	if (alloc->prev) alloc->prev->next = alloc->next;
-	if (alloc->next) alloc->next->prev = alloc->prev;
-	if (alloc->pool->alloc_head == alloc) alloc->pool->alloc_head = alloc->next;
-	if (alloc->pool->alloc_tail == alloc) alloc->pool->alloc_tail = alloc->prev;
+	mem_unlink_alloc(alloc);
+
+	thread_mutex_unlock(mem_mutex);
+
+	profile_count_free(alloc->numbytes);
 
 	free(alloc);
 }
 
+void *mem_share(void *mem)
+{
+	if (!mem)
+		return NULL;
+
+	thread_mutex_lock(mem_mutex);
+	((mem_alloc_t*)mem - 1)->refcount++;
+	thread_mutex_unlock(mem_mutex);
+
+	return mem;
+}
+
+void *mem_unshare(void *mem)
+{
+	mem_alloc_t *alloc;
+	void *copy;
+	bool_t shared;
+
+	if (!mem)
+		return NULL;
+
+	alloc = (mem_alloc_t*)mem - 1;
+
+	thread_mutex_lock(mem_mutex);
+	shared = alloc->refcount > 1;
+	thread_mutex_unlock(mem_mutex);
+
+	if (!shared)
+		return mem;
+
+	copy = mem_alloc_(mem_globalpool, alloc->numbytes, alloc->file, alloc->line);
+	if (!copy)
+		return NULL;
+	memcpy(copy, mem, alloc->numbytes);
+	mem_free(mem);
+	return copy;
+}
+
+void mem_get_stats(mem_stats_t *out_stats)
+{
+	thread_mutex_lock(mem_mutex);
+	out_stats->num_allocs = num_allocs;
+	out_stats->num_arena_allocs = num_arena_allocs;
+	out_stats->num_mallocs = num_mallocs;
+	out_stats->bytes_alloced = bytes_alloced;
+	out_stats->peak_bytes = peak_bytes;
+	out_stats->arena_bytes_reserved = arena_bytes_reserved;
+	thread_mutex_unlock(mem_mutex);
+}
+
+/* start measuring peak_bytes again from what is allocated now */
+void mem_reset_peak(void)
+{
+	thread_mutex_lock(mem_mutex);
+	peak_bytes = bytes_alloced;
+	thread_mutex_unlock(mem_mutex);
+}
+
+const char *profile_stage_names[PROFILE_NUMSTAGES] = { "read", "parse", "skins", "resize", "normals", "facetize", "palettize", "write", "render" };
+
+void profile_begin(profile_t *profile)
+{
+	profile_state_t *ps = &profile_state;
+
+	memset(profile, 0, sizeof(*profile));
+
+	ps->profile = profile;
+	ps->start_time = get_time();
+	ps->bytes = ps->peak = ps->start_bytes = 0;
+	ps->depth = 0;
+}
+
+void profile_end(void)
+{
+	profile_state_t *ps = &profile_state;
+
+	if (!ps->profile)
+		return;
+
+	while (ps->depth)
+		profile_pop();
+
+	ps->profile->total_time = get_time() - ps->start_time;
+	ps->profile->total_peak_bytes = (size_t)max(ps->peak - ps->start_bytes, 0);
+	ps->profile = NULL;
+}
+
+void profile_push(profile_stage_t stage)
+{
+	profile_state_t *ps = &profile_state;
+	double time;
+
+	if (!ps->profile || ps->depth == PROFILE_MAX_DEPTH)
+		return;
+
+	time = get_time();
+
+/* pause the enclosing stage */
+	if (ps->depth)
+		ps->profile->time[ps->stack[ps->depth - 1].stage] += time - ps->stack[ps->depth - 1].resume_time;
+
+	ps->stack[ps->depth].stage = stage;
+	ps->stack[ps->depth].resume_time = time;
+	ps->stack[ps->depth].start_bytes = ps->bytes;
+	ps->stack[ps->depth].outer_peak = ps->peak;
+	ps->depth++;
+
+	ps->peak = ps->bytes;
+}
+
+void profile_pop(void)
+{
+	profile_state_t *ps = &profile_state;
+	double time;
+	long long peak;
+
+	if (!ps->profile || !ps->depth)
+		return;
+
+	time = get_time();
+
+	ps->depth--;
+	peak = ps->peak - ps->stack[ps->depth].start_bytes;
+	ps->profile->time[ps->stack[ps->depth].stage] += time - ps->stack[ps->depth].resume_time;
+	ps->profile->peak_bytes[ps->stack[ps->depth].stage] = max(ps->profile->peak_bytes[ps->stack[ps->depth].stage], (size_t)max(peak, 0));
+
+/* resume the enclosing stage, whose peak includes this one's */
+	ps->peak = max(ps->peak, ps->stack[ps->depth].outer_peak);
+	if (ps->depth)
+		ps->stack[ps->depth - 1].resume_time = time;
+}
+
+void profile_worker_begin(profile_worker_t *worker)
+{
+	memset(worker, 0, sizeof(*worker));
+	profile_state.worker = worker;
+}
+
+void profile_worker_end(void)
+{
+	profile_state.worker = NULL;
+}
+
+void profile_add_workers(const profile_worker_t *workers, int num_workers)
+{
+	profile_state_t *ps = &profile_state;
+	long long bytes = 0, peak = 0;
+	size_t num_allocs = 0;
+	int i;
+
+	if (!ps->profile)
+		return;
+
+	for (i = 0; i < num_workers; i++)
+	{
+		num_allocs += workers[i].num_allocs;
+		bytes += workers[i].bytes;
+		peak += workers[i].peak;
+	}
+
+	if (ps->depth)
+		ps->profile->num_allocs[ps->stack[ps->depth - 1].stage] += num_allocs;
+	ps->profile->total_allocs += num_allocs;
+	ps->peak = max(ps->peak, ps->bytes + peak);
+	ps->bytes += bytes;
+}
+
 void *qmalloc_(size_t numbytes, const char *file, int line)
 {
 	return mem_alloc_(mem_globalpool, numbytes, file, line);
@@ -480,33 +1142,52 @@ char *copystring(const char *string)
 	return mem_copystring(mem_globalpool, string);
 }
 
-/* FIXME - do this properly */
+static char *mem_vsprintf(mem_pool_t *pool, const char *format, va_list ap)
+{
+	va_list ap2;
+	int length;
+	char *s;
+
+	va_copy(ap2, ap);
+	length = vsnprintf(NULL, 0, format, ap2);
+	va_end(ap2);
+
+	if (length < 0)
+		return NULL;
+
+	s = (char*)mem_alloc(pool, length + 1);
+	if (s)
+		vsnprintf(s, length + 1, format, ap);
+	return s;
+}
+
 char *mem_sprintf(mem_pool_t *pool, const char *format, ...)
 {
 	va_list ap;
-	static char buffer[16384];
+	char *s;
 
 	va_start(ap, format);
-	vsprintf(buffer, format, ap);
+	s = mem_vsprintf(pool, format, ap);
 	va_end(ap);
 
-	return mem_copystring(pool, buffer);
+	return s;
 }
 
 char *msprintf(const char *format, ...)
 {
 	va_list ap;
-	static char buffer[16384];
+	char *s;
 
 	va_start(ap, format);
-	vsprintf(buffer, format, ap);
+	s = mem_vsprintf(mem_globalpool, format, ap);
 	va_end(ap);
 
-	return copystring(buffer);
+	return s;
 }
 
 void mem_init(void)
 {
+	mem_mutex = thread_mutex_create();
 	mem_globalpool = mem_create_pool();
 }
 
@@ -516,19 +1197,21 @@ void mem_shutdown(void)
 	mem_pool_t *pool;
 
 #ifdef _DEBUG
-	printf("Peak memory allocated: %d bytes\n", peak_bytes);
+	printf("Peak memory allocated: %d bytes\n", (int)peak_bytes);
+	printf("Allocations: %d (%d from arenas), %d system allocations\n", (int)num_allocs, (int)num_arena_allocs, (int)num_mallocs);
+	printf("File data loaded: %d bytes mapped, %d bytes copied\n", (int)bytes_mapped, (int)bytes_read);
 	print_leaks = true;
 #else
 	print_leaks = false;
 #endif
 
-	mem_free_pool_(mem_globalpool, print_leaks);
+	mem_destroy_pool(mem_globalpool, print_leaks);
 
-	for (pool = mem_pool_head; pool; pool = pool->next)
+	while ((pool = mem_pool_head))
 	{
 		if (print_leaks)
 			printf("%s (ln %d) (pool)\n", pool->file, pool->line);
-		mem_free_pool_(pool, print_leaks);
+		mem_destroy_pool(pool, print_leaks);
 	}
 }
 
@@ -673,6 +1356,8 @@ struct xbuf_s
 	size_t bytes_written;
 
 	FILE *fp;
+	size_t bytes_flushed; /* file buffers only keep what was written since the last flush */
+	char *filename, *tempname; /* file buffers write to tempname, which xbuf_finish_file renames to filename */
 
 	char *error;
 };
@@ -689,6 +1374,7 @@ static void xbuf_flush(xbuf_t *xbuf)
 		return;
 	}
 
+	xbuf->bytes_flushed += xbuf->block_head->bytes_written;
 	xbuf->block_head->bytes_written = 0;
 }
 
@@ -732,6 +1418,9 @@ xbuf_t *xbuf_create_memory(size_t block_size, char **out_error)
 	xbuf->block_tail = NULL;
 	xbuf->bytes_written = 0;
 	xbuf->fp = NULL;
+	xbuf->bytes_flushed = 0;
+	xbuf->filename = NULL;
+	xbuf->tempname = NULL;
 	xbuf->error = NULL;
 
 	if (!xbuf_new_block(xbuf)) /* create the first block */
@@ -743,6 +1432,50 @@ xbuf_t *xbuf_create_memory(size_t block_size, char **out_error)
 	return xbuf;
 }
 
+/* creates a file beside filename that nobody else is writing, not even another
+ * thread saving to the same name. unlike mkstemp, it gets the usual permissions */
+static FILE *open_temp_file(const char *filename, char **out_tempname)
+{
+	char *tempname;
+	int i, fd, error;
+	FILE *fp;
+
+	for (i = 0; i < 1000; i++)
+	{
+#ifdef WIN32
+		tempname = msprintf("%s.%d.%d.tmp", filename, (int)_getpid(), i);
+		fd = _open(tempname, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+		fp = (fd >= 0) ? _fdopen(fd, "wb") : NULL;
+#else
+		tempname = msprintf("%s.%d.%d.tmp", filename, (int)getpid(), i);
+		fd = open(tempname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		fp = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+#endif
+		if (fp)
+		{
+			*out_tempname = tempname;
+			return fp;
+		}
+
+		error = errno;
+		if (fd >= 0)
+		{
+#ifdef WIN32
+			_close(fd);
+#else
+			close(fd);
+#endif
+			remove(tempname);
+		}
+		qfree(tempname);
+		errno = error;
+		if (fd >= 0 || error != EEXIST)
+			return NULL;
+	}
+
+	return NULL;
+}
+
 xbuf_t *xbuf_create_file(size_t block_size, const char *filename, char **out_error)
 {
 	xbuf_t *xbuf;
@@ -754,13 +1487,25 @@ xbuf_t *xbuf_create_file(size_t block_size, const char *filename, char **out_err
 	if (!xbuf)
 		return NULL;
 
-	xbuf->fp = openfile_write(filename, out_error);
-	if (!xbuf->fp)
+/* ask about overwriting the file itself, but stream into a sibling temporary
+ * file, so the file is left alone until the whole thing has been written.
+ * this also keeps a file being read from (mapped) while writing it intact */
+	if (!confirm_overwrite(filename, out_error))
+	{
+		xbuf_free(xbuf, NULL);
+		return NULL;
+	}
+
+	xbuf->filename = copystring(filename);
+	if (!(xbuf->fp = open_temp_file(filename, &xbuf->tempname)))
 	{
+		if (out_error)
+			*out_error = msprintf("couldn't open file: %s", strerror(errno));
 		xbuf_free(xbuf, NULL);
 		return NULL;
 	}
 
+	filelog_add(filename, true);
 	return xbuf;
 }
 
@@ -770,7 +1515,13 @@ bool_t xbuf_free(xbuf_t *xbuf, char **out_error)
 	xbuf_block_t *block, *nextblock;
 
 	if (xbuf->fp)
+	{
+	/* not finished, throw away what was written */
 		fclose(xbuf->fp);
+		remove(xbuf->tempname);
+	}
+	qfree(xbuf->filename);
+	qfree(xbuf->tempname);
 
 	for (block = xbuf->block_head; block; block = nextblock)
 	{
@@ -852,7 +1603,7 @@ void *xbuf_reserve_data(xbuf_t *xbuf, size_t length)
 	if (xbuf->error)
 		return NULL;
 	if (xbuf->fp)
-		return NULL; /* this won't work on file buffers currently (FIXME - is it possible?) */
+		return NULL; /* the memory would be flushed out from under the caller, use xbuf_reserve and xbuf_patch_data */
 	if (length > xbuf->block_size)
 		return NULL;
 
@@ -877,6 +1628,70 @@ void *xbuf_reserve_data(xbuf_t *xbuf, size_t length)
 	return memory;
 }
 
+/* reserve space to be filled in later with xbuf_patch_data, returning its
+ * offset. unlike xbuf_reserve_data this works on file buffers too */
+size_t xbuf_reserve(xbuf_t *xbuf, size_t length)
+{
+	static const unsigned char zeroes[256] = { 0 };
+	size_t offset = xbuf->bytes_written;
+
+	for (; length > sizeof(zeroes); length -= sizeof(zeroes))
+		xbuf_write_data(xbuf, sizeof(zeroes), zeroes);
+	xbuf_write_data(xbuf, length, zeroes);
+
+	return offset;
+}
+
+/* overwrite data that was written (or reserved) earlier */
+void xbuf_patch_data(xbuf_t *xbuf, size_t offset, size_t length, const void *data)
+{
+	const unsigned char *in = (const unsigned char*)data;
+	xbuf_block_t *block;
+	size_t amt;
+
+	if (xbuf->error)
+		return;
+
+	if (xbuf->fp)
+	{
+	/* seek back for the part that has already gone to the file */
+		if (offset < xbuf->bytes_flushed)
+		{
+			amt = min(length, xbuf->bytes_flushed - offset);
+
+			if (fseek(xbuf->fp, (long)offset, SEEK_SET) != 0 || fwrite(in, 1, amt, xbuf->fp) < amt || fseek(xbuf->fp, 0, SEEK_END) != 0)
+			{
+				xbuf->error = msprintf("failed to write to file: %s", strerror(errno));
+				return;
+			}
+
+			offset += amt;
+			in += amt;
+			length -= amt;
+		}
+
+		memcpy(xbuf->block_head->memory + offset - xbuf->bytes_flushed, in, length);
+		return;
+	}
+
+/* find the block(s) the data is in */
+	for (block = xbuf->block_head; block && length; block = block->next)
+	{
+		if (offset >= block->bytes_written)
+		{
+			offset -= block->bytes_written;
+			continue;
+		}
+
+		amt = min(length, block->bytes_written - offset);
+		memcpy(block->memory + offset, in, amt);
+
+		offset = 0;
+		in += amt;
+		length -= amt;
+	}
+}
+
 int xbuf_get_bytes_written(const xbuf_t *xbuf)
 {
 	return xbuf->bytes_written;
@@ -941,14 +1756,195 @@ bool_t xbuf_finish_memory(xbuf_t *xbuf, void **out_data, size_t *out_length, cha
 	return xbuf_free(xbuf, out_error); /* this will always return true */
 }
 
-/* finish writing to file, then free the xbuf */
+/* finish writing to file, move it into place, then free the xbuf. on failure
+ * the file is left as it was */
 bool_t xbuf_finish_file(xbuf_t *xbuf, char **out_error)
 {
+	FILE *fp = xbuf->fp;
+
 	xbuf_flush(xbuf);
+	if (xbuf->error || !fp)
+		return xbuf_free(xbuf, out_error);
+
+	xbuf->fp = NULL;
+	if (fclose(fp) != 0)
+		xbuf->error = msprintf("failed to write to file: %s", strerror(errno));
+#ifdef WIN32
+	/* rename won't replace an existing file on windows */
+	else if (!MoveFileExA(xbuf->tempname, xbuf->filename, MOVEFILE_REPLACE_EXISTING))
+		xbuf->error = msprintf("couldn't replace file: error %lu", (unsigned long)GetLastError());
+#else
+	else if (rename(xbuf->tempname, xbuf->filename) != 0)
+		xbuf->error = msprintf("couldn't replace file: %s", strerror(errno));
+#endif
+
+	if (xbuf->error)
+		remove(xbuf->tempname);
 
 	return xbuf_free(xbuf, out_error);
 }
 
+/* hashing */
+
+#define ROTL32(x,r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+/* MurmurHash3 (32 bit). seed is usually 0, or the hash of a previous piece of
+ * data to chain them. the result depends on the machine's byte order, so don't
+ * store it */
+unsigned int hash_data(const void *data, size_t length, unsigned int seed)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	unsigned int hash = seed, k;
+	size_t i;
+
+	for (i = 0; i + 4 <= length; i += 4)
+	{
+		memcpy(&k, p + i, 4);
+		k *= 0xcc9e2d51u;
+		k = ROTL32(k, 15);
+		k *= 0x1b873593u;
+
+		hash ^= k;
+		hash = ROTL32(hash, 13);
+		hash = hash * 5 + 0xe6546b64u;
+	}
+
+	k = 0;
+	switch (length & 3)
+	{
+	case 3: k ^= p[i + 2] << 16; /* fall through */
+	case 2: k ^= p[i + 1] << 8; /* fall through */
+	case 1: k ^= p[i];
+		k *= 0xcc9e2d51u;
+		k = ROTL32(k, 15);
+		k *= 0x1b873593u;
+		hash ^= k;
+	}
+
+	hash ^= (unsigned int)length;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+#undef ROTL32
+
+/* MurmurHash64A, with the data read in the same byte order on any machine, so
+ * unlike hash_data the result can be stored (to name files by their contents) */
+unsigned long long hash_data64(const void *data, size_t length, unsigned long long seed)
+{
+	const unsigned long long m = 0xc6a4a7935bd1e995ull;
+	const unsigned char *p = (const unsigned char*)data;
+	unsigned long long hash = seed ^ ((unsigned long long)length * m), k;
+	size_t i;
+
+	for (i = 0; i + 8 <= length; i += 8)
+	{
+		k = (unsigned long long)p[i] | ((unsigned long long)p[i + 1] << 8) | ((unsigned long long)p[i + 2] << 16) | ((unsigned long long)p[i + 3] << 24) |
+			((unsigned long long)p[i + 4] << 32) | ((unsigned long long)p[i + 5] << 40) | ((unsigned long long)p[i + 6] << 48) | ((unsigned long long)p[i + 7] << 56);
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+
+		hash ^= k;
+		hash *= m;
+	}
+
+	switch (length & 7)
+	{
+	case 7: hash ^= (unsigned long long)p[i + 6] << 48; /* fall through */
+	case 6: hash ^= (unsigned long long)p[i + 5] << 40; /* fall through */
+	case 5: hash ^= (unsigned long long)p[i + 4] << 32; /* fall through */
+	case 4: hash ^= (unsigned long long)p[i + 3] << 24; /* fall through */
+	case 3: hash ^= (unsigned long long)p[i + 2] << 16; /* fall through */
+	case 2: hash ^= (unsigned long long)p[i + 1] << 8; /* fall through */
+	case 1: hash ^= (unsigned long long)p[i];
+		hash *= m;
+	}
+
+	hash ^= hash >> 47;
+	hash *= m;
+	hash ^= hash >> 47;
+
+	return hash;
+}
+
+struct hashindex_s
+{
+	int hash_mask;
+	int *hash; /* first index in each bucket, -1 if empty */
+
+	int index_size;
+	int *next; /* next index in the same bucket, -1 at the end of the chain */
+};
+
+hashindex_t *hashindex_create(int hash_size, int index_size)
+{
+	hashindex_t *hashindex = (hashindex_t*)qmalloc(sizeof(hashindex_t));
+	int size;
+
+	for (size = 16; size < hash_size; size <<= 1);
+
+	hashindex->hash_mask = size - 1;
+	hashindex->hash = (int*)qmalloc(sizeof(int) * size);
+	memset(hashindex->hash, -1, sizeof(int) * size);
+
+	hashindex->index_size = max(index_size, 16);
+	hashindex->next = (int*)qmalloc(sizeof(int) * hashindex->index_size);
+
+	return hashindex;
+}
+
+void hashindex_free(hashindex_t *hashindex)
+{
+	if (!hashindex)
+		return;
+
+	qfree(hashindex->hash);
+	qfree(hashindex->next);
+	qfree(hashindex);
+}
+
+void hashindex_clear(hashindex_t *hashindex)
+{
+	memset(hashindex->hash, -1, sizeof(int) * (hashindex->hash_mask + 1));
+}
+
+/* index must be >= 0. the index array grows as needed */
+void hashindex_add(hashindex_t *hashindex, unsigned int key, int index)
+{
+	int bucket = key & hashindex->hash_mask;
+
+	if (index >= hashindex->index_size)
+	{
+		int size = max(index + 1, hashindex->index_size * 2);
+		int *next = (int*)qmalloc(sizeof(int) * size);
+
+		memcpy(next, hashindex->next, sizeof(int) * hashindex->index_size);
+		qfree(hashindex->next);
+		hashindex->next = next;
+		hashindex->index_size = size;
+	}
+
+	hashindex->next[index] = hashindex->hash[bucket];
+	hashindex->hash[bucket] = index;
+}
+
+/* walk the indices that were added with the same key (and maybe others, compare them) */
+int hashindex_first(const hashindex_t *hashindex, unsigned int key)
+{
+	return hashindex->hash[key & hashindex->hash_mask];
+}
+
+int hashindex_next(const hashindex_t *hashindex, int index)
+{
+	return hashindex->next[index];
+}
+
 void strip_extension( const char *in, char *out ) {
 	while ( *in && *in != '.' ) {
 		*out++ = *in++;
@@ -979,6 +1975,26 @@ void replace_extension(char *s, const char *ext, const char *newext)
 #define MAX_OSPATH 1024
 #define MAX_FOUND_FILES 4096
 
+typedef struct list_files_state_s
+{
+	char **list;
+	int num_files;
+	int num_ondisk; /* the first ones, which archived files with the same name don't add to */
+} list_files_state_t;
+
+static void list_archived_file(const char *name, void *data)
+{
+	list_files_state_t *state = (list_files_state_t*)data;
+	int i;
+
+	for (i = 0; i < state->num_ondisk; i++)
+		if (!strcmp(state->list[i], name))
+			return;
+
+	if (state->num_files < MAX_FOUND_FILES - 1)
+		state->list[state->num_files++] = copystring(name);
+}
+
 char **list_files(const char *directory, const char *extension, int *num_files) {
 	struct dirent *d;
 	DIR           *fdir;
@@ -990,6 +2006,7 @@ char **list_files(const char *directory, const char *extension, int *num_files)
 	int			  dironly = 0;
 
 	int           extLen;
+	list_files_state_t state;
 
 	memset(list, 0, sizeof(list));
 
@@ -1013,18 +2030,17 @@ char **list_files(const char *directory, const char *extension, int *num_files)
 	// search
 	nfiles = 0;
 
-	if ((fdir = opendir(directory)) == NULL) {
-		*num_files = 0;
-		return 0;
-	}
+	fdir = opendir(directory);
 
-	while ((d = readdir(fdir)) != NULL)
+	while (fdir && (d = readdir(fdir)) != NULL)
 	{
 		search = msprintf("%s/%s", directory, d->d_name);
 		if (stat(search, &st) == -1)
 		{
+			qfree(search);
 			continue;
 		}
+		qfree(search);
 		if ((dironly && !(st.st_mode & S_IFDIR)) ||
 			(!dironly && (st.st_mode & S_IFDIR)))
 		{
@@ -1049,9 +2065,20 @@ char **list_files(const char *directory, const char *extension, int *num_files)
 		nfiles++;
 	}
 
-	list[nfiles] = NULL;
+	if (fdir)
+		closedir(fdir);
 
-	closedir(fdir);
+/* and the ones in mounted archives, which may not exist on disk at all */
+	if (!dironly)
+	{
+		state.list = list;
+		state.num_files = nfiles;
+		state.num_ondisk = nfiles;
+		pack_list_files(directory, extension, list_archived_file, &state);
+		nfiles = state.num_files;
+	}
+
+	list[nfiles] = NULL;
 
 	*num_files = nfiles;
 
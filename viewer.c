@@ -28,11 +28,12 @@
 #include "global.h"
 #include "model.h"
 #include "matrix.h"
+#include "render.h"
 #include "v_font.h"
 
-int texwidth = -1; /* unused by viewer but needed by md2 exporter */
-int texheight = -1;
-const char *g_skinpath = NULL;
+THREAD_LOCAL int texwidth = -1; /* unused by viewer but needed by md2 exporter */
+THREAD_LOCAL int texheight = -1;
+THREAD_LOCAL const char *g_skinpath = NULL;
 
 int vid_width = -1;
 int vid_height = -1;
@@ -236,152 +237,7 @@ void r_init(void)
 
 float anim_progress = 0.0f;
 
-static struct
-{
-	int num_frames;
-
-	struct
-	{
-		int offset;
-		float frac;
-	} frames[2];
-} animblend;
-
-static void calc_anim(void)
-{
-	if (g_frame != -1)
-	{
-	/* view an individual frame or framegroup */
-		const frameinfo_t *frameinfo = &model->frameinfo[g_frame];
-
-		if (frameinfo->num_frames > 1)
-		{
-		/* framegroup */
-			if (nolerp)
-			{
-				int frame = (int)(anim_progress / frameinfo->frametime) % frameinfo->num_frames;
-
-				animblend.num_frames = 1;
-				animblend.frames[0].offset = frameinfo->frames[frame].offset;
-				animblend.frames[0].frac = 1.0f;
-			}
-			else
-			{
-				float frame;
-				int frame0, frame1;
-
-				frame = anim_progress / frameinfo->frametime;
-				frame -= (float)floor(frame / frameinfo->num_frames) * frameinfo->num_frames;
-
-				frame0 = (int)floor(frame) % frameinfo->num_frames;
-				frame1 = (frame0 + 1) % frameinfo->num_frames;
-
-				animblend.num_frames = 2;
-				animblend.frames[0].offset = frameinfo->frames[frame0].offset;
-				animblend.frames[0].frac = 1.0f - (frame - (float)frame0);
-				animblend.frames[1].offset = frameinfo->frames[frame1].offset;
-				animblend.frames[1].frac = frame - (float)frame0;
-			}
-		}
-		else
-		{
-		/* single frame */
-			animblend.num_frames = 1;
-			animblend.frames[0].offset = frameinfo->frames[0].offset;
-			animblend.frames[0].frac = 1.0f;
-		}
-	}
-	else
-	{
-	/* loop through all animation frames */
-		if (nolerp)
-		{
-			int frame = (int)(anim_progress / 0.1f) % model->num_frames;
-
-			animblend.num_frames = 1;
-			animblend.frames[0].offset = model->frameinfo[frame].frames[0].offset;
-			animblend.frames[0].frac = 1.0f;
-		}
-		else
-		{
-			float frame;
-			int frame0, frame1;
-
-			frame = anim_progress / 0.1f;
-			frame -= (float)floor(frame / model->num_frames) * model->num_frames;
-
-			frame0 = (int)floor(frame) % model->num_frames;
-			frame1 = (frame0 + 1) % model->num_frames;
-
-			animblend.num_frames = 2;
-			animblend.frames[0].offset = model->frameinfo[frame0].frames[0].offset;
-			animblend.frames[0].frac = 1.0f - (frame - (float)frame0);
-			animblend.frames[1].offset = model->frameinfo[frame1].frames[0].offset;
-			animblend.frames[1].frac = frame - (float)frame0;
-		}
-	}
-}
-
-static void animate_mesh(const mesh_t *mesh)
-{
-	if (animblend.num_frames == 1)
-	{
-		int offset = animblend.frames[0].offset;
-
-		memcpy(r_state.vertex3f, mesh->vertex3f + offset * mesh->num_vertices * 3, mesh->num_vertices * sizeof(float[3]));
-		memcpy(r_state.normal3f, mesh->normal3f + offset * mesh->num_vertices * 3, mesh->num_vertices * sizeof(float[3]));
-	}
-	if (animblend.num_frames == 2)
-	{
-		int offset0 = animblend.frames[0].offset;
-		int offset1 = animblend.frames[1].offset;
-		float frac0 = animblend.frames[0].frac;
-		float frac1 = animblend.frames[1].frac;
-		int i;
-
-		for (i = 0; i < mesh->num_vertices; i++)
-		{
-			const float *v0 = mesh->vertex3f + (offset0 * mesh->num_vertices + i) * 3;
-			const float *n0 = mesh->normal3f + (offset0 * mesh->num_vertices + i) * 3;
-			const float *v1 = mesh->vertex3f + (offset1 * mesh->num_vertices + i) * 3;
-			const float *n1 = mesh->normal3f + (offset1 * mesh->num_vertices + i) * 3;
-
-			r_state.vertex3f[i*3+0] = v0[0] * frac0 + v1[0] * frac1;
-			r_state.vertex3f[i*3+1] = v0[1] * frac0 + v1[1] * frac1;
-			r_state.vertex3f[i*3+2] = v0[2] * frac0 + v1[2] * frac1;
-
-			r_state.normal3f[i*3+0] = n0[0] * frac0 + n1[0] * frac1;
-			r_state.normal3f[i*3+1] = n0[1] * frac0 + n1[1] * frac1;
-			r_state.normal3f[i*3+2] = n0[2] * frac0 + n1[2] * frac1;
-
-			/* TODO - renormalize? */
-		}
-	}
-}
-
-static void light_mesh(const mesh_t *mesh)
-{
-	float tlightpos[3], lightnormal[3], dot;
-	const float *v, *n;
-	int i;
-	unsigned char *c;
-
-	mat4x4f_transform(&invmodelmatrix, g_lightpos, tlightpos);
-
-	for (i = 0, v = r_state.vertex3f, n = r_state.normal3f, c = r_state.colour4ub; i < mesh->num_vertices; i++, v += 3, n += 3, c += 4)
-	{
-		VectorSubtract(tlightpos, v, lightnormal);
-		VectorNormalize(lightnormal);
-
-		dot = DotProduct(n, lightnormal);
-
-		if (dot < 0)
-			dot = 0;
-
-		c[0] = c[1] = c[2] = (unsigned char)(dot * 255);
-		c[3] = 255;
-	}
-}
+static render_anim_t animblend;
 
 #if 0
 static void calculate_planes(mesh_t *mesh)
@@ -545,7 +401,7 @@ static void render(void)
 		glDisable(GL_CULL_FACE);
 	}
 
-	calc_anim();
+	render_calc_anim(model, g_frame, anim_progress, nolerp, &animblend);
 
 	for (i = 0; i < model->num_meshes; i++)
 	{
@@ -568,10 +424,15 @@ static void render(void)
 			fullbright_texcoord2f = mesh->renderdata.skins[skinoffset].components[SKIN_FULLBRIGHT].texcoord2f;
 		}
 
-		animate_mesh(mesh);
+		render_animate_mesh(mesh, &animblend, r_state.vertex3f, r_state.normal3f);
 
 		if (!wireframe)
-			light_mesh(mesh);
+		{
+			float tlightpos[3];
+
+			mat4x4f_transform(&invmodelmatrix, g_lightpos, tlightpos);
+			render_light_mesh(mesh->num_vertices, r_state.vertex3f, r_state.normal3f, tlightpos, r_state.colour4ub);
+		}
 
 		glEnableClientState(GL_VERTEX_ARRAY); CHECKGLERROR();
 		glVertexPointer(3, GL_FLOAT, sizeof(float[3]), r_state.vertex3f); CHECKGLERROR();